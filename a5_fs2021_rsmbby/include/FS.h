@@ -2,6 +2,7 @@
 #define _FS_H__
 
 #include <sys/types.h>
+#include <sys/uio.h>	// for struct iovec
 #include <dyn_array.h>
 
 #include <stdio.h>
@@ -28,8 +29,7 @@
 
 #define number_inodes 256
 #define inode_size 64
-#define number_fd 256
-#define fd_size 6	// any number as you see fit
+#define number_fd 256	// descriptors that can be open at once, unless raised with fs_set_fd_limit
 
 #define folder_number_entries 31
 
@@ -37,7 +37,9 @@
 struct inode 
 {
     uint32_t vacantFile;    // this parameter is only for directory. Used as a bitmap denoting availibility of entries in a directory file.
-    char owner[18];         // for alignment purpose only   
+    char owner[14];         // for alignment purpose only   
+    uint16_t group;         // allocation group a file's blocks start in while it has none to follow, zero for the classic format
+    uint16_t flags;         // INODE_* layout flags, zero for everything written by the classic format
 
     char fileType;          // 'r' denotes regular file, 'd' denotes directory file
 
@@ -52,32 +54,57 @@ struct inode
 };
 
 
-struct fileDescriptor 
-{
-    uint8_t inodeNum;	// the inode # of the fd
-
-    // usage, locate_order and locate_offset together locate the exact byte at which the cursor is 
-    uint8_t usage; 		// inode pointer usage info. Only the lower 3 digits will be used. 1 for direct, 2 for indirect, 4 for dbindirect
-    uint16_t locate_order;		// serial number or index of the block within direct, indirect, or dbindirect range
-    uint16_t locate_offset;		// offset of the cursor within a block
-};
-
-
 struct directoryFile {
     char filename[127];
     uint8_t inodeNumber;
 };
 
 
+// in-memory cache of (parent inode, name) -> child inode lookups, private to FS.c
+struct dcache;
+// descriptor table, private to FS.c
+struct fd_table;
+// inode cache, private to FS.c
+struct icache;
+// block cache, private to FS.c
+struct bcache;
+// metadata journal, private to FS.c
+struct journal;
+// set of changed image blocks, private to FS.c
+struct block_set;
+// every lock the FS takes, private to FS.c
+struct fs_locks;
+// asynchronous I/O queues and workers, private to FS.c
+struct aio;
+// growable inode table, private to FS.c
+struct inode_table;
+// free space summary, private to FS.c
+struct space_map;
+
 struct FS {
     block_store_t * BlockStore_whole;
     block_store_t * BlockStore_inode;
-    block_store_t * BlockStore_fd;
+    struct fd_table * fd_table; // open descriptors, in memory only
+    struct dcache * dcache;     // not persisted, rebuilt lazily after every mount
+    struct icache * icache;     // dirty inodes are written back on eviction and at unmount
+    struct bcache * bcache;     // metadata blocks, dirty ones are written back on eviction and at unmount
+    uint32_t features;          // FS_FEATURE_* bits chosen at format time, read back from the superblock at mount
+    size_t open_views;          // fs_view results not yet given back with fs_view_release
+    size_t delayed_blocks;      // free blocks promised to appends held back in descriptors
+    bool elide_zero_blocks;     // see fs_set_zero_elision, off after every mount
+    struct journal * journal;   // NULL unless the image was formatted with FS_FEATURE_JOURNAL
+    struct block_set * unsynced; // image blocks changed since the last fs_sync
+    struct fs_locks * locks;    // every call below may be made from any number of threads at once, except fs_unmount
+    struct aio * aio;           // see fs_submit, the workers start with the first request
+    struct inode_table * inode_table; // NULL unless the image was formatted with FS_FEATURE_LARGE_INODES, which leaves BlockStore_inode NULL
+    struct space_map * space;   // in memory only, rebuilt from the free block map at every mount
+    // NULL after every mount. When set, told of every run of blocks pushed through to the image file (see fs_sync)
+    void (*on_sync)(size_t block_ID, size_t count, void *arg);
+    void * on_sync_arg;         // passed to on_sync as it is
 };
 
 
 typedef struct inode inode_t;
-typedef struct fileDescriptor fileDescriptor_t;
 typedef struct directoryFile directoryFile_t;
 
 typedef struct FS FS_t;
@@ -87,8 +114,22 @@ typedef enum { FS_SEEK_SET, FS_SEEK_CUR, FS_SEEK_END } seek_t;
 
 typedef enum { FS_REGULAR, FS_DIRECTORY } file_t;
 
+// optional on-disk features, chosen once by fs_format_ex and fixed for the life of the image
+#define FS_FEATURE_DIR_INDEX 0x00000001     // directories outgrowing one block turn into hashed buckets instead of filling up
+#define FS_FEATURE_EXTENTS   0x00000002     // regular files map their blocks as (start, length) runs instead of block pointers
+#define FS_FEATURE_JOURNAL   0x00000004     // metadata changes are logged in a reserved region, and fs_mount brings the image back
+                                            // to the last commit after a crash. Freed blocks are reused once the freeing commits.
+#define FS_FEATURE_LARGE_INODES 0x00000008  // compact inodes with 32-bit block pointers in a table that grows as needed, up to
+                                            // FS_INODES_MAX. Names are at most FS_LARGE_FNAME_MAX characters.
+#define FS_FEATURES_SUPPORTED (FS_FEATURE_DIR_INDEX | FS_FEATURE_EXTENTS | FS_FEATURE_JOURNAL | FS_FEATURE_LARGE_INODES)
+
+#define FS_INODES_MAX 65536                 // files and directories an FS_FEATURE_LARGE_INODES image can hold, number_inodes otherwise
+#define FS_GROUP_BLOCKS 4096                // blocks per allocation group, a file's blocks start in its directory's group
+
 #define FS_FNAME_MAX (127)
 // INCLUDING null terminator
+#define FS_LARGE_FNAME_MAX (124)
+// the same on FS_FEATURE_LARGE_INODES images, where directory entries make room for wider inode numbers
 
 typedef struct {
     // You can add more if you want
@@ -97,6 +138,69 @@ typedef struct {
     file_t type;
 } file_record_t;
 
+// read-only window onto file data, pointing straight into the mounted image (see fs_view)
+typedef struct {
+    const void *data;   // first byte of the view, NULL for an empty view
+    size_t length;      // number of bytes readable at data
+    size_t inode_ID;    // the file the view keeps in place, for fs_view_release
+} fs_view_t;
+
+// block cache counters, see fs_cache_stats
+typedef struct {
+    size_t capacity;    // blocks the cache can hold
+    size_t hits;        // block reads and writes the cache served
+    size_t misses;      // block reads and writes that had to go to the image or claim a new cache block
+    size_t writebacks;  // dirty blocks written back to the image
+} fs_cache_stats_t;
+
+// asynchronous I/O, see fs_submit
+typedef enum { FS_AIO_READ, FS_AIO_WRITE } fs_aio_op_t;
+
+typedef struct {
+    fs_aio_op_t op;
+    int fd;             // the descriptor's position is neither used nor changed, like fs_pread/fs_pwrite
+    void *buffer;       // read into or written from, has to stay valid until the request's completion is polled
+    size_t nbyte;
+    off_t offset;       // from BOF
+    uint64_t tag;       // the caller's, handed back in the completion
+} fs_aio_request_t;
+
+typedef struct {
+    uint64_t tag;
+    ssize_t result;     // what fs_pread/fs_pwrite would have returned
+} fs_aio_completion_t;
+
+#define FS_AIO_QUEUE 256    // requests that can be outstanding at once, counting completions not polled yet
+
+// an open directory listing, see fs_opendir. The caller provides the storage, every field is private to FS.c
+typedef struct {
+    bool open;
+    bool done;
+    size_t inode_ID;        // the directory being listed
+    bool started;           // entries were buffered, the last of them is where the listing stands
+    size_t bucket;          // index bucket of that entry's name. Entries are listed by bucket, then name, in any layout
+    char name[FS_FNAME_MAX];    // that entry's name
+    size_t next;            // next buffered entry to hand out
+    size_t count;           // entries buffered
+    file_record_t entries[folder_number_entries];   // the next names past the position, in listing order
+} fs_dir_t;
+
+// how fragmented regular files are, see fs_fragmentation
+typedef struct {
+    size_t files;           // regular files measured
+    size_t blocks;          // data blocks they map, holes not counted
+    size_t fragments;       // runs of physically consecutive blocks those are in, at least one per file with blocks
+    double score;           // share of a file's blocks not sitting right behind its previous one: 0 when every file is
+                            // one run, 1 when no block of any file follows another
+} fs_frag_t;
+
+// progress of a defragmentation pass, see fs_defrag. Zeroed, it starts a new pass
+typedef struct {
+    size_t next_inode;      // where the next call picks up
+    size_t files_moved;     // files moved into one run so far
+    size_t blocks_moved;    // data blocks they hold
+} fs_defrag_t;
+
 ///
 /// Formats (and mounts) an FS file for use
 /// \param fname The file to format
@@ -104,6 +208,16 @@ typedef struct {
 ///
 FS_t *fs_format(const char *path);
 
+///
+/// Formats (and mounts) an FS file with optional on-disk features enabled
+///   fs_format(path) is the same as fs_format_ex(path, 0), and images formatted without features are readable by older builds
+///   Images with features can only be mounted by builds that support all of them
+/// \param path The file to format
+/// \param features Bitwise OR of FS_FEATURE_* flags
+/// \return Mounted FS object, NULL on error or if a feature is not supported
+///
+FS_t *fs_format_ex(const char *path, uint32_t features);
+
 ///
 /// Mounts an FS object and prepares it for use
 /// \param fname The file to mount
@@ -115,11 +229,29 @@ FS_t *fs_mount(const char *path);
 
 ///
 /// Unmounts the given object and frees all related resources
+///   Calls already running on other threads finish first, but none may be made once it has started
 /// \param fs The FS object to unmount
 /// \return 0 on success, < 0 on failure
 ///
 int fs_unmount(FS_t *fs);
 
+///
+/// Resizes the block cache that directory and extent tree blocks go through
+///   Dirty blocks are written back first and the counters start over. Every mount starts with 256 blocks.
+/// \param fs The FS to change
+/// \param blocks How many blocks to cache, 0 sends every block straight to the image
+/// \return 0 on success, < 0 on error
+///
+int fs_set_cache_capacity(FS_t *fs, size_t blocks);
+
+///
+/// Reads the block cache counters
+/// \param fs The FS to look at
+/// \param stats Filled in with the counters
+/// \return 0 on success, < 0 on error
+///
+int fs_cache_stats(FS_t *fs, fs_cache_stats_t *stats);
+
 ///
 /// Creates a new file at the specified location
 ///   Directories along the path that do not exist are not created
@@ -130,6 +262,21 @@ int fs_unmount(FS_t *fs);
 ///
 int fs_create(FS_t *fs, const char *path, file_t type);
 
+///
+/// Creates a batch of files in one directory
+///   The directory is looked up and locked once for every 64 names, and every directory block a slice of them
+///   changes is written once, so this is much cheaper than count calls to fs_create. Each name is handled on its own: a name that is
+///   malformed, already taken or doesn't fit fails without affecting the rest.
+/// \param fs The FS containing the directory
+/// \param dir Absolute path to the directory to create the files in
+/// \param names Names of the files to create, single path components without '/'
+/// \param count Number of names
+/// \param type Type of the files to create (regular/directory)
+/// \param results Optional, filled in with 0 or < 0 per name, as fs_create would have returned
+/// \return number of files created, < 0 on error (no directory at dir, invalid parameters)
+///
+ssize_t fs_create_many(FS_t *fs, const char *dir, const char *const *names, size_t count, file_t type, int *results);
+
 ///
 /// Opens the specified file for use
 ///   R/W position is set to the beginning of the file (BOF)
@@ -148,11 +295,31 @@ int fs_open(FS_t *fs, const char *path);
 ///
 int fs_close(FS_t *fs, int fd);
 
+///
+/// Sets how many descriptors can be open at once, number_fd after every mount
+///   Descriptors are numbered from 0, so every open descriptor has to stay below the new limit
+/// \param fs The FS to change
+/// \param limit The most descriptors that may be open at once, at most INT_MAX
+/// \return 0 on success, < 0 on error
+///
+int fs_set_fd_limit(FS_t *fs, size_t limit);
+
+///
+/// Turns detection of all-zero blocks in written data on or off, it is off after every mount
+///   While on, a whole block of zeros written where the file has no block yet is left a hole instead of being
+///   allocated. It reads back as zeros all the same. Blocks already allocated are always written in place
+/// \param fs The FS to change
+/// \param enabled Whether zero blocks are elided
+/// \return 0 on success, < 0 on error
+///
+int fs_set_zero_elision(FS_t *fs, bool enabled);
+
 ///
 /// Moves the R/W position of the given descriptor to the given location
 ///   Files cannot be seeked past the space remaining in the FS or before BOF (beginning of file)
 ///   Seeking past remaining space will seek to that limit, seeking before BOF will seek to BOF.
-///   Note that seeking beyond EOF will allocate more space in a file, but will not initialize that space.
+///   Seeking beyond EOF neither changes the file nor allocates space. A write there extends the file, and the
+///   bytes skipped over read back as zeros. Use fs_fallocate to reserve space up front.
 /// \param fs The FS containing the file
 /// \param fd The descriptor to seek
 /// \param offset Desired offset relative to whence
@@ -177,6 +344,8 @@ ssize_t fs_read(FS_t *fs, int fd, void *dst, size_t nbyte);
 /// Writes data from given buffer to the file linked to the descriptor
 ///   Writing past EOF extends the file
 ///   Writing inside a file overwrites existing data
+///   Short appends at EOF may be held in the descriptor and only get blocks at fs_close, or once the file is
+///   otherwise accessed, so a run of them ends up physically contiguous. They are visible to every descriptor.
 ///   R/W position in incremented by the number of bytes written
 /// \param fs The FS containing the file
 /// \param fd The file to write to
@@ -186,24 +355,238 @@ ssize_t fs_read(FS_t *fs, int fd, void *dst, size_t nbyte);
 ///
 ssize_t fs_write(FS_t *fs, int fd, const void *src, size_t nbyte);
 
+///
+/// Reads data from the file linked to the given descriptor, starting at an absolute offset
+///   Reading past EOF returns data up to EOF
+///   The R/W position is neither used nor changed, so reads through one descriptor may run concurrently
+/// \param fs The FS containing the file
+/// \param fd The file to read from
+/// \param dst The buffer to write to
+/// \param nbyte The number of bytes to read
+/// \param offset Offset from BOF to read from
+/// \return number of bytes read (< nbyte IFF read passes EOF), < 0 on error
+///
+ssize_t fs_pread(FS_t *fs, int fd, void *dst, size_t nbyte, off_t offset);
+
+///
+/// Writes data from given buffer to the file linked to the descriptor, starting at an absolute offset
+///   Writing past EOF extends the file, writing inside a file overwrites existing data
+///   The R/W position is neither used nor changed
+/// \param fs The FS containing the file
+/// \param fd The file to write to
+/// \param src The buffer to read from
+/// \param nbyte The number of bytes to write
+/// \param offset Offset from BOF to write to
+/// \return number of bytes written (< nbyte IFF out of space), < 0 on error
+///
+ssize_t fs_pwrite(FS_t *fs, int fd, const void *src, size_t nbyte, off_t offset);
+
+///
+/// Reads data from the file linked to the given descriptor into several buffers
+///   Behaves like one fs_read of the combined length, filling each buffer in order before the next
+///   R/W position in incremented by the number of bytes read
+/// \param fs The FS containing the file
+/// \param fd The file to read from
+/// \param iov The buffers to write to
+/// \param iovcnt The number of buffers in iov
+/// \return number of bytes read (< combined length IFF read passes EOF), < 0 on error
+///
+ssize_t fs_readv(FS_t *fs, int fd, const struct iovec *iov, int iovcnt);
+
+///
+/// Writes data from several buffers to the file linked to the descriptor
+///   Behaves like one fs_write of the buffers laid end to end, the blocks for all of them are allocated at once
+///   R/W position in incremented by the number of bytes written
+/// \param fs The FS containing the file
+/// \param fd The file to write to
+/// \param iov The buffers to read from
+/// \param iovcnt The number of buffers in iov
+/// \return number of bytes written (< combined length IFF out of space), < 0 on error
+///
+ssize_t fs_writev(FS_t *fs, int fd, const struct iovec *iov, int iovcnt);
+
+///
+/// Maps file data for reading without copying it, starting at an absolute offset
+///   The view covers the longest physically contiguous stretch of the file from offset, up to nbyte bytes and never past EOF,
+///   so callers wanting more keep calling with offset + view->length. Holes come back as views of zeros.
+///   The data is the image itself: it is only valid until fs_view_release or fs_unmount, and writes to the file show through
+///   Until then the file's blocks stay where they are: fs_remove and shrinking with fs_truncate fail, and fs_defrag skips it
+///   The R/W position is neither used nor changed
+/// \param fs The FS containing the file
+/// \param fd The file to view
+/// \param offset Offset from BOF of the first byte to view
+/// \param nbyte The most bytes the view may cover
+/// \param view Filled in with the view, which is empty at or past EOF
+/// \return number of bytes in the view, < 0 on error
+///
+ssize_t fs_view(FS_t *fs, int fd, off_t offset, size_t nbyte, fs_view_t *view);
+
+///
+/// Gives back a view obtained from fs_view
+///   The view is emptied, releasing an empty view does nothing
+/// \param fs The FS the view came from
+/// \param view The view to release
+/// \return 0 on success, < 0 on error
+///
+int fs_view_release(FS_t *fs, fs_view_t *view);
+
+///
+/// Reserves space for a range of the file up front, so later writes to it need no allocation
+///   Blocks not yet backing the range are allocated as contiguously as possible and read as zeros
+///   The file grows to offset + len if it is shorter. Existing data and the R/W position are left alone
+/// \param fs The FS containing the file
+/// \param fd The file to reserve space in
+/// \param offset Offset from BOF of the first byte to reserve
+/// \param len The number of bytes to reserve, > 0
+/// \return 0 on success, < 0 on error or when out of space (part of the range may be reserved by then)
+///
+int fs_fallocate(FS_t *fs, int fd, off_t offset, off_t len);
+
+///
+/// Sets the size of the file
+///   Shrinking frees every block past the new EOF, pointer blocks included, and discards the data there
+///   Growing leaves the new range unallocated, it reads as zeros. R/W positions of descriptors are left alone
+/// \param fs The FS containing the file
+/// \param fd The file to resize
+/// \param length The new size in bytes
+/// \return 0 on success, < 0 on error (shrinking a file with views outstanding, see fs_view)
+///
+int fs_truncate(FS_t *fs, int fd, off_t length);
+
+///
+/// Makes every change made to the FS so far durable in the image file, appends held back in descriptors included
+///   Only the blocks that changed since the last fs_sync are written out
+/// \param fs The FS to sync
+/// \return 0 on success, < 0 on error
+///
+int fs_sync(FS_t *fs);
+
+///
+/// Makes the data and metadata of one file durable in the image file
+///   Only the file's blocks that changed since they were last synced are written out, with the metadata needed to reach them
+///   On images formatted with FS_FEATURE_JOURNAL the metadata is made durable by committing the journal
+/// \param fs The FS containing the file
+/// \param fd The file to sync
+/// \return 0 on success, < 0 on error
+///
+int fs_fsync(FS_t *fs, int fd);
+
+///
+/// Measures how fragmented a regular file, or every regular file in the image, is
+/// \param fs The FS containing the files
+/// \param path The file to measure, NULL for every regular file in the image together
+/// \param frag Filled in with the result
+/// \return 0 on success, < 0 on error (path is not a regular file)
+///
+int fs_fragmentation(FS_t *fs, const char *path, fs_frag_t *frag);
+
+///
+/// Moves fragmented regular files into one run of blocks each, a few files per call so it can run while the FS is in use
+///   Files are visited by inode number, each one locked only while it is moved. A file's data is copied into a free run
+///   with its pointer blocks in front of it, the block pointers (direct, indirect and double indirect) or extents are
+///   switched over, and the old blocks are freed. Files without a free run that large, or with views (fs_view)
+///   outstanding, are left where they are. Calling it again with the same pass picks up where the last call stopped,
+///   so pausing between calls throttles it
+/// \param fs The FS to defragment
+/// \param pass Progress of the pass, zeroed to start one
+/// \param max_blocks Stop once this many blocks were moved in this call (the file that reaches it is finished), 0 for no limit
+/// \return 1 when there are files left to visit, 0 when the pass is done, < 0 on error
+///
+int fs_defrag(FS_t *fs, fs_defrag_t *pass, size_t max_blocks);
+
+///
+/// Queues reads and writes to be carried out in the background
+///   A pool of worker threads takes queued requests in batches. Requests on the same file for adjacent ranges are merged
+///   into one vectored call, and a batch is carried out in the order of the physical blocks it touches
+///   Requests may complete in any order, each one's outcome is collected with fs_poll
+/// \param fs The FS containing the files
+/// \param requests The requests to queue
+/// \param count The number of requests
+/// \return number of requests queued (fewer than count once FS_AIO_QUEUE are outstanding), < 0 on error
+///
+ssize_t fs_submit(FS_t *fs, const fs_aio_request_t *requests, size_t count);
+
+///
+/// Collects completed requests queued with fs_submit
+/// \param fs The FS the requests were queued on
+/// \param completions Filled in with the completions, oldest first
+/// \param max The most completions to collect
+/// \param wait Whether to wait for a completion when none is ready yet but some request is still outstanding
+/// \return number of completions collected, < 0 on error
+///
+ssize_t fs_poll(FS_t *fs, fs_aio_completion_t *completions, size_t max, bool wait);
+
 ///
 /// Deletes the specified file and closes all open descriptors to the file
-///   Directories can only be removed when empty
+///   Directories can only be removed when empty, and a file's last name not while views (fs_view) of it are outstanding
 /// \param fs The FS containing the file
 /// \param path Absolute path to file to remove
 /// \return 0 on success, < 0 on error
 ///
 int fs_remove(FS_t *fs, const char *path);
 
+///
+/// Deletes a batch of files from one directory
+///   The directory is looked up and locked once for every 64 names. Each name is handled as fs_remove would, and one that is
+///   missing or a directory that isn't empty fails without affecting the rest.
+/// \param fs The FS containing the directory
+/// \param dir Absolute path to the directory to remove the files from
+/// \param names Names of the files to remove, single path components without '/'
+/// \param count Number of names
+/// \param results Optional, filled in with 0 or < 0 per name, as fs_remove would have returned
+/// \return number of files removed, < 0 on error (no directory at dir, invalid parameters)
+///
+ssize_t fs_remove_many(FS_t *fs, const char *dir, const char *const *names, size_t count, int *results);
+
 ///
 /// Populates a dyn_array with information about the files in a directory
-///   Array contains up to 15 file_record_t structures
+///   Array contains one file_record_t per entry, up to 31 unless the image was formatted with FS_FEATURE_DIR_INDEX
 /// \param fs The FS containing the file
 /// \param path Absolute path to the directory to inspect
 /// \return dyn_array of file records, NULL on error
 ///
 dyn_array_t *fs_get_dir(FS_t *fs, const char *path);
 
+///
+/// Starts a listing of a directory without building it all up front, fs_readdir then hands the entries out
+///   The listing holds no locks or memory between calls, there is nothing to do if it is abandoned. Entries
+///   added or removed while it is under way may or may not show up, every other entry is read exactly once,
+///   also when the directory outgrows its first block during the listing (FS_FEATURE_DIR_INDEX).
+/// \param fs The FS containing the directory
+/// \param path Absolute path to the directory to list
+/// \param dir Storage for the listing, filled in
+/// \return 0 on success, < 0 on error
+///
+int fs_opendir(FS_t *fs, const char *path, fs_dir_t *dir);
+
+///
+/// Reads the next entry of a directory listing
+///   Entries are looked up a directory block's worth at a time, so most calls just copy one out of dir
+/// \param fs The FS containing the directory
+/// \param dir A listing started by fs_opendir
+/// \param record Filled in with the entry
+/// \return 1 for an entry, 0 once every entry has been read, < 0 on error (listing not open, directory removed)
+///
+int fs_readdir(FS_t *fs, fs_dir_t *dir, file_record_t *record);
+
+///
+/// Reads as many entries of a directory listing as fit
+/// \param fs The FS containing the directory
+/// \param dir A listing started by fs_opendir
+/// \param records Filled in with the entries
+/// \param max The most entries to read
+/// \return number of entries read, 0 once every entry has been read, < 0 on error
+///
+ssize_t fs_readdir_many(FS_t *fs, fs_dir_t *dir, file_record_t *records, size_t max);
+
+///
+/// Ends a directory listing, fs_readdir fails on it afterwards
+/// \param fs The FS containing the directory
+/// \param dir A listing started by fs_opendir
+/// \return 0 on success, < 0 on error
+///
+int fs_closedir(FS_t *fs, fs_dir_t *dir);
+
 /// Moves the file from one location to the other
 ///   Moving files does not affect open descriptors
 /// \param fs The FS containing the file
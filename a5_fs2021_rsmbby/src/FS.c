@@ -1,3 +1,9 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "dyn_array.h"
 #include "bitmap.h"
 #include "block_store.h"
@@ -14,1358 +20,6262 @@
 // remove it before you submit. Just allows things to compile initially.
 #define UNUSED(x) (void)(x)
 
-/// Formats (and mounts) an FS file for use
-/// \param fname The file to format
-/// \return Mounted FS object, NULL on error
-///
-FS_t *fs_format(const char *path)
-{
-    if(path != NULL && strlen(path) != 0)
-    {
-        FS_t * ptr_FS = (FS_t *)calloc(1, sizeof(FS_t));	// get started
-        ptr_FS->BlockStore_whole = block_store_create(path);				// pointer to start of a large chunck of memory
+// locking. Every entry point holds fs shared for as long as it runs. The few things that rework state every call
+// shares (syncing, journal commits, flushing every descriptor's held back appends, resizing the descriptor table or
+// the block cache, unmounting) hold it exclusively instead, see fs_enter/fs_leave. Under it:
+//   inodes     one rwlock per inode. For a regular file it covers the file's data, block map and size, and the
+//              state of descriptors open on it; for a directory, its entries. Readers share it.
+//   rename     held by the calls that lock more than one directory (fs_move, fs_link, removing a directory), so
+//              two of them never wait on each other
+//   descriptor each open descriptor's own mutex, for its position, block map cache and readahead state
+//   the rest   short critical sections around one structure each (the dentry cache has its own), never held
+//              while taking another lock except icache, which may take dirty, and inode_alloc, which may take
+//              alloc and dirty
+// They are taken in that order. Without the rename lock a call holds at most one directory's lock, and a file's lock
+// is never held while taking a directory's. Calls look names up before locking anything, so whatever they found is
+// checked again under its lock: a removed inode has linkCount 0.
+// The inode locks come in chunks of INODE_LOCK_CHUNK, created as the inode table grows (see inode_alloc). A chunk
+// exists before any inode in it can be found, so looking a lock up needs no lock.
+#define INODE_LOCK_CHUNK number_inodes
+#define INODE_LOCK_CHUNKS (FS_INODES_MAX / INODE_LOCK_CHUNK)
 
-        // reserve the 1st block for bitmap of inode
-        size_t bitmap_ID = block_store_allocate(ptr_FS->BlockStore_whole);
-        //		printf("bitmap_ID = %zu\n", bitmap_ID);
+struct fs_locks {
+    pthread_rwlock_t fs;
+    pthread_mutex_t rename;
+    pthread_rwlock_t *inodes[INODE_LOCK_CHUNKS];    // chunk i covers inodes i * INODE_LOCK_CHUNK on, NULL until needed
+    pthread_mutex_t alloc;          // the free block map, its summary and delayed_blocks
+    pthread_mutex_t inode_alloc;    // the inode bitmap and the growth of the inode table, may take alloc
+    pthread_mutex_t fd_table;       // which descriptors are open, and open_views
+    pthread_mutex_t icache;         // the inode cache's chains, LRU list and pins, not the inodes in it
+    pthread_mutex_t bcache;
+    pthread_mutex_t dirty;          // the journal's running transaction and the unsynced block set
+    pthread_key_t delay_draw;       // on a thread flushing held back appends, what they were promised, see space_usable
+};
 
-        // 2rd - 5th block for inodes, 4 blocks in total
-        size_t inode_start_block = block_store_allocate(ptr_FS->BlockStore_whole);
-        //		printf("inode_start_block = %zu\n", inode_start_block);		
-        for(int i = 0; i < 3; i++)
-        {
-            block_store_allocate(ptr_FS->BlockStore_whole);
-            //			printf("all the way with block %zu\n", block_store_allocate(ptr_FS->BlockStore_whole));
+// make sure the first count inodes have their locks
+// \return 0 on success, -1 when out of memory
+static int fs_locks_cover(struct fs_locks *locks, size_t count)
+{
+    for(size_t c = 0; c * INODE_LOCK_CHUNK < count && c < INODE_LOCK_CHUNKS; c++) {
+        if(locks->inodes[c] != NULL) {
+            continue;
         }
-
-        // install inode block store inside the whole block store
-        ptr_FS->BlockStore_inode = block_store_inode_create(block_store_Data_location(ptr_FS->BlockStore_whole) + bitmap_ID * BLOCK_SIZE_BYTES, block_store_Data_location(ptr_FS->BlockStore_whole) + inode_start_block * BLOCK_SIZE_BYTES);
-
-        // the first inode is reserved for root dir
-        block_store_sub_allocate(ptr_FS->BlockStore_inode);
-        //		printf("first inode ID = %zu\n", block_store_sub_allocate(ptr_FS->BlockStore_inode));
-
-        // update the root inode info.
-        uint8_t root_inode_ID = 0;	// root inode is the first one in the inode table
-        inode_t * root_inode = (inode_t *) calloc(1, sizeof(inode_t));
-        //		printf("size of inode_t = %zu\n", sizeof(inode_t));
-        root_inode->vacantFile = 0x00000000;
-        root_inode->fileType = 'd';								
-        root_inode->inodeNumber = root_inode_ID;
-        root_inode->linkCount = 1;
-        //		root_inode->directPointer[0] = root_data_ID;	// not allocate date block for it until it has a sub-folder or file
-        block_store_inode_write(ptr_FS->BlockStore_inode, root_inode_ID, root_inode);		
-        free(root_inode);
-
-        // now allocate space for the file descriptors
-        ptr_FS->BlockStore_fd = block_store_fd_create();
-
-        return ptr_FS;
+        pthread_rwlock_t *chunk = malloc(INODE_LOCK_CHUNK * sizeof(pthread_rwlock_t));
+        if(chunk == NULL) {
+            return -1;
+        }
+        for(size_t i = 0; i < INODE_LOCK_CHUNK; i++) {
+            pthread_rwlock_init(&chunk[i], NULL);
+        }
+        locks->inodes[c] = chunk;
     }
-
-    return NULL;	
+    return 0;
 }
 
-
-
-///
-/// Mounts an FS object and prepares it for use
-/// \param fname The file to mount
-
-/// \return Mounted FS object, NULL on error
-
-///
-FS_t *fs_mount(const char *path)
+static struct fs_locks *fs_locks_create(void)
 {
-    if(path != NULL && strlen(path) != 0)
-    {
-        FS_t * ptr_FS = (FS_t *)calloc(1, sizeof(FS_t));	// get started
-        ptr_FS->BlockStore_whole = block_store_open(path);	// get the chunck of data	
-
-        // the bitmap block should be the 1st one
-        size_t bitmap_ID = 0;
-
-        // the inode blocks start with the 2nd block, and goes around until the 5th block, 4 in total
-        size_t inode_start_block = 1;
+    struct fs_locks *locks = calloc(1, sizeof(struct fs_locks));
+    if(locks == NULL) {
+        return NULL;
+    }
+    //a classic image has number_inodes inodes, one chunk of them
+    if(fs_locks_cover(locks, number_inodes) < 0) {
+        free(locks);
+        return NULL;
+    }
+    pthread_rwlock_init(&locks->fs, NULL);
+    pthread_mutex_init(&locks->rename, NULL);
+    pthread_mutex_init(&locks->alloc, NULL);
+    pthread_mutex_init(&locks->inode_alloc, NULL);
+    pthread_mutex_init(&locks->fd_table, NULL);
+    pthread_mutex_init(&locks->icache, NULL);
+    pthread_mutex_init(&locks->bcache, NULL);
+    pthread_mutex_init(&locks->dirty, NULL);
+    pthread_key_create(&locks->delay_draw, NULL);
+    return locks;
+}
 
-        // attach the bitmaps to their designated place
-        ptr_FS->BlockStore_inode = block_store_inode_create(block_store_Data_location(ptr_FS->BlockStore_whole) + bitmap_ID * BLOCK_SIZE_BYTES, block_store_Data_location(ptr_FS->BlockStore_whole) + inode_start_block * BLOCK_SIZE_BYTES);
+static void fs_locks_destroy(struct fs_locks *locks)
+{
+    if(locks == NULL) {
+        return;
+    }
+    pthread_rwlock_destroy(&locks->fs);
+    pthread_mutex_destroy(&locks->rename);
+    for(size_t c = 0; c < INODE_LOCK_CHUNKS && locks->inodes[c] != NULL; c++) {
+        for(size_t i = 0; i < INODE_LOCK_CHUNK; i++) {
+            pthread_rwlock_destroy(&locks->inodes[c][i]);
+        }
+        free(locks->inodes[c]);
+    }
+    pthread_mutex_destroy(&locks->alloc);
+    pthread_mutex_destroy(&locks->inode_alloc);
+    pthread_mutex_destroy(&locks->fd_table);
+    pthread_mutex_destroy(&locks->icache);
+    pthread_mutex_destroy(&locks->bcache);
+    pthread_mutex_destroy(&locks->dirty);
+    pthread_key_delete(locks->delay_draw);
+    free(locks);
+}
 
-        // since file descriptors are allocated outside of the whole blocks, we can simply reallocate space for it.
-        ptr_FS->BlockStore_fd = block_store_fd_create();
+static pthread_rwlock_t *inode_rwlock(FS_t *fs, size_t inode_ID)
+{
+    return &fs->locks->inodes[inode_ID / INODE_LOCK_CHUNK][inode_ID % INODE_LOCK_CHUNK];
+}
 
-        return ptr_FS;
+static void inode_lock(FS_t *fs, size_t inode_ID, bool write)
+{
+    if(write) {
+        pthread_rwlock_wrlock(inode_rwlock(fs, inode_ID));
+    }
+    else {
+        pthread_rwlock_rdlock(inode_rwlock(fs, inode_ID));
     }
+}
 
-    return NULL;		
+static void inode_unlock(FS_t *fs, size_t inode_ID)
+{
+    pthread_rwlock_unlock(inode_rwlock(fs, inode_ID));
 }
 
+// dentry cache: remembers the result of looking a name up in a directory, keyed by (parent inode, name).
+// Negative entries remember names that are known to be missing, so failed lookups are cheap too.
+// Every function that changes a directory entry has to keep this in sync (see fs_create/fs_remove/fs_move/fs_link).
+#define DCACHE_BUCKETS 512      // power of two, hash is masked into it
+#define DCACHE_ENTRIES 1024     // once full, the least recently used entry is recycled
+#define DCACHE_NEGATIVE SIZE_MAX
 
+typedef struct dentry {
+    struct dentry *hash_next;
+    struct dentry *lru_prev;    // towards the most recently used entry
+    struct dentry *lru_next;    // towards the least recently used entry
+    size_t parent;
+    size_t child;               // DCACHE_NEGATIVE if the name does not exist in parent
+    char child_type;            // fileType of the child inode, so a walk doesn't have to read it
+    uint32_t hash;
+    uint8_t name_len;
+    char name[FS_FNAME_MAX + 1];
+} dentry_t;
 
+struct dcache {
+    dentry_t *buckets[DCACHE_BUCKETS];
+    dentry_t *lru_head;
+    dentry_t *lru_tail;
+    dentry_t *free_list;
+    pthread_mutex_t lock;
+    dentry_t entries[DCACHE_ENTRIES];
+};
 
-///
-/// Unmounts the given object and frees all related resources
-/// \param fs The FS object to unmount
-/// \return 0 on success, < 0 on failure
-///
-int fs_unmount(FS_t *fs)
+// FNV-1a over the name bytes. The name does not need to be null terminated.
+static uint32_t name_hash(const char *name, size_t len)
 {
-    if(fs != NULL)
-    {	
-        block_store_inode_destroy(fs->BlockStore_inode);
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-        block_store_destroy(fs->BlockStore_whole);
-        block_store_fd_destroy(fs->BlockStore_fd);
+static size_t dcache_bucket(size_t parent, uint32_t hash)
+{
+    return (hash ^ (uint32_t)(parent * 2654435761u)) & (DCACHE_BUCKETS - 1);
+}
 
-        free(fs);
-        return 0;
+static struct dcache *dcache_create(void)
+{
+    struct dcache *dc = calloc(1, sizeof(struct dcache));
+    if(dc == NULL) {
+        return NULL;
     }
-    return -1;
+    for(size_t i = 0; i < DCACHE_ENTRIES; i++) {
+        dc->entries[i].hash_next = dc->free_list;
+        dc->free_list = &dc->entries[i];
+    }
+    pthread_mutex_init(&dc->lock, NULL);
+    return dc;
 }
 
-
-// check if the input filename is valid or not
-bool isValidFileName(const char *filename)
+static void dcache_destroy(struct dcache *dc)
 {
-    if(!filename || strlen(filename) == 0 || strlen(filename) > 127 || '/'==filename[0])
-    {
-        return false;
+    if(dc != NULL) {
+        pthread_mutex_destroy(&dc->lock);
+        free(dc);
     }
+}
 
-    return true;
+static void dcache_lru_unlink(struct dcache *dc, dentry_t *d)
+{
+    if(d->lru_prev != NULL) {
+        d->lru_prev->lru_next = d->lru_next;
+    }
+    else {
+        dc->lru_head = d->lru_next;
+    }
+    if(d->lru_next != NULL) {
+        d->lru_next->lru_prev = d->lru_prev;
+    }
+    else {
+        dc->lru_tail = d->lru_prev;
+    }
+    d->lru_prev = NULL;
+    d->lru_next = NULL;
 }
 
+static void dcache_lru_push_front(struct dcache *dc, dentry_t *d)
+{
+    d->lru_prev = NULL;
+    d->lru_next = dc->lru_head;
+    if(dc->lru_head != NULL) {
+        dc->lru_head->lru_prev = d;
+    }
+    dc->lru_head = d;
+    if(dc->lru_tail == NULL) {
+        dc->lru_tail = d;
+    }
+}
 
+// unhook an entry from its hash chain and the LRU list and give it back to the free list
+static void dcache_drop(struct dcache *dc, dentry_t *d)
+{
+    dentry_t **link = &dc->buckets[dcache_bucket(d->parent, d->hash)];
+    while(*link != d) {
+        link = &(*link)->hash_next;
+    }
+    *link = d->hash_next;
+    dcache_lru_unlink(dc, d);
+    d->hash_next = dc->free_list;
+    dc->free_list = d;
+}
 
-// use str_split to decompose the input string into filenames along the path, '/' as delimiter
-char** str_split(char* a_str, const char a_delim, size_t * count)
+// a single hash probe, with dc->lock held. NULL on a miss. Hits are moved to the front of the LRU list.
+static dentry_t *dcache_find(struct dcache *dc, size_t parent, const char *name, size_t len, uint32_t hash)
 {
-    if(*a_str != '/')
-    {
+    if(dc == NULL) {
         return NULL;
     }
-    char** result    = 0;
-    char* tmp        = a_str;
-    char delim[2];
-    delim[0] = a_delim;
-    delim[1] = '\0';
-
-    /* Count how many elements will be extracted. */
-    while (*tmp)
-    {
-        if (a_delim == *tmp)
-        {
-            (*count)++;
+    for(dentry_t *d = dc->buckets[dcache_bucket(parent, hash)]; d != NULL; d = d->hash_next) {
+        if(d->hash == hash && d->parent == parent && d->name_len == len && memcmp(d->name, name, len) == 0) {
+            dcache_lru_unlink(dc, d);
+            dcache_lru_push_front(dc, d);
+            return d;
         }
-        tmp++;
     }
+    return NULL;
+}
 
-    result = (char**)calloc(1, sizeof(char*) * (*count));
-    for(size_t i = 0; i < (*count); i++)
-    {
-        *(result + i) = (char*)calloc(1, 200);
+// copy out what is known about (parent, name)
+// \return false on a miss, true and the child and its type (child DCACHE_NEGATIVE for a missing name) on a hit
+static bool dcache_lookup(struct dcache *dc, size_t parent, const char *name, size_t len, size_t *child, char *child_type)
+{
+    if(dc == NULL) {
+        return false;
     }
+    pthread_mutex_lock(&dc->lock);
+    dentry_t *d = dcache_find(dc, parent, name, len, name_hash(name, len));
+    if(d != NULL) {
+        *child = d->child;
+        *child_type = d->child_type;
+    }
+    pthread_mutex_unlock(&dc->lock);
+    return d != NULL;
+}
 
-    if (result)
-    {
-        size_t idx  = 0;
-        char* token = strtok(a_str, delim);
-
-        while (token)
-        {
-            strcpy(*(result + idx++), token);
-            //    *(result + idx++) = strdup(token);
-            token = strtok(NULL, delim);
+// add or overwrite the entry for (parent, name). child == DCACHE_NEGATIVE records that the name is missing
+static void dcache_insert(struct dcache *dc, size_t parent, const char *name, size_t len, size_t child, char child_type)
+{
+    if(dc == NULL || len > FS_FNAME_MAX) {
+        return;
+    }
+    uint32_t hash = name_hash(name, len);
+    pthread_mutex_lock(&dc->lock);
+    dentry_t *d = dcache_find(dc, parent, name, len, hash);
+    if(d == NULL) {
+        if(dc->free_list == NULL) {
+            // recycle the least recently used entry
+            dcache_drop(dc, dc->lru_tail);
         }
+        d = dc->free_list;
+        dc->free_list = d->hash_next;
+        d->parent = parent;
+        d->hash = hash;
+        d->name_len = (uint8_t)len;
+        memcpy(d->name, name, len);
+        d->name[len] = '\0';
+        size_t bucket = dcache_bucket(parent, hash);
+        d->hash_next = dc->buckets[bucket];
+        dc->buckets[bucket] = d;
+        dcache_lru_push_front(dc, d);
+    }
+    d->child = child;
+    d->child_type = child_type;
+    pthread_mutex_unlock(&dc->lock);
+}
 
+// forget every entry that lives in the given directory, used when the directory inode goes away
+static void dcache_purge_parent(struct dcache *dc, size_t parent)
+{
+    if(dc == NULL) {
+        return;
     }
-    return result;
+    pthread_mutex_lock(&dc->lock);
+    for(size_t i = 0; i < DCACHE_BUCKETS; i++) {
+        dentry_t **link = &dc->buckets[i];
+        while(*link != NULL) {
+            dentry_t *d = *link;
+            if(d->parent == parent) {
+                *link = d->hash_next;
+                dcache_lru_unlink(dc, d);
+                d->hash_next = dc->free_list;
+                dc->free_list = d;
+            }
+            else {
+                link = &d->hash_next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&dc->lock);
 }
 
+// block set: block numbers in the order they were first added, with a bitmap alongside for the duplicate check.
+// Tracks which blocks of the mapped image changed, for the journal's running transaction and for fs_sync.
+struct block_set {
+    uint32_t *blocks;
+    size_t count;
+    size_t capacity;
+    bool overflow;                  // a block could not be added, so the set no longer knows every changed block
+    uint8_t map[BLOCK_STORE_NUM_BLOCKS / 8];
+};
 
+static bool block_set_contains(const struct block_set *set, size_t block_ID)
+{
+    return block_ID < BLOCK_STORE_NUM_BLOCKS && (set->map[block_ID / 8] & (1u << (block_ID % 8))) != 0;
+}
 
-///
-/// Creates a new file at the specified location
-///   Directories along the path that do not exist are not created
-/// \param fs The FS containing the file
-/// \param path Absolute path to file to create
-/// \param type Type of file to create (regular/directory)
-/// \return 0 on success, < 0 on failure
-///
-int fs_create(FS_t *fs, const char *path, file_t type)
+static void block_set_add(struct block_set *set, size_t block_ID)
 {
-    if(fs != NULL && path != NULL && strlen(path) != 0 && (type == FS_REGULAR || type == FS_DIRECTORY))
-    {
-        char* copy_path = (char*)calloc(1, 65535);
-        strcpy(copy_path, path);
-        char** tokens;		// tokens are the directory names along the path. The last one is the name for the new file or dir
-        size_t count = 0;
-        tokens = str_split(copy_path, '/', &count);
-        free(copy_path);
-        if(tokens == NULL)
-        {
-            return -1;
+    if(block_ID >= BLOCK_STORE_NUM_BLOCKS || block_set_contains(set, block_ID)) {
+        return;
+    }
+    if(set->count == set->capacity) {
+        size_t capacity = set->capacity == 0 ? 64 : set->capacity * 2;
+        uint32_t *blocks = realloc(set->blocks, capacity * sizeof(uint32_t));
+        if(blocks == NULL) {
+            set->overflow = true;
+            return;
         }
+        set->blocks = blocks;
+        set->capacity = capacity;
+    }
+    set->blocks[set->count++] = block_ID;
+    set->map[block_ID / 8] |= 1u << (block_ID % 8);
+}
 
-        // let's check if the filenames are valid or not
-        for(size_t n = 0; n < count; n++)
-        {	
-            if(isValidFileName(*(tokens + n)) == false)
-            {
-                // before any return, we need to free tokens, otherwise memory leakage
-                for (size_t i = 0; i < count; i++)
-                {
-                    free(*(tokens + i));
-                }
-                free(tokens);
-                //printf("invalid filename\n");
-                return -1;
-            }
+static void block_set_clear(struct block_set *set)
+{
+    if(set->overflow) {
+        memset(set->map, 0, sizeof(set->map));
+    }
+    else {
+        for(size_t i = 0; i < set->count; i++) {
+            set->map[set->blocks[i] / 8] = 0;
         }
+    }
+    set->count = 0;
+    set->overflow = false;
+}
 
-        size_t parent_inode_ID = 0;	// start from the 1st inode, ie., the inode for root directory
-        // first, let's find the parent dir
-        size_t indicator = 0;
+static struct block_set *block_set_create(void)
+{
+    return calloc(1, sizeof(struct block_set));
+}
 
-        // we declare parent_inode and parent_data here since it will still be used after the for loop
-        directoryFile_t * parent_data = (directoryFile_t *)calloc(1, BLOCK_SIZE_BYTES);
-        inode_t * parent_inode = (inode_t *) calloc(1, sizeof(inode_t));	
+static void block_set_destroy(struct block_set *set)
+{
+    if(set != NULL) {
+        free(set->blocks);
+        free(set);
+    }
+}
 
-        for(size_t i = 0; i < count - 1; i++)
-        {
-            block_store_inode_read(fs->BlockStore_inode, parent_inode_ID, parent_inode);	// read out the parent inode
-            // in case file and dir has the same name
-            if(parent_inode->fileType == 'd')
-            {
-                block_store_read(fs->BlockStore_whole, parent_inode->directPointer[0], parent_data);
+// metadata journal (FS_FEATURE_JOURNAL): a region reserved at format time where metadata changes are logged, so that
+// after a crash the image holds every committed transaction and nothing of the one that was running. Metadata is
+// changed in the mapped image, which the kernel may write back at any time, so before a block first changes in a
+// transaction its before-image is logged and synced (metadata_dirty): inode table blocks, blocks written through the
+// block cache, classic pointer blocks, the inode bitmap and the free block map. Blocks the transaction allocated
+// need none, and blocks it frees can't be allocated again until it commits, so their contents stay what a roll back
+// expects. Many operations are grouped into one transaction, which is committed once enough of them piled up
+// (journal_op_done), and at unmount. A commit writes the after-images to the log and syncs only that stretch of the
+// log, or syncs the blocks in place when they don't fit. Logged blocks' home locations are synced lazily, at a
+// checkpoint, when the log is full, at fs_sync or at unmount. fs_mount replays every complete transaction still in
+// the log and rolls back the one after it. File data is not logged.
+// In the region, block 0 is the journal superblock, after-images are logged from block 1 up and the running
+// transaction's before-images from the last block down, so emptying the log leaves them alone.
+struct journal {
+    size_t start;                   // first block of the region, which is the journal superblock
+    size_t blocks;                  // length of the region
+    size_t head;                    // next free block of the region, 1 right after a checkpoint
+    uint64_t sequence;              // number of the running transaction
+    size_t ops;                     // operations grouped into the running transaction
+    size_t undone;                  // before-images the running transaction logged
+    struct block_set dirty;         // metadata blocks the running transaction changed, overflow means it has to be written through
+    struct block_set covered;       // blocks it may change in place: their before-image is logged, or they were free when it began
+    struct block_set freed;         // blocks it released, which stay taken until it commits
+    struct block_set logged;        // blocks with an after-image in the log
+};
 
-                for(int j = 0; j < folder_number_entries; j++)
-                {
-                    if( ((parent_inode->vacantFile >> j) & 1) == 1 && strcmp((parent_data + j) -> filename, *(tokens + i)) == 0 )
-                    {
-                        parent_inode_ID = (parent_data + j) -> inodeNumber;
-                        indicator++;
-                    }					
-                }
-            }					
-        }
-        //		printf("indicator = %zu\n", indicator);
-        //		printf("parent_inode_ID = %lu\n", parent_inode_ID);
+static void metadata_dirty(FS_t *fs, size_t block_ID);
 
-        // read out the parent inode
-        block_store_inode_read(fs->BlockStore_inode, parent_inode_ID, parent_inode);
-        if(indicator == count - 1 && parent_inode->fileType == 'd')
-        {
-            // same file or dir name in the same path is intolerable
-            for(int m = 0; m < folder_number_entries; m++)
-            {
-                // rid out the case of existing same file or dir name
-                if( ((parent_inode->vacantFile >> m) & 1) == 1)
-                {
-                    // before read out parent_data, we need to make sure it does exist!
-                    block_store_read(fs->BlockStore_whole, parent_inode->directPointer[0], parent_data);
-                    if( strcmp((parent_data + m) -> filename, *(tokens + count - 1)) == 0 )
-                    {
-                        free(parent_data);
-                        free(parent_inode);	
-                        // before any return, we need to free tokens, otherwise memory leakage
-                        for (size_t i = 0; i < count; i++)
-                        {
-                            free(*(tokens + i));
-                        }
-                        free(tokens);
-                        //printf("filename already exists\n");
-                        return -1;											
-                    }
-                }
-            }	
+// the free block map is about to change
+static void free_map_dirty(FS_t *fs)
+{
+    metadata_dirty(fs, BLOCK_STORE_AVAIL_BLOCKS);
+    metadata_dirty(fs, BLOCK_STORE_AVAIL_BLOCKS + 1);
+}
 
-            // cannot declare k inside for loop, since it will be used later.
-            int k = 0;
-            for( ; k < folder_number_entries; k++)
-            {
-                if( ((parent_inode->vacantFile >> k) & 1) == 0 )
-                    break;
-            }
+// blocks [first, first + count) were free when the running transaction began, so it needs no before-images of them
+static void journal_allocated(FS_t *fs, size_t first, size_t count)
+{
+    if(fs->journal == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&fs->locks->dirty);
+    for(size_t i = 0; i < count; i++) {
+        block_set_add(&fs->journal->covered, first + i);
+    }
+    pthread_mutex_unlock(&fs->locks->dirty);
+}
 
-            // if k == 0, then we have to declare a new parent data block
-            //			printf("k = %d\n", k);
-            if(k == 0)
-            {
-                size_t parent_data_ID = block_store_allocate(fs->BlockStore_whole);
-                //					printf("parent_data_ID = %zu\n", parent_data_ID);
-                if(parent_data_ID < BLOCK_STORE_AVAIL_BLOCKS)
-                {
-                    parent_inode->directPointer[0] = parent_data_ID;
-                }
-                else
-                {
-                    free(parent_inode);
-                    free(parent_data);
-                    // before any return, we need to free tokens, otherwise memory leakage
-                    for (size_t i = 0; i < count; i++)
-                    {
-                        free(*(tokens + i));
-                    }
-                    free(tokens);
-                    //printf("No available blocks\n");
-                    return -1;												
-                }
-            }
+// hold back the release of block_ID until the running transaction commits
+// \return false when there is no journal, or it couldn't keep track, and the block has to be released right away
+static bool journal_free(FS_t *fs, size_t block_ID)
+{
+    if(fs->journal == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&fs->locks->dirty);
+    block_set_add(&fs->journal->freed, block_ID);
+    bool held = block_set_contains(&fs->journal->freed, block_ID);
+    pthread_mutex_unlock(&fs->locks->dirty);
+    return held;
+}
 
-            if(k < folder_number_entries)	// k == folder_number_entries means this directory is full
-            {
-                size_t child_inode_ID = block_store_sub_allocate(fs->BlockStore_inode);
-                //printf("new child_inode_ID = %zu\n", child_inode_ID);
-                // ugh, inodes are used up
-                if(child_inode_ID == SIZE_MAX)
-                {
-                    free(parent_data);
-                    free(parent_inode);
-                    // before any return, we need to free tokens, otherwise memory leakage
-                    for (size_t i = 0; i < count; i++)
-                    {
-                        free(*(tokens + i));
-                    }
-                    free(tokens);
-                    //printf("could not allocate block for child\n");
-                    return -1;	
-                }
+// inode flags bits
+#define INODE_DIR_INDEX 0x0001      // the directory uses the indexed layout (see the directory layout below)
+#define INODE_EXTENTS 0x0002        // the regular file is extent mapped (see the file block mapping below)
+#define INODE_POINTER_BYTES (offsetof(inode_t, doubleIndirectPointer) + sizeof(uint16_t) - offsetof(inode_t, directPointer))
 
-                // wow, at last, we make it!				
-                // update the parent inode
-                parent_inode->vacantFile |= (1 << k);
-                // in the following cases, we should allocate parent data first: 
-                // 1)the parent dir is not the root dir; 
-                // 2)the file or dir to create is to be the 1st in the parent dir
-
-                block_store_inode_write(fs->BlockStore_inode, parent_inode_ID, parent_inode);	
-
-                // update the parent directory file block
-                block_store_read(fs->BlockStore_whole, parent_inode->directPointer[0], parent_data);
-                strcpy((parent_data + k)->filename, *(tokens + count - 1));
-                //printf("the newly created file's name is: %s\n", (parent_data + k)->filename);
-                (parent_data + k)->inodeNumber = child_inode_ID;
-                block_store_write(fs->BlockStore_whole, parent_inode->directPointer[0], parent_data);
-
-                // update the newly created inode
-                inode_t * child_inode = (inode_t *) calloc(1, sizeof(inode_t));
-                child_inode->vacantFile = 0;
-                if(type == FS_REGULAR)
-                {
-                    child_inode->fileType = 'r';
-                }
-                else if(type == FS_DIRECTORY)
-                {
-                    child_inode->fileType = 'd';
-                }	
+// inode table. A classic image keeps number_inodes inodes in blocks 1 - 4 with their bitmap in block 0, both reached
+// through BlockStore_inode. An FS_FEATURE_LARGE_INODES image keeps them in table blocks of INODES_PER_BLOCK each,
+// found through the map block. The first table block is block 4, the others are allocated one at a time as the table
+// fills up (see inode_alloc), and the table never shrinks. The bitmap covers FS_INODES_MAX inodes. Inodes are stored
+// there with fixed width fields and 32-bit block pointers, and translated to and from inode_t on the way in and out.
+// Either way every access goes through the functions below, with the icache lock held.
+#define INODES_PER_BLOCK (BLOCK_SIZE_BYTES / inode_size)
+#define INODE_MAP_BLOCK 1           // uint32_t table block of every INODES_PER_BLOCK inodes, 0 past the end of the table
+#define INODE_BITMAP_BLOCK 2
+#define INODE_BITMAP_BLOCKS (FS_INODES_MAX / BLOCK_SIZE_BITS)
+#define INODE_FIRST_TABLE_BLOCK (INODE_BITMAP_BLOCK + INODE_BITMAP_BLOCKS)
 
-                child_inode->inodeNumber = child_inode_ID;
-                child_inode->fileSize = 0;
-                child_inode->linkCount = 1;
-                block_store_inode_write(fs->BlockStore_inode, child_inode_ID, child_inode);
+struct inode_table {
+    uint32_t *map;          // the map block, in the mapped image
+    bitmap_t *bitmap;       // over the bitmap blocks, in the mapped image
+    size_t capacity;        // inodes the table has blocks for
+};
 
-                //printf("after creation, parent_inode->vacantFile = %d\n", parent_inode->vacantFile);
+// an inode as an FS_FEATURE_LARGE_INODES image stores it. Its number is its place in the table.
+typedef struct {
+    uint64_t fileSize;
+    uint32_t vacantFile;
+    uint32_t linkCount;
+    uint32_t blocks[8];     // directPointer[0 - 5], indirectPointer[0], doubleIndirectPointer. An extent mapped
+                            // file keeps its inode_extents_t in the first INODE_POINTER_BYTES as it is instead
+    uint16_t flags;
+    char fileType;
+    uint8_t reserved;
+    uint16_t group;
+    uint8_t unused[10];
+} inode_disk_t;
 
+typedef char inode_disk_fits[sizeof(inode_disk_t) == inode_size ? 1 : -1];
+typedef char inode_map_fits[BLOCK_SIZE_BYTES / sizeof(uint32_t) * INODES_PER_BLOCK == FS_INODES_MAX ? 1 : -1];
 
+static inode_disk_t *inode_disk(FS_t *fs, size_t inode_ID)
+{
+    uint8_t *table_block = block_store_Data_location(fs->BlockStore_whole) + (size_t)fs->inode_table->map[inode_ID / INODES_PER_BLOCK] * BLOCK_SIZE_BYTES;
+    return (inode_disk_t *)table_block + inode_ID % INODES_PER_BLOCK;
+}
 
-                // free the temp space
-                free(parent_inode);
-                free(parent_data);
-                free(child_inode);
-                // before any return, we need to free tokens, otherwise memory leakage
-                for (size_t i = 0; i < count; i++)
-                {
-                    free(*(tokens + i));
-                }
-                free(tokens);					
-                return 0;
-            }				
-        }
-        // before any return, we need to free tokens, otherwise memory leakage
-        for (size_t i = 0; i < count; i++)
-        {
-            free(*(tokens + i));
-        }
-        free(tokens); 
-        free(parent_inode);	
-        free(parent_data);
+// \return the image block inode_ID is stored in
+static size_t inode_table_block(FS_t *fs, size_t inode_ID)
+{
+    if(fs->inode_table == NULL) {
+        return 1 + inode_ID * inode_size / BLOCK_SIZE_BYTES;
     }
-    return -1;
+    return fs->inode_table->map[inode_ID / INODES_PER_BLOCK];
 }
 
+static void inode_table_read(FS_t *fs, size_t inode_ID, inode_t *inode)
+{
+    if(fs->inode_table == NULL) {
+        block_store_inode_read(fs->BlockStore_inode, inode_ID, inode);
+        return;
+    }
+    const inode_disk_t *disk = inode_disk(fs, inode_ID);
+    memset(inode, 0, sizeof(inode_t));
+    inode->vacantFile = disk->vacantFile;
+    inode->flags = disk->flags;
+    inode->fileType = disk->fileType;
+    inode->group = disk->group;
+    inode->inodeNumber = inode_ID;
+    inode->fileSize = disk->fileSize;
+    inode->linkCount = disk->linkCount;
+    if(inode->flags & INODE_EXTENTS) {
+        memcpy(inode->directPointer, disk->blocks, INODE_POINTER_BYTES);
+        return;
+    }
+    //the image has no more than 2^16 blocks, so every pointer fits the in-memory inode
+    for(int i = 0; i < 6; i++) {
+        inode->directPointer[i] = (uint16_t)disk->blocks[i];
+    }
+    inode->indirectPointer[0] = (uint16_t)disk->blocks[6];
+    inode->doubleIndirectPointer = (uint16_t)disk->blocks[7];
+}
 
-
-///
-/// Opens the specified file for use
-///   R/W position is set to the beginning of the file (BOF)
-///   Directories cannot be opened
-/// \param fs The FS containing the file
-/// \param path path to the requested file
-/// \return file descriptor to the requested file, < 0 on error
-///
-int fs_open(FS_t *fs, const char *path)
+static void inode_table_write(FS_t *fs, size_t inode_ID, const inode_t *inode)
 {
-    if(fs != NULL && path != NULL && strlen(path) != 0)
+    metadata_dirty(fs, inode_table_block(fs, inode_ID));
+    if(fs->inode_table == NULL) {
+        block_store_inode_write(fs->BlockStore_inode, inode_ID, inode);
+    }
+    else {
+        inode_disk_t *disk = inode_disk(fs, inode_ID);
+        memset(disk, 0, sizeof(inode_disk_t));
+        disk->vacantFile = inode->vacantFile;
+        disk->flags = inode->flags;
+        disk->fileType = inode->fileType;
+        disk->group = inode->group;
+        disk->fileSize = inode->fileSize;
+        disk->linkCount = (uint32_t)inode->linkCount;
+        if(inode->flags & INODE_EXTENTS) {
+            memcpy(disk->blocks, inode->directPointer, INODE_POINTER_BYTES);
+        }
+        else {
+            for(int i = 0; i < 6; i++) {
+                disk->blocks[i] = inode->directPointer[i];
+            }
+            disk->blocks[6] = inode->indirectPointer[0];
+            disk->blocks[7] = inode->doubleIndirectPointer;
+        }
+    }
+}
+
+// attach the inode table of an FS_FEATURE_LARGE_INODES image, laying out an empty one with just its first block first
+// when formatting
+// \return 0 on success, -1 if the map doesn't make sense or out of memory
+static int inode_table_open(FS_t *fs, bool format)
+{
+    uint8_t *image = block_store_Data_location(fs->BlockStore_whole);
+    struct inode_table *t = calloc(1, sizeof(struct inode_table));
+    if(t == NULL) {
+        return -1;
+    }
+    t->map = (uint32_t *)(image + INODE_MAP_BLOCK * BLOCK_SIZE_BYTES);
+    if(format) {
+        memset(image + INODE_MAP_BLOCK * BLOCK_SIZE_BYTES, 0, (1 + INODE_BITMAP_BLOCKS) * BLOCK_SIZE_BYTES);
+        memset(image + INODE_FIRST_TABLE_BLOCK * BLOCK_SIZE_BYTES, 0, BLOCK_SIZE_BYTES);
+        t->map[0] = INODE_FIRST_TABLE_BLOCK;
+    }
+    t->bitmap = bitmap_overlay(FS_INODES_MAX, image + INODE_BITMAP_BLOCK * BLOCK_SIZE_BYTES);
+    while(t->bitmap != NULL && t->capacity < FS_INODES_MAX && t->map[t->capacity / INODES_PER_BLOCK] != 0) {
+        if(t->map[t->capacity / INODES_PER_BLOCK] >= BLOCK_STORE_AVAIL_BLOCKS) {
+            break;
+        }
+        t->capacity += INODES_PER_BLOCK;
+    }
+    if(t->bitmap == NULL || t->capacity == 0 || (t->capacity < FS_INODES_MAX && t->map[t->capacity / INODES_PER_BLOCK] != 0)
+            || fs_locks_cover(fs->locks, t->capacity) < 0) {
+        bitmap_destroy(t->bitmap);
+        free(t);
+        return -1;
+    }
+    fs->inode_table = t;
+    return 0;
+}
+
+static void inode_table_close(struct inode_table *t)
+{
+    if(t == NULL) {
+        return;
+    }
+    bitmap_destroy(t->bitmap);
+    free(t);
+}
+
+// inode cache: in-memory copies of inodes, keyed by inode number. Users pin an inode with inode_get and work on the
+// cached copy until inode_put; changes just mark it dirty. Dirty inodes reach the inode table when they are evicted,
+// at icache_sync and at unmount. Open descriptors keep their file's inode pinned, so the I/O path never rereads it.
+// Only unpinned entries sit on the LRU list, and only ICACHE_UNPINNED of them are kept. Pinned entries are open
+// files and calls in progress. A classic image has only number_inodes inodes to pin, so inode_get never runs out of
+// entries; with FS_FEATURE_LARGE_INODES more can be pinned at once, and inode_get allocates entries past ICACHE_ENTRIES.
+#define ICACHE_BUCKETS 256      // power of two, the inode number is masked into it
+#define ICACHE_UNPINNED 64
+#define ICACHE_ENTRIES (number_inodes + ICACHE_UNPINNED + 16)
+
+typedef struct cached_inode {
+    inode_t inode;                      // first, so a pinned inode_t * leads straight back to its entry
+    struct cached_inode *hash_next;
+    struct cached_inode *lru_prev;      // towards the most recently used entry
+    struct cached_inode *lru_next;      // towards the least recently used entry
+    size_t inode_ID;
+    size_t refs;                        // pins, entries with refs > 0 are never evicted
+    bool dirty;
+    int delayed;                        // descriptor holding appends to this file back from the image, -1 for none
+    size_t dirty_first;                 // file blocks [dirty_first, dirty_end) hold data fs_fsync hasn't synced yet
+    size_t dirty_end;                   // 0 when there is none
+    size_t views;                       // fs_view results not given back yet, each holding a pin. Under the icache lock
+    struct cached_inode *extra_next;    // entries allocated past ICACHE_ENTRIES, for icache_destroy
+} cached_inode_t;
+
+struct icache {
+    cached_inode_t *buckets[ICACHE_BUCKETS];
+    cached_inode_t *lru_head;
+    cached_inode_t *lru_tail;
+    cached_inode_t *free_list;
+    size_t unpinned;                    // entries on the LRU list
+    cached_inode_t *extra;
+    cached_inode_t entries[ICACHE_ENTRIES];
+};
+
+static struct icache *icache_create(void)
+{
+    struct icache *ic = calloc(1, sizeof(struct icache));
+    if(ic == NULL) {
+        return NULL;
+    }
+    for(size_t i = 0; i < ICACHE_ENTRIES; i++) {
+        ic->entries[i].hash_next = ic->free_list;
+        ic->free_list = &ic->entries[i];
+    }
+    return ic;
+}
+
+static void icache_destroy(struct icache *ic)
+{
+    if(ic == NULL) {
+        return;
+    }
+    while(ic->extra != NULL) {
+        cached_inode_t *e = ic->extra;
+        ic->extra = e->extra_next;
+        free(e);
+    }
+    free(ic);
+}
+
+static void icache_lru_unlink(struct icache *ic, cached_inode_t *e)
+{
+    if(e->lru_prev != NULL) {
+        e->lru_prev->lru_next = e->lru_next;
+    }
+    else {
+        ic->lru_head = e->lru_next;
+    }
+    if(e->lru_next != NULL) {
+        e->lru_next->lru_prev = e->lru_prev;
+    }
+    else {
+        ic->lru_tail = e->lru_prev;
+    }
+    e->lru_prev = NULL;
+    e->lru_next = NULL;
+}
+
+static void icache_lru_push_front(struct icache *ic, cached_inode_t *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = ic->lru_head;
+    if(ic->lru_head != NULL) {
+        ic->lru_head->lru_prev = e;
+    }
+    ic->lru_head = e;
+    if(ic->lru_tail == NULL) {
+        ic->lru_tail = e;
+    }
+}
+
+// with the icache lock held, which every write to the inode table is made under
+static void icache_write_back(FS_t *fs, cached_inode_t *e)
+{
+    if(e->dirty) {
+        inode_table_write(fs, e->inode_ID, &e->inode);
+        e->dirty = false;
+    }
+}
+
+// write back and recycle the least recently used unpinned entry
+// \return false if every entry is pinned
+static bool icache_evict(FS_t *fs, struct icache *ic)
+{
+    cached_inode_t *e = ic->lru_tail;
+    if(e == NULL) {
+        return false;
+    }
+    icache_write_back(fs, e);
+    cached_inode_t **link = &ic->buckets[e->inode_ID & (ICACHE_BUCKETS - 1)];
+    while(*link != e) {
+        link = &(*link)->hash_next;
+    }
+    *link = e->hash_next;
+    icache_lru_unlink(ic, e);
+    ic->unpinned--;
+    e->hash_next = ic->free_list;
+    ic->free_list = e;
+    return true;
+}
+
+// with the icache lock held
+// \return the entry of inode_ID, NULL if it isn't cached
+static cached_inode_t *icache_find(struct icache *ic, size_t inode_ID)
+{
+    cached_inode_t *e = ic->buckets[inode_ID & (ICACHE_BUCKETS - 1)];
+    while(e != NULL && e->inode_ID != inode_ID) {
+        e = e->hash_next;
+    }
+    return e;
+}
+
+// pin inode_ID, reading it in on a miss
+// \return the cached inode, NULL if there is no cache or everything in it is pinned
+static inode_t *inode_get(FS_t *fs, size_t inode_ID)
+{
+    struct icache *ic = fs->icache;
+    if(ic == NULL) {
+        return NULL;
+    }
+    size_t bucket = inode_ID & (ICACHE_BUCKETS - 1);
+    pthread_mutex_lock(&fs->locks->icache);
+    for(cached_inode_t *e = ic->buckets[bucket]; e != NULL; e = e->hash_next) {
+        if(e->inode_ID == inode_ID) {
+            if(e->refs++ == 0) {
+                icache_lru_unlink(ic, e);
+                ic->unpinned--;
+            }
+            pthread_mutex_unlock(&fs->locks->icache);
+            return &e->inode;
+        }
+    }
+    if(ic->free_list == NULL && !icache_evict(fs, ic)) {
+        cached_inode_t *extra = calloc(1, sizeof(cached_inode_t));
+        if(extra == NULL) {
+            pthread_mutex_unlock(&fs->locks->icache);
+            return NULL;
+        }
+        extra->extra_next = ic->extra;
+        ic->extra = extra;
+        ic->free_list = extra;
+    }
+    cached_inode_t *e = ic->free_list;
+    ic->free_list = e->hash_next;
+    inode_table_read(fs, inode_ID, &e->inode);
+    e->inode_ID = inode_ID;
+    e->refs = 1;
+    e->dirty = false;
+    e->delayed = -1;
+    e->dirty_end = 0;
+    e->views = 0;
+    e->hash_next = ic->buckets[bucket];
+    ic->buckets[bucket] = e;
+    pthread_mutex_unlock(&fs->locks->icache);
+    return &e->inode;
+}
+
+// unpin an inode from inode_get. The last unpin makes it the most recently used eviction candidate,
+// pushing out the least recently used one if too many are kept.
+static void inode_put(FS_t *fs, inode_t *inode)
+{
+    cached_inode_t *e = (cached_inode_t *)inode;
+    pthread_mutex_lock(&fs->locks->icache);
+    if(--e->refs == 0) {
+        icache_lru_push_front(fs->icache, e);
+        if(++fs->icache->unpinned > ICACHE_UNPINNED) {
+            icache_evict(fs, fs->icache);
+        }
+    }
+    pthread_mutex_unlock(&fs->locks->icache);
+}
+
+// whether views (fs_view) of inode_ID are outstanding. They point straight at its blocks, which then may be neither
+// freed nor moved. A viewed inode is pinned, so one that isn't cached has none.
+static bool inode_viewed(FS_t *fs, size_t inode_ID)
+{
+    if(fs->icache == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&fs->locks->icache);
+    cached_inode_t *e = icache_find(fs->icache, inode_ID);
+    bool viewed = e != NULL && e->views > 0;
+    pthread_mutex_unlock(&fs->locks->icache);
+    return viewed;
+}
+
+static void inode_mark_dirty(inode_t *inode)
+{
+    ((cached_inode_t *)inode)->dirty = true;
+}
+
+// copy an inode out, through the cache so pending changes are seen
+static void inode_read(FS_t *fs, size_t inode_ID, inode_t *inode)
+{
+    inode_t *cached = inode_get(fs, inode_ID);
+    if(cached == NULL) {
+        pthread_mutex_lock(&fs->locks->icache);
+        inode_table_read(fs, inode_ID, inode);
+        pthread_mutex_unlock(&fs->locks->icache);
+        return;
+    }
+    memcpy(inode, cached, sizeof(inode_t));
+    inode_put(fs, cached);
+}
+
+// copy an inode in. It only lands in the inode table on write back.
+static void inode_write(FS_t *fs, size_t inode_ID, const inode_t *inode)
+{
+    inode_t *cached = inode_get(fs, inode_ID);
+    if(cached == NULL) {
+        pthread_mutex_lock(&fs->locks->icache);
+        inode_table_write(fs, inode_ID, inode);
+        pthread_mutex_unlock(&fs->locks->icache);
+        return;
+    }
+    memcpy(cached, inode, sizeof(inode_t));
+    inode_mark_dirty(cached);
+    inode_put(fs, cached);
+}
+
+// the fileType of an inode someone holds a name of. It is set before the name exists and never changes while it
+// does, so unlike the rest of the inode it can be read without the inode's lock.
+static char inode_type(FS_t *fs, size_t inode_ID)
+{
+    inode_t *cached = inode_get(fs, inode_ID);
+    if(cached == NULL) {
+        inode_t inode;
+        inode_read(fs, inode_ID, &inode);
+        return inode.fileType;
+    }
+    char type = cached->fileType;
+    inode_put(fs, cached);
+    return type;
+}
+
+// write every dirty inode back to the inode table, pinned or not
+static void icache_sync(FS_t *fs)
+{
+    if(fs->icache == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&fs->locks->icache);
+    for(size_t i = 0; i < ICACHE_BUCKETS; i++) {
+        for(cached_inode_t *e = fs->icache->buckets[i]; e != NULL; e = e->hash_next) {
+            icache_write_back(fs, e);
+        }
+    }
+    pthread_mutex_unlock(&fs->locks->icache);
+}
+
+// block cache: copies of the metadata blocks FS.c reads and writes whole (directory blocks, directory index and
+// bucket blocks, extent tree nodes), so repeated lookups don't go back to the image. File data and classic pointer
+// blocks are used in place in the mapped image and never pass through here. Writes only dirty the cached copy;
+// dirty blocks reach the image when they are evicted, at bcache_sync and at unmount. Blocks are recycled least
+// recently used first. A released block has to be dropped from here (see block_free), or a stale dirty copy
+// could later be written over whatever the block holds next.
+#define BCACHE_BUCKETS 1024     // power of two, the block number is masked into it
+#define BCACHE_DEFAULT_BLOCKS 256
+
+typedef struct cached_block {
+    struct cached_block *hash_next;
+    struct cached_block *lru_prev;      // towards the most recently used block
+    struct cached_block *lru_next;      // towards the least recently used block
+    size_t block_ID;
+    bool dirty;
+    uint8_t *data;
+} cached_block_t;
+
+struct bcache {
+    cached_block_t *buckets[BCACHE_BUCKETS];
+    cached_block_t *lru_head;
+    cached_block_t *lru_tail;
+    cached_block_t *free_list;
+    fs_cache_stats_t stats;
+    cached_block_t *entries;
+    uint8_t *blocks;                    // capacity blocks of storage, entries[i].data points at the i-th
+};
+
+// \return the cache, NULL if it couldn't be allocated. A capacity of 0 gives a cache that passes everything through.
+static struct bcache *bcache_create(size_t capacity)
+{
+    struct bcache *bc = calloc(1, sizeof(struct bcache));
+    if(bc == NULL) {
+        return NULL;
+    }
+    if(capacity > 0) {
+        bc->entries = calloc(capacity, sizeof(cached_block_t));
+        bc->blocks = malloc(capacity * BLOCK_SIZE_BYTES);
+        if(bc->entries == NULL || bc->blocks == NULL) {
+            free(bc->entries);
+            free(bc->blocks);
+            free(bc);
+            return NULL;
+        }
+    }
+    for(size_t i = 0; i < capacity; i++) {
+        bc->entries[i].data = bc->blocks + i * BLOCK_SIZE_BYTES;
+        bc->entries[i].hash_next = bc->free_list;
+        bc->free_list = &bc->entries[i];
+    }
+    bc->stats.capacity = capacity;
+    return bc;
+}
+
+static void bcache_destroy(struct bcache *bc)
+{
+    if(bc != NULL) {
+        free(bc->entries);
+        free(bc->blocks);
+        free(bc);
+    }
+}
+
+static void bcache_lru_unlink(struct bcache *bc, cached_block_t *b)
+{
+    if(b->lru_prev != NULL) {
+        b->lru_prev->lru_next = b->lru_next;
+    }
+    else {
+        bc->lru_head = b->lru_next;
+    }
+    if(b->lru_next != NULL) {
+        b->lru_next->lru_prev = b->lru_prev;
+    }
+    else {
+        bc->lru_tail = b->lru_prev;
+    }
+    b->lru_prev = NULL;
+    b->lru_next = NULL;
+}
+
+static void bcache_lru_push_front(struct bcache *bc, cached_block_t *b)
+{
+    b->lru_prev = NULL;
+    b->lru_next = bc->lru_head;
+    if(bc->lru_head != NULL) {
+        bc->lru_head->lru_prev = b;
+    }
+    bc->lru_head = b;
+    if(bc->lru_tail == NULL) {
+        bc->lru_tail = b;
+    }
+}
+
+// unhook a block from its hash chain and the LRU list and give its entry back to the free list
+static void bcache_drop(struct bcache *bc, cached_block_t *b)
+{
+    cached_block_t **link = &bc->buckets[b->block_ID & (BCACHE_BUCKETS - 1)];
+    while(*link != b) {
+        link = &(*link)->hash_next;
+    }
+    *link = b->hash_next;
+    bcache_lru_unlink(bc, b);
+    b->hash_next = bc->free_list;
+    bc->free_list = b;
+}
+
+static void bcache_write_back(FS_t *fs, cached_block_t *b)
+{
+    if(b->dirty) {
+        block_store_write(fs->BlockStore_whole, b->block_ID, b->data);
+        b->dirty = false;
+        fs->bcache->stats.writebacks++;
+    }
+}
+
+// a single hash probe, counted as a hit or a miss. Hits become the most recently used block.
+static cached_block_t *bcache_find(struct bcache *bc, size_t block_ID)
+{
+    for(cached_block_t *b = bc->buckets[block_ID & (BCACHE_BUCKETS - 1)]; b != NULL; b = b->hash_next) {
+        if(b->block_ID == block_ID) {
+            bc->stats.hits++;
+            bcache_lru_unlink(bc, b);
+            bcache_lru_push_front(bc, b);
+            return b;
+        }
+    }
+    bc->stats.misses++;
+    return NULL;
+}
+
+// an entry for block_ID, recycling the least recently used block if none is free. Its data is left as it was.
+// \return NULL if the cache has no room at all
+static cached_block_t *bcache_claim(FS_t *fs, size_t block_ID)
+{
+    struct bcache *bc = fs->bcache;
+    if(bc->free_list == NULL) {
+        if(bc->lru_tail == NULL) {
+            return NULL;
+        }
+        bcache_write_back(fs, bc->lru_tail);
+        bcache_drop(bc, bc->lru_tail);
+    }
+    cached_block_t *b = bc->free_list;
+    bc->free_list = b->hash_next;
+    size_t bucket = block_ID & (BCACHE_BUCKETS - 1);
+    b->block_ID = block_ID;
+    b->dirty = false;
+    b->hash_next = bc->buckets[bucket];
+    bc->buckets[bucket] = b;
+    bcache_lru_push_front(bc, b);
+    return b;
+}
+
+// read a whole block through the cache
+static void bcache_read(FS_t *fs, size_t block_ID, void *buffer)
+{
+    if(fs->bcache == NULL) {
+        block_store_read(fs->BlockStore_whole, block_ID, buffer);
+        return;
+    }
+    pthread_mutex_lock(&fs->locks->bcache);
+    cached_block_t *b = bcache_find(fs->bcache, block_ID);
+    if(b == NULL) {
+        b = bcache_claim(fs, block_ID);
+        if(b == NULL) {
+            block_store_read(fs->BlockStore_whole, block_ID, buffer);
+            pthread_mutex_unlock(&fs->locks->bcache);
+            return;
+        }
+        block_store_read(fs->BlockStore_whole, block_ID, b->data);
+    }
+    memcpy(buffer, b->data, BLOCK_SIZE_BYTES);
+    pthread_mutex_unlock(&fs->locks->bcache);
+}
+
+// write a whole block through the cache. It only lands in the image on write back.
+static void bcache_write(FS_t *fs, size_t block_ID, const void *buffer)
+{
+    //everything written through here is metadata
+    metadata_dirty(fs, block_ID);
+    if(fs->bcache == NULL) {
+        block_store_write(fs->BlockStore_whole, block_ID, buffer);
+        return;
+    }
+    pthread_mutex_lock(&fs->locks->bcache);
+    cached_block_t *b = bcache_find(fs->bcache, block_ID);
+    if(b == NULL) {
+        b = bcache_claim(fs, block_ID);
+        if(b == NULL) {
+            block_store_write(fs->BlockStore_whole, block_ID, buffer);
+            pthread_mutex_unlock(&fs->locks->bcache);
+            return;
+        }
+    }
+    memcpy(b->data, buffer, BLOCK_SIZE_BYTES);
+    b->dirty = true;
+    pthread_mutex_unlock(&fs->locks->bcache);
+}
+
+// write every dirty block back to the image
+static void bcache_sync(FS_t *fs)
+{
+    if(fs->bcache == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&fs->locks->bcache);
+    for(cached_block_t *b = fs->bcache->lru_head; b != NULL; b = b->lru_next) {
+        bcache_write_back(fs, b);
+    }
+    pthread_mutex_unlock(&fs->locks->bcache);
+}
+
+// free space summary: an in-memory copy of the free block map with a segment tree over it, so that finding a free
+// block, or a run of them near a goal, takes O(log n) however full the image is instead of a scan from block 0.
+// Leaves cover a word of 64 blocks, and every node counts its free blocks, its longest free run and the free runs
+// touching either end. It is built at format and mount, after which every allocation and release goes through it
+// with the alloc lock held, and the block store's own map is kept in step.
+#define SPACE_WORD_BITS 64
+#define SPACE_WORDS (BLOCK_STORE_NUM_BLOCKS / SPACE_WORD_BITS)
+
+typedef struct {
+    uint32_t free;      // free blocks under the node
+    uint32_t longest;   // longest run of free blocks under it
+    uint32_t prefix;    // free blocks from its first block on
+    uint32_t suffix;    // free blocks up to its last block
+} space_node_t;
+
+struct space_map {
+    uint64_t used[SPACE_WORDS];             // bit i of word w set: block w * 64 + i is taken
+    space_node_t nodes[2 * SPACE_WORDS];    // node 1 is the root, node k has children 2k and 2k + 1, leaves follow
+    size_t last_group;                      // allocation group the last new directory went to, see group_for_child
+};
+
+static bool space_is_free(const struct space_map *m, size_t block_ID)
+{
+    return block_ID < BLOCK_STORE_AVAIL_BLOCKS && ((m->used[block_ID / SPACE_WORD_BITS] >> (block_ID % SPACE_WORD_BITS)) & 1) == 0;
+}
+
+// redo a leaf from its word
+static void space_leaf(struct space_map *m, size_t word)
+{
+    space_node_t *n = &m->nodes[SPACE_WORDS + word];
+    uint64_t used = m->used[word];
+    uint32_t run = 0;
+    bool in_prefix = true;
+    memset(n, 0, sizeof(*n));
+    for(size_t i = 0; i < SPACE_WORD_BITS; i++) {
+        if((used >> i) & 1) {
+            run = 0;
+            in_prefix = false;
+            continue;
+        }
+        n->free++;
+        n->prefix += in_prefix;
+        if(++run > n->longest) {
+            n->longest = run;
+        }
+    }
+    n->suffix = run;
+}
+
+// redo node k from its children, each half blocks long
+static void space_combine(struct space_map *m, size_t k, uint32_t half)
+{
+    const space_node_t *l = &m->nodes[2 * k], *r = &m->nodes[2 * k + 1];
+    space_node_t *n = &m->nodes[k];
+    n->free = l->free + r->free;
+    n->prefix = l->prefix == half ? half + r->prefix : l->prefix;
+    n->suffix = r->suffix == half ? half + l->suffix : r->suffix;
+    n->longest = l->longest > r->longest ? l->longest : r->longest;
+    if(l->suffix + r->prefix > n->longest) {
+        n->longest = l->suffix + r->prefix;
+    }
+}
+
+// a word changed: redo its leaf and the path up to the root
+static void space_update(struct space_map *m, size_t word)
+{
+    space_leaf(m, word);
+    uint32_t half = SPACE_WORD_BITS;
+    for(size_t k = (SPACE_WORDS + word) / 2; k >= 1; k /= 2, half *= 2) {
+        space_combine(m, k, half);
+    }
+}
+
+// mark count blocks from first taken or free, redoing each word they touch once
+static void space_mark(struct space_map *m, size_t first, size_t count, bool used)
+{
+    for(size_t b = first; b < first + count; b++) {
+        uint64_t bit = (uint64_t)1 << (b % SPACE_WORD_BITS);
+        m->used[b / SPACE_WORD_BITS] = used ? m->used[b / SPACE_WORD_BITS] | bit : m->used[b / SPACE_WORD_BITS] & ~bit;
+    }
+    for(size_t w = first / SPACE_WORD_BITS; count > 0 && w <= (first + count - 1) / SPACE_WORD_BITS; w++) {
+        space_update(m, w);
+    }
+}
+
+// the block store can't be asked whether a block is free, so every block is requested and the free ones given back
+static struct space_map *space_create(block_store_t *bs)
+{
+    struct space_map *m = (struct space_map *)calloc(1, sizeof(struct space_map));
+    if(m == NULL) {
+        return NULL;
+    }
+    for(size_t b = 0; b < BLOCK_STORE_NUM_BLOCKS; b++) {
+        bool used = true;
+        if(b < BLOCK_STORE_AVAIL_BLOCKS && block_store_request(bs, b)) {
+            block_store_release(bs, b);
+            used = false;
+        }
+        if(used) {
+            m->used[b / SPACE_WORD_BITS] |= (uint64_t)1 << (b % SPACE_WORD_BITS);
+        }
+    }
+    for(size_t w = 0; w < SPACE_WORDS; w++) {
+        space_leaf(m, w);
+    }
+    for(size_t k = SPACE_WORDS - 1; k >= 1; k--) {
+        uint32_t half = SPACE_WORD_BITS;
+        for(size_t level = k; level < SPACE_WORDS / 2; level *= 2) {
+            half *= 2;
+        }
+        space_combine(m, k, half);
+    }
+    return m;
+}
+
+// find the first run of want free blocks that starts at or after from, below node k which covers span blocks from
+// lo. *carry is the free run ending right before lo, which a run may start in; whole nodes without a long enough run
+// are stepped over, so only O(log n) nodes are looked at besides the one leaf the run is found in.
+// \return the run's first block, SIZE_MAX if there is none
+static size_t space_find_below(const struct space_map *m, size_t k, size_t lo, size_t span, size_t from, size_t want, size_t *carry)
+{
+    const space_node_t *n = &m->nodes[k];
+    if(lo + span <= from) {
+        return SIZE_MAX;
+    }
+    if(lo >= from) {
+        if(*carry + n->prefix >= want) {
+            return lo - *carry;
+        }
+        if(n->longest < want) {
+            *carry = n->free == span ? *carry + span : n->suffix;
+            return SIZE_MAX;
+        }
+    }
+    if(span == SPACE_WORD_BITS) {
+        for(size_t b = lo < from ? from : lo; b < lo + span; b++) {
+            if(!space_is_free(m, b)) {
+                *carry = 0;
+            }
+            else if(++*carry >= want) {
+                return b + 1 - want;
+            }
+        }
+        return SIZE_MAX;
+    }
+    size_t found = space_find_below(m, 2 * k, lo, span / 2, from, want, carry);
+    return found != SIZE_MAX ? found : space_find_below(m, 2 * k + 1, lo + span / 2, span / 2, from, want, carry);
+}
+
+// first run of want free blocks at or after from
+// \return its first block, SIZE_MAX if there is none
+static size_t space_find(const struct space_map *m, size_t from, size_t want)
+{
+    size_t carry = 0;
+    if(m->nodes[1].longest < want) {
+        return SIZE_MAX;
+    }
+    return space_find_below(m, 1, 0, BLOCK_STORE_NUM_BLOCKS, from, want, &carry);
+}
+
+// take up to want contiguous free blocks starting exactly at first, in the summary and the block store
+// \return how many were taken
+static size_t space_take(FS_t *fs, size_t first, size_t want)
+{
+    size_t got = 0;
+    free_map_dirty(fs);
+    while(got < want && space_is_free(fs->space, first + got)) {
+        if(!block_store_request(fs->BlockStore_whole, first + got)) {
+            //the store says taken: trust it and stop the run there
+            space_mark(fs->space, first + got, 1, true);
+            break;
+        }
+        got++;
+    }
+    space_mark(fs->space, first, got, true);
+    journal_allocated(fs, first, got);
+    return got;
+}
+
+// free blocks left, with the alloc lock held
+static size_t space_free_blocks(FS_t *fs)
+{
+    return fs->space != NULL ? fs->space->nodes[1].free : block_store_get_free_blocks(fs->BlockStore_whole);
+}
+
+// how many of want blocks the caller may take, with the alloc lock held. The blocks promised to held back appends
+// (fs->delayed_blocks) stay free for them: only a flush writing appends out takes from those, up to what they were
+// promised, which fd_delay_flush leaves with delay_draw for the allocations it makes.
+static size_t space_usable(FS_t *fs, size_t want)
+{
+    const size_t *promised = pthread_getspecific(fs->locks->delay_draw);
+    size_t kept = fs->delayed_blocks - (promised != NULL ? *promised : 0);
+    size_t free_blocks = space_free_blocks(fs);
+    size_t usable = free_blocks > kept ? free_blocks - kept : 0;
+    return want < usable ? want : usable;
+}
+
+// got blocks were taken, with the alloc lock held. A flush's come out of what its appends were promised first.
+static void space_used(FS_t *fs, size_t got)
+{
+    size_t *promised = pthread_getspecific(fs->locks->delay_draw);
+    if(promised != NULL) {
+        size_t draw = got < *promised ? got : *promised;
+        *promised -= draw;
+        fs->delayed_blocks -= draw;
+    }
+}
+
+// allocation groups: the image is cut into GROUPS stretches of FS_GROUP_BLOCKS blocks. Every inode records the group
+// its blocks start in (see inode_t::group). Files go into the group of the directory they are created in, so a
+// directory's blocks and the data of its files stay close, while new directories spread out over the image. Once
+// a file has blocks, the next ones go right behind them. Groups are only a starting point for the search, so a
+// full group spills over into the ones after it. Each group is one node of the free space summary.
+#define GROUPS (BLOCK_STORE_NUM_BLOCKS / FS_GROUP_BLOCKS)
+
+// where the search for a block of a file in group starts
+static size_t group_goal(size_t group)
+{
+    return (group % GROUPS) * FS_GROUP_BLOCKS;
+}
+
+// the group for a new file in parent: the parent's own for regular files, the one with the most free blocks for
+// directories. Ties go to the first one after the group the last directory got, so empty directories spread too.
+static uint16_t group_for_child(FS_t *fs, const inode_t *parent, file_t type)
+{
+    if(type == FS_REGULAR || fs->space == NULL) {
+        return parent->group;
+    }
+    pthread_mutex_lock(&fs->locks->alloc);
+    struct space_map *m = fs->space;
+    size_t best = (m->last_group + 1) % GROUPS;
+    for(size_t i = 2; i <= GROUPS; i++) {
+        size_t g = (m->last_group + i) % GROUPS;
+        if(m->nodes[GROUPS + g].free > m->nodes[GROUPS + best].free) {
+            best = g;
+        }
+    }
+    m->last_group = best;
+    pthread_mutex_unlock(&fs->locks->alloc);
+    return (uint16_t)best;
+}
+
+// release a block back to the FS right away
+static void block_release_now(FS_t *fs, size_t block_ID)
+{
+    free_map_dirty(fs);
+    pthread_mutex_lock(&fs->locks->alloc);
+    block_store_release(fs->BlockStore_whole, block_ID);
+    if(fs->space != NULL) {
+        space_mark(fs->space, block_ID, 1, false);
+    }
+    pthread_mutex_unlock(&fs->locks->alloc);
+}
+
+// release a block back to the FS, dropping any cached copy of it first. With a journal it only becomes free once
+// the running transaction commits.
+static void block_free(FS_t *fs, size_t block_ID)
+{
+    if(fs->bcache != NULL) {
+        pthread_mutex_lock(&fs->locks->bcache);
+        for(cached_block_t *b = fs->bcache->buckets[block_ID & (BCACHE_BUCKETS - 1)]; b != NULL; b = b->hash_next) {
+            if(b->block_ID == block_ID) {
+                bcache_drop(fs->bcache, b);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&fs->locks->bcache);
+    }
+    if(!journal_free(fs, block_ID)) {
+        block_release_now(fs, block_ID);
+    }
+}
+
+// take the first free block at or after goal, or before it when there is none
+// \return the block, BLOCK_STORE_AVAIL_BLOCKS or more when the FS is full
+static size_t block_alloc(FS_t *fs, size_t goal)
+{
+    pthread_mutex_lock(&fs->locks->alloc);
+    size_t block_ID = BLOCK_STORE_AVAIL_BLOCKS;
+    if(space_usable(fs, 1) == 0) {
+        block_ID = SIZE_MAX;
+    }
+    else if(fs->space == NULL) {
+        free_map_dirty(fs);
+        block_ID = block_store_allocate(fs->BlockStore_whole);
+        journal_allocated(fs, block_ID, block_ID < BLOCK_STORE_AVAIL_BLOCKS);
+    }
+    else {
+        do {
+            if((block_ID = space_find(fs->space, goal, 1)) == SIZE_MAX) {
+                block_ID = space_find(fs->space, 0, 1);
+            }
+        } while(block_ID != SIZE_MAX && space_take(fs, block_ID, 1) == 0);
+    }
+    if(block_ID < BLOCK_STORE_AVAIL_BLOCKS) {
+        space_used(fs, 1);
+    }
+    pthread_mutex_unlock(&fs->locks->alloc);
+    return block_ID == SIZE_MAX ? BLOCK_STORE_AVAIL_BLOCKS : block_ID;
+}
+
+// give a full FS_FEATURE_LARGE_INODES inode table another block, with the inode_alloc lock held. The locks of the
+// new inodes are created before any of them can be handed out.
+// \return 0 on success, -1 when the table is as big as it gets or out of blocks or memory
+static int inode_table_grow(FS_t *fs)
+{
+    struct inode_table *t = fs->inode_table;
+    if(t->capacity >= FS_INODES_MAX || fs_locks_cover(fs->locks, t->capacity + INODES_PER_BLOCK) < 0) {
+        return -1;
+    }
+    size_t block_ID = block_alloc(fs, 0);
+    if(block_ID >= BLOCK_STORE_AVAIL_BLOCKS) {
+        return -1;
+    }
+    metadata_dirty(fs, block_ID);
+    memset(block_store_Data_location(fs->BlockStore_whole) + block_ID * BLOCK_SIZE_BYTES, 0, BLOCK_SIZE_BYTES);
+    metadata_dirty(fs, INODE_MAP_BLOCK);
+    t->map[t->capacity / INODES_PER_BLOCK] = block_ID;
+    t->capacity += INODES_PER_BLOCK;
+    return 0;
+}
+
+// take a free inode
+// \return its number, SIZE_MAX when every inode is in use
+static size_t inode_alloc(FS_t *fs)
+{
+    pthread_mutex_lock(&fs->locks->inode_alloc);
+    struct inode_table *t = fs->inode_table;
+    size_t inode_ID;
+    if(t == NULL) {
+        //the bitmap is in block 0
+        metadata_dirty(fs, 0);
+        inode_ID = block_store_sub_allocate(fs->BlockStore_inode);
+    }
+    else {
+        //the table is always filled from the front, so the first free inode is past its end only when it is full
+        inode_ID = bitmap_ffz(t->bitmap);
+        if(inode_ID != SIZE_MAX && inode_ID >= t->capacity && inode_table_grow(fs) < 0) {
+            inode_ID = SIZE_MAX;
+        }
+        if(inode_ID != SIZE_MAX) {
+            metadata_dirty(fs, INODE_BITMAP_BLOCK + inode_ID / BLOCK_SIZE_BITS);
+            bitmap_set(t->bitmap, inode_ID);
+        }
+    }
+    pthread_mutex_unlock(&fs->locks->inode_alloc);
+    return inode_ID;
+}
+
+static void inode_free(FS_t *fs, size_t inode_ID)
+{
+    pthread_mutex_lock(&fs->locks->inode_alloc);
+    if(fs->inode_table == NULL) {
+        metadata_dirty(fs, 0);
+        block_store_sub_release(fs->BlockStore_inode, inode_ID);
+    }
+    else {
+        metadata_dirty(fs, INODE_BITMAP_BLOCK + inode_ID / BLOCK_SIZE_BITS);
+        bitmap_reset(fs->inode_table->bitmap, inode_ID);
+    }
+    pthread_mutex_unlock(&fs->locks->inode_alloc);
+}
+
+// per-descriptor block map cache: the last run of physically contiguous blocks a descriptor mapped.
+// Sequential I/O keeps landing inside it, so most calls never walk the pointer blocks or the extent tree.
+// Only mapped runs are remembered, and a mapped block only moves when its file releases blocks, so
+// anything that frees file blocks has to call fd_map_forget.
+struct fd_map {
+    size_t inode;           // inode the run belongs to, FD_MAP_EMPTY when nothing is cached
+    size_t lblock;          // first file block of the run
+    size_t pblock;          // physical block backing lblock
+    size_t length;
+};
+
+#define FD_MAP_EMPTY SIZE_MAX
+
+// delayed allocation: small appends through a descriptor are collected here instead of being written, and only get
+// blocks when the buffer is flushed, which reserves the whole range in one pass and so lays it out contiguously.
+// The file size already counts buffered bytes. At most one descriptor buffers for a file at a time (cached_inode_t
+// delayed), and anything else touching the file's blocks flushes it first. Blocks for the worst case are promised
+// up front in fs->delayed_blocks, which no other allocation may take (see space_usable), so a buffered append never
+// fails later for lack of space.
+struct fd_delay {
+    uint8_t *data;          // FD_DELAY_BYTES, allocated by the first buffered append
+    uint64_t offset;        // file offset of data[0]
+    size_t length;
+    size_t reserved;        // blocks promised to this buffer
+};
+
+// descriptor table: descriptors index straight into files[]. Closed slots are chained into a free list, most
+// recently closed first, so low numbers get reused. The table starts at number_fd slots and doubles when it
+// runs out, up to limit. Resizing moves every slot, so it only happens while the FS is held exclusively.
+typedef struct {
+    inode_t *inode;         // the file's inode, pinned in the inode cache while open. NULL for a closed slot
+    uint64_t position;      // R/W position, bytes from BOF
+    struct fd_map map;      // see file_map_run
+    uint64_t ra_next;       // where a read continuing the current sequential stream would start, see file_readahead
+    size_t ra_window;       // blocks to keep prefetched ahead of the stream, 0 while access looks random
+    size_t ra_end;          // file block the prefetched range ends at
+    struct fd_delay delay;  // see fd_delay_append
+    long next_free;         // next closed slot, -1 at the end of the list
+    pthread_mutex_t lock;   // held by calls that use or move the position, see fs_locks
+} open_file_t;
+
+struct fd_table {
+    open_file_t *files;
+    size_t capacity;        // slots in files
+    size_t limit;           // most descriptors open at once, see fs_set_fd_limit
+    long free_head;         // first closed slot, -1 when all of them are open
+};
+
+// chain closed slots [from, to) onto the free list so that the lowest one comes out first
+static void fd_table_free_range(struct fd_table *ft, size_t from, size_t to)
+{
+    for(size_t i = to; i-- > from;) {
+        ft->files[i].inode = NULL;
+        ft->files[i].next_free = ft->free_head;
+        ft->free_head = i;
+    }
+}
+
+static struct fd_table *fd_table_create(void)
+{
+    struct fd_table *ft = calloc(1, sizeof(struct fd_table));
+    if(ft == NULL) {
+        return NULL;
+    }
+    ft->files = calloc(number_fd, sizeof(open_file_t));
+    if(ft->files == NULL) {
+        free(ft);
+        return NULL;
+    }
+    ft->capacity = number_fd;
+    ft->limit = number_fd;
+    ft->free_head = -1;
+    fd_table_free_range(ft, 0, ft->capacity);
+    for(size_t i = 0; i < ft->capacity; i++) {
+        pthread_mutex_init(&ft->files[i].lock, NULL);
+    }
+    return ft;
+}
+
+static void fd_table_destroy(struct fd_table *ft)
+{
+    if(ft != NULL) {
+        for(size_t i = 0; i < ft->capacity; i++) {
+            if(ft->files[i].inode != NULL) {
+                free(ft->files[i].delay.data);
+            }
+            pthread_mutex_destroy(&ft->files[i].lock);
+        }
+        free(ft->files);
+        free(ft);
+    }
+}
+
+// give files[] room for exactly capacity slots, opening the new ones. A mutex can't be moved, so every slot's mutex
+// is set up again afterwards. Nothing may hold them, which the exclusively held FS guarantees.
+// \return 0 on success, -1 if the table couldn't grow (it is left as it was)
+static int fd_table_resize(struct fd_table *ft, size_t capacity)
+{
+    for(size_t i = 0; i < ft->capacity; i++) {
+        pthread_mutex_destroy(&ft->files[i].lock);
+    }
+    open_file_t *files = realloc(ft->files, capacity * sizeof(open_file_t));
+    //a shrink that couldn't move just keeps the larger block
+    bool resized = files != NULL || capacity < ft->capacity;
+    if(files != NULL) {
+        ft->files = files;
+    }
+    if(!resized) {
+        capacity = ft->capacity;
+    }
+    else if(capacity > ft->capacity) {
+        fd_table_free_range(ft, ft->capacity, capacity);
+    }
+    for(size_t i = 0; i < capacity; i++) {
+        pthread_mutex_init(&ft->files[i].lock, NULL);
+    }
+    if(!resized) {
+        return -1;
+    }
+    ft->capacity = capacity;
+    return 0;
+}
+
+// take a closed slot
+// \return the descriptor, -1 if none is left without growing the table
+static int fd_table_take(FS_t *fs)
+{
+    struct fd_table *ft = fs->fd_table;
+    pthread_mutex_lock(&fs->locks->fd_table);
+    long fd = ft->free_head;
+    if(fd >= 0) {
+        ft->free_head = ft->files[fd].next_free;
+    }
+    pthread_mutex_unlock(&fs->locks->fd_table);
+    return fd;
+}
+
+// double the table, as far as the limit allows, with the FS held exclusively
+// \return 0 on success, -1 if it is as large as it may get or the memory couldn't be had
+static int fd_table_grow(struct fd_table *ft)
+{
+    if(ft->free_head >= 0) {
+        //someone else grew it while we waited for the FS
+        return 0;
+    }
+    size_t capacity = ft->capacity * 2 < ft->limit ? ft->capacity * 2 : ft->limit;
+    if(capacity <= ft->capacity) {
+        return -1;
+    }
+    return fd_table_resize(ft, capacity);
+}
+
+static void fd_table_give_back(FS_t *fs, int fd)
+{
+    struct fd_table *ft = fs->fd_table;
+    pthread_mutex_lock(&fs->locks->fd_table);
+    ft->files[fd].inode = NULL;
+    ft->files[fd].next_free = ft->free_head;
+    ft->free_head = fd;
+    pthread_mutex_unlock(&fs->locks->fd_table);
+}
+
+// look up an open descriptor, pin its file and lock it: shared to read, exclusively to change it. A read of a
+// file with appends held back takes it exclusively as well, since those get written first.
+// \return its slot, whose inode only needs inode_mark_dirty after a change. NULL if fd is not open
+static open_file_t *fd_acquire(FS_t *fs, int fd, bool write)
+{
+    struct fd_table *ft = fs->fd_table;
+    pthread_mutex_lock(&fs->locks->fd_table);
+    if(fd < 0 || (size_t)fd >= ft->capacity || ft->files[fd].inode == NULL) {
+        pthread_mutex_unlock(&fs->locks->fd_table);
+        return NULL;
+    }
+    open_file_t *file = &ft->files[fd];
+    cached_inode_t *e = (cached_inode_t *)file->inode;
+    //an extra pin, so the inode stays ours even if the descriptor is closed while we wait for the lock
+    inode_get(fs, e->inode_ID);
+    pthread_mutex_unlock(&fs->locks->fd_table);
+    inode_lock(fs, e->inode_ID, write);
+    if(!write && e->delayed >= 0) {
+        inode_unlock(fs, e->inode_ID);
+        inode_lock(fs, e->inode_ID, true);
+    }
+    pthread_mutex_lock(&fs->locks->fd_table);
+    bool open = file->inode == &e->inode;
+    pthread_mutex_unlock(&fs->locks->fd_table);
+    if(!open) {
+        inode_unlock(fs, e->inode_ID);
+        inode_put(fs, &e->inode);
+        return NULL;
+    }
+    return file;
+}
+
+// undo fd_acquire. inode is the one the descriptor was open on, it may have been closed since.
+static void fd_release(FS_t *fs, inode_t *inode)
+{
+    inode_unlock(fs, ((cached_inode_t *)inode)->inode_ID);
+    inode_put(fs, inode);
+}
+
+// with the write path, where the blocks get mapped
+static void fd_delay_flush(FS_t *fs, open_file_t *file);
+static void fd_delay_make_room(FS_t *fs, size_t nbyte);
+
+// give every buffered append its blocks, with the FS held exclusively
+static void fd_delay_flush_all(FS_t *fs)
+{
+    for(size_t i = 0; i < fs->fd_table->capacity; i++) {
+        if(fs->fd_table->files[i].inode != NULL && fs->fd_table->files[i].delay.length > 0) {
+            fd_delay_flush(fs, &fs->fd_table->files[i]);
+        }
+    }
+}
+
+// drop every descriptor's cached run of inode_ID, which is locked for writing
+static void fd_map_forget(FS_t *fs, size_t inode_ID)
+{
+    pthread_mutex_lock(&fs->locks->fd_table);
+    for(size_t i = 0; i < fs->fd_table->capacity; i++) {
+        inode_t *inode = fs->fd_table->files[i].inode;
+        if(inode != NULL && ((cached_inode_t *)inode)->inode_ID == inode_ID) {
+            fs->fd_table->files[i].map.inode = FD_MAP_EMPTY;
+        }
+    }
+    pthread_mutex_unlock(&fs->locks->fd_table);
+}
+
+#define JOURNAL_BLOCKS 1024             // region reserved at format time, 4 MiB
+#define JOURNAL_MAGIC 0x4C4E524Au       // "JRNL"
+#define JOURNAL_SUPER 1
+#define JOURNAL_DESCRIPTOR 2
+#define JOURNAL_COMMIT 3
+#define JOURNAL_UNDO 4
+#define JOURNAL_GROUP_OPS 32            // operations grouped into one transaction before it is committed
+#define JOURNAL_GROUP_BLOCKS 256        // or changed metadata blocks, whichever comes first
+#define JOURNAL_TAGS ((BLOCK_SIZE_BYTES - 24) / sizeof(uint32_t))
+#define JOURNAL_UNDO_MAX (JOURNAL_TAGS / 2)     // before-images one transaction can log, each takes a tag and a checksum
+
+// every block of the log starts like this. A transaction is one or more descriptors, each followed by the blocks
+// it tags, and then a commit block. Only a commit whose checksum matches makes the transaction count.
+// The running transaction's before-images are tagged by the undo block, the last one of the region, and are stored
+// in the blocks right in front of it, the first one closest.
+typedef struct {
+    uint32_t magic;
+    uint32_t type;                  // JOURNAL_SUPER, JOURNAL_DESCRIPTOR, JOURNAL_COMMIT or JOURNAL_UNDO
+    uint64_t sequence;              // transaction the block belongs to. In the superblock, the first one to replay
+    uint32_t count;                 // descriptor and undo: tags in use. commit: blocks logged by the whole transaction
+    uint32_t checksum;              // commit: over every descriptor and logged block of the transaction, in order
+    uint32_t tags[JOURNAL_TAGS];    // descriptor: home of each logged block following it. undo: JOURNAL_UNDO_MAX
+                                    // homes, then the checksum of each before-image
+} journal_block_t;
+
+typedef char journal_block_fits[sizeof(journal_block_t) <= BLOCK_SIZE_BYTES ? 1 : -1];
+
+static struct journal *journal_create(size_t start, size_t blocks)
+{
+    struct journal *j = calloc(1, sizeof(struct journal));
+    if(j == NULL) {
+        return NULL;
+    }
+    j->start = start;
+    j->blocks = blocks;
+    j->head = 1;
+    j->sequence = 1;
+    return j;
+}
+
+static void journal_destroy(struct journal *j)
+{
+    if(j != NULL) {
+        free(j->dirty.blocks);
+        free(j->covered.blocks);
+        free(j->freed.blocks);
+        free(j->logged.blocks);
+        free(j);
+    }
+}
+
+static journal_block_t *journal_block(FS_t *fs, size_t index)
+{
+    return (journal_block_t *)(block_store_Data_location(fs->BlockStore_whole) + (fs->journal->start + index) * BLOCK_SIZE_BYTES);
+}
+
+// FNV-1a, continued from sum
+static uint32_t journal_checksum(uint32_t sum, const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    for(size_t i = 0; i < length; i++) {
+        sum = (sum ^ bytes[i]) * 16777619u;
+    }
+    return sum;
+}
+
+#define JOURNAL_CHECKSUM_SEED 2166136261u
+
+// push blocks [block_ID, block_ID + count) of the mapped image through to the image file
+static void image_sync_blocks(FS_t *fs, size_t block_ID, size_t count)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)(block_store_Data_location(fs->BlockStore_whole) + block_ID * BLOCK_SIZE_BYTES);
+    uintptr_t aligned = start & ~(uintptr_t)(page - 1);
+    msync((void *)aligned, start - aligned + count * BLOCK_SIZE_BYTES, MS_SYNC);
+    if(fs->on_sync != NULL) {
+        fs->on_sync(block_ID, count, fs->on_sync_arg);
+    }
+}
+
+// forget the running transaction, it has been committed or written through. Under the dirty lock even though the FS
+// is held exclusively, since fs_enter and fs_leave look at the counts outside the FS lock (see journal_commit_due).
+static void journal_clear(FS_t *fs)
+{
+    struct journal *j = fs->journal;
+    pthread_mutex_lock(&fs->locks->dirty);
+    block_set_clear(&j->dirty);
+    block_set_clear(&j->covered);
+    block_set_clear(&j->freed);
+    j->ops = 0;
+    j->undone = 0;
+    pthread_mutex_unlock(&fs->locks->dirty);
+}
+
+// empty the log: from now on replay starts at the running transaction
+static void journal_reset(FS_t *fs)
+{
+    journal_block_t *super = journal_block(fs, 0);
+    memset(super, 0, BLOCK_SIZE_BYTES);
+    super->magic = JOURNAL_MAGIC;
+    super->type = JOURNAL_SUPER;
+    super->sequence = fs->journal->sequence;
+    image_sync_blocks(fs, fs->journal->start, 1);
+    fs->journal->head = 1;
+    block_set_clear(&fs->journal->logged);
+}
+
+// sync the home of every block in the log, after which the log isn't needed anymore and is emptied. Blocks the
+// running transaction changed may go along, which is fine since it logged their before-images.
+static void journal_checkpoint(FS_t *fs)
+{
+    struct journal *j = fs->journal;
+    size_t pos = 1;
+    while(pos < j->head) {
+        const journal_block_t *b = journal_block(fs, pos);
+        if(b->type == JOURNAL_DESCRIPTOR) {
+            for(size_t i = 0; i < b->count; i++) {
+                image_sync_blocks(fs, b->tags[i], 1);
+            }
+            pos += b->count;
+        }
+        pos++;
+    }
+    journal_reset(fs);
+}
+
+// log the before-image of block_ID ahead of the running transaction's first change to it, with the dirty lock held.
+// The copy and the undo block counting it are synced before the caller goes on to change the block.
+static void journal_protect(FS_t *fs, size_t block_ID)
+{
+    struct journal *j = fs->journal;
+    if(block_set_contains(&j->covered, block_ID) || (block_ID >= j->start && block_ID < j->start + j->blocks)) {
+        return;
+    }
+    if(j->undone >= JOURNAL_UNDO_MAX || j->undone + 3 > j->blocks) {
+        //a single call changing hundreds of blocks, which calls that could split their work up to avoid (see
+        //fs_create_many), and which fs_enter keeps from piling up: this block can't be rolled back
+        return;
+    }
+    size_t slot = j->blocks - 2 - j->undone;
+    if(slot < j->head) {
+        //the log grew into the before-images
+        journal_checkpoint(fs);
+    }
+    journal_block_t *undo = journal_block(fs, j->blocks - 1);
+    void *copy = journal_block(fs, slot);
+    memcpy(copy, block_store_Data_location(fs->BlockStore_whole) + block_ID * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+    if(j->undone == 0) {
+        memset(undo, 0, BLOCK_SIZE_BYTES);
+        undo->magic = JOURNAL_MAGIC;
+        undo->type = JOURNAL_UNDO;
+        undo->sequence = j->sequence;
+    }
+    undo->tags[j->undone] = block_ID;
+    undo->tags[JOURNAL_UNDO_MAX + j->undone] = journal_checksum(JOURNAL_CHECKSUM_SEED, copy, BLOCK_SIZE_BYTES);
+    undo->count = ++j->undone;
+    //one sync for both. A copy that didn't make it fails its checksum and isn't rolled back, but then its block
+    //hadn't been changed yet either.
+    image_sync_blocks(fs, j->start + slot, j->blocks - slot);
+    block_set_add(&j->covered, block_ID);
+}
+
+// note that metadata block block_ID is about to change, in the mapped image or in a cached copy written back before
+// the next commit or fs_sync. It is called ahead of the change, for the journal to log the block's before-image first.
+static void metadata_dirty(FS_t *fs, size_t block_ID)
+{
+    pthread_mutex_lock(&fs->locks->dirty);
+    if(fs->journal != NULL) {
+        journal_protect(fs, block_ID);
+        block_set_add(&fs->journal->dirty, block_ID);
+    }
+    if(fs->unsynced != NULL) {
+        block_set_add(fs->unsynced, block_ID);
+    }
+    pthread_mutex_unlock(&fs->locks->dirty);
+}
+
+static void block_release_now(FS_t *fs, size_t block_ID);
+
+// give the blocks the running transaction freed back, as part of it. None of them is logged: whatever they hold is
+// free space after the commit. An after-image of one still in the log from an earlier transaction would be replayed
+// over whatever the block holds next, so the log is checkpointed first then.
+static void journal_release_freed(FS_t *fs)
+{
+    struct journal *j = fs->journal;
+    bool revoked = false;
+    size_t count = 0;
+    //the dirty lock, like journal_clear
+    pthread_mutex_lock(&fs->locks->dirty);
+    for(size_t i = 0; i < j->dirty.count; i++) {
+        uint32_t b = j->dirty.blocks[i];
+        if(block_set_contains(&j->freed, b)) {
+            j->dirty.map[b / 8] &= ~(1u << (b % 8));
+        }
+        else {
+            j->dirty.blocks[count++] = b;
+        }
+    }
+    j->dirty.count = count;
+    pthread_mutex_unlock(&fs->locks->dirty);
+    for(size_t i = 0; i < j->freed.count && !revoked; i++) {
+        revoked = block_set_contains(&j->logged, j->freed.blocks[i]);
+    }
+    if(revoked || j->freed.overflow) {
+        journal_checkpoint(fs);
+    }
+    for(size_t i = 0; i < j->freed.count; i++) {
+        block_release_now(fs, j->freed.blocks[i]);
+    }
+}
+
+// make the running transaction durable. Appends held back in descriptors get their blocks and the caches write
+// back first, so the mapped image holds the transaction's blocks as they are to be logged.
+static void journal_commit(FS_t *fs)
+{
+    struct journal *j = fs->journal;
+    if(j == NULL) {
+        return;
+    }
+    fd_delay_flush_all(fs);
+    icache_sync(fs);
+    bcache_sync(fs);
+    journal_release_freed(fs);
+    if(j->dirty.count == 0 && !j->dirty.overflow) {
+        pthread_mutex_lock(&fs->locks->dirty);
+        j->ops = 0;
+        pthread_mutex_unlock(&fs->locks->dirty);
+        return;
+    }
+    size_t count = j->dirty.count;
+    size_t need = (count + JOURNAL_TAGS - 1) / JOURNAL_TAGS + count + 1;
+    //the before-images stay until the commit is through
+    size_t end = j->undone > 0 ? j->blocks - 1 - j->undone : j->blocks;
+    if(!j->dirty.overflow && j->head + need > end) {
+        journal_checkpoint(fs);
+    }
+    if(j->dirty.overflow || j->head + need > end) {
+        //can't be logged, so the blocks are synced in place. A crash before the log is reset past the transaction
+        //still rolls it back, so it stays atomic.
+        if(j->dirty.overflow) {
+            image_sync_blocks(fs, 0, BLOCK_STORE_NUM_BLOCKS);
+        }
+        else {
+            for(size_t i = 0; i < count; i++) {
+                image_sync_blocks(fs, j->dirty.blocks[i], 1);
+            }
+        }
+        j->sequence++;
+        journal_reset(fs);
+        journal_clear(fs);
+        return;
+    }
+    const uint8_t *image = block_store_Data_location(fs->BlockStore_whole);
+    size_t pos = j->head;
+    uint32_t sum = JOURNAL_CHECKSUM_SEED;
+    for(size_t done = 0; done < count; ) {
+        size_t n = count - done < JOURNAL_TAGS ? count - done : JOURNAL_TAGS;
+        journal_block_t *descriptor = journal_block(fs, pos++);
+        memset(descriptor, 0, BLOCK_SIZE_BYTES);
+        descriptor->magic = JOURNAL_MAGIC;
+        descriptor->type = JOURNAL_DESCRIPTOR;
+        descriptor->sequence = j->sequence;
+        descriptor->count = n;
+        memcpy(descriptor->tags, j->dirty.blocks + done, n * sizeof(uint32_t));
+        sum = journal_checksum(sum, descriptor, BLOCK_SIZE_BYTES);
+        for(size_t i = 0; i < n; i++) {
+            void *copy = journal_block(fs, pos++);
+            memcpy(copy, image + (size_t)j->dirty.blocks[done + i] * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+            sum = journal_checksum(sum, copy, BLOCK_SIZE_BYTES);
+            block_set_add(&j->logged, j->dirty.blocks[done + i]);
+        }
+        done += n;
+    }
+    journal_block_t *commit = journal_block(fs, pos);
+    memset(commit, 0, BLOCK_SIZE_BYTES);
+    commit->magic = JOURNAL_MAGIC;
+    commit->type = JOURNAL_COMMIT;
+    commit->sequence = j->sequence;
+    commit->count = count;
+    commit->checksum = sum;
+    //one sync for the whole transaction, the checksum catches a commit block that made it without the rest
+    image_sync_blocks(fs, j->start + j->head, need);
+    j->head += need;
+    j->sequence++;
+    journal_clear(fs);
+}
+
+// count one finished operation into the running transaction. The call's fs_leave commits it once the group is big enough.
+static void journal_op_done(FS_t *fs)
+{
+    if(fs->journal != NULL) {
+        pthread_mutex_lock(&fs->locks->dirty);
+        fs->journal->ops++;
+        pthread_mutex_unlock(&fs->locks->dirty);
+    }
+}
+
+// whether the running transaction has taken up half the room for before-images, past which no new call may join it
+static bool journal_commit_urgent(FS_t *fs)
+{
+    struct journal *j = fs->journal;
+    if(j == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&fs->locks->dirty);
+    bool urgent = j->undone >= JOURNAL_UNDO_MAX / 2;
+    pthread_mutex_unlock(&fs->locks->dirty);
+    return urgent;
+}
+
+// whether the running transaction is big enough to be committed
+static bool journal_commit_due(FS_t *fs)
+{
+    struct journal *j = fs->journal;
+    if(j == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&fs->locks->dirty);
+    bool due = j->ops >= JOURNAL_GROUP_OPS || j->dirty.count >= JOURNAL_GROUP_BLOCKS || j->undone >= JOURNAL_UNDO_MAX / 2;
+    pthread_mutex_unlock(&fs->locks->dirty);
+    return due;
+}
+
+// copy every complete transaction in the log to the home blocks, oldest first, then put the before-images of the
+// transaction after them back, and empty the log. Runs at mount, before anything reads metadata.
+static void journal_replay(FS_t *fs)
+{
+    struct journal *j = fs->journal;
+    const journal_block_t *super = journal_block(fs, 0);
+    if(super->magic == JOURNAL_MAGIC && super->type == JOURNAL_SUPER) {
+        j->sequence = super->sequence;
+    }
+    uint8_t *image = block_store_Data_location(fs->BlockStore_whole);
+    size_t pos = 1;
+    bool replayed = false;
+    while(pos < j->blocks) {
+        //the whole transaction has to check out before any of it is applied
+        size_t end = pos;
+        size_t logged = 0;
+        uint32_t sum = JOURNAL_CHECKSUM_SEED;
+        const journal_block_t *b = journal_block(fs, end);
+        while(b->magic == JOURNAL_MAGIC && b->type == JOURNAL_DESCRIPTOR && b->sequence == j->sequence
+                && b->count <= JOURNAL_TAGS && b->count < j->blocks - end - 1) {
+            sum = journal_checksum(sum, b, BLOCK_SIZE_BYTES);
+            for(size_t i = 1; i <= b->count; i++) {
+                sum = journal_checksum(sum, journal_block(fs, end + i), BLOCK_SIZE_BYTES);
+            }
+            logged += b->count;
+            end += b->count + 1;
+            b = journal_block(fs, end);
+        }
+        if(end == pos || b->magic != JOURNAL_MAGIC || b->type != JOURNAL_COMMIT || b->sequence != j->sequence
+                || b->count != logged || b->checksum != sum) {
+            break;
+        }
+        for(size_t at = pos; at < end; ) {
+            const journal_block_t *descriptor = journal_block(fs, at);
+            for(size_t i = 0; i < descriptor->count; i++) {
+                size_t home = descriptor->tags[i];
+                if(home < BLOCK_STORE_NUM_BLOCKS && (home < j->start || home >= j->start + j->blocks)) {
+                    memcpy(image + home * BLOCK_SIZE_BYTES, journal_block(fs, at + 1 + i), BLOCK_SIZE_BYTES);
+                }
+            }
+            at += descriptor->count + 1;
+        }
+        pos = end + 1;
+        j->sequence++;
+        replayed = true;
+    }
+    //the transaction that was running never committed, but may have changed blocks in place
+    const journal_block_t *undo = journal_block(fs, j->blocks - 1);
+    if(j->blocks > 2 && undo->magic == JOURNAL_MAGIC && undo->type == JOURNAL_UNDO && undo->sequence == j->sequence
+            && undo->count <= JOURNAL_UNDO_MAX && undo->count + 2 <= j->blocks) {
+        for(size_t i = 0; i < undo->count; i++) {
+            const void *copy = journal_block(fs, j->blocks - 2 - i);
+            size_t home = undo->tags[i];
+            if(home < BLOCK_STORE_NUM_BLOCKS && (home < j->start || home >= j->start + j->blocks)
+                    && journal_checksum(JOURNAL_CHECKSUM_SEED, copy, BLOCK_SIZE_BYTES) == undo->tags[JOURNAL_UNDO_MAX + i]) {
+                memcpy(image + home * BLOCK_SIZE_BYTES, copy, BLOCK_SIZE_BYTES);
+            }
+        }
+        //a new number, so that these before-images never match again
+        j->sequence++;
+        replayed = true;
+    }
+    if(replayed) {
+        image_sync_blocks(fs, 0, BLOCK_STORE_NUM_BLOCKS);
+    }
+    journal_reset(fs);
+}
+
+// every entry point runs between fs_enter and fs_leave, see fs_locks
+static void fs_enter(FS_t *fs)
+{
+    //a transaction that took up half the room for before-images is committed before another call can join it
+    if(journal_commit_urgent(fs)) {
+        pthread_rwlock_wrlock(&fs->locks->fs);
+        if(journal_commit_urgent(fs)) {
+            journal_commit(fs);
+        }
+        pthread_rwlock_unlock(&fs->locks->fs);
+    }
+    pthread_rwlock_rdlock(&fs->locks->fs);
+}
+
+static void fs_enter_exclusive(FS_t *fs)
+{
+    pthread_rwlock_wrlock(&fs->locks->fs);
+}
+
+static void fs_leave_exclusive(FS_t *fs)
+{
+    pthread_rwlock_unlock(&fs->locks->fs);
+}
+
+// a commit needs the FS to itself, so it is made on the way out by the call that made the group big enough
+static void fs_leave(FS_t *fs)
+{
+    pthread_rwlock_unlock(&fs->locks->fs);
+    if(journal_commit_due(fs)) {
+        fs_enter_exclusive(fs);
+        if(journal_commit_due(fs)) {
+            journal_commit(fs);
+        }
+        fs_leave_exclusive(fs);
+    }
+}
+
+// with the asynchronous I/O calls, which need the whole I/O path
+static struct aio *aio_create(void);
+static void aio_destroy(FS_t *fs);
+
+// the superblock lives in the otherwise unused tail of block 0, behind the inode bitmap.
+// Images formatted before it existed have zeros there, which reads back as "no features".
+#define FS_SUPER_OFFSET 2048
+#define FS_SUPER_MAGIC 0x31324653u     // "FS21"
+#define FS_SUPER_VERSION 2             // images with FS_FEATURE_LARGE_INODES, version 1 images are laid out the classic way
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t features;
+    uint32_t journal_start;     // FS_FEATURE_JOURNAL: where the journal region is, see struct journal
+    uint32_t journal_blocks;
+    uint32_t reserved[11];
+} fs_super_t;
+
+static void super_write(FS_t *fs)
+{
+    fs_super_t super;
+    memset(&super, 0, sizeof(super));
+    super.magic = FS_SUPER_MAGIC;
+    super.version = (fs->features & FS_FEATURE_LARGE_INODES) != 0 ? FS_SUPER_VERSION : 1;
+    super.features = fs->features;
+    if(fs->journal != NULL) {
+        super.journal_start = fs->journal->start;
+        super.journal_blocks = fs->journal->blocks;
+    }
+    memcpy(block_store_Data_location(fs->BlockStore_whole) + FS_SUPER_OFFSET, &super, sizeof(super));
+}
+
+// \return 0 and the feature bits in fs->features (and fs->journal when there is one), -1 if the image needs
+// something this build can't do or its superblock doesn't make sense
+static int super_read(FS_t *fs)
+{
+    fs_super_t super;
+    memcpy(&super, block_store_Data_location(fs->BlockStore_whole) + FS_SUPER_OFFSET, sizeof(super));
+    fs->features = 0;
+    if(super.magic != FS_SUPER_MAGIC) {
+        return 0;	// classic image
+    }
+    if(super.version > FS_SUPER_VERSION || (super.features & ~FS_FEATURES_SUPPORTED) != 0) {
+        return -1;
+    }
+    if((super.features & FS_FEATURE_JOURNAL) != 0) {
+        if(super.journal_start == 0 || super.journal_blocks < 2 || super.journal_start + super.journal_blocks > BLOCK_STORE_AVAIL_BLOCKS) {
+            return -1;
+        }
+        fs->journal = journal_create(super.journal_start, super.journal_blocks);
+        if(fs->journal == NULL) {
+            return -1;
+        }
+    }
+    fs->features = super.features;
+    return 0;
+}
+
+/// Formats (and mounts) an FS file for use
+/// \param fname The file to format
+/// \return Mounted FS object, NULL on error
+///
+FS_t *fs_format(const char *path)
+{
+    return fs_format_ex(path, 0);
+}
+
+///
+/// Formats (and mounts) an FS file with optional on-disk features enabled
+/// \param path The file to format
+/// \param features Bitwise OR of FS_FEATURE_* flags
+/// \return Mounted FS object, NULL on error or if a feature is not supported
+///
+FS_t *fs_format_ex(const char *path, uint32_t features)
+{
+    if(path != NULL && strlen(path) != 0 && (features & ~FS_FEATURES_SUPPORTED) == 0)
+    {
+        FS_t * ptr_FS = (FS_t *)calloc(1, sizeof(FS_t));	// get started
+        ptr_FS->locks = fs_locks_create();
+        if(ptr_FS->locks == NULL)
+        {
+            free(ptr_FS);
+            return NULL;
+        }
+        ptr_FS->BlockStore_whole = block_store_create(path);				// pointer to start of a large chunck of memory
+
+        // reserve the 1st block for bitmap of inode
+        size_t bitmap_ID = block_store_allocate(ptr_FS->BlockStore_whole);
+        //		printf("bitmap_ID = %zu\n", bitmap_ID);
+
+        // 2rd - 5th block for inodes, 4 blocks in total
+        size_t inode_start_block = block_store_allocate(ptr_FS->BlockStore_whole);
+        //		printf("inode_start_block = %zu\n", inode_start_block);		
+        for(int i = 0; i < 3; i++)
+        {
+            block_store_allocate(ptr_FS->BlockStore_whole);
+            //			printf("all the way with block %zu\n", block_store_allocate(ptr_FS->BlockStore_whole));
+        }
+
+        // install inode block store inside the whole block store. A large inode table uses the same 5 blocks
+        // for its superblock, map, bitmap and first table block instead
+        if((features & FS_FEATURE_LARGE_INODES) == 0)
+        {
+            ptr_FS->BlockStore_inode = block_store_inode_create(block_store_Data_location(ptr_FS->BlockStore_whole) + bitmap_ID * BLOCK_SIZE_BYTES, block_store_Data_location(ptr_FS->BlockStore_whole) + inode_start_block * BLOCK_SIZE_BYTES);
+        }
+        else if(inode_table_open(ptr_FS, true) < 0)
+        {
+            block_store_destroy(ptr_FS->BlockStore_whole);
+            fs_locks_destroy(ptr_FS->locks);
+            free(ptr_FS);
+            return NULL;
+        }
+
+        // the first inode is reserved for root dir
+        inode_alloc(ptr_FS);
+        //		printf("first inode ID = %zu\n", block_store_sub_allocate(ptr_FS->BlockStore_inode));
+
+        // update the root inode info.
+        uint8_t root_inode_ID = 0;	// root inode is the first one in the inode table
+        inode_t * root_inode = (inode_t *) calloc(1, sizeof(inode_t));
+        //		printf("size of inode_t = %zu\n", sizeof(inode_t));
+        root_inode->vacantFile = 0x00000000;
+        root_inode->fileType = 'd';								
+        root_inode->inodeNumber = root_inode_ID;
+        root_inode->linkCount = 1;
+        //		root_inode->directPointer[0] = root_data_ID;	// not allocate date block for it until it has a sub-folder or file
+        inode_table_write(ptr_FS, root_inode_ID, root_inode);
+        free(root_inode);
+
+        // the journal region goes right behind the inode table, the blocks after it are still free
+        if((features & FS_FEATURE_JOURNAL) != 0)
+        {
+            size_t journal_start = inode_start_block + 4;
+            for(size_t i = 0; i < JOURNAL_BLOCKS; i++)
+            {
+                block_store_request(ptr_FS->BlockStore_whole, journal_start + i);
+            }
+            ptr_FS->journal = journal_create(journal_start, JOURNAL_BLOCKS);
+            if(ptr_FS->journal == NULL)
+            {
+                if(ptr_FS->BlockStore_inode != NULL)
+                {
+                    block_store_inode_destroy(ptr_FS->BlockStore_inode);
+                }
+                inode_table_close(ptr_FS->inode_table);
+                block_store_destroy(ptr_FS->BlockStore_whole);
+                fs_locks_destroy(ptr_FS->locks);
+                free(ptr_FS);
+                return NULL;
+            }
+            journal_reset(ptr_FS);
+        }
+
+        // only stamp a superblock when asked for something, so plain images stay byte for byte what they always were
+        ptr_FS->features = features;
+        if(features != 0)
+        {
+            super_write(ptr_FS);
+        }
+
+        // every block the layout needs is taken by now, so the summary starts out right
+        ptr_FS->space = space_create(ptr_FS->BlockStore_whole);
+
+        // now allocate space for the file descriptors
+        ptr_FS->fd_table = fd_table_create();
+        ptr_FS->dcache = dcache_create();
+        ptr_FS->icache = icache_create();
+        ptr_FS->bcache = bcache_create(BCACHE_DEFAULT_BLOCKS);
+        ptr_FS->unsynced = block_set_create();
+        ptr_FS->aio = aio_create();
+
+        return ptr_FS;
+    }
+
+    return NULL;	
+}
+
+
+
+///
+/// Mounts an FS object and prepares it for use
+/// \param fname The file to mount
+
+/// \return Mounted FS object, NULL on error
+
+///
+FS_t *fs_mount(const char *path)
+{
+    if(path != NULL && strlen(path) != 0)
+    {
+        FS_t * ptr_FS = (FS_t *)calloc(1, sizeof(FS_t));	// get started
+        ptr_FS->locks = fs_locks_create();
+        if(ptr_FS->locks == NULL)
+        {
+            free(ptr_FS);
+            return NULL;
+        }
+        ptr_FS->BlockStore_whole = block_store_open(path);	// get the chunck of data	
+
+        // the bitmap block should be the 1st one
+        size_t bitmap_ID = 0;
+
+        // the inode blocks start with the 2nd block, and goes around until the 5th block, 4 in total
+        size_t inode_start_block = 1;
+
+        // refuse images that use features this build doesn't understand rather than corrupting them
+        if(ptr_FS->BlockStore_whole == NULL || super_read(ptr_FS) < 0)
+        {
+            journal_destroy(ptr_FS->journal);
+            block_store_destroy(ptr_FS->BlockStore_whole);
+            fs_locks_destroy(ptr_FS->locks);
+            free(ptr_FS);
+            return NULL;
+        }
+
+        // whatever was committed before the last crash lands in place, and whatever wasn't is rolled back, before
+        // anything reads metadata
+        if(ptr_FS->journal != NULL)
+        {
+            journal_replay(ptr_FS);
+        }
+
+        // attach the bitmaps to their designated place
+        if((ptr_FS->features & FS_FEATURE_LARGE_INODES) == 0)
+        {
+            ptr_FS->BlockStore_inode = block_store_inode_create(block_store_Data_location(ptr_FS->BlockStore_whole) + bitmap_ID * BLOCK_SIZE_BYTES, block_store_Data_location(ptr_FS->BlockStore_whole) + inode_start_block * BLOCK_SIZE_BYTES);
+        }
+        else if(inode_table_open(ptr_FS, false) < 0)
+        {
+            journal_destroy(ptr_FS->journal);
+            block_store_destroy(ptr_FS->BlockStore_whole);
+            fs_locks_destroy(ptr_FS->locks);
+            free(ptr_FS);
+            return NULL;
+        }
+
+        // the free space summary is in memory only, rebuilt from the replayed free block map
+        ptr_FS->space = space_create(ptr_FS->BlockStore_whole);
+
+        // since file descriptors live in memory only, every mount starts with an empty table.
+        ptr_FS->fd_table = fd_table_create();
+        // lookups are cached in memory only, so every mount starts with an empty dentry cache
+        ptr_FS->dcache = dcache_create();
+        ptr_FS->icache = icache_create();
+        ptr_FS->bcache = bcache_create(BCACHE_DEFAULT_BLOCKS);
+        ptr_FS->unsynced = block_set_create();
+        ptr_FS->aio = aio_create();
+
+        return ptr_FS;
+    }
+
+    return NULL;		
+}
+
+
+
+
+///
+/// Unmounts the given object and frees all related resources
+/// \param fs The FS object to unmount
+/// \return 0 on success, < 0 on failure
+///
+int fs_unmount(FS_t *fs)
+{
+    if(fs != NULL)
+    {	
+        //pending appends, inode and block changes have to reach the image before it goes away. With a journal they
+        //are committed, and the log is emptied once everything is in place. Calls still running finish first,
+        //and so do queued asynchronous requests.
+        aio_destroy(fs);
+        fs_enter_exclusive(fs);
+        journal_commit(fs);
+        if(fs->journal != NULL) {
+            journal_checkpoint(fs);
+            journal_destroy(fs->journal);
+            fs->journal = NULL;
+        }
+        fd_delay_flush_all(fs);
+        icache_sync(fs);
+        icache_destroy(fs->icache);
+        bcache_sync(fs);
+        bcache_destroy(fs->bcache);
+        block_set_destroy(fs->unsynced);
+        if(fs->BlockStore_inode != NULL) {
+            block_store_inode_destroy(fs->BlockStore_inode);
+        }
+        inode_table_close(fs->inode_table);
+        free(fs->space);
+
+        block_store_destroy(fs->BlockStore_whole);
+        fd_table_destroy(fs->fd_table);
+        dcache_destroy(fs->dcache);
+        fs_leave_exclusive(fs);
+        fs_locks_destroy(fs->locks);
+
+        free(fs);
+        return 0;
+    }
+    return -1;
+}
+
+int fs_set_cache_capacity(FS_t *fs, size_t blocks)
+{
+    if(fs == NULL) {
+        return -1;
+    }
+    struct bcache *bc = bcache_create(blocks);
+    if(bc == NULL) {
+        return -1;
+    }
+    //everything the old cache holds back has to be in the image before the new one starts out empty
+    fs_enter_exclusive(fs);
+    bcache_sync(fs);
+    bcache_destroy(fs->bcache);
+    fs->bcache = bc;
+    fs_leave_exclusive(fs);
+    return 0;
+}
+
+int fs_cache_stats(FS_t *fs, fs_cache_stats_t *stats)
+{
+    if(fs == NULL || stats == NULL) {
+        return -1;
+    }
+    fs_enter(fs);
+    int ret = -1;
+    if(fs->bcache != NULL) {
+        pthread_mutex_lock(&fs->locks->bcache);
+        *stats = fs->bcache->stats;
+        pthread_mutex_unlock(&fs->locks->bcache);
+        ret = 0;
+    }
+    fs_leave(fs);
+    return ret;
+}
+
+
+// a single path component, as a span over the caller's path string. Nothing is copied, the path must outlive the span.
+typedef struct {
+    uint16_t offset;
+    uint16_t length;
+} path_span_t;
+
+// deepest path we accept. Spans live on the caller's stack, so this bounds the stack usage of every entry point
+#define FS_PATH_MAX_DEPTH 64
+
+// split an absolute path into its components without touching the heap
+//   every component has to be 1 - 127 characters long, so empty components ("//" or a trailing '/') are errors
+//   "/" alone is valid and has 0 components, callers that need a name have to check count themselves
+// \return 0 and the number of components in count, -1 on a malformed path
+static int path_tokenize(const char *path, path_span_t *spans, size_t *count)
+{
+    if(path == NULL || path[0] != '/') {
+        return -1;
+    }
+    *count = 0;
+    size_t pos = 1;
+    if(path[pos] == '\0') {
+        // root only
+        return 0;
+    }
+    while(true) {
+        size_t start = pos;
+        while(path[pos] != '/' && path[pos] != '\0') {
+            pos++;
+            if(pos - start > FS_FNAME_MAX) {
+                return -1;
+            }
+        }
+        if(pos == start || *count == FS_PATH_MAX_DEPTH || pos > UINT16_MAX) {
+            return -1;
+        }
+        spans[*count].offset = (uint16_t)start;
+        spans[*count].length = (uint16_t)(pos - start);
+        (*count)++;
+        if(path[pos] == '\0') {
+            return 0;
+        }
+        pos++;
+    }
+}
+
+// Directory entries. On an FS_FEATURE_LARGE_INODES image an entry is laid out as
+//   char filename[FS_LARGE_FNAME_MAX]; uint32_t inodeNumber;
+// in the same 128 bytes as a directoryFile_t, so the directory layouts below are the same for both. Only the
+// functions here know the difference. Either way a name that fills its field has no terminator.
+
+// \return the longest name a directory entry of this image can hold
+static size_t dirent_name_max(const FS_t *fs)
+{
+    return fs->inode_table != NULL ? FS_LARGE_FNAME_MAX : FS_FNAME_MAX;
+}
+
+static size_t dirent_inode(const FS_t *fs, const directoryFile_t *entry)
+{
+    if(fs->inode_table == NULL) {
+        return entry->inodeNumber;
+    }
+    uint32_t inode_ID;
+    memcpy(&inode_ID, (const char *)entry + FS_LARGE_FNAME_MAX, sizeof(inode_ID));
+    return inode_ID;
+}
+
+// compare a directory entry against a name that is not necessarily null terminated
+static bool dirent_name_equals(const FS_t *fs, const directoryFile_t *entry, const char *name, size_t len)
+{
+    size_t max = dirent_name_max(fs);
+    if(len > max || memcmp(entry->filename, name, len) != 0) {
+        return false;
+    }
+    return len == max || entry->filename[len] == '\0';
+}
+
+// store a name that is not necessarily null terminated, and the inode it names, into a directory entry
+static void dirent_set(const FS_t *fs, directoryFile_t *entry, const char *name, size_t len, size_t inode_ID)
+{
+    memset(entry, 0, sizeof(directoryFile_t));
+    memcpy(entry->filename, name, len);
+    if(fs->inode_table == NULL) {
+        entry->inodeNumber = inode_ID;
+    }
+    else {
+        uint32_t wide_ID = (uint32_t)inode_ID;
+        memcpy((char *)entry + FS_LARGE_FNAME_MAX, &wide_ID, sizeof(wide_ID));
+    }
+}
+
+// copy a directory entry's name out into a file_record_t's
+static void dirent_get_name(const FS_t *fs, const directoryFile_t *entry, char *name)
+{
+    size_t max = dirent_name_max(fs);
+    memcpy(name, entry->filename, max);
+    memset(name + max, 0, FS_FNAME_MAX - max);
+}
+
+// Directory layout.
+// A classic directory is one block of folder_number_entries entries hanging off directPointer[0], with
+// occupancy in the inode's vacantFile bitmap. On images formatted with FS_FEATURE_DIR_INDEX a directory
+// that outgrows its block is converted, once, to the indexed layout: directPointer[0] then points at an
+// index block of bucket heads, every name hashes to one bucket, and a bucket is a chain of dir_bucket_t
+// blocks. An indexed directory keeps its entry count in vacantFile, so vacantFile == 0 still means empty.
+#define DIR_INDEX_BUCKETS (BLOCK_SIZE_BYTES / sizeof(uint16_t))
+#define DIR_BLOCK_ENTRIES (BLOCK_SIZE_BYTES / sizeof(directoryFile_t))
+
+typedef struct {
+    uint32_t vacantFile;    // occupancy of entries, same bit layout as a classic directory inode's
+    uint16_t next;          // next block in this bucket's chain, 0 ends it
+    uint8_t padding[sizeof(directoryFile_t) - sizeof(uint32_t) - sizeof(uint16_t)];
+    directoryFile_t entries[folder_number_entries];
+} dir_bucket_t;
+
+typedef char dir_bucket_fills_block[sizeof(dir_bucket_t) == BLOCK_SIZE_BYTES ? 1 : -1];
+
+static bool dir_is_indexed(const inode_t *dir)
+{
+    return (dir->flags & INODE_DIR_INDEX) != 0;
+}
+
+static size_t dir_bucket_of(const char *name, size_t len)
+{
+    return name_hash(name, len) & (DIR_INDEX_BUCKETS - 1);
+}
+
+// \return the first unoccupied slot of a directory block, -1 if all of them are taken
+static int dir_free_slot(uint32_t vacant)
+{
+    for(int j = 0; j < folder_number_entries; j++) {
+        if(((vacant >> j) & 1) == 0) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+// \return the occupied slot holding name, -1 if there is none
+static int dir_find_slot(const FS_t *fs, const directoryFile_t *entries, uint32_t vacant, const char *name, size_t len)
+{
+    for(int j = 0; j < folder_number_entries; j++) {
+        if(((vacant >> j) & 1) == 1 && dirent_name_equals(fs, &entries[j], name, len)) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+// look name up in the directory's own blocks, without the dentry cache
+// \return 0 and the child's inode number, -1 if the name does not exist
+static int dir_find_entry(FS_t *fs, const inode_t *dir, const char *name, size_t len, size_t *child_ID)
+{
+    if(dir->vacantFile == 0) {
+        return -1;
+    }
+    if(!dir_is_indexed(dir)) {
+        directoryFile_t data[DIR_BLOCK_ENTRIES];
+        bcache_read(fs, dir->directPointer[0], data);
+        int j = dir_find_slot(fs, data, dir->vacantFile, name, len);
+        if(j < 0) {
+            return -1;
+        }
+        *child_ID = dirent_inode(fs, &data[j]);
+        return 0;
+    }
+    uint16_t index[DIR_INDEX_BUCKETS];
+    bcache_read(fs, dir->directPointer[0], index);
+    dir_bucket_t bucket;
+    for(uint16_t block = index[dir_bucket_of(name, len)]; block != 0; block = bucket.next) {
+        bcache_read(fs, block, &bucket);
+        int j = dir_find_slot(fs, bucket.entries, bucket.vacantFile, name, len);
+        if(j >= 0) {
+            *child_ID = dirent_inode(fs, &bucket.entries[j]);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// put one entry into its bucket of an in-memory index, pushing a fresh block, from near goal, onto the chain when
+// every block in it is full
+// \return 0 on success (index_dirty is set if the index itself changed), -1 when out of blocks
+static int dir_index_insert(FS_t *fs, uint16_t *index, const char *name, size_t len, size_t child_ID, size_t goal, bool *index_dirty)
+{
+    size_t b = dir_bucket_of(name, len);
+    dir_bucket_t bucket;
+    for(uint16_t block = index[b]; block != 0; block = bucket.next) {
+        bcache_read(fs, block, &bucket);
+        int j = dir_free_slot(bucket.vacantFile);
+        if(j >= 0) {
+            dirent_set(fs, &bucket.entries[j], name, len, child_ID);
+            bucket.vacantFile |= (1u << j);
+            bcache_write(fs, block, &bucket);
+            return 0;
+        }
+    }
+    size_t new_block = block_alloc(fs, goal);
+    if(new_block >= BLOCK_STORE_AVAIL_BLOCKS) {
+        return -1;
+    }
+    memset(&bucket, 0, sizeof(bucket));
+    bucket.next = index[b];
+    bucket.vacantFile = 1;
+    dirent_set(fs, &bucket.entries[0], name, len, child_ID);
+    bcache_write(fs, new_block, &bucket);
+    index[b] = new_block;
+    *index_dirty = true;
+    return 0;
+}
+
+// give back every bucket block hanging off an index
+static void dir_index_release(FS_t *fs, const uint16_t *index)
+{
+    dir_bucket_t bucket;
+    for(size_t b = 0; b < DIR_INDEX_BUCKETS; b++) {
+        for(uint16_t block = index[b]; block != 0; block = bucket.next) {
+            bcache_read(fs, block, &bucket);
+            block_free(fs, block);
+        }
+    }
+}
+
+// rewrite a classic directory in the indexed layout, leaving it untouched if the blocks for that can't be had.
+// A directory that never had a block gets an empty index.
+static int dir_convert_to_index(FS_t *fs, inode_t *dir)
+{
+    size_t index_block = block_alloc(fs, group_goal(dir->group));
+    if(index_block >= BLOCK_STORE_AVAIL_BLOCKS) {
+        return -1;
+    }
+    directoryFile_t data[DIR_BLOCK_ENTRIES];
+    if(dir->directPointer[0] != 0) {
+        bcache_read(fs, dir->directPointer[0], data);
+    }
+    uint16_t index[DIR_INDEX_BUCKETS];
+    memset(index, 0, sizeof(index));
+    bool index_dirty = false;
+    uint32_t entries = 0;
+    for(int j = 0; j < folder_number_entries; j++) {
+        if(((dir->vacantFile >> j) & 1) == 0) {
+            continue;
+        }
+        if(dir_index_insert(fs, index, data[j].filename, strnlen(data[j].filename, dirent_name_max(fs)), dirent_inode(fs, &data[j]), group_goal(dir->group), &index_dirty) < 0) {
+            dir_index_release(fs, index);
+            block_free(fs, index_block);
+            return -1;
+        }
+        entries++;
+    }
+    bcache_write(fs, index_block, index);
+    if(dir->directPointer[0] != 0) {
+        block_free(fs, dir->directPointer[0]);
+    }
+    dir->directPointer[0] = index_block;
+    dir->flags |= INODE_DIR_INDEX;
+    dir->vacantFile = entries;
+    inode_write(fs, dir->inodeNumber, dir);
+    return 0;
+}
+
+// add name -> child_ID to a directory and write the directory inode back
+// \return 0 on success, -1 if the name is too long for this image, the directory is full or the FS is out of blocks
+static int dir_add_entry(FS_t *fs, inode_t *dir, const char *name, size_t len, size_t child_ID)
+{
+    if(len > dirent_name_max(fs)) {
+        return -1;
+    }
+    if(!dir_is_indexed(dir)) {
+        int k = dir_free_slot(dir->vacantFile);
+        if(k >= 0) {
+            directoryFile_t data[DIR_BLOCK_ENTRIES];
+            if(dir->directPointer[0] == 0) {
+                // nothing was ever stored in this directory, so it has no block yet
+                size_t data_ID = block_alloc(fs, group_goal(dir->group));
+                if(data_ID >= BLOCK_STORE_AVAIL_BLOCKS) {
+                    return -1;
+                }
+                dir->directPointer[0] = data_ID;
+                memset(data, 0, sizeof(data));
+            }
+            else {
+                bcache_read(fs, dir->directPointer[0], data);
+            }
+            dirent_set(fs, &data[k], name, len, child_ID);
+            dir->vacantFile |= (1u << k);
+            bcache_write(fs, dir->directPointer[0], data);
+            inode_write(fs, dir->inodeNumber, dir);
+            return 0;
+        }
+        // the block is full, which is the end of the line unless the image may grow indexed directories
+        if((fs->features & FS_FEATURE_DIR_INDEX) == 0 || dir_convert_to_index(fs, dir) < 0) {
+            return -1;
+        }
+    }
+    uint16_t index[DIR_INDEX_BUCKETS];
+    bcache_read(fs, dir->directPointer[0], index);
+    bool index_dirty = false;
+    if(dir_index_insert(fs, index, name, len, child_ID, group_goal(dir->group), &index_dirty) < 0) {
+        return -1;
+    }
+    if(index_dirty) {
+        bcache_write(fs, dir->directPointer[0], index);
+    }
+    dir->vacantFile++;
+    inode_write(fs, dir->inodeNumber, dir);
+    return 0;
+}
+
+// drop name from a directory and write the directory inode back
+// \return 0 on success, -1 if the name isn't there
+static int dir_remove_entry(FS_t *fs, inode_t *dir, const char *name, size_t len)
+{
+    if(dir->vacantFile == 0) {
+        return -1;
+    }
+    if(!dir_is_indexed(dir)) {
+        directoryFile_t data[DIR_BLOCK_ENTRIES];
+        bcache_read(fs, dir->directPointer[0], data);
+        int j = dir_find_slot(fs, data, dir->vacantFile, name, len);
+        if(j < 0) {
+            return -1;
+        }
+        //we are going to clear the entry as well to be safe...
+        memset(&data[j], 0, sizeof(data[j]));
+        dir->vacantFile &= ~(1u << j);
+        bcache_write(fs, dir->directPointer[0], data);
+        inode_write(fs, dir->inodeNumber, dir);
+        return 0;
+    }
+    uint16_t index[DIR_INDEX_BUCKETS];
+    bcache_read(fs, dir->directPointer[0], index);
+    size_t b = dir_bucket_of(name, len);
+    uint16_t prev = 0;
+    dir_bucket_t bucket;
+    for(uint16_t block = index[b]; block != 0; prev = block, block = bucket.next) {
+        bcache_read(fs, block, &bucket);
+        int j = dir_find_slot(fs, bucket.entries, bucket.vacantFile, name, len);
+        if(j < 0) {
+            continue;
+        }
+        memset(&bucket.entries[j], 0, sizeof(bucket.entries[j]));
+        bucket.vacantFile &= ~(1u << j);
+        if(bucket.vacantFile != 0) {
+            bcache_write(fs, block, &bucket);
+        }
+        else {
+            // unlink the emptied block right away so chains only ever hold live entries
+            if(prev == 0) {
+                index[b] = bucket.next;
+                bcache_write(fs, dir->directPointer[0], index);
+            }
+            else {
+                dir_bucket_t prev_bucket;
+                bcache_read(fs, prev, &prev_bucket);
+                prev_bucket.next = bucket.next;
+                bcache_write(fs, prev, &prev_bucket);
+            }
+            block_free(fs, block);
+        }
+        dir->vacantFile--;
+        inode_write(fs, dir->inodeNumber, dir);
+        return 0;
+    }
+    return -1;
+}
+
+// give back every block an empty directory still holds, before its inode is released
+static void dir_release(FS_t *fs, inode_t *dir)
+{
+    if(dir->directPointer[0] == 0) {
+        return;
+    }
+    if(dir_is_indexed(dir)) {
+        uint16_t index[DIR_INDEX_BUCKETS];
+        bcache_read(fs, dir->directPointer[0], index);
+        dir_index_release(fs, index);
+    }
+    block_free(fs, dir->directPointer[0]);
+    dir->directPointer[0] = 0;
+}
+
+// a walk over every entry of a directory in storage order, reading each block once
+typedef struct {
+    bool started;
+    bool done;
+    size_t bucket;          // index slot the loaded block hangs off, indexed directories only
+    size_t slot;            // next entry to look at in the loaded block
+    uint16_t index[DIR_INDEX_BUCKETS];
+    union {
+        directoryFile_t entries[DIR_BLOCK_ENTRIES];
+        dir_bucket_t bucket;
+    } block;
+} dir_iter_t;
+
+static void dir_iter_init(dir_iter_t *it)
+{
+    it->started = false;
+    it->done = false;
+    it->bucket = 0;
+    it->slot = 0;
+}
+
+// load the first block of the first non-empty bucket at or after it->bucket
+static bool dir_iter_seek_bucket(FS_t *fs, dir_iter_t *it)
+{
+    while(it->bucket < DIR_INDEX_BUCKETS && it->index[it->bucket] == 0) {
+        it->bucket++;
+    }
+    if(it->bucket == DIR_INDEX_BUCKETS) {
+        it->done = true;
+        return false;
+    }
+    bcache_read(fs, it->index[it->bucket], &it->block);
+    it->slot = 0;
+    return true;
+}
+
+// \return the next entry, NULL once the directory is exhausted. The entry is only valid until the next call.
+static const directoryFile_t *dir_iter_next(FS_t *fs, const inode_t *dir, dir_iter_t *it)
+{
+    bool indexed = dir_is_indexed(dir);
+    while(!it->done) {
+        if(!it->started) {
+            it->started = true;
+            if(dir->vacantFile == 0) {
+                it->done = true;
+            }
+            else if(!indexed) {
+                bcache_read(fs, dir->directPointer[0], &it->block);
+                it->slot = 0;
+            }
+            else {
+                bcache_read(fs, dir->directPointer[0], it->index);
+                it->bucket = 0;
+                dir_iter_seek_bucket(fs, it);
+            }
+            continue;
+        }
+        uint32_t vacant = indexed ? it->block.bucket.vacantFile : dir->vacantFile;
+        const directoryFile_t *entries = indexed ? it->block.bucket.entries : it->block.entries;
+        while(it->slot < folder_number_entries) {
+            size_t j = it->slot++;
+            if(((vacant >> j) & 1) == 1) {
+                return &entries[j];
+            }
+        }
+        if(!indexed) {
+            it->done = true;
+        }
+        else if(it->block.bucket.next != 0) {
+            bcache_read(fs, it->block.bucket.next, &it->block);
+            it->slot = 0;
+        }
+        else {
+            it->bucket++;
+            dir_iter_seek_bucket(fs, it);
+        }
+    }
+    return NULL;
+}
+
+// look a single name up in the directory parent_ID, going to the directory block only when the dentry cache misses.
+// The caller holds parent_ID's lock.
+// \return 0 and the child's inode number and fileType on success, -1 if the name does not exist or parent is not a directory
+static int dir_lookup(FS_t *fs, size_t parent_ID, const char *name, size_t len, size_t *child_ID, char *child_type)
+{
+    size_t cached;
+    char cached_type;
+    if(dcache_lookup(fs->dcache, parent_ID, name, len, &cached, &cached_type)) {
+        if(cached == DCACHE_NEGATIVE) {
+            return -1;
+        }
+        *child_ID = cached;
+        *child_type = cached_type;
+        return 0;
+    }
+    inode_t parent_inode;
+    inode_read(fs, parent_ID, &parent_inode);
+    if(parent_inode.fileType != 'd') {
+        return -1;
+    }
+    if(dir_find_entry(fs, &parent_inode, name, len, child_ID) == 0) {
+        *child_type = inode_type(fs, *child_ID);
+        dcache_insert(fs->dcache, parent_ID, name, len, *child_ID, *child_type);
+        return 0;
+    }
+    dcache_insert(fs->dcache, parent_ID, name, len, DCACHE_NEGATIVE, 0);
+    return -1;
+}
+
+// walk the first count path components starting from the root directory
+// \return 0 and the inode number and fileType of the last component, -1 if some component is missing or not a directory
+static int walk_path(FS_t *fs, const char *path, const path_span_t *tokens, size_t count, size_t *inode_ID, char *type)
+{
+    size_t current_ID = 0;	// the root directory
+    char current_type = 'd';
+    for(size_t i = 0; i < count; i++) {
+        if(current_type != 'd') {
+            return -1;
+        }
+        //only the directory being looked in is locked, so the result may be gone by the time the caller locks it
+        size_t parent_ID = current_ID;
+        inode_lock(fs, parent_ID, false);
+        int found = dir_lookup(fs, parent_ID, path + tokens[i].offset, tokens[i].length, &current_ID, &current_type);
+        inode_unlock(fs, parent_ID);
+        if(found < 0) {
+            return -1;
+        }
+    }
+    *inode_ID = current_ID;
+    *type = current_type;
+    return 0;
+}
+
+
+// write the inode of a file that was just given its first name in parent
+static void inode_init_child(FS_t *fs, size_t inode_ID, file_t type, const inode_t *parent)
+{
+    inode_t child;
+    memset(&child, 0, sizeof(child));
+    child.group = group_for_child(fs, parent, type);
+    if(type == FS_REGULAR) {
+        child.fileType = 'r';
+        if(fs->features & FS_FEATURE_EXTENTS) {
+            child.flags |= INODE_EXTENTS;
+        }
+    }
+    else {
+        child.fileType = 'd';
+    }
+    child.inodeNumber = inode_ID;
+    child.linkCount = 1;
+    inode_write(fs, inode_ID, &child);
+}
+
+
+///
+/// Creates a new file at the specified location
+///   Directories along the path that do not exist are not created
+/// \param fs The FS containing the file
+/// \param path Absolute path to file to create
+/// \param type Type of file to create (regular/directory)
+/// \return 0 on success, < 0 on failure
+///
+int fs_create(FS_t *fs, const char *path, file_t type)
+{
+    if(fs != NULL && path != NULL && strlen(path) != 0 && (type == FS_REGULAR || type == FS_DIRECTORY))
+    {
+        path_span_t tokens[FS_PATH_MAX_DEPTH];		// tokens are the directory names along the path. The last one is the name for the new file or dir
+        size_t count = 0;
+        if(path_tokenize(path, tokens, &count) < 0 || count == 0)
+        {
+            return -1;
+        }
+
+
+        fs_enter(fs);
+        // the new entry may need a directory or inode table block, which can't come out of what appends were promised
+        fd_delay_make_room(fs, BLOCK_SIZE_BYTES);
+
+        // first, let's find the parent dir
+        size_t parent_inode_ID = 0;
+        char parent_type = 0;
+        int found_parent = walk_path(fs, path, tokens, count - 1, &parent_inode_ID, &parent_type);
+
+        // we declare parent_inode here since it will still be used after the if block
+        inode_t * parent_inode = (inode_t *) calloc(1, sizeof(inode_t));	
+
+        if(found_parent == 0 && parent_type == 'd')
+        {
+            // from here on the parent can't change under us, but it may have been removed since the walk
+            inode_lock(fs, parent_inode_ID, true);
+            inode_read(fs, parent_inode_ID, parent_inode);
+
+            // same file or dir name in the same path is intolerable
+            size_t existing_ID;
+            char existing_type;
+            if(parent_inode->fileType != 'd' || parent_inode->linkCount == 0
+                || dir_lookup(fs, parent_inode_ID, path + tokens[count - 1].offset, tokens[count - 1].length, &existing_ID, &existing_type) == 0)
+            {
+                inode_unlock(fs, parent_inode_ID);
+                free(parent_inode);	
+                fs_leave(fs);
+                //printf("filename already exists\n");
+                return -1;											
+            }
+
+            size_t child_inode_ID = inode_alloc(fs);
+            //printf("new child_inode_ID = %zu\n", child_inode_ID);
+            // ugh, inodes are used up
+            if(child_inode_ID == SIZE_MAX)
+            {
+                inode_unlock(fs, parent_inode_ID);
+                free(parent_inode);
+                fs_leave(fs);
+                //printf("could not allocate block for child\n");
+                return -1;	
+            }
+
+            // the directory layer finds a free slot, allocating the parent's first block or growing it as needed,
+            // and writes the parent inode back. A full directory gives the inode back.
+            if(dir_add_entry(fs, parent_inode, path + tokens[count - 1].offset, tokens[count - 1].length, child_inode_ID) < 0)
+            {
+                inode_free(fs, child_inode_ID);
+                inode_unlock(fs, parent_inode_ID);
+                free(parent_inode);
+                fs_leave(fs);
+                return -1;
+            }
+
+            // wow, at last, we make it!				
+            // update the newly created inode
+            inode_init_child(fs, child_inode_ID, type, parent_inode);
+
+            // the name now exists, replace the negative entry the duplicate check above left behind
+            dcache_insert(fs->dcache, parent_inode_ID, path + tokens[count - 1].offset, tokens[count - 1].length, child_inode_ID, type == FS_REGULAR ? 'r' : 'd');
+            inode_unlock(fs, parent_inode_ID);
+
+            // free the temp space
+            free(parent_inode);
+            journal_op_done(fs);
+            fs_leave(fs);
+            return 0;
+        }
+        free(parent_inode);	
+        fs_leave(fs);
+    }
+    return -1;
+}
+
+
+
+// batched creation (fs_create_many) and removal (fs_remove_many). The directory is walked to and locked once for
+// every BATCH_SLICE names, and each slice is a call of its own as far as the journal goes, so a big batch doesn't
+// make one transaction that runs out of room for before-images. A batch create works on the directory's blocks in memory: a classic directory's block is read once and written
+// once, and the names for an indexed directory are sorted by bucket so every chain is loaded, filled and written once.
+typedef struct {
+    size_t bucket;          // indexed directories only
+    size_t index;           // position in the caller's names
+    size_t len;
+    size_t child_ID;
+    int result;
+} dir_batch_item_t;
+
+#define BATCH_SLICE 64
+
+// a bucket chain block held in memory while a batch fills the bucket
+typedef struct {
+    uint16_t block_ID;
+    bool dirty;
+    dir_bucket_t bucket;
+} dir_batch_block_t;
+
+static int dir_batch_item_compare(const void *a, const void *b)
+{
+    const dir_batch_item_t *x = a;
+    const dir_batch_item_t *y = b;
+    if(x->bucket != y->bucket) {
+        return x->bucket < y->bucket ? -1 : 1;
+    }
+    //names in one bucket stay in the caller's order, so the first of two equal names is the one created
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// \return whether name can be a directory entry as it is, and its length in len
+static bool dir_name_valid(const FS_t *fs, const char *name, size_t *len)
+{
+    if(name == NULL) {
+        return false;
+    }
+    *len = strnlen(name, FS_FNAME_MAX + 1);
+    return *len != 0 && *len <= dirent_name_max(fs) && memchr(name, '/', *len) == NULL;
+}
+
+// \return the number of unoccupied slots of a directory block
+static size_t dir_free_slots(uint32_t vacant)
+{
+    size_t count = 0;
+    for(int j = 0; j < folder_number_entries; j++) {
+        count += ((vacant >> j) & 1) == 0;
+    }
+    return count;
+}
+
+// make room for one more block in a batch's chain
+static int dir_batch_grow(dir_batch_block_t **chain, size_t *capacity)
+{
+    size_t grown = *capacity == 0 ? 4 : *capacity * 2;
+    dir_batch_block_t *larger = realloc(*chain, grown * sizeof(dir_batch_block_t));
+    if(larger == NULL) {
+        return -1;
+    }
+    *chain = larger;
+    *capacity = grown;
+    return 0;
+}
+
+// add a batch of names to a classic directory, its block is read once and written once.
+// Names that are taken or don't fit anymore keep their result of -1.
+static void dir_add_batch_classic(FS_t *fs, inode_t *dir, const char *const *names, dir_batch_item_t *items, size_t count, file_t type)
+{
+    directoryFile_t data[DIR_BLOCK_ENTRIES];
+    if(dir->directPointer[0] != 0) {
+        bcache_read(fs, dir->directPointer[0], data);
+    }
+    else {
+        memset(data, 0, sizeof(data));
+    }
+    bool dirty = false;
+    for(size_t i = 0; i < count; i++) {
+        const char *name = names[items[i].index];
+        int k = dir_free_slot(dir->vacantFile);
+        if(k < 0 || dir_find_slot(fs, data, dir->vacantFile, name, items[i].len) >= 0) {
+            continue;
+        }
+        size_t child_ID = inode_alloc(fs);
+        if(child_ID == SIZE_MAX) {
+            continue;
+        }
+        if(dir->directPointer[0] == 0) {
+            size_t data_ID = block_alloc(fs, group_goal(dir->group));
+            if(data_ID >= BLOCK_STORE_AVAIL_BLOCKS) {
+                inode_free(fs, child_ID);
+                continue;
+            }
+            dir->directPointer[0] = data_ID;
+        }
+        dirent_set(fs, &data[k], name, items[i].len, child_ID);
+        dir->vacantFile |= (1u << k);
+        dirty = true;
+        inode_init_child(fs, child_ID, type, dir);
+        items[i].child_ID = child_ID;
+        items[i].result = 0;
+    }
+    if(dirty) {
+        bcache_write(fs, dir->directPointer[0], data);
+    }
+}
+
+// add a batch of names, sorted by bucket, to an indexed directory. Each bucket's chain is read once and every
+// block of it that changed is written once, the index too. Names that are taken keep their result of -1.
+static void dir_add_batch_indexed(FS_t *fs, inode_t *dir, const char *const *names, dir_batch_item_t *items, size_t count, file_t type)
+{
+    uint16_t index[DIR_INDEX_BUCKETS];
+    bcache_read(fs, dir->directPointer[0], index);
+    bool index_dirty = false;
+    dir_batch_block_t *chain = NULL;
+    size_t capacity = 0;
+    for(size_t first = 0, last = 0; first < count; first = last) {
+        size_t b = items[first].bucket;
+        while(last < count && items[last].bucket == b) {
+            last++;
+        }
+        size_t length = 0;
+        bool loaded = true;
+        for(uint16_t block = index[b]; block != 0; block = chain[length - 1].bucket.next) {
+            if(length == capacity && dir_batch_grow(&chain, &capacity) < 0) {
+                loaded = false;
+                break;
+            }
+            chain[length].block_ID = block;
+            chain[length].dirty = false;
+            bcache_read(fs, block, &chain[length].bucket);
+            length++;
+        }
+        for(size_t i = first; i < last && loaded; i++) {
+            const char *name = names[items[i].index];
+            bool taken = false;
+            dir_batch_block_t *target = NULL;
+            int k = -1;
+            for(size_t c = 0; c < length && !taken; c++) {
+                taken = dir_find_slot(fs, chain[c].bucket.entries, chain[c].bucket.vacantFile, name, items[i].len) >= 0;
+                if(target == NULL && (k = dir_free_slot(chain[c].bucket.vacantFile)) >= 0) {
+                    target = &chain[c];
+                }
+            }
+            if(taken) {
+                continue;
+            }
+            size_t child_ID = inode_alloc(fs);
+            if(child_ID == SIZE_MAX) {
+                continue;
+            }
+            if(target == NULL) {
+                //every block of the chain is full, push a fresh one onto it
+                size_t new_block = block_alloc(fs, group_goal(dir->group));
+                if(new_block >= BLOCK_STORE_AVAIL_BLOCKS || (length == capacity && dir_batch_grow(&chain, &capacity) < 0)) {
+                    if(new_block < BLOCK_STORE_AVAIL_BLOCKS) {
+                        block_free(fs, new_block);
+                    }
+                    inode_free(fs, child_ID);
+                    continue;
+                }
+                target = &chain[length++];
+                target->block_ID = new_block;
+                memset(&target->bucket, 0, sizeof(target->bucket));
+                target->bucket.next = index[b];
+                index[b] = new_block;
+                index_dirty = true;
+                k = 0;
+            }
+            dirent_set(fs, &target->bucket.entries[k], name, items[i].len, child_ID);
+            target->bucket.vacantFile |= (1u << k);
+            target->dirty = true;
+            dir->vacantFile++;
+            inode_init_child(fs, child_ID, type, dir);
+            items[i].child_ID = child_ID;
+            items[i].result = 0;
+        }
+        for(size_t c = 0; c < length; c++) {
+            if(chain[c].dirty) {
+                bcache_write(fs, chain[c].block_ID, &chain[c].bucket);
+            }
+        }
+    }
+    if(index_dirty) {
+        bcache_write(fs, dir->directPointer[0], index);
+    }
+    free(chain);
+}
+
+ssize_t fs_create_many(FS_t *fs, const char *dir, const char *const *names, size_t count, file_t type, int *results)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid. Every name is checked on its own, a bad
+    one only fails itself.
+    next, the names are worked through in slices of BATCH_SLICE. For each, walk to the directory and lock it, making
+    sure it is still there. If it is gone the names left fail.
+    A classic directory that can't take every name left is converted to the indexed layout up front when the image
+    allows it, rather than when its block fills up half way through.
+    The slice's names are then added with the directory's blocks in memory, each block written once, and every new
+    inode is written. The directory inode is written once per slice and the dentry cache learns every new name.
+    We return how many were created.
+    */
+    if(fs == NULL || dir == NULL || (names == NULL && count != 0) || (type != FS_REGULAR && type != FS_DIRECTORY)) {
+        return -1;
+    }
+    path_span_t tokens[FS_PATH_MAX_DEPTH];
+    size_t depth = 0;
+    if(path_tokenize(dir, tokens, &depth) < 0) {
+        return -1;
+    }
+    dir_batch_item_t *items = calloc(count != 0 ? count : 1, sizeof(dir_batch_item_t));
+    if(items == NULL) {
+        return -1;
+    }
+    size_t valid = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(results != NULL) {
+            results[i] = -1;
+        }
+        size_t len;
+        if(dir_name_valid(fs, names[i], &len)) {
+            items[valid].bucket = dir_bucket_of(names[i], len);
+            items[valid].index = i;
+            items[valid].len = len;
+            items[valid].result = -1;
+            valid++;
+        }
+    }
+
+    ssize_t created = 0;
+    size_t first = 0;
+    do {
+        size_t n = valid - first < BATCH_SLICE ? valid - first : BATCH_SLICE;
+        dir_batch_item_t *slice = items + first;
+        fs_enter(fs);
+        fd_delay_make_room(fs, n * BLOCK_SIZE_BYTES);
+        size_t parent_ID = 0;
+        char parent_type = 0;
+        inode_t parent;
+        bool found = walk_path(fs, dir, tokens, depth, &parent_ID, &parent_type) == 0 && parent_type == 'd';
+        if(found) {
+            inode_lock(fs, parent_ID, true);
+            inode_read(fs, parent_ID, &parent);
+            found = parent.fileType == 'd' && parent.linkCount != 0;
+            if(!found) {
+                inode_unlock(fs, parent_ID);
+            }
+        }
+        if(!found) {
+            //the directory went away between two slices, the names left fail
+            fs_leave(fs);
+            if(first == 0) {
+                free(items);
+                return -1;
+            }
+            break;
+        }
+
+        if(!dir_is_indexed(&parent) && valid - first > dir_free_slots(parent.vacantFile) && (fs->features & FS_FEATURE_DIR_INDEX)) {
+            //if the blocks for it can't be had the directory stays classic, and the names that don't fit fail
+            dir_convert_to_index(fs, &parent);
+        }
+        if(dir_is_indexed(&parent)) {
+            qsort(slice, n, sizeof(dir_batch_item_t), dir_batch_item_compare);
+            dir_add_batch_indexed(fs, &parent, names, slice, n, type);
+        }
+        else {
+            dir_add_batch_classic(fs, &parent, names, slice, n, type);
+        }
+
+        ssize_t slice_created = 0;
+        for(size_t i = 0; i < n; i++) {
+            if(slice[i].result == 0) {
+                dcache_insert(fs->dcache, parent_ID, names[slice[i].index], slice[i].len, slice[i].child_ID, type == FS_REGULAR ? 'r' : 'd');
+                slice_created++;
+            }
+        }
+        if(slice_created > 0) {
+            inode_write(fs, parent_ID, &parent);
+            journal_op_done(fs);
+        }
+        created += slice_created;
+        inode_unlock(fs, parent_ID);
+        fs_leave(fs);
+        first += n;
+    } while(first < valid);
+
+    for(size_t i = 0; results != NULL && i < valid; i++) {
+        results[items[i].index] = items[i].result;
+    }
+    free(items);
+    return created;
+}
+
+
+
+///
+/// Opens the specified file for use
+///   R/W position is set to the beginning of the file (BOF)
+///   Directories cannot be opened
+/// \param fs The FS containing the file
+/// \param path path to the requested file
+/// \return file descriptor to the requested file, < 0 on error
+///
+int fs_open(FS_t *fs, const char *path)
+{
+    if(fs != NULL && path != NULL && strlen(path) != 0)
+    {
+        path_span_t tokens[FS_PATH_MAX_DEPTH];		// tokens are the directory names along the path. The last one is the name for the new file or dir
+        size_t count = 0;
+        if(path_tokenize(path, tokens, &count) < 0 || count == 0)
+        {
+            return -1;
+        }
+
+
+        fs_enter(fs);
+
+        // locate the file
+        size_t parent_inode_ID = 0;
+        char file_type = 0;
+        int found = walk_path(fs, path, tokens, count, &parent_inode_ID, &file_type);
+        // now let's open the file, it's too bad if file to be opened is a dir
+        if(found == 0 && file_type != 'd')
+        {
+            // it could be possible that fd runs out. A full table can only grow with the FS to ourselves
+            int fd_ID = fd_table_take(fs);
+            if(fd_ID < 0)
+            {
+                fs_leave(fs);
+                fs_enter_exclusive(fs);
+                int grown = fd_table_grow(fs->fd_table);
+                fs_leave_exclusive(fs);
+                fs_enter(fs);
+                if(grown == 0)
+                {
+                    fd_ID = fd_table_take(fs);
+                }
+            }
+            if(fd_ID >= 0)
+            {
+                size_t file_inode_ID = parent_inode_ID;
+
+                // the descriptor keeps the file's inode pinned in the inode cache until it is closed
+                inode_t *file_inode = inode_get(fs, file_inode_ID);
+                if(file_inode == NULL)
+                {
+                    fd_table_give_back(fs, fd_ID);
+                    fs_leave(fs);
+                    return -1;
+                }
+
+                // the file may have been removed since the walk
+                inode_lock(fs, file_inode_ID, false);
+                if(file_inode->fileType != 'r' || file_inode->linkCount == 0)
+                {
+                    inode_unlock(fs, file_inode_ID);
+                    inode_put(fs, file_inode);
+                    fd_table_give_back(fs, fd_ID);
+                    fs_leave(fs);
+                    return -1;
+                }
+
+                // assign a file descriptor ID to the open behavior. The slot only counts as open once inode is set
+                open_file_t *file = &fs->fd_table->files[fd_ID];
+                file->position = 0; // R/W position is set to the beginning of the file (BOF)
+                file->map.inode = FD_MAP_EMPTY;
+                file->ra_next = 0;  // so reading from BOF counts as sequential right away
+                file->ra_window = 0;
+                file->ra_end = 0;
+                file->delay.data = NULL;
+                file->delay.length = 0;
+                file->delay.reserved = 0;
+                pthread_mutex_lock(&fs->locks->fd_table);
+                file->inode = file_inode;
+                pthread_mutex_unlock(&fs->locks->fd_table);
+                inode_unlock(fs, file_inode_ID);
+                fs_leave(fs);
+                return fd_ID;
+            }	
+        }
+        fs_leave(fs);
+    }
+    return -1;
+}
+
+
+///
+/// Closes the given file descriptor
+/// \param fs The FS containing the file
+/// \param fd The file to close
+/// \return 0 on success, < 0 on failure
+///
+int fs_close(FS_t *fs, int fd)
+{
+    if(fs != NULL)
     {
-        char* copy_path = (char*)calloc(1, 65535);
-        strcpy(copy_path, path);
-        char** tokens;		// tokens are the directory names along the path. The last one is the name for the new file or dir
+        fs_enter(fs);
+        // first, make sure this fd is in use
+        open_file_t *file = fd_acquire(fs, fd, true);
+        if(file != NULL)
+        {
+            // held back appends get their blocks now, while the inode is still pinned
+            inode_t *inode = file->inode;
+            pthread_mutex_lock(&file->lock);
+            fd_delay_flush(fs, file);
+            free(file->delay.data);
+            file->delay.data = NULL;
+            pthread_mutex_unlock(&file->lock);
+            fd_table_give_back(fs, fd);
+            fd_release(fs, inode);
+            inode_put(fs, inode);
+            journal_op_done(fs);
+            fs_leave(fs);
+            return 0;
+        }	
+        fs_leave(fs);
+    }
+    return -1;
+}
+
+int fs_set_fd_limit(FS_t *fs, size_t limit)
+{
+    if(fs == NULL || limit == 0 || limit > INT_MAX) {
+        return -1;
+    }
+    struct fd_table *ft = fs->fd_table;
+    fs_enter_exclusive(fs);
+    if(limit < ft->capacity) {
+        //shrinking, which only works if nothing is open past the new end
+        for(size_t i = limit; i < ft->capacity; i++) {
+            if(ft->files[i].inode != NULL) {
+                fs_leave_exclusive(fs);
+                return -1;
+            }
+        }
+        fd_table_resize(ft, limit);
+        //the free list may run through the slots that were cut off, so chain up what's left again
+        ft->free_head = -1;
+        for(size_t i = ft->capacity; i-- > 0;) {
+            if(ft->files[i].inode == NULL) {
+                ft->files[i].next_free = ft->free_head;
+                ft->free_head = i;
+            }
+        }
+    }
+    ft->limit = limit;
+    fs_leave_exclusive(fs);
+    return 0;
+}
+
+int fs_set_zero_elision(FS_t *fs, bool enabled)
+{
+    if(fs == NULL) {
+        return -1;
+    }
+    fs_enter_exclusive(fs);
+    fs->elide_zero_blocks = enabled;
+    fs_leave_exclusive(fs);
+    return 0;
+}
+
+
+
+///
+/// Populates a dyn_array with information about the files in a directory
+///   Array contains up to 31 file_record_t structures
+/// \param fs The FS containing the file
+/// \param path Absolute path to the directory to inspect
+/// \return dyn_array of file records, NULL on error
+///
+dyn_array_t *fs_get_dir(FS_t *fs, const char *path)
+{
+    if(fs != NULL && path != NULL && strlen(path) != 0)
+    {	
+        path_span_t tokens[FS_PATH_MAX_DEPTH];		// tokens are the directory names along the path, a lone slash has none
         size_t count = 0;
-        tokens = str_split(copy_path, '/', &count);
-        free(copy_path);
-        if(tokens == NULL)
+        if(path_tokenize(path, tokens, &count) < 0)
+        {
+            return NULL;
+        }
+
+        fs_enter(fs);
+
+        // search along the path and find the deepest dir
+        size_t parent_inode_ID = 0;
+        char dir_type = 0;
+        int found = walk_path(fs, path, tokens, count, &parent_inode_ID, &dir_type);
+
+        // now let's enumerate the files/dir in it, holding it still while we do
+        if(found == 0 && dir_type == 'd')
         {
+            inode_lock(fs, parent_inode_ID, false);
+            inode_t * dir_inode = (inode_t *) calloc(1, sizeof(inode_t));
+            inode_read(fs, parent_inode_ID, dir_inode);	// read out the file inode			
+            if(dir_inode->fileType == 'd' && dir_inode->linkCount != 0)
+            {
+                // prepare the walk over its entries, which reads each directory block once
+                dir_iter_t * iter = (dir_iter_t *)calloc(1, sizeof(dir_iter_t));
+                dir_iter_init(iter);
+
+                // prepare the dyn_array to hold the data. An indexed directory knows exactly how many entries it has
+                size_t capacity = folder_number_entries;
+                if(dir_is_indexed(dir_inode) && dir_inode->vacantFile > capacity)
+                {
+                    capacity = dir_inode->vacantFile;
+                }
+                dyn_array_t * dynArray = dyn_array_create(capacity, sizeof(file_record_t), NULL);
+
+                const directoryFile_t * entry;
+                while((entry = dir_iter_next(fs, dir_inode, iter)) != NULL)
+                {
+                    file_record_t* fileRec = (file_record_t *)calloc(1, sizeof(file_record_t));
+                    dirent_get_name(fs, entry, fileRec->name);
+
+                    // to know fileType of the member in this dir, we have to refer to its inode
+                    char member_type = inode_type(fs, dirent_inode(fs, entry));
+                    if(member_type == 'd')
+                    {
+                        fileRec->type = FS_DIRECTORY;
+                    }
+                    else if(member_type == 'r')
+                    {
+                        fileRec->type = FS_REGULAR;
+                    }
+
+                    // now insert the file record into the dyn_array
+                    dyn_array_push_back(dynArray, fileRec);
+                    free(fileRec);
+                }
+                free(iter);
+                free(dir_inode);
+                inode_unlock(fs, parent_inode_ID);
+                fs_leave(fs);
+                return(dynArray);
+            }
+            free(dir_inode);
+            inode_unlock(fs, parent_inode_ID);
+        }
+        fs_leave(fs);
+    }
+    return NULL;
+}
+
+// A listing hands the entries out ordered by (index bucket of the name, name), whatever the directory's layout, and
+// stands at the last entry it buffered. Names coming and going, chain blocks being pushed or unlinked, or the
+// directory turning indexed change nothing about the order of the other names, so each of those is listed once.
+static int dir_stream_order(size_t bucket_a, const char *name_a, size_t bucket_b, const char *name_b)
+{
+    if(bucket_a != bucket_b) {
+        return bucket_a < bucket_b ? -1 : 1;
+    }
+    return strcmp(name_a, name_b);
+}
+
+// consider the occupied entries of one directory block for a listing's buffer, which keeps the first names past the
+// position in order. buckets and inodes run alongside dir->entries.
+static void dir_stream_collect(FS_t *fs, fs_dir_t *dir, size_t *buckets, size_t *inodes, const directoryFile_t *entries, uint32_t vacant)
+{
+    for(int j = 0; j < folder_number_entries; j++) {
+        if(((vacant >> j) & 1) == 0) {
+            continue;
+        }
+        char name[FS_FNAME_MAX];
+        dirent_get_name(fs, &entries[j], name);
+        size_t bucket = dir_bucket_of(name, strlen(name));
+        if(dir->started && dir_stream_order(bucket, name, dir->bucket, dir->name) <= 0) {
+            continue;
+        }
+        size_t pos = dir->count;
+        while(pos > 0 && dir_stream_order(bucket, name, buckets[pos - 1], dir->entries[pos - 1].name) < 0) {
+            pos--;
+        }
+        if(pos == folder_number_entries) {
+            continue;
+        }
+        //a full buffer drops its last entry
+        size_t kept = dir->count < folder_number_entries ? dir->count : folder_number_entries - 1;
+        memmove(&dir->entries[pos + 1], &dir->entries[pos], (kept - pos) * sizeof(file_record_t));
+        memmove(&buckets[pos + 1], &buckets[pos], (kept - pos) * sizeof(size_t));
+        memmove(&inodes[pos + 1], &inodes[pos], (kept - pos) * sizeof(size_t));
+        memcpy(dir->entries[pos].name, name, FS_FNAME_MAX);
+        buckets[pos] = bucket;
+        inodes[pos] = dirent_inode(fs, &entries[j]);
+        dir->count = kept + 1;
+    }
+}
+
+// buffer the next entries of a listing, the first ones past its position: from the whole block of a classic
+// directory, or from the whole chain of the first bucket of an indexed one that has any.
+// \return 0 with dir->count entries buffered (none once the listing is over), -1 if the directory is gone
+static int dir_stream_fill(FS_t *fs, fs_dir_t *dir)
+{
+    dir->next = 0;
+    dir->count = 0;
+    inode_lock(fs, dir->inode_ID, false);
+    inode_t inode;
+    inode_read(fs, dir->inode_ID, &inode);
+    if(inode.fileType != 'd' || inode.linkCount == 0) {
+        inode_unlock(fs, dir->inode_ID);
+        dir->done = true;
+        return -1;
+    }
+    size_t buckets[folder_number_entries];
+    size_t inodes[folder_number_entries];
+    if(inode.vacantFile == 0) {
+        //empty
+    }
+    else if(!dir_is_indexed(&inode)) {
+        directoryFile_t data[DIR_BLOCK_ENTRIES];
+        bcache_read(fs, inode.directPointer[0], data);
+        dir_stream_collect(fs, dir, buckets, inodes, data, inode.vacantFile);
+    }
+    else {
+        uint16_t index[DIR_INDEX_BUCKETS];
+        bcache_read(fs, inode.directPointer[0], index);
+        dir_bucket_t bucket;
+        //every name in a chain is in that bucket, and all of them come before the next bucket's
+        for(size_t b = dir->started ? dir->bucket : 0; dir->count == 0 && b < DIR_INDEX_BUCKETS; b++) {
+            for(uint16_t block = index[b]; block != 0; block = bucket.next) {
+                bcache_read(fs, block, &bucket);
+                dir_stream_collect(fs, dir, buckets, inodes, bucket.entries, bucket.vacantFile);
+            }
+        }
+    }
+    for(size_t i = 0; i < dir->count; i++) {
+        dir->entries[i].type = inode_type(fs, inodes[i]) == 'd' ? FS_DIRECTORY : FS_REGULAR;
+    }
+    inode_unlock(fs, dir->inode_ID);
+    if(dir->count == 0) {
+        dir->done = true;
+    }
+    else {
+        dir->started = true;
+        dir->bucket = buckets[dir->count - 1];
+        memcpy(dir->name, dir->entries[dir->count - 1].name, FS_FNAME_MAX);
+    }
+    return 0;
+}
+
+int fs_opendir(FS_t *fs, const char *path, fs_dir_t *dir)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid
+    next, walk to the directory and check it is one, and still there once we have it locked
+    the listing starts before its first block, nothing is read until the first fs_readdir
+    */
+    if(fs == NULL || path == NULL || dir == NULL) {
+        return -1;
+    }
+    path_span_t tokens[FS_PATH_MAX_DEPTH];
+    size_t count = 0;
+    if(path_tokenize(path, tokens, &count) < 0) {
+        return -1;
+    }
+    fs_enter(fs);
+    size_t inode_ID = 0;
+    char type = 0;
+    int found = walk_path(fs, path, tokens, count, &inode_ID, &type);
+    if(found == 0 && type == 'd') {
+        inode_lock(fs, inode_ID, false);
+        inode_t inode;
+        inode_read(fs, inode_ID, &inode);
+        if(inode.fileType != 'd' || inode.linkCount == 0) {
+            found = -1;
+        }
+        else {
+            dir->open = true;
+            dir->done = false;
+            dir->inode_ID = inode_ID;
+            dir->started = false;
+            dir->bucket = 0;
+            dir->next = 0;
+            dir->count = 0;
+        }
+        inode_unlock(fs, inode_ID);
+    }
+    else {
+        found = -1;
+    }
+    fs_leave(fs);
+    return found;
+}
+
+int fs_readdir(FS_t *fs, fs_dir_t *dir, file_record_t *record)
+{
+    if(record == NULL) {
+        return -1;
+    }
+    return (int)fs_readdir_many(fs, dir, record, 1);
+}
+
+ssize_t fs_readdir_many(FS_t *fs, fs_dir_t *dir, file_record_t *records, size_t max)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid, and that the listing is open
+    hand out the buffered entries first. Whenever they run out, buffer the next ones past the last of them, with the
+    directory locked only while that is done. A directory removed under the listing ends it with an error,
+    unless some entries were read already, then the next call reports the end.
+    We return how many entries were read.
+    */
+    if(fs == NULL || dir == NULL || !dir->open || (records == NULL && max != 0)) {
+        return -1;
+    }
+    fs_enter(fs);
+    size_t got = 0;
+    while(got < max) {
+        if(dir->next == dir->count) {
+            if(dir->done) {
+                break;
+            }
+            if(dir_stream_fill(fs, dir) < 0) {
+                fs_leave(fs);
+                return got > 0 ? (ssize_t)got : -1;
+            }
+            continue;
+        }
+        size_t n = dir->count - dir->next;
+        if(n > max - got) {
+            n = max - got;
+        }
+        memcpy(records + got, dir->entries + dir->next, n * sizeof(file_record_t));
+        dir->next += n;
+        got += n;
+    }
+    fs_leave(fs);
+    return got;
+}
+
+int fs_closedir(FS_t *fs, fs_dir_t *dir)
+{
+    if(fs == NULL || dir == NULL || !dir->open) {
+        return -1;
+    }
+    dir->open = false;
+    return 0;
+}
+
+// File block mapping.
+// Classic files map their blocks through directPointer[6], indirectPointer[0] and doubleIndirectPointer.
+// On images formatted with FS_FEATURE_EXTENTS regular files map them as extents instead: runs of
+// (first file block, first physical block, length). A file with a single run keeps it in the inode's
+// pointer area; once it has more, they move to an extent tree whose root block's number takes its place.
+// The tree is at most two levels, a root of index records over leaves of extents, which covers far
+// more runs than a 16-bit image has blocks.
+// Either way the I/O below moves data in contiguous physical runs, one memcpy per run, straight
+// between the caller's buffer and the mapped image.
+#define POINTERS_PER_BLOCK (BLOCK_SIZE_BYTES / sizeof(uint16_t))
+#define CLASSIC_INDIRECT_START 6
+#define CLASSIC_DOUBLE_START (CLASSIC_INDIRECT_START + POINTERS_PER_BLOCK)
+#define CLASSIC_MAX_BLOCKS (CLASSIC_DOUBLE_START + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+
+typedef struct {
+    uint32_t logical;       // first file block of the run
+    uint32_t start;         // first physical block of the run (the child block in index records)
+    uint32_t length;        // number of blocks, 0 marks an unused inline slot
+} extent_t;
+
+// what an extent mapped inode keeps in place of its block pointers
+typedef struct {
+    extent_t first;         // the only extent while there is just one
+    uint32_t tree;          // root block of the extent tree once there are more, 0 before that
+} inode_extents_t;
+
+typedef char inode_extents_fit[INODE_POINTER_BYTES == sizeof(inode_extents_t) ? 1 : -1];
+
+#define EXTENT_MAGIC 0xE87E
+#define EXTENTS_PER_BLOCK ((BLOCK_SIZE_BYTES - 16) / sizeof(extent_t))
+#define EXTENT_LEAF_FILL (EXTENTS_PER_BLOCK * 3 / 4)    // slack left in rebuilt leaves so inserts don't rebuild again right away
+
+typedef struct {
+    uint16_t magic;
+    uint16_t depth;         // 0 for a leaf of extents, 1 for an index whose records point at leaves
+    uint32_t count;
+    uint8_t padding[8];
+    extent_t records[EXTENTS_PER_BLOCK];
+} extent_block_t;
+
+typedef char extent_block_fills_block[sizeof(extent_block_t) <= BLOCK_SIZE_BYTES && sizeof(extent_block_t) + sizeof(extent_t) > BLOCK_SIZE_BYTES ? 1 : -1];
+
+static bool inode_is_extent_mapped(const inode_t *inode)
+{
+    return (inode->flags & INODE_EXTENTS) != 0;
+}
+
+static void inode_get_extents(const inode_t *inode, inode_extents_t *root)
+{
+    memcpy(root, inode->directPointer, sizeof(*root));
+}
+
+static void inode_set_extents(inode_t *inode, const inode_extents_t *root)
+{
+    memcpy(inode->directPointer, root, sizeof(*root));
+}
+
+static uint8_t *block_address(FS_t *fs, size_t block_ID)
+{
+    return block_store_Data_location(fs->BlockStore_whole) + block_ID * BLOCK_SIZE_BYTES;
+}
+
+// note that file blocks [lblock, lblock + count), backed by the physical blocks from pblock on, changed in the mapped
+// image. The file is open, so its inode is cached, and locked for writing.
+static void file_dirty(FS_t *fs, inode_t *inode, size_t lblock, size_t pblock, size_t count)
+{
+    cached_inode_t *e = (cached_inode_t *)inode;
+    if(e->dirty_end == 0 || lblock < e->dirty_first) {
+        e->dirty_first = lblock;
+    }
+    if(lblock + count > e->dirty_end) {
+        e->dirty_end = lblock + count;
+    }
+    if(fs->unsynced != NULL) {
+        pthread_mutex_lock(&fs->locks->dirty);
+        for(size_t i = 0; i < count; i++) {
+            block_set_add(fs->unsynced, pblock + i);
+        }
+        pthread_mutex_unlock(&fs->locks->dirty);
+    }
+}
+
+// allocate up to want physically contiguous blocks, starting as close to goal as possible: at goal itself if it is
+// free, else at the first run of want free blocks after it, then before it, and only when no run that long is left
+// at the first free block after goal, or before it.
+// \return how many were allocated (0 when the FS is full), the first one in *start
+static size_t block_alloc_run(FS_t *fs, size_t goal, size_t want, size_t *start)
+{
+    pthread_mutex_lock(&fs->locks->alloc);
+    size_t first = 0;
+    size_t got = 0;
+    if((want = space_usable(fs, want)) == 0) {
+        pthread_mutex_unlock(&fs->locks->alloc);
+        return 0;
+    }
+    if(fs->space == NULL) {
+        free_map_dirty(fs);
+        if(goal != 0 && goal < BLOCK_STORE_AVAIL_BLOCKS && block_store_request(fs->BlockStore_whole, goal)) {
+            first = goal;
+        }
+        else if((first = block_store_allocate(fs->BlockStore_whole)) >= BLOCK_STORE_AVAIL_BLOCKS) {
+            pthread_mutex_unlock(&fs->locks->alloc);
+            return 0;
+        }
+        got = 1;
+        while(got < want && first + got < BLOCK_STORE_AVAIL_BLOCKS && block_store_request(fs->BlockStore_whole, first + got)) {
+            got++;
+        }
+        journal_allocated(fs, first, got);
+    }
+    while(got == 0) {
+        if(goal != 0 && space_is_free(fs->space, goal)) {
+            first = goal;
+        }
+        else if((first = space_find(fs->space, goal, want)) == SIZE_MAX && (first = space_find(fs->space, 0, want)) == SIZE_MAX &&
+                (first = space_find(fs->space, goal, 1)) == SIZE_MAX && (first = space_find(fs->space, 0, 1)) == SIZE_MAX) {
+            pthread_mutex_unlock(&fs->locks->alloc);
+            return 0;
+        }
+        got = space_take(fs, first, want);
+    }
+    space_used(fs, got);
+    pthread_mutex_unlock(&fs->locks->alloc);
+    *start = first;
+    return got;
+}
+
+// allocate one block, preferring goal so that neighbouring file blocks stay physically contiguous
+// \return the block, 0 when the FS is full
+static size_t block_alloc_near(FS_t *fs, size_t goal)
+{
+    size_t block_ID;
+    return block_alloc_run(fs, goal, 1, &block_ID) != 0 ? block_ID : 0;
+}
+
+static void block_release_run(FS_t *fs, size_t start, size_t length)
+{
+    for(size_t i = 0; i < length; i++) {
+        block_free(fs, start + i);
+    }
+}
+
+// allocate a pointer block and clear it, since zero means "not mapped" in it
+static size_t pointer_block_alloc(FS_t *fs, size_t goal)
+{
+    size_t block_ID = block_alloc_near(fs, goal);
+    if(block_ID != 0) {
+        metadata_dirty(fs, block_ID);
+        memset(block_address(fs, block_ID), 0, BLOCK_SIZE_BYTES);
+    }
+    return block_ID;
+}
+
+// pointer blocks are used in place in the mapped image, so following a pointer never copies a block
+static uint16_t *pointer_block(FS_t *fs, uint16_t block_ID)
+{
+    return (uint16_t *)block_address(fs, block_ID);
+}
+
+// resolve file block lblock through the classic pointers. With alloc, a missing block (and any pointer
+// block on the way) is allocated near goal; the inode is updated but not written.
+// \return the physical block, 0 for a hole or when the FS is full
+static size_t classic_bmap(FS_t *fs, inode_t *inode, size_t lblock, bool alloc, size_t goal)
+{
+    if(lblock < CLASSIC_INDIRECT_START) {
+        if(inode->directPointer[lblock] == 0 && alloc) {
+            inode->directPointer[lblock] = block_alloc_near(fs, goal);
+        }
+        return inode->directPointer[lblock];
+    }
+    uint16_t *ind;
+    size_t ind_ID;
+    size_t slot;
+    if(lblock < CLASSIC_DOUBLE_START) {
+        if(inode->indirectPointer[0] == 0) {
+            if(!alloc || (inode->indirectPointer[0] = pointer_block_alloc(fs, goal)) == 0) {
+                return 0;
+            }
+            goal = inode->indirectPointer[0] + 1;
+        }
+        ind_ID = inode->indirectPointer[0];
+        ind = pointer_block(fs, ind_ID);
+        slot = lblock - CLASSIC_INDIRECT_START;
+    }
+    else if(lblock < CLASSIC_MAX_BLOCKS) {
+        if(inode->doubleIndirectPointer == 0) {
+            if(!alloc || (inode->doubleIndirectPointer = pointer_block_alloc(fs, goal)) == 0) {
+                return 0;
+            }
+            goal = inode->doubleIndirectPointer + 1;
+        }
+        uint16_t *dbl = pointer_block(fs, inode->doubleIndirectPointer);
+        size_t dbl_slot = (lblock - CLASSIC_DOUBLE_START) / POINTERS_PER_BLOCK;
+        if(dbl[dbl_slot] == 0) {
+            size_t new_ID;
+            if(!alloc || (new_ID = pointer_block_alloc(fs, goal)) == 0) {
+                return 0;
+            }
+            metadata_dirty(fs, inode->doubleIndirectPointer);
+            dbl[dbl_slot] = new_ID;
+            goal = new_ID + 1;
+        }
+        ind_ID = dbl[dbl_slot];
+        ind = pointer_block(fs, ind_ID);
+        slot = (lblock - CLASSIC_DOUBLE_START) % POINTERS_PER_BLOCK;
+    }
+    else {
+        return 0;
+    }
+    if(ind[slot] == 0 && alloc) {
+        size_t pblock = block_alloc_near(fs, goal);
+        if(pblock != 0) {
+            metadata_dirty(fs, ind_ID);
+            ind[slot] = pblock;
+        }
+    }
+    return ind[slot];
+}
+
+// free every block of a classic file from file block from on, pointer blocks left without any pointers included,
+// and clear the pointers to them. from 0 releases the whole file.
+static void classic_release(FS_t *fs, inode_t *inode, size_t from)
+{
+    for(size_t i = from; i < CLASSIC_INDIRECT_START; i++) {
+        if(inode->directPointer[i] != 0) {
+            block_free(fs, inode->directPointer[i]);
+            inode->directPointer[i] = 0;
+        }
+    }
+    //pointer blocks are changed in place, even the ones freed along the way, which a roll back brings back
+    if(inode->indirectPointer[0] != 0 && from < CLASSIC_DOUBLE_START) {
+        uint16_t *ind = pointer_block(fs, inode->indirectPointer[0]);
+        metadata_dirty(fs, inode->indirectPointer[0]);
+        for(size_t i = from > CLASSIC_INDIRECT_START ? from - CLASSIC_INDIRECT_START : 0; i < POINTERS_PER_BLOCK; i++) {
+            if(ind[i] != 0) {
+                block_free(fs, ind[i]);
+                ind[i] = 0;
+            }
+        }
+        if(from <= CLASSIC_INDIRECT_START) {
+            block_free(fs, inode->indirectPointer[0]);
+            inode->indirectPointer[0] = 0;
+        }
+    }
+    if(inode->doubleIndirectPointer != 0) {
+        uint16_t *dbl = pointer_block(fs, inode->doubleIndirectPointer);
+        metadata_dirty(fs, inode->doubleIndirectPointer);
+        for(size_t j = 0; j < POINTERS_PER_BLOCK; j++) {
+            size_t base = CLASSIC_DOUBLE_START + j * POINTERS_PER_BLOCK;
+            if(dbl[j] == 0 || base + POINTERS_PER_BLOCK <= from) {
+                continue;
+            }
+            uint16_t *ind = pointer_block(fs, dbl[j]);
+            metadata_dirty(fs, dbl[j]);
+            for(size_t i = from > base ? from - base : 0; i < POINTERS_PER_BLOCK; i++) {
+                if(ind[i] != 0) {
+                    block_free(fs, ind[i]);
+                    ind[i] = 0;
+                }
+            }
+            if(from <= base) {
+                block_free(fs, dbl[j]);
+                dbl[j] = 0;
+            }
+        }
+        if(from <= CLASSIC_DOUBLE_START) {
+            block_free(fs, inode->doubleIndirectPointer);
+            inode->doubleIndirectPointer = 0;
+        }
+    }
+}
+
+// a run can absorb the one right after it when both the file blocks and the physical blocks line up
+static bool extent_merge(extent_t *a, const extent_t *b)
+{
+    if(a->logical + a->length != b->logical || a->start + a->length != b->start) {
+        return false;
+    }
+    a->length += b->length;
+    return true;
+}
+
+// \return index of the last record whose logical block is <= lblock, -1 if every record is past it
+static long extent_search(const extent_t *records, size_t count, uint32_t lblock)
+{
+    long lo = 0;
+    long hi = (long)count - 1;
+    long found = -1;
+    while(lo <= hi) {
+        long mid = (lo + hi) / 2;
+        if(records[mid].logical <= lblock) {
+            found = mid;
+            lo = mid + 1;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+// read the leaf that does, or would, hold lblock into leaf
+// \return the leaf's block number, and in *hole_end the first file block that belongs to a later leaf
+static uint32_t extent_leaf_for(FS_t *fs, uint32_t root, uint32_t lblock, extent_block_t *leaf, uint32_t *hole_end)
+{
+    *hole_end = UINT32_MAX;
+    bcache_read(fs, root, leaf);
+    if(leaf->depth == 0) {
+        return root;
+    }
+    long i = extent_search(leaf->records, leaf->count, lblock);
+    if(i < 0) {
+        i = 0;
+    }
+    if((size_t)i + 1 < leaf->count) {
+        *hole_end = leaf->records[i + 1].logical;
+    }
+    uint32_t leaf_ID = leaf->records[i].start;
+    bcache_read(fs, leaf_ID, leaf);
+    return leaf_ID;
+}
+
+// find the extent covering lblock
+// \return true and the extent in *found, or false and in *hole_end the first file block after lblock that is mapped (UINT32_MAX if none)
+static bool extent_find(FS_t *fs, const inode_t *inode, uint32_t lblock, extent_t *found, uint32_t *hole_end)
+{
+    inode_extents_t root;
+    inode_get_extents(inode, &root);
+    *hole_end = UINT32_MAX;
+    if(root.tree == 0) {
+        if(root.first.length != 0 && lblock >= root.first.logical && lblock < root.first.logical + root.first.length) {
+            *found = root.first;
+            return true;
+        }
+        if(root.first.length != 0 && lblock < root.first.logical) {
+            *hole_end = root.first.logical;
+        }
+        return false;
+    }
+    extent_block_t leaf;
+    uint32_t leaf_end;
+    extent_leaf_for(fs, root.tree, lblock, &leaf, &leaf_end);
+    long i = extent_search(leaf.records, leaf.count, lblock);
+    if(i >= 0 && lblock < leaf.records[i].logical + leaf.records[i].length) {
+        *found = leaf.records[i];
+        return true;
+    }
+    *hole_end = (size_t)(i + 1) < leaf.count ? leaf.records[i + 1].logical : leaf_end;
+    return false;
+}
+
+// append every extent of a tree to *records, growing it as needed
+static int extent_collect(FS_t *fs, uint32_t block_ID, extent_t **records, size_t *count, size_t *capacity)
+{
+    extent_block_t *node = (extent_block_t *)malloc(BLOCK_SIZE_BYTES);
+    if(node == NULL) {
+        return -1;
+    }
+    bcache_read(fs, block_ID, node);
+    for(size_t i = 0; i < node->count; i++) {
+        if(node->depth != 0) {
+            if(extent_collect(fs, node->records[i].start, records, count, capacity) < 0) {
+                free(node);
+                return -1;
+            }
+            continue;
+        }
+        if(*count == *capacity) {
+            size_t grown = *capacity == 0 ? EXTENTS_PER_BLOCK : *capacity * 2;
+            extent_t *bigger = (extent_t *)realloc(*records, grown * sizeof(extent_t));
+            if(bigger == NULL) {
+                free(node);
+                return -1;
+            }
+            *records = bigger;
+            *capacity = grown;
+        }
+        (*records)[(*count)++] = node->records[i];
+    }
+    free(node);
+    return 0;
+}
+
+// load every extent of a file, in file order, into a malloc'ed array the caller frees
+// \return 0 on success, -1 when out of memory
+static int extent_load(FS_t *fs, const inode_t *inode, extent_t **records, size_t *count)
+{
+    inode_extents_t root;
+    inode_get_extents(inode, &root);
+    size_t capacity = 1;
+    *count = 0;
+    *records = (extent_t *)malloc(sizeof(extent_t));
+    if(*records == NULL) {
+        return -1;
+    }
+    if(root.tree == 0) {
+        if(root.first.length != 0) {
+            (*records)[(*count)++] = root.first;
+        }
+        return 0;
+    }
+    if(extent_collect(fs, root.tree, records, count, &capacity) < 0) {
+        free(*records);
+        *records = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// the blocks an extent tree itself occupies, root first
+static size_t extent_tree_blocks(FS_t *fs, uint32_t root, uint32_t *blocks)
+{
+    if(root == 0) {
+        return 0;
+    }
+    extent_block_t node;
+    bcache_read(fs, root, &node);
+    size_t n = 0;
+    blocks[n++] = root;
+    if(node.depth != 0) {
+        for(size_t i = 0; i < node.count; i++) {
+            blocks[n++] = node.records[i].start;
+        }
+    }
+    return n;
+}
+
+// replace a file's whole extent map with records (sorted, non-overlapping), packing leaves fill records full.
+// Blocks of the old tree are reused first, so a map that doesn't grow never needs new blocks.
+// \return 0 on success, -1 if blocks for the tree couldn't be had (the old map is left in place then)
+static int extent_store(FS_t *fs, inode_t *inode, const extent_t *records, size_t count, size_t fill)
+{
+    inode_extents_t root;
+    inode_get_extents(inode, &root);
+    uint32_t old_blocks[EXTENTS_PER_BLOCK + 1];
+    size_t old_count = extent_tree_blocks(fs, root.tree, old_blocks);
+
+    size_t leaves = 0;
+    size_t needed = 0;
+    if(count > 1) {
+        leaves = count <= EXTENTS_PER_BLOCK ? 1 : (count + fill - 1) / fill;
+        if(leaves > EXTENTS_PER_BLOCK) {
+            return -1;
+        }
+        needed = leaves == 1 ? 1 : leaves + 1;
+    }
+    uint32_t blocks[EXTENTS_PER_BLOCK + 1];
+    size_t have = 0;
+    for( ; have < needed && have < old_count; have++) {
+        blocks[have] = old_blocks[have];
+    }
+    for(size_t got = have; got < needed; got++) {
+        size_t block_ID = block_alloc_near(fs, got > 0 ? blocks[got - 1] + 1 : group_goal(inode->group));
+        if(block_ID == 0) {
+            for(size_t undo = have; undo < got; undo++) {
+                block_free(fs, blocks[undo]);
+            }
+            return -1;
+        }
+        blocks[got] = block_ID;
+    }
+    for(size_t spare = have; spare < old_count; spare++) {
+        block_free(fs, old_blocks[spare]);
+    }
+
+    memset(&root, 0, sizeof(root));
+    if(count == 1) {
+        root.first = records[0];
+    }
+    else if(count > 1) {
+        extent_block_t *node = (extent_block_t *)calloc(1, BLOCK_SIZE_BYTES);
+        if(leaves == 1) {
+            node->magic = EXTENT_MAGIC;
+            node->count = count;
+            memcpy(node->records, records, count * sizeof(extent_t));
+            bcache_write(fs, blocks[0], node);
+        }
+        else {
+            extent_block_t *index = (extent_block_t *)calloc(1, BLOCK_SIZE_BYTES);
+            index->magic = EXTENT_MAGIC;
+            index->depth = 1;
+            index->count = leaves;
+            for(size_t l = 0; l < leaves; l++) {
+                size_t first = l * fill;
+                size_t n = count - first < fill ? count - first : fill;
+                memset(node, 0, BLOCK_SIZE_BYTES);
+                node->magic = EXTENT_MAGIC;
+                node->count = n;
+                memcpy(node->records, records + first, n * sizeof(extent_t));
+                bcache_write(fs, blocks[l + 1], node);
+                index->records[l].logical = records[first].logical;
+                index->records[l].start = blocks[l + 1];
+                index->records[l].length = n;
+            }
+            bcache_write(fs, blocks[0], index);
+            free(index);
+        }
+        free(node);
+        root.tree = blocks[0];
+    }
+    inode_set_extents(inode, &root);
+    return 0;
+}
+
+// map a new run into a file whose extents don't cover any of it yet. The inode is updated but not written.
+// \return 0 on success, -1 if the extent tree needed a block and the FS is full
+static int extent_insert(FS_t *fs, inode_t *inode, extent_t e)
+{
+    inode_extents_t root;
+    inode_get_extents(inode, &root);
+    if(root.tree == 0) {
+        if(root.first.length == 0 || extent_merge(&root.first, &e)) {
+            if(root.first.length == 0) {
+                root.first = e;
+            }
+            inode_set_extents(inode, &root);
+            return 0;
+        }
+        extent_t pair[2];
+        pair[0] = e.logical < root.first.logical ? e : root.first;
+        pair[1] = e.logical < root.first.logical ? root.first : e;
+        if(extent_merge(&pair[0], &pair[1])) {
+            return extent_store(fs, inode, pair, 1, EXTENT_LEAF_FILL);
+        }
+        return extent_store(fs, inode, pair, 2, EXTENT_LEAF_FILL);
+    }
+
+    // the common case: the run lands in a leaf with room, usually merging into the extent just before it
+    extent_block_t leaf;
+    uint32_t leaf_end;
+    uint32_t leaf_ID = extent_leaf_for(fs, root.tree, e.logical, &leaf, &leaf_end);
+    size_t pos = (size_t)(extent_search(leaf.records, leaf.count, e.logical) + 1);
+    if(pos > 0 && extent_merge(&leaf.records[pos - 1], &e)) {
+        if(pos < leaf.count && extent_merge(&leaf.records[pos - 1], &leaf.records[pos])) {
+            memmove(&leaf.records[pos], &leaf.records[pos + 1], (leaf.count - pos - 1) * sizeof(extent_t));
+            leaf.count--;
+        }
+        bcache_write(fs, leaf_ID, &leaf);
+        return 0;
+    }
+    if(pos < leaf.count && extent_merge(&e, &leaf.records[pos])) {
+        leaf.records[pos] = e;
+        bcache_write(fs, leaf_ID, &leaf);
+        return 0;
+    }
+    if(leaf.count < EXTENTS_PER_BLOCK) {
+        memmove(&leaf.records[pos + 1], &leaf.records[pos], (leaf.count - pos) * sizeof(extent_t));
+        leaf.records[pos] = e;
+        leaf.count++;
+        bcache_write(fs, leaf_ID, &leaf);
+        return 0;
+    }
+
+    // the leaf is full, rebuild the tree with slack in every leaf
+    extent_t *records;
+    size_t count;
+    if(extent_load(fs, inode, &records, &count) < 0) {
+        return -1;
+    }
+    extent_t *grown = (extent_t *)realloc(records, (count + 1) * sizeof(extent_t));
+    if(grown == NULL) {
+        free(records);
+        return -1;
+    }
+    records = grown;
+    pos = (size_t)(extent_search(records, count, e.logical) + 1);
+    memmove(&records[pos + 1], &records[pos], (count - pos) * sizeof(extent_t));
+    records[pos] = e;
+    int result = extent_store(fs, inode, records, count + 1, EXTENT_LEAF_FILL);
+    free(records);
+    return result;
+}
+
+// free every block of an extent mapped file from file block from on, and cut its map short. from 0 releases the
+// whole file, tree blocks included. The tree never grows from this, so it can't run out of blocks.
+// \return 0 on success, -1 if the map couldn't be loaded (nothing is released then)
+static int extent_release(FS_t *fs, inode_t *inode, size_t from)
+{
+    extent_t *records;
+    size_t count;
+    if(extent_load(fs, inode, &records, &count) < 0) {
+        return -1;
+    }
+    size_t kept = 0;
+    for(size_t i = 0; i < count; i++) {
+        extent_t e = records[i];
+        if(e.logical + e.length <= from) {
+            records[kept++] = e;
+        }
+        else if(e.logical < from) {
+            size_t keep = from - e.logical;
+            block_release_run(fs, e.start + keep, e.length - keep);
+            e.length = keep;
+            records[kept++] = e;
+        }
+        else {
+            block_release_run(fs, e.start, e.length);
+        }
+    }
+    //packed full, the tree needs no more blocks than it has now
+    extent_store(fs, inode, records, kept, EXTENTS_PER_BLOCK);
+    free(records);
+    return 0;
+}
+
+// give back every block a regular file holds from file block from on, before its inode is released (from 0) or when
+// it shrinks. The inode is updated but not written, and descriptors may still have the freed blocks mapped.
+// \return 0 on success, < 0 on failure
+static int file_release(FS_t *fs, inode_t *inode, size_t from)
+{
+    if(inode_is_extent_mapped(inode)) {
+        return extent_release(fs, inode, from);
+    }
+    classic_release(fs, inode, from);
+    return 0;
+}
+
+#define FD_MAP_LOOKAHEAD 256    // blocks a classic lookup maps past the request on a miss, so the next sequential calls hit
+
+// the physical run backing file blocks [lblock, lblock + max). map is the calling descriptor's cache, or NULL
+// when there isn't one; a mapped run found here replaces what it held.
+// \return the run's length (>= 1), its first block in *pblock, which is 0 when the run is a hole
+static size_t file_map_run(FS_t *fs, inode_t *inode, struct fd_map *map, size_t lblock, size_t max, size_t *pblock)
+{
+    if(map != NULL && map->inode == inode->inodeNumber && lblock >= map->lblock && lblock - map->lblock < map->length) {
+        size_t run = map->length - (lblock - map->lblock);
+        *pblock = map->pblock + (lblock - map->lblock);
+        return run < max ? run : max;
+    }
+    size_t run;
+    if(inode_is_extent_mapped(inode)) {
+        extent_t e;
+        uint32_t hole_end;
+        if(extent_find(fs, inode, lblock, &e, &hole_end)) {
+            run = e.logical + e.length - lblock;
+            *pblock = e.start + (lblock - e.logical);
+        }
+        else {
+            run = hole_end - lblock;
+            *pblock = 0;
+        }
+    }
+    else {
+        *pblock = classic_bmap(fs, inode, lblock, false, 0);
+        size_t want = max;
+        if(map != NULL && *pblock != 0 && want < FD_MAP_LOOKAHEAD) {
+            want = FD_MAP_LOOKAHEAD;
+        }
+        run = 1;
+        while(run < want) {
+            size_t next = classic_bmap(fs, inode, lblock + run, false, 0);
+            if(*pblock == 0 ? next != 0 : next != *pblock + run) {
+                break;
+            }
+            run++;
+        }
+    }
+    if(map != NULL && *pblock != 0) {
+        map->inode = inode->inodeNumber;
+        map->lblock = lblock;
+        map->pblock = *pblock;
+        map->length = run;
+    }
+    return run < max ? run : max;
+}
+
+// make sure every block under the byte range [offset, offset + nbyte) is backed, allocating what isn't.
+// New blocks the range only partly covers are zeroed so stale data never shows through, and with zero
+// all the new blocks are, for callers that won't write the range themselves. The inode is updated but not written.
+// \return how many bytes from offset are backed, less than nbyte only when the FS ran out of blocks
+static size_t file_reserve(FS_t *fs, inode_t *inode, struct fd_map *map, uint64_t offset, size_t nbyte, bool zero)
+{
+    size_t first = offset / BLOCK_SIZE_BYTES;
+    size_t last = (offset + nbyte - 1) / BLOCK_SIZE_BYTES;
+    bool extents = inode_is_extent_mapped(inode);
+    size_t lblock = first;
+    size_t goal = 0;
+    if(first > 0) {
+        file_map_run(fs, inode, map, first - 1, 1, &goal);
+        goal = goal != 0 ? goal + 1 : 0;
+    }
+    if(goal == 0) {
+        //nothing before the range to follow, start in the file's group
+        goal = group_goal(inode->group);
+    }
+    while(lblock <= last) {
+        size_t pblock;
+        size_t run = file_map_run(fs, inode, map, lblock, last - lblock + 1, &pblock);
+        if(pblock != 0) {
+            goal = pblock + run;
+            lblock += run;
+            continue;
+        }
+        size_t start = 0;
+        size_t got = 0;
+        if(extents) {
+            got = block_alloc_run(fs, goal, run, &start);
+            extent_t e = { lblock, start, got };
+            if(got != 0 && extent_insert(fs, inode, e) < 0) {
+                block_release_run(fs, start, got);
+                got = 0;
+            }
+        }
+        else {
+            start = classic_bmap(fs, inode, lblock, true, goal);
+            got = start != 0 ? 1 : 0;
+        }
+        if(got == 0) {
+            break;
+        }
+        if(zero) {
+            memset(block_address(fs, start), 0, got * BLOCK_SIZE_BYTES);
+            file_dirty(fs, inode, lblock, start, got);
+        }
+        else {
+            if(lblock == first && offset % BLOCK_SIZE_BYTES != 0) {
+                memset(block_address(fs, start), 0, BLOCK_SIZE_BYTES);
+                file_dirty(fs, inode, lblock, start, 1);
+            }
+            if(lblock + got - 1 == last && (offset + nbyte) % BLOCK_SIZE_BYTES != 0) {
+                memset(block_address(fs, start + got - 1), 0, BLOCK_SIZE_BYTES);
+                file_dirty(fs, inode, lblock + got - 1, start + got - 1, 1);
+            }
+        }
+        goal = start + got;
+        lblock += got;
+    }
+    if(lblock > last) {
+        return nbyte;
+    }
+    if(lblock * BLOCK_SIZE_BYTES <= offset) {
+        return 0;
+    }
+    return lblock * BLOCK_SIZE_BYTES - offset;
+}
+
+// copy between a buffer and the file's bytes [offset, offset + nbyte), which must already be backed or holes.
+// Holes read as zeros; writes must not touch them.
+static void file_copy(FS_t *fs, inode_t *inode, struct fd_map *map, uint64_t offset, uint8_t *buffer, size_t nbyte, bool write)
+{
+    size_t done = 0;
+    while(done < nbyte) {
+        uint64_t pos = offset + done;
+        size_t within = pos % BLOCK_SIZE_BYTES;
+        size_t blocks = (within + (nbyte - done) + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+        size_t pblock;
+        size_t run = file_map_run(fs, inode, map, pos / BLOCK_SIZE_BYTES, blocks, &pblock);
+        size_t chunk = run * BLOCK_SIZE_BYTES - within;
+        if(chunk > nbyte - done) {
+            chunk = nbyte - done;
+        }
+        if(pblock == 0) {
+            if(!write) {
+                memset(buffer + done, 0, chunk);
+            }
+        }
+        else if(write) {
+            memcpy(block_address(fs, pblock) + within, buffer + done, chunk);
+            file_dirty(fs, inode, pos / BLOCK_SIZE_BYTES, pblock, (within + chunk + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES);
+        }
+        else {
+            memcpy(buffer + done, block_address(fs, pblock) + within, chunk);
+        }
+        done += chunk;
+    }
+}
+
+// add up the lengths of an iovec array
+// \return 0 on success, -1 if the array is malformed or the total doesn't fit in an ssize_t
+static int iov_total(const struct iovec *iov, int iovcnt, size_t *total)
+{
+    if(iovcnt < 0 || (iov == NULL && iovcnt > 0)) {
+        return -1;
+    }
+    *total = 0;
+    for(int i = 0; i < iovcnt; i++) {
+        if(iov[i].iov_base == NULL && iov[i].iov_len > 0) {
+            return -1;
+        }
+        if(iov[i].iov_len > (size_t)SSIZE_MAX - *total) {
+            return -1;
+        }
+        *total += iov[i].iov_len;
+    }
+    return 0;
+}
+
+// copy between the buffers of iov, in order, and the file's bytes [offset, offset + nbyte), sharing one mapping context
+static void file_copyv(FS_t *fs, inode_t *inode, struct fd_map *map, uint64_t offset, const struct iovec *iov, int iovcnt, size_t nbyte, bool write)
+{
+    for(int i = 0; i < iovcnt && nbyte > 0; i++) {
+        size_t len = iov[i].iov_len < nbyte ? iov[i].iov_len : nbyte;
+        file_copy(fs, inode, map, offset, (uint8_t *)iov[i].iov_base, len, write);
+        offset += len;
+        nbyte -= len;
+    }
+}
+
+// whether the nbyte bytes that start from bytes into the buffers of iov, laid end to end, are all zero
+static bool iov_range_is_zero(const struct iovec *iov, int iovcnt, size_t from, size_t nbyte)
+{
+    for(int i = 0; i < iovcnt && nbyte > 0; i++) {
+        if(from >= iov[i].iov_len) {
+            from -= iov[i].iov_len;
+            continue;
+        }
+        const uint8_t *bytes = (const uint8_t *)iov[i].iov_base + from;
+        size_t len = iov[i].iov_len - from < nbyte ? iov[i].iov_len - from : nbyte;
+        for(size_t j = 0; j < len; j++) {
+            if(bytes[j] != 0) {
+                return false;
+            }
+        }
+        nbyte -= len;
+        from = 0;
+    }
+    return true;
+}
+
+// file_reserve for a write of the buffers of iov, except that whole blocks of zeros in them are skipped,
+// so where the file has no block yet they stay holes
+// \return how many bytes from offset are backed or left as holes, less than nbyte only when the FS ran out of blocks
+static size_t file_reserve_sparse(FS_t *fs, inode_t *inode, struct fd_map *map, uint64_t offset, const struct iovec *iov, int iovcnt, size_t nbyte)
+{
+    size_t done = 0;
+    while(done < nbyte) {
+        size_t within = (offset + done) % BLOCK_SIZE_BYTES;
+        size_t chunk = BLOCK_SIZE_BYTES - within < nbyte - done ? BLOCK_SIZE_BYTES - within : nbyte - done;
+        if(chunk == BLOCK_SIZE_BYTES && iov_range_is_zero(iov, iovcnt, done, chunk)) {
+            done += chunk;
+            continue;
+        }
+        //reserve up to the next block of zeros in one go, so the data around it still lands contiguously
+        size_t end = done + chunk;
+        while(end < nbyte) {
+            chunk = BLOCK_SIZE_BYTES < nbyte - end ? BLOCK_SIZE_BYTES : nbyte - end;
+            if(chunk == BLOCK_SIZE_BYTES && iov_range_is_zero(iov, iovcnt, end, chunk)) {
+                break;
+            }
+            end += chunk;
+        }
+        size_t backed = file_reserve(fs, inode, map, offset + done, end - done, false);
+        if(backed < end - done) {
+            return done + backed;
+        }
+        done = end;
+    }
+    return nbyte;
+}
+
+// read up to nbyte bytes at offset into the buffers of iov, stopping at EOF
+// \return the number of bytes read
+static size_t file_readv_at(FS_t *fs, inode_t *inode, struct fd_map *map, uint64_t offset, const struct iovec *iov, int iovcnt, size_t nbyte)
+{
+    if(offset >= inode->fileSize || nbyte == 0) {
+        return 0;
+    }
+    if(nbyte > inode->fileSize - offset) {
+        nbyte = inode->fileSize - offset;
+    }
+    file_copyv(fs, inode, map, offset, iov, iovcnt, nbyte, false);
+    return nbyte;
+}
+
+// logical block numbers are 32 bits, which also keeps absolute offsets from wrapping
+#define FILE_BYTES_LIMIT ((uint64_t)UINT32_MAX * BLOCK_SIZE_BYTES)
+
+// write nbyte bytes from the buffers of iov at offset, extending the file as needed.
+// Every block the whole range needs is reserved in one pass, minus the zero blocks left as holes when the FS
+// elides them (file_copy never writes holes). The inode is updated but not written.
+// \return the number of bytes written, less than nbyte only when the FS ran out of blocks
+static size_t file_writev_at(FS_t *fs, inode_t *inode, struct fd_map *map, uint64_t offset, const struct iovec *iov, int iovcnt, size_t nbyte)
+{
+    if(nbyte == 0 || offset >= FILE_BYTES_LIMIT) {
+        return 0;
+    }
+    if(nbyte > FILE_BYTES_LIMIT - offset) {
+        nbyte = FILE_BYTES_LIMIT - offset;
+    }
+    size_t backed;
+    if(fs->elide_zero_blocks) {
+        backed = file_reserve_sparse(fs, inode, map, offset, iov, iovcnt, nbyte);
+    }
+    else {
+        backed = file_reserve(fs, inode, map, offset, nbyte, false);
+    }
+    file_copyv(fs, inode, map, offset, iov, iovcnt, backed, true);
+    if(backed > 0 && offset + backed > inode->fileSize) {
+        inode->fileSize = offset + backed;
+    }
+    return backed;
+}
+
+static size_t file_read_at(FS_t *fs, inode_t *inode, struct fd_map *map, uint64_t offset, void *dst, size_t nbyte)
+{
+    struct iovec iov = { dst, nbyte };
+    return file_readv_at(fs, inode, map, offset, &iov, 1, nbyte);
+}
+
+static size_t file_write_at(FS_t *fs, inode_t *inode, struct fd_map *map, uint64_t offset, const void *src, size_t nbyte)
+{
+    struct iovec iov = { (void *)src, nbyte };
+    return file_writev_at(fs, inode, map, offset, &iov, 1, nbyte);
+}
+
+// the block map cache of an open descriptor. Positional calls don't use it: they may run concurrently on one
+// descriptor, and random access would only thrash it anyway.
+static struct fd_map *fd_map_of(open_file_t *file)
+{
+    return &file->map;
+}
+
+#define FS_READAHEAD_MIN 4       // blocks prefetched once a stream is seen
+#define FS_READAHEAD_MAX 256     // the window doubles on every sequential read up to this
+
+// Sequential stream detection for cursor reads. A read starting where the previous one ended grows the
+// descriptor's window, anything else shuts it. With an open window, the mapped blocks in the window past this read
+// are handed to the kernel with POSIX_MADV_WILLNEED, so it can page them in from the image while the caller is
+// still busy with this read. Hints are only issued once half the prefetched range has been consumed.
+static void file_readahead(FS_t *fs, open_file_t *file, uint64_t offset, size_t nbyte)
+{
+    if(offset != file->ra_next) {
+        file->ra_window = 0;
+        file->ra_end = 0;
+    }
+    else if(file->ra_window < FS_READAHEAD_MAX) {
+        file->ra_window = file->ra_window == 0 ? FS_READAHEAD_MIN : file->ra_window * 2;
+        if(file->ra_window > FS_READAHEAD_MAX) {
+            file->ra_window = FS_READAHEAD_MAX;
+        }
+    }
+    file->ra_next = offset + nbyte;
+    if(file->ra_window == 0 || offset + nbyte >= file->inode->fileSize) {
+        return;
+    }
+    size_t from = (offset + nbyte + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    size_t to = from + file->ra_window;
+    size_t eof = (file->inode->fileSize + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    if(to > eof) {
+        to = eof;
+    }
+    if(file->ra_end > from + file->ra_window / 2 || file->ra_end >= to) {
+        return;
+    }
+    if(file->ra_end > from) {
+        from = file->ra_end;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    while(from < to) {
+        size_t pblock;
+        size_t run = file_map_run(fs, file->inode, &file->map, from, to - from, &pblock);
+        if(pblock != 0) {
+            uintptr_t start = (uintptr_t)block_address(fs, pblock);
+            uintptr_t aligned = start & ~(uintptr_t)(page - 1);
+            posix_madvise((void *)aligned, start - aligned + run * BLOCK_SIZE_BYTES, POSIX_MADV_WILLNEED);
+        }
+        from += run;
+    }
+    file->ra_end = to;
+}
+
+// the largest file a 16-bit image can hold: every block not taken by the FBM, block_store, the inode table,
+// the root directory and the classic pointer blocks such a file needs
+#define FS_MAX_FILE_BLOCKS 65483
+
+#define FD_DELAY_BYTES (64 * BLOCK_SIZE_BYTES)   // appends this long or longer are written straight away
+
+// the most blocks backing [offset, offset + nbyte) could take, pointer blocks and extent leaves included
+static size_t delay_worst_case(uint64_t offset, size_t nbyte)
+{
+    return (offset + nbyte + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES - offset / BLOCK_SIZE_BYTES + 3;
+}
+
+// write out a descriptor's buffered appends, which always end at EOF, and give back what was promised for them.
+// The blocks they get come out of that promise, so all of them are written.
+static void fd_delay_flush(FS_t *fs, open_file_t *file)
+{
+    struct fd_delay *d = &file->delay;
+    size_t promised = d->reserved;
+    if(d->length > 0) {
+        pthread_setspecific(fs->locks->delay_draw, &promised);
+        file_write_at(fs, file->inode, &file->map, d->offset, d->data, d->length);
+        pthread_setspecific(fs->locks->delay_draw, NULL);
+        inode_mark_dirty(file->inode);
+        d->length = 0;
+        ((cached_inode_t *)file->inode)->delayed = -1;
+    }
+    pthread_mutex_lock(&fs->locks->alloc);
+    fs->delayed_blocks -= promised;
+    pthread_mutex_unlock(&fs->locks->alloc);
+    d->reserved = 0;
+}
+
+// before touching inode's blocks: flush the descriptor buffering appends to it, if there is one
+static void file_flush_delayed(FS_t *fs, inode_t *inode)
+{
+    int fd = ((cached_inode_t *)inode)->delayed;
+    if(fd >= 0) {
+        fd_delay_flush(fs, &fs->fd_table->files[fd]);
+    }
+}
+
+// before a write of nbyte that may not be buffered: flush every buffer if the blocks it may take could eat into what
+// they were promised. Flushing them all needs the FS to itself, so this is called holding nothing but fs_enter.
+static void fd_delay_make_room(FS_t *fs, size_t nbyte)
+{
+    //the offset isn't known before the descriptor is locked, so assume the worst alignment
+    size_t need = delay_worst_case(BLOCK_SIZE_BYTES - 1, nbyte);
+    pthread_mutex_lock(&fs->locks->alloc);
+    bool short_of_room = fs->delayed_blocks > 0 && space_free_blocks(fs) < fs->delayed_blocks + need;
+    pthread_mutex_unlock(&fs->locks->alloc);
+    if(short_of_room) {
+        fs_leave(fs);
+        fs_enter_exclusive(fs);
+        fd_delay_flush_all(fs);
+        fs_leave_exclusive(fs);
+        fs_enter(fs);
+    }
+}
+
+// take a write at the descriptor's position into its buffer instead of writing it. Only appends at EOF shorter
+// than the buffer qualify, and only while there is room to promise blocks for them.
+// \return true if it was buffered, false if the caller has to write it
+static bool fd_delay_append(FS_t *fs, int fd, open_file_t *file, const struct iovec *iov, int iovcnt, size_t nbyte)
+{
+    inode_t *inode = file->inode;
+    cached_inode_t *e = (cached_inode_t *)inode;
+    if(e->delayed >= 0 && e->delayed != fd) {
+        file_flush_delayed(fs, inode);
+    }
+    if(nbyte == 0 || nbyte >= FD_DELAY_BYTES || file->position != inode->fileSize || nbyte > FILE_BYTES_LIMIT - file->position) {
+        return false;
+    }
+    struct fd_delay *d = &file->delay;
+    if(d->length + nbyte > FD_DELAY_BYTES) {
+        fd_delay_flush(fs, file);
+    }
+    if(d->data == NULL && (d->data = malloc(FD_DELAY_BYTES)) == NULL) {
+        return false;
+    }
+    if(d->length == 0) {
+        d->offset = file->position;
+    }
+    size_t need = delay_worst_case(d->offset, d->length + nbyte);
+    if(need > d->reserved) {
+        //running out of space shows up right away, in a write the caller makes
+        pthread_mutex_lock(&fs->locks->alloc);
+        if(space_free_blocks(fs) < fs->delayed_blocks + (need - d->reserved)) {
+            pthread_mutex_unlock(&fs->locks->alloc);
+            return false;
+        }
+        fs->delayed_blocks += need - d->reserved;
+        pthread_mutex_unlock(&fs->locks->alloc);
+        d->reserved = need;
+    }
+    for(int i = 0; i < iovcnt; i++) {
+        if(iov[i].iov_len > 0) {
+            memcpy(d->data + d->length, iov[i].iov_base, iov[i].iov_len);
+            d->length += iov[i].iov_len;
+        }
+    }
+    inode->fileSize = d->offset + d->length;
+    inode_mark_dirty(inode);
+    e->delayed = fd;
+    return true;
+}
+
+// a file is going away: whatever a descriptor holds back for it is dropped, not written
+static void fd_delay_discard(FS_t *fs, size_t inode_ID)
+{
+    inode_t *inode = inode_get(fs, inode_ID);
+    if(inode == NULL) {
+        return;
+    }
+    int fd = ((cached_inode_t *)inode)->delayed;
+    if(fd >= 0) {
+        struct fd_delay *d = &fs->fd_table->files[fd].delay;
+        inode->fileSize = d->offset;
+        d->length = 0;
+        pthread_mutex_lock(&fs->locks->alloc);
+        fs->delayed_blocks -= d->reserved;
+        pthread_mutex_unlock(&fs->locks->alloc);
+        d->reserved = 0;
+        ((cached_inode_t *)inode)->delayed = -1;
+    }
+    inode_put(fs, inode);
+}
+
+off_t fs_seek(FS_t *fs, int fd, off_t offset, seek_t whence)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid
+    next, check to make sure the file descriptor is valid, and that it points to a valid file
+    We then look at the whence parameter to see where we start seeking from: the beginning of the file, the descriptor's current position, or the end of the file.
+    The offset is applied to that, and the result is clamped between BOF and the furthest position any file could ever reach.
+    Finally the new position is stored in the descriptor and returned.
+    */
+    //error check fs
+    if(fs == NULL){
+        return -1;
+    }
+    if(whence != FS_SEEK_SET && whence != FS_SEEK_CUR && whence != FS_SEEK_END) {
+        //invalid whence
+        return -1;
+    }
+    //make sure we have valid fd, and get the inode it refers to
+    fs_enter(fs);
+    open_file_t *file = fd_acquire(fs, fd, false);
+    if(file == NULL) {
+        fs_leave(fs);
+        return -1;
+    }
+    inode_t *fileInode = file->inode;
+    pthread_mutex_lock(&file->lock);
+    off_t base = 0;
+    if(whence == FS_SEEK_CUR) {
+        base = file->position;
+    }
+    else if(whence == FS_SEEK_END) {
+        base = fileInode->fileSize;
+    }
+    off_t max_position = (off_t)FS_MAX_FILE_BLOCKS * BLOCK_SIZE_BYTES - 1;
+    off_t position;
+    if(offset < 0 && offset < -base) {
+        //going past beginning so stop at BOF
+        position = 0;
+    }
+    else if(offset > 0 && offset > max_position - base) {
+        //going past the end of what the FS could ever hold, so stop there
+        position = max_position;
+    }
+    else {
+        position = base + offset;
+    }
+    file->position = position;
+    pthread_mutex_unlock(&file->lock);
+    fd_release(fs, fileInode);
+    fs_leave(fs);
+    return position;
+}
+
+ssize_t fs_read(FS_t *fs, int fd, void *dst, size_t nbyte)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid
+    next, check to make sure the file descriptor is valid, and that it points to a valid file
+    At this point, reading can commence. We start at the descriptor's position and copy whole contiguous runs of blocks at a time into dst.
+    If we run into eof, we stop and return what we have. Finally the descriptor's position is advanced by what was read.
+    */
+    //error check parameters
+    if(fs == NULL || dst == NULL) {
+        return -1;
+    }
+    //check and make sure the fd is valid
+    fs_enter(fs);
+    open_file_t *file = fd_acquire(fs, fd, false);
+    if(file == NULL) {
+        fs_leave(fs);
+        return -1;
+    }
+    inode_t *fileInode = file->inode;
+    pthread_mutex_lock(&file->lock);
+    uint64_t position = file->position;
+    file_flush_delayed(fs, fileInode);
+    file_readahead(fs, file, position, nbyte);
+    size_t bytes_read = file_read_at(fs, fileInode, fd_map_of(file), position, dst, nbyte);
+    //now just update the position
+    file->position = position + bytes_read;
+    pthread_mutex_unlock(&file->lock);
+    fd_release(fs, fileInode);
+    fs_leave(fs);
+    return bytes_read;
+}
+
+ssize_t fs_write(FS_t *fs, int fd, const void *src, size_t nbyte)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid
+    next, check to make sure the file descriptor is valid, and that it points to a valid file
+    A short append at EOF is only copied into the descriptor's buffer, and the file size and position move on. The buffer gets its blocks,
+    all in one contiguous reservation, when it fills up, when the descriptor is closed, or when anything else needs the file's blocks.
+    Any other write first flushes a buffer held for the file. Writing then commences: every block under the range being written that isn't backed yet is allocated, as contiguously as possible.
+    If we run out of blocks, we only write the part that is backed. The data is then copied in contiguous runs of blocks.
+    We finally update the file size and the descriptor's position and return how many bytes were written.
+    */
+    //error check parameters
+    if(fs == NULL || src == NULL) {
+        return -1;
+    }
+    //check and make sure the fd is valid
+    fs_enter(fs);
+    fd_delay_make_room(fs, nbyte);
+    open_file_t *file = fd_acquire(fs, fd, true);
+    if(file == NULL) {
+        fs_leave(fs);
+        return -1;
+    }
+    inode_t *fileInode = file->inode;
+    pthread_mutex_lock(&file->lock);
+    uint64_t position = file->position;
+    struct iovec iov = { (void *)src, nbyte };
+    size_t bytes_written = nbyte;
+    if(!fd_delay_append(fs, fd, file, &iov, 1, nbyte)) {
+        file_flush_delayed(fs, fileInode);
+        bytes_written = file_write_at(fs, fileInode, fd_map_of(file), position, src, nbyte);
+        if(nbyte > 0) {
+            //even a write that ran out of space may have mapped blocks, the cached inode goes back to bs later
+            inode_mark_dirty(fileInode);
+        }
+    }
+    file->position = position + bytes_written;
+    pthread_mutex_unlock(&file->lock);
+    fd_release(fs, fileInode);
+    fs_leave(fs);
+    return bytes_written;
+}
+
+ssize_t fs_pread(FS_t *fs, int fd, void *dst, size_t nbyte, off_t offset)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid, and that the offset isn't before BOF
+    next, check to make sure the file descriptor is valid, and that it points to a valid file
+    The read then works exactly like fs_read starting at offset, except that the descriptor is never written,
+    so any number of threads can read through the same descriptor at once.
+    */
+    if(fs == NULL || dst == NULL || offset < 0) {
+        return -1;
+    }
+    fs_enter(fs);
+    open_file_t *file = fd_acquire(fs, fd, false);
+    if(file == NULL) {
+        fs_leave(fs);
+        return -1;
+    }
+    inode_t *fileInode = file->inode;
+    file_flush_delayed(fs, fileInode);
+    size_t bytes_read = file_read_at(fs, fileInode, NULL, offset, dst, nbyte);
+    fd_release(fs, fileInode);
+    fs_leave(fs);
+    return bytes_read;
+}
+
+ssize_t fs_pwrite(FS_t *fs, int fd, const void *src, size_t nbyte, off_t offset)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid, and that the offset isn't before BOF
+    next, check to make sure the file descriptor is valid, and that it points to a valid file
+    The write then works exactly like fs_write starting at offset. Only the inode is written back, the descriptor's
+    position is left alone.
+    */
+    if(fs == NULL || src == NULL || offset < 0) {
+        return -1;
+    }
+    fs_enter(fs);
+    fd_delay_make_room(fs, nbyte);
+    open_file_t *file = fd_acquire(fs, fd, true);
+    if(file == NULL) {
+        fs_leave(fs);
+        return -1;
+    }
+    inode_t *fileInode = file->inode;
+    file_flush_delayed(fs, fileInode);
+    size_t bytes_written = file_write_at(fs, fileInode, NULL, offset, src, nbyte);
+    if(nbyte > 0) {
+        inode_mark_dirty(fileInode);
+    }
+    fd_release(fs, fileInode);
+    fs_leave(fs);
+    return bytes_written;
+}
+
+ssize_t fs_readv(FS_t *fs, int fd, const struct iovec *iov, int iovcnt)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid, and add up how much is being asked for
+    next, check to make sure the file descriptor is valid, and that it points to a valid file
+    The read then works like one fs_read of the total length, except that the data is spread over the buffers in order,
+    each filled before moving to the next. The descriptor's position is advanced once by what was read.
+    */
+    size_t total;
+    if(fs == NULL || iov_total(iov, iovcnt, &total) < 0) {
+        return -1;
+    }
+    fs_enter(fs);
+    open_file_t *file = fd_acquire(fs, fd, false);
+    if(file == NULL) {
+        fs_leave(fs);
+        return -1;
+    }
+    inode_t *fileInode = file->inode;
+    pthread_mutex_lock(&file->lock);
+    uint64_t position = file->position;
+    file_flush_delayed(fs, fileInode);
+    file_readahead(fs, file, position, total);
+    size_t bytes_read = file_readv_at(fs, fileInode, fd_map_of(file), position, iov, iovcnt, total);
+    file->position = position + bytes_read;
+    pthread_mutex_unlock(&file->lock);
+    fd_release(fs, fileInode);
+    fs_leave(fs);
+    return bytes_read;
+}
+
+ssize_t fs_writev(FS_t *fs, int fd, const struct iovec *iov, int iovcnt)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid, and add up how much is being written
+    next, check to make sure the file descriptor is valid, and that it points to a valid file
+    The write then works like one fs_write of the total length: every block under the whole range is reserved at once,
+    then each buffer is copied in order right after the previous one. The inode and the descriptor are each written back once.
+    */
+    size_t total;
+    if(fs == NULL || iov_total(iov, iovcnt, &total) < 0) {
+        return -1;
+    }
+    fs_enter(fs);
+    fd_delay_make_room(fs, total);
+    open_file_t *file = fd_acquire(fs, fd, true);
+    if(file == NULL) {
+        fs_leave(fs);
+        return -1;
+    }
+    inode_t *fileInode = file->inode;
+    pthread_mutex_lock(&file->lock);
+    uint64_t position = file->position;
+    size_t bytes_written = total;
+    if(!fd_delay_append(fs, fd, file, iov, iovcnt, total)) {
+        file_flush_delayed(fs, fileInode);
+        bytes_written = file_writev_at(fs, fileInode, fd_map_of(file), position, iov, iovcnt, total);
+        if(total > 0) {
+            inode_mark_dirty(fileInode);
+        }
+    }
+    file->position = position + bytes_written;
+    pthread_mutex_unlock(&file->lock);
+    fd_release(fs, fileInode);
+    fs_leave(fs);
+    return bytes_written;
+}
+
+// what views of holes point at
+static const uint8_t fs_zero_block[BLOCK_SIZE_BYTES];
+
+ssize_t fs_view(FS_t *fs, int fd, off_t offset, size_t nbyte, fs_view_t *view)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid, and that the offset isn't before BOF
+    next, check to make sure the file descriptor is valid, and that it points to a valid file
+    We clamp the request to EOF, then find the run of physical blocks backing offset. The view is simply the address of
+    offset inside that run in the mapped image, cut short at the end of the run or the request, whichever comes first.
+    Holes have no blocks, so those views point at a block of zeros instead.
+    A view pins the inode and is counted on it until fs_view_release, and nothing frees or moves the blocks of a viewed file.
+    */
+    if(fs == NULL || view == NULL || offset < 0) {
+        return -1;
+    }
+    fs_enter(fs);
+    open_file_t *file = fd_acquire(fs, fd, false);
+    if(file == NULL) {
+        fs_leave(fs);
+        return -1;
+    }
+    inode_t *fileInode = file->inode;
+    file_flush_delayed(fs, fileInode);
+    view->data = NULL;
+    view->length = 0;
+    if((uint64_t)offset >= fileInode->fileSize || nbyte == 0) {
+        fd_release(fs, fileInode);
+        fs_leave(fs);
+        return 0;
+    }
+    if(nbyte > fileInode->fileSize - offset) {
+        nbyte = fileInode->fileSize - offset;
+    }
+    size_t within = offset % BLOCK_SIZE_BYTES;
+    size_t pblock;
+    size_t run = file_map_run(fs, fileInode, NULL, offset / BLOCK_SIZE_BYTES, (within + nbyte + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES, &pblock);
+    if(pblock == 0) {
+        //one block of zeros at a time is all we have to point at
+        view->data = fs_zero_block + within;
+        run = 1;
+    }
+    else {
+        view->data = block_address(fs, pblock) + within;
+    }
+    view->length = run * BLOCK_SIZE_BYTES - within < nbyte ? run * BLOCK_SIZE_BYTES - within : nbyte;
+    cached_inode_t *e = (cached_inode_t *)fileInode;
+    view->inode_ID = e->inode_ID;
+    pthread_mutex_lock(&fs->locks->icache);
+    //the descriptor's pin keeps the entry off the LRU list, so taking another is just a count
+    e->refs++;
+    e->views++;
+    pthread_mutex_unlock(&fs->locks->icache);
+    pthread_mutex_lock(&fs->locks->fd_table);
+    fs->open_views++;
+    pthread_mutex_unlock(&fs->locks->fd_table);
+    fd_release(fs, fileInode);
+    fs_leave(fs);
+    return view->length;
+}
+
+int fs_view_release(FS_t *fs, fs_view_t *view)
+{
+    if(fs == NULL || view == NULL) {
+        return -1;
+    }
+    if(view->data != NULL) {
+        fs_enter(fs);
+        cached_inode_t *e = NULL;
+        if(fs->icache != NULL) {
+            pthread_mutex_lock(&fs->locks->icache);
+            e = icache_find(fs->icache, view->inode_ID);
+            if(e != NULL && e->views > 0) {
+                e->views--;
+            }
+            else {
+                e = NULL;
+            }
+            pthread_mutex_unlock(&fs->locks->icache);
+        }
+        if(e == NULL) {
+            //not one of ours, or released twice
+            fs_leave(fs);
+            return -1;
+        }
+        pthread_mutex_lock(&fs->locks->fd_table);
+        fs->open_views--;
+        pthread_mutex_unlock(&fs->locks->fd_table);
+        inode_put(fs, &e->inode);
+        fs_leave(fs);
+    }
+    view->data = NULL;
+    view->length = 0;
+    return 0;
+}
+
+int fs_fallocate(FS_t *fs, int fd, off_t offset, off_t len)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid, and that the range lies between BOF and the largest file the FS could hold
+    next, check to make sure the file descriptor is valid, and that it points to a valid file
+    Appends held back for the file get their blocks first, so they don't end up behind the reservation.
+    Every block under the range that isn't backed yet is then allocated, in runs as long as the free space allows, and cleared.
+    If everything got reserved, the file size is raised to the end of the range when it falls short of it.
+    */
+    if(fs == NULL || offset < 0 || len <= 0) {
+        return -1;
+    }
+    off_t max_size = (off_t)FS_MAX_FILE_BLOCKS * BLOCK_SIZE_BYTES;
+    if(offset >= max_size || len > max_size - offset) {
+        return -1;
+    }
+    fs_enter(fs);
+    fd_delay_make_room(fs, len);
+    open_file_t *file = fd_acquire(fs, fd, true);
+    if(file == NULL) {
+        fs_leave(fs);
+        return -1;
+    }
+    inode_t *fileInode = file->inode;
+    file_flush_delayed(fs, fileInode);
+    size_t reserved = file_reserve(fs, fileInode, NULL, offset, len, true);
+    //even a reservation that ran out of space may have mapped blocks
+    inode_mark_dirty(fileInode);
+    if(reserved == (size_t)len && (uint64_t)(offset + len) > fileInode->fileSize) {
+        fileInode->fileSize = offset + len;
+    }
+    fd_release(fs, fileInode);
+    if(reserved < (size_t)len) {
+        fs_leave(fs);
+        return -1;
+    }
+    journal_op_done(fs);
+    fs_leave(fs);
+    return 0;
+}
+
+int fs_truncate(FS_t *fs, int fd, off_t length)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid, and that the new size is one a file could have
+    next, check to make sure the file descriptor is valid, and that it points to a valid file
+    Appends held back for the file get written first, so the new size applies to them too.
+    When shrinking, every block from the first one wholly past the new EOF is freed, along with pointer blocks nothing points through anymore,
+    and the rest of the block the new EOF falls in is cleared, so growing the file again later reads zeros there. A file with views
+    outstanding can't be shrunk, they point at those blocks.
+    Finally the size is set. Growing needs nothing else, since unbacked blocks below EOF read as zeros.
+    */
+    if(fs == NULL || length < 0) {
+        return -1;
+    }
+    if(length > (off_t)FS_MAX_FILE_BLOCKS * BLOCK_SIZE_BYTES) {
+        return -1;
+    }
+    fs_enter(fs);
+    open_file_t *file = fd_acquire(fs, fd, true);
+    if(file == NULL) {
+        fs_leave(fs);
+        return -1;
+    }
+    inode_t *fileInode = file->inode;
+    file_flush_delayed(fs, fileInode);
+    if((uint64_t)length < fileInode->fileSize) {
+        if(inode_viewed(fs, ((cached_inode_t *)fileInode)->inode_ID) || file_release(fs, fileInode, (length + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES) < 0) {
+            fd_release(fs, fileInode);
+            fs_leave(fs);
             return -1;
         }
+        //freed blocks may still be mapped by descriptors
+        fd_map_forget(fs, fileInode->inodeNumber);
+        size_t within = length % BLOCK_SIZE_BYTES;
+        size_t pblock = 0;
+        if(within != 0) {
+            file_map_run(fs, fileInode, NULL, length / BLOCK_SIZE_BYTES, 1, &pblock);
+        }
+        if(pblock != 0) {
+            memset(block_address(fs, pblock) + within, 0, BLOCK_SIZE_BYTES - within);
+            file_dirty(fs, fileInode, length / BLOCK_SIZE_BYTES, pblock, 1);
+        }
+    }
+    fileInode->fileSize = length;
+    inode_mark_dirty(fileInode);
+    fd_release(fs, fileInode);
+    journal_op_done(fs);
+    fs_leave(fs);
+    return 0;
+}
+
+// a stretch of consecutive image blocks waiting to be synced, so that neighbouring blocks go out in one msync
+typedef struct {
+    size_t start;
+    size_t length;
+} sync_run_t;
+
+static void sync_run_flush(FS_t *fs, sync_run_t *run)
+{
+    if(run->length != 0) {
+        image_sync_blocks(fs, run->start, run->length);
+        run->length = 0;
+    }
+}
+
+// add block_ID to the run, syncing what the run holds first if block_ID doesn't continue it
+static void sync_run_add(FS_t *fs, sync_run_t *run, size_t block_ID)
+{
+    if(run->length != 0 && block_ID >= run->start && block_ID <= run->start + run->length) {
+        if(block_ID == run->start + run->length) {
+            run->length++;
+        }
+        return;
+    }
+    sync_run_flush(fs, run);
+    run->start = block_ID;
+    run->length = 1;
+}
+
+// whether block_ID changed since the last fs_sync, for calls that don't have the FS to themselves
+static bool block_unsynced(FS_t *fs, size_t block_ID)
+{
+    pthread_mutex_lock(&fs->locks->dirty);
+    bool unsynced = block_set_contains(fs->unsynced, block_ID);
+    pthread_mutex_unlock(&fs->locks->dirty);
+    return unsynced;
+}
+
+static int block_number_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int fs_sync(FS_t *fs)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check the FS
+    next, get everything that is only in memory into the mapped image: appends held back in descriptors, cached inodes and
+    cached blocks. A journal commits its running transaction on the way.
+    Every block that changed since the last sync was noted in fs->unsynced. Those blocks, plus block 0 and the free block map,
+    are sorted and synced in runs of neighbouring blocks. If the set lost track of a block, the whole image is synced instead.
+    Finally the set and the files' unsynced ranges are emptied. Every logged block is now in place, so the log is emptied too.
+    */
+    if(fs == NULL) {
+        return -1;
+    }
+    fs_enter_exclusive(fs);
+    fd_delay_flush_all(fs);
+    journal_commit(fs);
+    icache_sync(fs);
+    bcache_sync(fs);
+    struct block_set *set = fs->unsynced;
+    if(set != NULL && set->count != 0) {
+        //the inode bitmap and the free block map change along with nearly everything else
+        block_set_add(set, 0);
+        block_set_add(set, BLOCK_STORE_AVAIL_BLOCKS);
+        block_set_add(set, BLOCK_STORE_AVAIL_BLOCKS + 1);
+    }
+    if(set == NULL || set->overflow) {
+        image_sync_blocks(fs, 0, BLOCK_STORE_NUM_BLOCKS);
+    }
+    else {
+        qsort(set->blocks, set->count, sizeof(uint32_t), block_number_compare);
+        sync_run_t run = { 0, 0 };
+        for(size_t i = 0; i < set->count; i++) {
+            sync_run_add(fs, &run, set->blocks[i]);
+        }
+        sync_run_flush(fs, &run);
+    }
+    if(set != NULL) {
+        block_set_clear(set);
+    }
+    if(fs->icache != NULL) {
+        for(size_t i = 0; i < ICACHE_BUCKETS; i++) {
+            for(cached_inode_t *e = fs->icache->buckets[i]; e != NULL; e = e->hash_next) {
+                e->dirty_end = 0;
+            }
+        }
+    }
+    if(fs->journal != NULL && fs->journal->head > 1) {
+        journal_reset(fs);
+    }
+    fs_leave_exclusive(fs);
+    return 0;
+}
 
-        // let's check if the filenames are valid or not
-        for(size_t n = 0; n < count; n++)
-        {	
-            if(isValidFileName(*(tokens + n)) == false)
-            {
-                // before any return, we need to free tokens, otherwise memory leakage
-                for (size_t i = 0; i < count; i++)
-                {
-                    free(*(tokens + i));
-                }
-                free(tokens);
-                return -1;
+int fs_fsync(FS_t *fs, int fd)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid
+    next, check to make sure the file descriptor is valid, and get appends held back for the file written
+    Data goes first, so that metadata never reaches the image file pointing at blocks whose contents didn't: the file blocks
+    written since its last fsync are mapped, and the physical blocks among them that are still unsynced are synced in runs.
+    Then the metadata. With a journal, committing the running transaction makes it durable.
+    Without one, the inode is written back and its inode table block, the pointer blocks or extent tree blocks that map
+    the file, block 0 and the free block map are synced, again only those that changed.
+    If the FS lost track of which blocks changed, this falls back to fs_sync.
+    */
+    if(fs == NULL) {
+        return -1;
+    }
+    fs_enter(fs);
+    open_file_t *file = fd_acquire(fs, fd, true);
+    if(file == NULL) {
+        fs_leave(fs);
+        return -1;
+    }
+    inode_t *fileInode = file->inode;
+    pthread_mutex_lock(&fs->locks->dirty);
+    bool lost_track = fs->unsynced == NULL || fs->unsynced->overflow;
+    pthread_mutex_unlock(&fs->locks->dirty);
+    if(lost_track) {
+        fd_release(fs, fileInode);
+        fs_leave(fs);
+        return fs_sync(fs);
+    }
+    cached_inode_t *e = (cached_inode_t *)fileInode;
+    file_flush_delayed(fs, fileInode);
+    sync_run_t run = { 0, 0 };
+    bool changed = false;
+    for(size_t lblock = e->dirty_first; lblock < e->dirty_end; ) {
+        size_t pblock;
+        size_t length = file_map_run(fs, fileInode, NULL, lblock, e->dirty_end - lblock, &pblock);
+        for(size_t i = 0; pblock != 0 && i < length; i++) {
+            if(block_unsynced(fs, pblock + i)) {
+                sync_run_add(fs, &run, pblock + i);
+                changed = true;
             }
-        }	
+        }
+        lblock += length;
+    }
+    sync_run_flush(fs, &run);
+    e->dirty_end = 0;
+    if(fs->journal != NULL) {
+        //a commit needs the FS to itself
+        fd_release(fs, fileInode);
+        fs_leave(fs);
+        fs_enter_exclusive(fs);
+        journal_commit(fs);
+        fs_leave_exclusive(fs);
+        return 0;
+    }
+    pthread_mutex_lock(&fs->locks->icache);
+    icache_write_back(fs, e);
+    pthread_mutex_unlock(&fs->locks->icache);
+    uint32_t map[EXTENTS_PER_BLOCK + 3];
+    size_t count = 0;
+    map[count++] = inode_table_block(fs, e->inode_ID);
+    if(inode_is_extent_mapped(fileInode)) {
+        //extent tree nodes reach the image through the block cache
+        bcache_sync(fs);
+        inode_extents_t root;
+        inode_get_extents(fileInode, &root);
+        count += extent_tree_blocks(fs, root.tree, map + count);
+    }
+    else {
+        map[count++] = fileInode->indirectPointer[0];
+        map[count++] = fileInode->doubleIndirectPointer;
+    }
+    for(size_t i = 0; i < count; i++) {
+        if(map[i] != 0 && block_unsynced(fs, map[i])) {
+            sync_run_add(fs, &run, map[i]);
+            changed = true;
+        }
+    }
+    if(!inode_is_extent_mapped(fileInode) && fileInode->doubleIndirectPointer != 0) {
+        const uint16_t *dbl = pointer_block(fs, fileInode->doubleIndirectPointer);
+        for(size_t j = 0; j < BLOCK_SIZE_BYTES / sizeof(uint16_t); j++) {
+            if(dbl[j] != 0 && block_unsynced(fs, dbl[j])) {
+                sync_run_add(fs, &run, dbl[j]);
+                changed = true;
+            }
+        }
+    }
+    if(changed) {
+        sync_run_add(fs, &run, 0);
+        sync_run_add(fs, &run, BLOCK_STORE_AVAIL_BLOCKS);
+        sync_run_add(fs, &run, BLOCK_STORE_AVAIL_BLOCKS + 1);
+    }
+    sync_run_flush(fs, &run);
+    fd_release(fs, fileInode);
+    fs_leave(fs);
+    return 0;
+}
 
-        size_t parent_inode_ID = 0;	// start from the 1st inode, ie., the inode for root directory
-        // first, let's find the parent dir
-        size_t indicator = 0;
+// defragmentation: a file's data blocks in file order, as runs that are contiguous both in the file and in the image.
+// A block starts a new fragment when it doesn't sit right behind the block before it, holes don't count. A file is
+// moved by copying its data into one free run, with its pointer blocks in front, switching its map over and freeing
+// the old blocks, all with the file locked for writing and under one fs_enter per file.
+typedef struct {
+    extent_t *runs;
+    size_t count;
+    size_t capacity;
+    size_t blocks;
+    size_t fragments;
+} defrag_map_t;
 
-        inode_t * parent_inode = (inode_t *) calloc(1, sizeof(inode_t));
-        directoryFile_t * parent_data = (directoryFile_t *)calloc(1, BLOCK_SIZE_BYTES);			
+// append file block lblock at pblock, growing the last run when both line up
+// \return 0 on success, -1 when out of memory
+static int defrag_map_add(defrag_map_t *map, size_t lblock, size_t pblock, size_t length)
+{
+    extent_t e = { lblock, pblock, length };
+    if(map->count == 0 || map->runs[map->count - 1].start + map->runs[map->count - 1].length != pblock) {
+        map->fragments++;
+    }
+    map->blocks += length;
+    if(map->count > 0 && extent_merge(&map->runs[map->count - 1], &e)) {
+        return 0;
+    }
+    if(map->count == map->capacity) {
+        size_t grown = map->capacity == 0 ? 64 : map->capacity * 2;
+        extent_t *bigger = (extent_t *)realloc(map->runs, grown * sizeof(extent_t));
+        if(bigger == NULL) {
+            return -1;
+        }
+        map->runs = bigger;
+        map->capacity = grown;
+    }
+    map->runs[map->count++] = e;
+    return 0;
+}
 
-        // locate the file
-        for(size_t i = 0; i < count; i++)
-        {		
-            block_store_inode_read(fs->BlockStore_inode, parent_inode_ID, parent_inode);	// read out the parent inode
-            if(parent_inode->fileType == 'd')
-            {
-                block_store_read(fs->BlockStore_whole, parent_inode->directPointer[0], parent_data);
-                //printf("parent_inode->vacantFile = %d\n", parent_inode->vacantFile);
-                for(int j = 0; j < folder_number_entries; j++)
-                {
-                    //printf("(parent_data + j) -> filename = %s\n", (parent_data + j) -> filename);
-                    if( ((parent_inode->vacantFile >> j) & 1) == 1 && strcmp((parent_data + j) -> filename, *(tokens + i)) == 0 )
-                    {
-                        parent_inode_ID = (parent_data + j) -> inodeNumber;
-                        indicator++;
-                    }					
+// the data runs of a regular file, read straight from its pointer blocks or extents
+// \return 0 on success, -1 when out of memory
+static int defrag_map_load(FS_t *fs, const inode_t *inode, defrag_map_t *map)
+{
+    memset(map, 0, sizeof(*map));
+    int result = 0;
+    if(inode_is_extent_mapped(inode)) {
+        extent_t *records;
+        size_t count;
+        if(extent_load(fs, inode, &records, &count) < 0) {
+            return -1;
+        }
+        for(size_t i = 0; i < count && result == 0; i++) {
+            result = defrag_map_add(map, records[i].logical, records[i].start, records[i].length);
+        }
+        free(records);
+        return result;
+    }
+    for(size_t i = 0; i < CLASSIC_INDIRECT_START && result == 0; i++) {
+        if(inode->directPointer[i] != 0) {
+            result = defrag_map_add(map, i, inode->directPointer[i], 1);
+        }
+    }
+    if(inode->indirectPointer[0] != 0) {
+        const uint16_t *ind = pointer_block(fs, inode->indirectPointer[0]);
+        for(size_t i = 0; i < POINTERS_PER_BLOCK && result == 0; i++) {
+            if(ind[i] != 0) {
+                result = defrag_map_add(map, CLASSIC_INDIRECT_START + i, ind[i], 1);
+            }
+        }
+    }
+    if(inode->doubleIndirectPointer != 0) {
+        const uint16_t *dbl = pointer_block(fs, inode->doubleIndirectPointer);
+        for(size_t j = 0; j < POINTERS_PER_BLOCK && result == 0; j++) {
+            if(dbl[j] == 0) {
+                continue;
+            }
+            const uint16_t *ind = pointer_block(fs, dbl[j]);
+            for(size_t i = 0; i < POINTERS_PER_BLOCK && result == 0; i++) {
+                if(ind[i] != 0) {
+                    result = defrag_map_add(map, CLASSIC_DOUBLE_START + j * POINTERS_PER_BLOCK + i, ind[i], 1);
                 }
-            }					
-        }		
-        free(parent_data);			
-        free(parent_inode);	
-        //printf("indicator = %zu\n", indicator);
-        //printf("count = %zu\n", count);
-        // now let's open the file
-        if(indicator == count)
-        {
-            size_t fd_ID = block_store_sub_allocate(fs->BlockStore_fd);
-            //printf("fd_ID = %zu\n", fd_ID);
-            // it could be possible that fd runs out
-            if(fd_ID < number_fd)
-            {
-                size_t file_inode_ID = parent_inode_ID;
-                inode_t * file_inode = (inode_t *) calloc(1, sizeof(inode_t));
-                block_store_inode_read(fs->BlockStore_inode, file_inode_ID, file_inode);	// read out the file inode	
+            }
+        }
+    }
+    return result;
+}
 
-                // it's too bad if file to be opened is a dir 
-                if(file_inode->fileType == 'd')
-                {
-                    free(file_inode);
-                    // before any return, we need to free tokens, otherwise memory leakage
-                    for (size_t i = 0; i < count; i++)
-                    {
-                        free(*(tokens + i));
-                    }
-                    free(tokens);
-                    return -1;
-                }
+// a file with blocks has one fragment it can't do without, and as many blocks that could follow another as it has
+// blocks past its first. with_blocks counts the files measured that have any.
+static void frag_score(fs_frag_t *frag, size_t with_blocks)
+{
+    if(frag->blocks > with_blocks) {
+        frag->score = (double)(frag->fragments - with_blocks) / (double)(frag->blocks - with_blocks);
+    }
+}
 
-                // assign a file descriptor ID to the open behavior
-                fileDescriptor_t * fd = (fileDescriptor_t *)calloc(1, sizeof(fileDescriptor_t));
-                fd->inodeNum = file_inode_ID;
-                fd->usage = 1;
-                fd->locate_order = 0; // R/W position is set to the beginning of the file (BOF)
-                fd->locate_offset = 0;
-                block_store_fd_write(fs->BlockStore_fd, fd_ID, fd);
-
-                free(file_inode);
-                free(fd);
-                // before any return, we need to free tokens, otherwise memory leakage
-                for (size_t i = 0; i < count; i++)
-                {
-                    free(*(tokens + i));
-                }
-                free(tokens);			
-                return fd_ID;
-            }	
-        }
-        // before any return, we need to free tokens, otherwise memory leakage
-        for (size_t i = 0; i < count; i++)
-        {
-            free(*(tokens + i));
+// take want free blocks in one run, the first one at or after goal, or before it
+// \return 0 on success, -1 when there is no run that long
+static int block_alloc_whole_run(FS_t *fs, size_t goal, size_t want, size_t *start)
+{
+    if(fs->space == NULL || want == 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&fs->locks->alloc);
+    size_t first = SIZE_MAX;
+    if(space_usable(fs, want) == want && (first = space_find(fs->space, goal, want)) == SIZE_MAX) {
+        first = space_find(fs->space, 0, want);
+    }
+    size_t got = first != SIZE_MAX ? space_take(fs, first, want) : 0;
+    pthread_mutex_unlock(&fs->locks->alloc);
+    if(got < want) {
+        block_release_run(fs, first, got);
+        return -1;
+    }
+    *start = first;
+    return 0;
+}
+
+// point file block lblock of a classic file at pblock, taking the pointer blocks the way needs from *next_pointer on
+static void defrag_classic_set(FS_t *fs, inode_t *inode, size_t lblock, size_t pblock, size_t *next_pointer)
+{
+    if(lblock < CLASSIC_INDIRECT_START) {
+        inode->directPointer[lblock] = pblock;
+        return;
+    }
+    uint16_t *parent = NULL;
+    size_t slot;
+    if(lblock < CLASSIC_DOUBLE_START) {
+        parent = &inode->indirectPointer[0];
+        slot = lblock - CLASSIC_INDIRECT_START;
+    }
+    else {
+        if(inode->doubleIndirectPointer == 0) {
+            inode->doubleIndirectPointer = (*next_pointer)++;
+            metadata_dirty(fs, inode->doubleIndirectPointer);
+            memset(pointer_block(fs, inode->doubleIndirectPointer), 0, BLOCK_SIZE_BYTES);
         }
-        free(tokens);
+        parent = &pointer_block(fs, inode->doubleIndirectPointer)[(lblock - CLASSIC_DOUBLE_START) / POINTERS_PER_BLOCK];
+        slot = (lblock - CLASSIC_DOUBLE_START) % POINTERS_PER_BLOCK;
     }
-    return -1;
+    if(*parent == 0) {
+        *parent = (*next_pointer)++;
+        metadata_dirty(fs, *parent);
+        memset(pointer_block(fs, *parent), 0, BLOCK_SIZE_BYTES);
+    }
+    pointer_block(fs, *parent)[slot] = pblock;
 }
 
+// how many pointer blocks a classic file with these runs needs
+static size_t defrag_classic_pointers(const defrag_map_t *map)
+{
+    size_t pointers = 0;
+    size_t last_group = SIZE_MAX;
+    for(size_t r = 0; r < map->count; r++) {
+        const extent_t *e = &map->runs[r];
+        if(e->logical + e->length > CLASSIC_INDIRECT_START && e->logical < CLASSIC_DOUBLE_START && pointers == 0) {
+            pointers = 1;
+        }
+        for(size_t lblock = e->logical; lblock < e->logical + e->length; lblock++) {
+            if(lblock >= CLASSIC_DOUBLE_START && (lblock - CLASSIC_DOUBLE_START) / POINTERS_PER_BLOCK != last_group) {
+                //the double indirect block comes with the first group
+                pointers += last_group == SIZE_MAX ? 2 : 1;
+                last_group = (lblock - CLASSIC_DOUBLE_START) / POINTERS_PER_BLOCK;
+            }
+        }
+    }
+    return pointers;
+}
 
-///
-/// Closes the given file descriptor
-/// \param fs The FS containing the file
-/// \param fd The file to close
-/// \return 0 on success, < 0 on failure
-///
-int fs_close(FS_t *fs, int fd)
+// move a regular file, locked for writing, into one run if it is in more than one
+// \return data blocks moved, 0 when it was left where it is
+static size_t defrag_file(FS_t *fs, inode_t *inode, const defrag_map_t *map)
 {
-    if(fs != NULL && fd >=0 && fd < number_fd)
-    {
-        // first, make sure this fd is in use
-        if(block_store_sub_test(fs->BlockStore_fd, fd))
-        {
-            block_store_sub_release(fs->BlockStore_fd, fd);
+    if(map->fragments <= 1) {
+        return 0;
+    }
+    //a view maps the file's blocks themselves. New ones wait for the inode lock we hold
+    bool viewed = inode_viewed(fs, ((cached_inode_t *)inode)->inode_ID);
+    bool extents = inode_is_extent_mapped(inode);
+    size_t pointers = extents ? 0 : defrag_classic_pointers(map);
+    size_t start;
+    if(viewed || block_alloc_whole_run(fs, group_goal(inode->group), pointers + map->blocks, &start) < 0) {
+        return 0;
+    }
+    extent_t *moved = (extent_t *)malloc(map->count * sizeof(extent_t));
+    if(moved == NULL) {
+        block_release_run(fs, start, pointers + map->blocks);
+        return 0;
+    }
+    size_t next = start + pointers;
+    size_t count = 0;
+    for(size_t r = 0; r < map->count; r++) {
+        extent_t e = { map->runs[r].logical, next, map->runs[r].length };
+        memcpy(block_address(fs, e.start), block_address(fs, map->runs[r].start), e.length * BLOCK_SIZE_BYTES);
+        file_dirty(fs, inode, e.logical, e.start, e.length);
+        next += e.length;
+        if(count == 0 || !extent_merge(&moved[count - 1], &e)) {
+            moved[count++] = e;
+        }
+    }
+    if(extents) {
+        if(extent_store(fs, inode, moved, count, EXTENT_LEAF_FILL) < 0) {
+            free(moved);
+            block_release_run(fs, start, map->blocks);
             return 0;
-        }	
+        }
+        for(size_t r = 0; r < map->count; r++) {
+            block_release_run(fs, map->runs[r].start, map->runs[r].length);
+        }
     }
-    return -1;
+    else {
+        inode_t old = *inode;
+        memset(inode->directPointer, 0, sizeof(inode->directPointer));
+        inode->indirectPointer[0] = 0;
+        inode->doubleIndirectPointer = 0;
+        size_t next_pointer = start;
+        for(size_t r = 0; r < count; r++) {
+            for(size_t i = 0; i < moved[r].length; i++) {
+                defrag_classic_set(fs, inode, moved[r].logical + i, moved[r].start + i, &next_pointer);
+            }
+        }
+        classic_release(fs, &old, 0);
+    }
+    free(moved);
+    fd_map_forget(fs, inode->inodeNumber);
+    inode_mark_dirty(inode);
+    return map->blocks;
 }
 
+// inodes there may be files in
+static size_t inode_capacity(FS_t *fs)
+{
+    if(fs->inode_table == NULL) {
+        return number_inodes;
+    }
+    pthread_mutex_lock(&fs->locks->inode_alloc);
+    size_t capacity = fs->inode_table->capacity;
+    pthread_mutex_unlock(&fs->locks->inode_alloc);
+    return capacity;
+}
 
+// add a regular file's fragmentation to frag, with the FS entered, counting it in *with_blocks if it has any
+// \return 0 on success or when inode_ID isn't a regular file (nothing is added then), -1 when out of memory
+static int frag_measure(FS_t *fs, size_t inode_ID, fs_frag_t *frag, size_t *with_blocks)
+{
+    inode_lock(fs, inode_ID, false);
+    inode_t inode;
+    inode_read(fs, inode_ID, &inode);
+    defrag_map_t map;
+    int result = 0;
+    if(inode.fileType == 'r' && inode.linkCount != 0) {
+        result = defrag_map_load(fs, &inode, &map);
+        if(result == 0) {
+            frag->files++;
+            frag->blocks += map.blocks;
+            frag->fragments += map.fragments;
+            *with_blocks += map.blocks > 0;
+        }
+        free(map.runs);
+    }
+    inode_unlock(fs, inode_ID);
+    return result;
+}
 
-///
-/// Populates a dyn_array with information about the files in a directory
-///   Array contains up to 31 file_record_t structures
-/// \param fs The FS containing the file
-/// \param path Absolute path to the directory to inspect
-/// \return dyn_array of file records, NULL on error
-///
-dyn_array_t *fs_get_dir(FS_t *fs, const char *path)
+int fs_fragmentation(FS_t *fs, const char *path, fs_frag_t *frag)
 {
-    if(fs != NULL && path != NULL && strlen(path) != 0)
-    {	
-        char* copy_path = (char*)malloc(200);
-        strcpy(copy_path, path);
-        char** tokens;		// tokens are the directory names along the path. The last one is the name for the new file or dir
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid
+    With a path, walk to the file and check it is a regular file, still there once it is locked.
+    Without one, every inode in use that is a regular file is measured, each locked in turn.
+    A file's data blocks are followed in file order, through its pointer blocks or its extents, and every block that doesn't
+    sit right behind the one before it starts a new fragment. The score is the share of blocks past each file's first that do.
+    */
+    if(fs == NULL || frag == NULL) {
+        return -1;
+    }
+    memset(frag, 0, sizeof(*frag));
+    size_t with_blocks = 0;
+    int result = 0;
+    if(path != NULL) {
+        path_span_t tokens[FS_PATH_MAX_DEPTH];
         size_t count = 0;
-        tokens = str_split(copy_path, '/', &count);
-        free(copy_path);
-
-        if(strlen(*tokens) == 0)
-        {
-            // a spcial case: only a slash, no dir names
-            count -= 1;
+        if(path_tokenize(path, tokens, &count) < 0 || count == 0) {
+            return -1;
         }
-        else
-        {
-            for(size_t n = 0; n < count; n++)
-            {	
-                if(isValidFileName(*(tokens + n)) == false)
-                {
-                    // before any return, we need to free tokens, otherwise memory leakage
-                    for (size_t i = 0; i < count; i++)
-                    {
-                        free(*(tokens + i));
-                    }
-                    free(tokens);		
-                    return NULL;
-                }
-            }			
-        }		
-
-        // search along the path and find the deepest dir
-        size_t parent_inode_ID = 0;	// start from the 1st inode, ie., the inode for root directory
-        // first, let's find the parent dir
-        size_t indicator = 0;
-
-        inode_t * parent_inode = (inode_t *) calloc(1, sizeof(inode_t));
-        directoryFile_t * parent_data = (directoryFile_t *)calloc(1, BLOCK_SIZE_BYTES);
-        for(size_t i = 0; i < count; i++)
-        {
-            block_store_inode_read(fs->BlockStore_inode, parent_inode_ID, parent_inode);	// read out the parent inode
-            // in case file and dir has the same name. But from the test cases we can see, this case would not happen
-            if(parent_inode->fileType == 'd')
-            {			
-                block_store_read(fs->BlockStore_whole, parent_inode->directPointer[0], parent_data);
-                for(int j = 0; j < folder_number_entries; j++)
-                {
-                    if( ((parent_inode->vacantFile >> j) & 1) == 1 && strcmp((parent_data + j) -> filename, *(tokens + i)) == 0 )
-                    {
-                        parent_inode_ID = (parent_data + j) -> inodeNumber;
-                        indicator++;
-                    }					
-                }	
-            }					
-        }	
-        free(parent_data);
-        free(parent_inode);	
-
-        // now let's enumerate the files/dir in it
-        if(indicator == count)
-        {
-            inode_t * dir_inode = (inode_t *) calloc(1, sizeof(inode_t));
-            block_store_inode_read(fs->BlockStore_inode, parent_inode_ID, dir_inode);	// read out the file inode			
-            if(dir_inode->fileType == 'd')
-            {
-                // prepare the data to be read out
-                directoryFile_t * dir_data = (directoryFile_t *)calloc(1, BLOCK_SIZE_BYTES);
-                block_store_read(fs->BlockStore_whole, dir_inode->directPointer[0], dir_data);
-
-                // prepare the dyn_array to hold the data
-                dyn_array_t * dynArray = dyn_array_create(folder_number_entries, sizeof(file_record_t), NULL);
-
-                for(int j = 0; j < folder_number_entries; j++)
-                {
-                    if( ((dir_inode->vacantFile >> j) & 1) == 1 )
-                    {
-                        file_record_t* fileRec = (file_record_t *)calloc(1, sizeof(file_record_t));
-                        strcpy(fileRec->name, (dir_data + j) -> filename);
-
-                        // to know fileType of the member in this dir, we have to refer to its inode
-                        inode_t * member_inode = (inode_t *) calloc(1, sizeof(inode_t));
-                        block_store_inode_read(fs->BlockStore_inode, (dir_data + j) -> inodeNumber, member_inode);
-                        if(member_inode->fileType == 'd')
-                        {
-                            fileRec->type = FS_DIRECTORY;
-                        }
-                        else if(member_inode->fileType == 'f')
-                        {
-                            fileRec->type = FS_REGULAR;
-                        }
-
-                        // now insert the file record into the dyn_array
-                        dyn_array_push_front(dynArray, fileRec);
-                        free(fileRec);
-                        free(member_inode);
-                    }					
-                }
-                free(dir_data);
-                free(dir_inode);
-                // before any return, we need to free tokens, otherwise memory leakage
-                if(strlen(*tokens) == 0)
-                {
-                    // a spcial case: only a slash, no dir names
-                    count += 1;
-                }
-                for (size_t i = 0; i < count; i++)
-                {
-                    free(*(tokens + i));
-                }
-                free(tokens);	
-                return(dynArray);
-            }
-            free(dir_inode);
+        fs_enter(fs);
+        size_t inode_ID = 0;
+        char type = 0;
+        result = walk_path(fs, path, tokens, count, &inode_ID, &type);
+        if(result == 0 && type == 'r') {
+            result = frag_measure(fs, inode_ID, frag, &with_blocks);
         }
-        // before any return, we need to free tokens, otherwise memory leakage
-        if(strlen(*tokens) == 0)
-        {
-            // a spcial case: only a slash, no dir names
-            count += 1;
+        fs_leave(fs);
+        if(result < 0 || frag->files == 0) {
+            return -1;
         }
-        for (size_t i = 0; i < count; i++)
-        {
-            free(*(tokens + i));
+    }
+    else {
+        for(size_t inode_ID = 0; inode_ID < inode_capacity(fs) && result == 0; inode_ID++) {
+            fs_enter(fs);
+            result = frag_measure(fs, inode_ID, frag, &with_blocks);
+            fs_leave(fs);
         }
-        free(tokens);	
     }
-    return NULL;
+    frag_score(frag, with_blocks);
+    return result;
 }
-off_t fs_seek(FS_t *fs, int fd, off_t offset, seek_t whence)
+
+int fs_defrag(FS_t *fs, fs_defrag_t *pass, size_t max_blocks)
 {
     //PSEUDOCODE:
     /*
     first, error check all parameters to ensure all not null or invalid
-    next, check to make sure the file descriptor is valid, and that it points to a valid file
-    At this point, seeking can commence. We first look at the whence parameter to see where we start seeking from. 
-    If we're seeking from the current position, this can be recieved from the fd. Otherwise, we assume the beginning/end of file.
-    We then open up the inode of the given file. We know that each given block is 4096 bytes. So we first need to get to the correct block
-    This can be done by seeing the current position and doing modular division on it by 4096 to figure out which block to start in.
-    If this is greater than the 6th block, we will have to index into the indirect pointers. Once we know which block we start at, we seek by the offset.
-    If this offset is greater than one block, then we will need to identify the new block in the same way we did previously. We get to the ending block, and find the new position,
-    and finally return that offset. If we are at the EOF or BOF, we return that.
+    Inodes are visited from where the pass stopped, one per fs_enter, so exclusive callers and journal commits get in between.
+    A regular file is locked for writing, appends held back for it are written first, and its data runs are followed.
+    If it is in more than one run and no view is outstanding, one free run for its data and pointer blocks is taken near the
+    start of its group, the data is copied over, the map is switched and the old blocks are freed.
+    The call stops once max_blocks were moved, or at the end of the inode table.
     */
-    //error check fs
-    if(fs == NULL){
+    if(fs == NULL || pass == NULL) {
         return -1;
     }
-    //make sure we have valid fd
-    if(!block_store_sub_test(fs->BlockStore_fd, fd))
-    {
-        return -1;
+    size_t moved = 0;
+    while(pass->next_inode < inode_capacity(fs) && (max_blocks == 0 || moved < max_blocks)) {
+        size_t inode_ID = pass->next_inode++;
+        fs_enter(fs);
+        inode_lock(fs, inode_ID, true);
+        inode_t *inode = inode_get(fs, inode_ID);
+        if(inode != NULL && inode->fileType == 'r' && inode->linkCount != 0) {
+            file_flush_delayed(fs, inode);
+            defrag_map_t map;
+            if(defrag_map_load(fs, inode, &map) == 0) {
+                size_t blocks = defrag_file(fs, inode, &map);
+                if(blocks > 0) {
+                    moved += blocks;
+                    pass->files_moved++;
+                    pass->blocks_moved += blocks;
+                    journal_op_done(fs);
+                }
+            }
+            free(map.runs);
+        }
+        if(inode != NULL) {
+            inode_put(fs, inode);
+        }
+        inode_unlock(fs, inode_ID);
+        fs_leave(fs);
     }
-    //pull down file descriptor based on num given
-    fileDescriptor_t* fileDescr = calloc(1,sizeof(fileDescriptor_t));
-    if(fileDescr == NULL ) {
-        return -1;
+    return pass->next_inode < inode_capacity(fs) ? 1 : 0;
+}
+
+// asynchronous I/O: fs_submit queues requests in a ring and worker threads take them off it in batches. Each batch
+// is sorted by file and offset, so that requests for adjacent ranges of a file merge into runs carried out as one
+// vectored call, and the runs are then carried out in the order of the first physical block each touches, so a
+// batch walks the image in one direction. Completions go into a second ring until fs_poll collects them.
+// outstanding counts requests from fs_submit until their completion is collected and never exceeds FS_AIO_QUEUE,
+// so a worker always finds room in the completion ring.
+#define AIO_WORKERS 4
+#define AIO_BATCH 64
+
+struct aio {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;          // a request was queued, or the workers are to stop
+    pthread_cond_t completed;       // a completion was posted
+    fs_aio_request_t requests[FS_AIO_QUEUE];
+    size_t request_head;
+    size_t request_count;
+    fs_aio_completion_t completions[FS_AIO_QUEUE];
+    size_t completion_head;
+    size_t completion_count;
+    size_t outstanding;
+    bool stopping;                  // the workers finish what is queued and exit
+    size_t workers;                 // threads started, none before the first fs_submit
+    pthread_t threads[AIO_WORKERS];
+};
+
+typedef struct {
+    fs_aio_request_t request;
+    size_t index;           // position in the batch as taken off the ring, keeps equal requests in order
+    size_t inode_ID;        // file the descriptor is open on, SIZE_MAX if it isn't open or the request is malformed
+    size_t run;             // on the first request of a run, how many requests it merged
+    ssize_t result;
+} aio_item_t;
+
+// a run of a batch waiting to be carried out
+typedef struct {
+    size_t pblock;          // first physical block it touches, 0 for a hole
+    size_t first;           // its first request in the sorted batch
+} aio_run_t;
+
+static struct aio *aio_create(void)
+{
+    struct aio *a = calloc(1, sizeof(struct aio));
+    if(a == NULL) {
+        return NULL;
     }
-    size_t fd_bytes_read = block_store_fd_read(fs->BlockStore_fd,fd,fileDescr);
-    if(fd_bytes_read != sizeof(fileDescriptor_t) || fileDescr->inodeNum == 0) {
-        //if we read less than the # of bytes or the inode # is 0 (which should never happen), then we must have been given invalid fd.
-        free(fileDescr);
-        return -1;
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->queued, NULL);
+    pthread_cond_init(&a->completed, NULL);
+    return a;
+}
+
+// stop the workers once they have carried out every queued request, and throw away whatever wasn't collected.
+// Runs before fs_unmount takes the FS, since the workers need it to finish.
+static void aio_destroy(FS_t *fs)
+{
+    struct aio *a = fs->aio;
+    if(a == NULL) {
+        return;
     }
-    inode_t* fileInode = calloc(1, sizeof(inode_t));
-    if(fileInode == NULL) {
-        free(fileDescr);
-        return -1;
+    pthread_mutex_lock(&a->lock);
+    a->stopping = true;
+    pthread_cond_broadcast(&a->queued);
+    pthread_mutex_unlock(&a->lock);
+    for(size_t i = 0; i < a->workers; i++) {
+        pthread_join(a->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->queued);
+    pthread_cond_destroy(&a->completed);
+    free(a);
+    fs->aio = NULL;
+}
+
+// the inode an open descriptor refers to
+// \return its number, SIZE_MAX if fd isn't open
+static size_t fd_inode_ID(FS_t *fs, int fd)
+{
+    size_t inode_ID = SIZE_MAX;
+    pthread_mutex_lock(&fs->locks->fd_table);
+    if(fd >= 0 && (size_t)fd < fs->fd_table->capacity && fs->fd_table->files[fd].inode != NULL) {
+        inode_ID = ((cached_inode_t *)fs->fd_table->files[fd].inode)->inode_ID;
     }
-    //get inode we are writing to.
-    block_store_inode_read(fs->BlockStore_inode,fileDescr->inodeNum,fileInode);
-    if(offset == 0 && whence == FS_SEEK_CUR) {
-        //if no offset, just get current offset to return.
-        off_t current = fileDescr->locate_order*BLOCK_SIZE_BYTES + fileDescr->locate_offset;
-        free(fileDescr);
-        free(fileInode);
-        return current;
+    pthread_mutex_unlock(&fs->locks->fd_table);
+    return inode_ID;
+}
+
+static int aio_item_compare(const void *a, const void *b)
+{
+    const aio_item_t *x = (const aio_item_t *)a;
+    const aio_item_t *y = (const aio_item_t *)b;
+    if(x->inode_ID != y->inode_ID) {
+        return x->inode_ID < y->inode_ID ? -1 : 1;
     }
-    if(whence == FS_SEEK_CUR) {
-        if(offset < 0) {
-            //we need to make sure we are not going before BOF if this is the case.
-            off_t pos_offset = offset * -1;
-            uint16_t numblocks = pos_offset / BLOCK_SIZE_BYTES;
-            if(fileDescr->usage == 1) {
-                if(numblocks - fileDescr->locate_order < 0) {
-                    //going past beginning so set to 0 for each
-                    fileDescr->usage = 1;
-                    fileDescr->locate_order = 0;
-                    fileDescr->locate_offset = 0;
-                    block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-                    free(fileDescr);
-                    free(fileInode);
-                    return 0;
-                }
-                else if(fileDescr->locate_order == 0 && fileDescr->locate_offset - (pos_offset % BLOCK_SIZE_BYTES) < 0) {
-                    //going past beginning
-                    fileDescr->usage = 1;
-                    fileDescr->locate_order = 0;
-                    fileDescr->locate_offset = 0;
-                    block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-                    free(fileDescr);
-                    free(fileInode);
-                    return 0;
-                }
-            }
-            else if(fileDescr->usage == 2) {
-                if(numblocks - (fileDescr->locate_order + 6) < 0) {
-                    fileDescr->usage = 1;
-                    fileDescr->locate_order = 0;
-                    fileDescr->locate_offset = 0;
-                    block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-                    free(fileDescr);
-                    free(fileInode);
-                    return 0;
-                }
-            }
-            else {
-                if(numblocks - (fileDescr->locate_order + 6) < 0) {
-                    fileDescr->usage = 1;
-                    fileDescr->locate_order = 0;
-                    fileDescr->locate_offset = 0;
-                    block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-                    free(fileDescr);
-                    free(fileInode);
-                    return 0;
-                }
-            }
-            fileDescr->locate_order -= numblocks;
-            fileDescr->locate_offset -= (pos_offset % BLOCK_SIZE_BYTES);
-            if(fileDescr->locate_order > UINT16_MAX - BLOCK_SIZE_BYTES && fileDescr->usage > 1) {
-                if(fileDescr->usage == 2) {
-                    fileDescr->usage = 1;
-                }
-                else {
-                    fileDescr->usage = 2;
-                }
-                fileDescr->locate_order = 2048;
-            }
-            //if we wrap around due to negative overflow, then...
-            if(fileDescr->locate_offset > UINT16_MAX - BLOCK_SIZE_BYTES) {
-                //smaller than a block, so decrease block count by one and set to end of that block.
-                uint16_t offset_to_subtract = fileDescr->locate_offset * -1;
-                fileDescr->locate_order--;
-                fileDescr->locate_offset = BLOCK_SIZE_BYTES - offset_to_subtract;
+    if(x->request.op != y->request.op) {
+        return x->request.op < y->request.op ? -1 : 1;
+    }
+    if(x->request.offset != y->request.offset) {
+        return x->request.offset < y->request.offset ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static int aio_run_compare(const void *a, const void *b)
+{
+    const aio_run_t *x = (const aio_run_t *)a;
+    const aio_run_t *y = (const aio_run_t *)b;
+    if(x->pblock != y->pblock) {
+        return x->pblock < y->pblock ? -1 : 1;
+    }
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+// the physical block backing the start of a run, 0 for a hole or a descriptor that was closed meanwhile
+static size_t aio_run_block(FS_t *fs, const aio_item_t *item)
+{
+    size_t pblock = 0;
+    fs_enter(fs);
+    open_file_t *file = fd_acquire(fs, item->request.fd, false);
+    if(file != NULL) {
+        file_map_run(fs, file->inode, NULL, item->request.offset / BLOCK_SIZE_BYTES, 1, &pblock);
+        fd_release(fs, file->inode);
+    }
+    fs_leave(fs);
+    return pblock;
+}
+
+// carry out count requests merged into one run, like one fs_preadv or fs_pwritev, and split the result among them
+static void aio_run_execute(FS_t *fs, aio_item_t *items, size_t count)
+{
+    struct iovec iov[AIO_BATCH];
+    size_t total = 0;
+    for(size_t i = 0; i < count; i++) {
+        iov[i].iov_base = items[i].request.buffer;
+        iov[i].iov_len = items[i].request.nbyte;
+        total += items[i].request.nbyte;
+    }
+    bool write = items[0].request.op == FS_AIO_WRITE;
+    ssize_t done = -1;
+    fs_enter(fs);
+    if(write) {
+        fd_delay_make_room(fs, total);
+    }
+    open_file_t *file = fd_acquire(fs, items[0].request.fd, write);
+    if(file != NULL) {
+        inode_t *fileInode = file->inode;
+        file_flush_delayed(fs, fileInode);
+        if(write) {
+            done = file_writev_at(fs, fileInode, NULL, items[0].request.offset, iov, count, total);
+            if(total > 0) {
+                inode_mark_dirty(fileInode);
             }
         }
         else {
-            //going forward in file from current pos.
-            uint16_t numblocks = offset / BLOCK_SIZE_BYTES;
-            fileDescr->locate_order += numblocks;
-            fileDescr->locate_offset += (offset % BLOCK_SIZE_BYTES);
-            if(fileDescr->locate_order > 2048 && fileDescr->usage < 4) {
-                if(fileDescr->usage == 2) {
-                    fileDescr->usage = 4;
-                    fileDescr->locate_order -= 2048 + 6;
-                }
-                else {
-                    fileDescr->usage = 2;
-                    fileDescr->locate_order -= 6;
-                }
-                if(fileDescr->locate_order > 2048 + 6  && fileDescr->usage == 2) {
-                    fileDescr->usage = 4;
-                    fileDescr->locate_order -= 2048;
-                }
-            }
-            if(fileDescr->locate_offset > BLOCK_SIZE_BYTES) {
-                fileDescr->locate_order++;
-                fileDescr->locate_offset -= BLOCK_SIZE_BYTES;
-            }
+            done = file_readv_at(fs, fileInode, NULL, items[0].request.offset, iov, count, total);
         }
+        fd_release(fs, fileInode);
     }
-    else if(whence == FS_SEEK_SET) {
-        if(offset < 0) {
-            //can't have negative offset when setting, as we will go before BOF.
-            free(fileDescr);
-            free(fileInode);
-            return 0;
-        }
-        fileDescr->locate_offset = offset%BLOCK_SIZE_BYTES;
-        if(offset / BLOCK_SIZE_BYTES < 6) {
-            //we are within direct pointer
-            fileDescr->usage = 1;
-            fileDescr->locate_order = offset/BLOCK_SIZE_BYTES;
-        }
-        else if(offset / BLOCK_SIZE_BYTES < 2048 + 6) {
-            //within indirect
-            fileDescr->usage = 2;
-            fileDescr->locate_order = (offset/BLOCK_SIZE_BYTES) - 6;
+    fs_leave(fs);
+    for(size_t i = 0; i < count; i++) {
+        if(done < 0) {
+            items[i].result = -1;
         }
         else {
-            //within double indirect
-            fileDescr->usage = 4;
-            fileDescr->locate_order = (offset/BLOCK_SIZE_BYTES) - 6;
-
+            items[i].result = (size_t)done < items[i].request.nbyte ? done : (ssize_t)items[i].request.nbyte;
+            done -= items[i].result;
         }
     }
-    else if(whence == FS_SEEK_END) {
-        if(offset > 0) {
-            //can't go past eof
-            free(fileDescr);
-            free(fileInode);
-            return 0;
-        }
-        off_t pos_offset = offset * -1;
-        uint16_t numblocks = pos_offset / BLOCK_SIZE_BYTES;
-        fileDescr->locate_order -= numblocks;
-        fileDescr->locate_offset -= (pos_offset % BLOCK_SIZE_BYTES);
-        if(fileDescr->locate_order > UINT16_MAX - BLOCK_SIZE_BYTES && fileDescr->usage > 1) {
-            if(fileDescr->usage == 2) {
-                fileDescr->usage = 1;
-            }
-            else {
-                fileDescr->usage = 2;
+}
+
+// carry out a batch taken off the request ring and post its completions
+static void aio_run_batch(FS_t *fs, aio_item_t *items, size_t count)
+{
+    struct aio *a = fs->aio;
+    for(size_t i = 0; i < count; i++) {
+        const fs_aio_request_t *r = &items[i].request;
+        items[i].index = i;
+        items[i].result = -1;
+        bool valid = (r->op == FS_AIO_READ || r->op == FS_AIO_WRITE) && r->buffer != NULL && r->offset >= 0;
+        items[i].inode_ID = valid ? fd_inode_ID(fs, r->fd) : SIZE_MAX;
+    }
+    qsort(items, count, sizeof(aio_item_t), aio_item_compare);
+    //adjacent ranges of the same file going the same way make up a run
+    aio_run_t runs[AIO_BATCH];
+    size_t run_count = 0;
+    for(size_t i = 0; i < count; ) {
+        size_t j = i + 1;
+        if(items[i].inode_ID != SIZE_MAX) {
+            while(j < count && items[j].inode_ID == items[i].inode_ID && items[j].request.op == items[i].request.op
+                    && items[j].request.offset == items[j - 1].request.offset + (off_t)items[j - 1].request.nbyte) {
+                j++;
             }
-            fileDescr->locate_order = 2048;
-        }
-        //if we wrap around due to negative overflow, then...
-        if(fileDescr->locate_offset > UINT16_MAX - BLOCK_SIZE_BYTES) {
-            //smaller than a block, so decrease block count by one and set to end of that block.
-            uint16_t offset_to_subtract = fileDescr->locate_offset * -1;
-            fileDescr->locate_order--;
-            fileDescr->locate_offset = BLOCK_SIZE_BYTES - offset_to_subtract;
+            runs[run_count].pblock = aio_run_block(fs, &items[i]);
+            runs[run_count].first = i;
+            run_count++;
         }
+        items[i].run = j - i;
+        i = j;
     }
-    else {
-        //invalid whence, free & return error.
-        free(fileDescr);
-        free(fileInode);
-        return -1;
-    }
-    //need to see if we went past EOF so set the offset to -1 to the most recent writable bit
-    if(fileDescr->usage == 4 && (fileDescr->locate_order+6+2048) > 65000) {
-        //very close to EOF, so decreement by 1.
-        fileDescr->locate_order--;
-        fileDescr->locate_offset = BLOCK_SIZE_BYTES - 1;
-    }
-    //write back file descr when done
-    off_t from_beginning = 0;
-    if(fileDescr->usage == 1){
-        from_beginning = fileDescr->locate_order*BLOCK_SIZE_BYTES + fileDescr->locate_offset;
+    qsort(runs, run_count, sizeof(aio_run_t), aio_run_compare);
+    for(size_t i = 0; i < run_count; i++) {
+        aio_run_execute(fs, items + runs[i].first, items[runs[i].first].run);
     }
-    else if(fileDescr->usage == 2) {
-        from_beginning = (fileDescr->locate_order+6)*BLOCK_SIZE_BYTES + fileDescr->locate_offset;
+    pthread_mutex_lock(&a->lock);
+    for(size_t i = 0; i < count; i++) {
+        fs_aio_completion_t *c = &a->completions[(a->completion_head + a->completion_count++) % FS_AIO_QUEUE];
+        c->tag = items[i].request.tag;
+        c->result = items[i].result;
     }
-    else {
-        from_beginning = (fileDescr->locate_order+6+2048)*BLOCK_SIZE_BYTES + fileDescr->locate_offset;
+    pthread_cond_broadcast(&a->completed);
+    pthread_mutex_unlock(&a->lock);
+}
+
+static void *aio_worker(void *arg)
+{
+    FS_t *fs = (FS_t *)arg;
+    struct aio *a = fs->aio;
+    aio_item_t items[AIO_BATCH];
+    for(;;) {
+        pthread_mutex_lock(&a->lock);
+        while(a->request_count == 0 && !a->stopping) {
+            pthread_cond_wait(&a->queued, &a->lock);
+        }
+        if(a->request_count == 0) {
+            pthread_mutex_unlock(&a->lock);
+            return NULL;
+        }
+        //leave some for the other workers when there is plenty
+        size_t count = a->request_count < AIO_BATCH ? a->request_count : AIO_BATCH;
+        for(size_t i = 0; i < count; i++) {
+            items[i].request = a->requests[a->request_head];
+            a->request_head = (a->request_head + 1) % FS_AIO_QUEUE;
+        }
+        a->request_count -= count;
+        pthread_mutex_unlock(&a->lock);
+        aio_run_batch(fs, items, count);
     }
-    block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-    free(fileDescr);
-    free(fileInode);
-    return from_beginning;
 }
 
-ssize_t fs_read(FS_t *fs, int fd, void *dst, size_t nbyte)
+ssize_t fs_submit(FS_t *fs, const fs_aio_request_t *requests, size_t count)
 {
     //PSEUDOCODE:
     /*
     first, error check all parameters to ensure all not null or invalid
-    next, check to make sure the file descriptor is valid, and that it points to a valid file
-    At this point, reading can commence. We start at the start at the given block/offset indicated by the fd.
-    We read nbytes into a buffer of size nbytes. If we run to the end of a block, we grab the next block and continue reading.
-    If we run into eof, we stop and return what we have. We finally return what was written to the buffer.
+    next, start the worker pool if this is the first request. Requests themselves are checked by the workers, a bad one
+    simply completes with an error.
+    As many requests as there is room for are copied into the request ring, and the workers are woken up to take them.
+    We return how many were queued, so the caller can collect completions and submit the rest later.
     */
-    //error check parameters
-    if(fs == NULL || dst == NULL) {
-        return -1;
-    }
-    //check and make sure the fd is valid
-    if(!block_store_sub_test(fs->BlockStore_fd, fd))
-    {
-        return -1;
-    }
-    //pull down file descriptor based on num given
-    fileDescriptor_t* fileDescr = calloc(1,sizeof(fileDescriptor_t));
-    if(fileDescr == NULL ) {
+    if(fs == NULL || fs->aio == NULL || (requests == NULL && count != 0)) {
         return -1;
     }
-    size_t fd_bytes_read = block_store_fd_read(fs->BlockStore_fd,fd,fileDescr);
-    if(fd_bytes_read != sizeof(fileDescriptor_t) || fileDescr->inodeNum == 0) {
-        //if we read less than the # of bytes or the inode # is 0 (which should never happen), then we must have been given invalid fd.
-        free(fileDescr);
-        return -1;
+    struct aio *a = fs->aio;
+    pthread_mutex_lock(&a->lock);
+    while(a->workers < AIO_WORKERS && pthread_create(&a->threads[a->workers], NULL, aio_worker, fs) == 0) {
+        a->workers++;
     }
-    inode_t* fileInode = calloc(1, sizeof(inode_t));
-    if(fileInode == NULL) {
-        free(fileDescr);
+    if(a->workers == 0) {
+        pthread_mutex_unlock(&a->lock);
         return -1;
     }
-    //get inode we are writing to.
-    block_store_inode_read(fs->BlockStore_inode,fileDescr->inodeNum,fileInode);
-    void* current_block = calloc(1,BLOCK_SIZE_BYTES);
-    size_t bytes_read = 0;
-    for(bytes_read = 0; bytes_read != nbyte;) {
-        uint16_t block_index = 0;
-        block_index = fileDescr->locate_order;
-        if(fileDescr->usage == 1) {
-            //using direct
-            if(fileInode->directPointer[block_index] == 0) {
-                //can't read empty block, error somewhere, so indicate that.
-                free(fileDescr);
-                free(fileInode);
-                free(current_block);
-                return -1;
-            }
-            block_store_read(fs->BlockStore_whole,fileInode->directPointer[block_index],current_block);
-        }
-        else if(fileDescr->usage == 2) {
-            if(fileInode->indirectPointer[0] == 0) {
-                //can't read empty block, error somewhere, so indicate that.
-                free(fileDescr);
-                free(fileInode);
-                free(current_block);
-                return -1;
-            }
-            uint16_t indirectArr[2048] = {0};
-            block_store_read(fs->BlockStore_whole,fileInode->indirectPointer[0],indirectArr);
-            block_store_read(fs->BlockStore_whole,indirectArr[block_index],current_block);
-        }
-        else {
-            //double indirect
-            if(fileInode->doubleIndirectPointer == 0) {
-                //can't read empty block, error somewhere, so indicate that.
-                free(fileDescr);
-                free(fileInode);
-                free(current_block);
-                return -1;
-            }
-            uint16_t doubleIndirectArr[2048] = {0};
-            block_store_read(fs->BlockStore_whole,fileInode->indirectPointer[0],doubleIndirectArr);
-            uint16_t indirectArr[2048] = {0};
-            //not sure if this is right...
-            block_store_read(fs->BlockStore_whole,block_index / 2048,indirectArr);
-            block_store_read(fs->BlockStore_whole,indirectArr[block_index % 2048], current_block);
-        }
-        if(fileDescr->locate_offset != 0) {
-            //cursor within a block, so let's just scan to the end of the block
-            uint16_t loc = nbyte - bytes_read;
-            if(loc < (BLOCK_SIZE_BYTES - fileDescr->locate_offset)) {
-                //staying within current block this read.
-                memcpy((bytes_read + dst),(current_block + fileDescr->locate_offset),nbyte-bytes_read);
-                fileDescr->locate_offset = nbyte-bytes_read;
-                bytes_read += nbyte-bytes_read;
-            }
-            else {
-                //reading to end of block
-                size_t bytes_to_read_this_iter = BLOCK_SIZE_BYTES - fileDescr->locate_offset;
-                memcpy((bytes_read + dst), (current_block + fileDescr->locate_offset), bytes_to_read_this_iter);
-                bytes_read += bytes_to_read_this_iter;
-                //now need to increment locate_order & set locate_offset to 0
-                fileDescr->locate_order++;
-                fileDescr->locate_offset = 0;
-            }
-        }
-        else {
-            //cursor at start of block, so let's read to tne end of the block, or if we're almost done, we read to nbyte
-            if(nbyte - bytes_read < BLOCK_SIZE_BYTES) {
-                //reading less than a block
-                memcpy((bytes_read+ dst),(current_block),nbyte-bytes_read);
-                fileDescr->locate_offset = nbyte-bytes_read;
-                bytes_read += nbyte-bytes_read;
-            }
-            else {
-                //reading a block
-                memcpy((bytes_read+dst),current_block,BLOCK_SIZE_BYTES);
-                fileDescr->locate_order++;
-                bytes_read += BLOCK_SIZE_BYTES;
-            }
-        }
-        if(fileDescr->locate_order == 6 && fileDescr->usage == 1) {
-            //need to go up to indirect blocks
-            fileDescr->locate_order = 0;
-            fileDescr->usage = 2;
-        }
-        else if(fileDescr->locate_order == 2048 && fileDescr->usage == 2) {
-            //go up to double indirect
-            fileDescr->locate_order = 0;
-            fileDescr->usage = 4;
-        }
+    size_t room = FS_AIO_QUEUE - a->outstanding;
+    size_t queued = count < room ? count : room;
+    for(size_t i = 0; i < queued; i++) {
+        a->requests[(a->request_head + a->request_count++) % FS_AIO_QUEUE] = requests[i];
     }
-    //now just update fileDescr & free temp space
-    block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-    free(fileInode);
-    free(fileDescr);
-    free(current_block);
-    return bytes_read;
-}
-size_t findFirstDoubleOpen(uint16_t* doubleIndirectPtrArr) {
-    for(int i = 0; i < 2048; i++) {
-        //we will run out of blocks before we hit the end of this array, so its okay to check i+1
-        if(doubleIndirectPtrArr[i+1]==0) {
-            return i;
-        }
+    a->outstanding += queued;
+    if(queued > 0) {
+        pthread_cond_broadcast(&a->queued);
     }
-    return 0;
+    pthread_mutex_unlock(&a->lock);
+    return queued;
 }
-ssize_t fs_write(FS_t *fs, int fd, const void *src, size_t nbyte)
+
+ssize_t fs_poll(FS_t *fs, fs_aio_completion_t *completions, size_t max, bool wait)
 {
     //PSEUDOCODE:
     /*
     first, error check all parameters to ensure all not null or invalid
-    next, check to make sure the file descriptor is valid, and that it points to a valid file
-    At this point, writing can commence. We start at the start at the given block/offset indicated by the fd.
-    We write nbytes into the given block starting at the given offset using the given src. If we run to the end of a block, we ask for another block, update the inode and continue writing.
-    If we run out of blocks return an error, we stop and return what we have. We finally return what was how many bytes were written.
+    next, if asked to wait, sleep until a worker posts a completion, unless nothing is outstanding that could ever complete.
+    Up to max completions are then copied out of the completion ring, oldest first, which also frees their room for fs_submit.
     */
-    //error check parameters
-    if(fs == NULL || src == NULL) {
+    if(fs == NULL || fs->aio == NULL || (completions == NULL && max != 0)) {
         return -1;
     }
-    //check and make sure the fd is valid
-    if(!block_store_sub_test(fs->BlockStore_fd, fd))
-    {
-        return -1;
+    struct aio *a = fs->aio;
+    pthread_mutex_lock(&a->lock);
+    while(wait && max != 0 && a->completion_count == 0 && a->outstanding > 0) {
+        pthread_cond_wait(&a->completed, &a->lock);
     }
-    //pull down file descriptor based on num given
-    fileDescriptor_t* fileDescr = calloc(1,sizeof(fileDescriptor_t));
-    if(fileDescr == NULL ) {
-        return -1;
+    size_t collected = max < a->completion_count ? max : a->completion_count;
+    for(size_t i = 0; i < collected; i++) {
+        completions[i] = a->completions[a->completion_head];
+        a->completion_head = (a->completion_head + 1) % FS_AIO_QUEUE;
     }
-    size_t fd_bytes_read = block_store_fd_read(fs->BlockStore_fd,fd,fileDescr);
-    if(fd_bytes_read != sizeof(fileDescriptor_t) || fileDescr->inodeNum == 0) {
-        //if we read less than the # of bytes or the inode # is 0 (which should never happen), then we must have been given invalid fd.
-        free(fileDescr);
-        return -1;
+    a->completion_count -= collected;
+    a->outstanding -= collected;
+    pthread_mutex_unlock(&a->lock);
+    return collected;
+}
+
+// drop the name name -> child_ID from a directory, and free the child along with it when that was its last name.
+// The caller holds the directory's lock for writing, and the rename lock if the child is a directory.
+// \return 0 on success, -1 if the child is a directory that isn't empty or a file with views outstanding
+static int dir_unlink(FS_t *fs, size_t parent_ID, inode_t *parent_inode, const char *name, size_t name_len, size_t child_inode_ID, char child_type)
+{
+    int found = 0;
+    //a directory linked into itself is its own parent, and already locked
+    bool own_parent = child_inode_ID == parent_ID;
+    if(!own_parent) {
+        inode_lock(fs, child_inode_ID, true);
     }
-    inode_t* fileInode = calloc(1, sizeof(inode_t));
-    if(fileInode == NULL) {
-        free(fileDescr);
-        return -1;
+    inode_t * child_inode = (inode_t *) calloc(1, sizeof(inode_t));
+    inode_read(fs, child_inode_ID, child_inode);	// read out the child inode
+    if(child_inode->fileType == 'd' && child_inode->vacantFile != 0) {
+        //not vacant, so can't be removed, indicate error.
+        found = -1;
     }
-    //get inode we are writing to.
-    block_store_inode_read(fs->BlockStore_inode,fileDescr->inodeNum,fileInode);
-
-    //array for double indirect, holding pointers to indirect block & indirect array
-    //uint16_t doubleIndirectPtrArr[2048] = {0};
-    uint16_t indirectPtrArr[2048] = {0};
-    if(nbyte == 0) {
-        //if we aren't writing at all, just return at this point. Don't need to update anything but overwrite inode just in case.
-        block_store_inode_write(fs->BlockStore_inode,fileDescr->inodeNum,fileInode);
-        free(fileInode);
-        free(fileDescr);
-        return 0;
+    else if(child_inode->linkCount > 1) {
+        //other names still lead to it, so only this one goes
+        dir_remove_entry(fs, parent_inode, name, name_len);
+        inode_read(fs, child_inode_ID, child_inode);
+        child_inode->linkCount--;
+        inode_write(fs, child_inode_ID, child_inode);
+        dcache_insert(fs->dcache, parent_ID, name, name_len, DCACHE_NEGATIVE, 0);
+        found = 1;
     }
-    //get temp buffer that allows each block's data to be written individually
-    void* tempBuffer = calloc(1, BLOCK_SIZE_BYTES);
-    //pointer blocks setup now if needed, now we just loop through data and write to it
-    //at this point, we passed all error checking, so if we allocate a block and it fails, we are out of space, so return bytes written.
-    size_t bytes_written = 0;
-    for(bytes_written = 0; bytes_written != nbyte;) {
-        //if offset is already advanced into current block, then we might not need another block
-        if(fileDescr->locate_offset == 0) {
-            //need new block allocated since offset is 0
-            size_t block_num = 0;
-            if(fileDescr->usage ==1) {
-                //we know we are still using direct ptr blocks, so find open block.
-                int count;
-                for(count = 0; count < 6; count++) {
-                    if(fileInode->directPointer[count] == 0) {
-                        break;
-                    }
-                }
-                //found space in direct ptr
-                block_num = block_store_allocate(fs->BlockStore_whole);
-                fileInode->directPointer[count] = block_num;
-                if (block_num == SIZE_MAX) {
-                    //uh oh error, ran out of blocks, so free everything, and write back what was done so far.
-                    //write updated inode back to bs
-                    block_store_inode_write(fs->BlockStore_inode,fileDescr->inodeNum,fileInode);
-                    free(fileInode);
-                    fileInode = NULL;
-                    block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-                    free(fileDescr);
-                    free(tempBuffer);
-                    return bytes_written;
-                }
-
-            }
-            else if(fileDescr->usage == 2) {
-                //using indirect
-                block_store_read(fs->BlockStore_whole,fileInode->indirectPointer[0],indirectPtrArr);
-                int indirect_block_array_num = 0;
-                for(indirect_block_array_num = 0; indirect_block_array_num < 2048; indirect_block_array_num++) {
-                    //look for open spot in indirectArr
-                    if(indirectPtrArr[indirect_block_array_num] == 0) {
-                        break;
-                    }
-                }
-                    block_num = block_store_allocate(fs->BlockStore_whole);
-                    if(block_num == SIZE_MAX) {
-                        //write updated inode back to bs
-                        //uh oh error, ran out of blocks, so free everything, and write back what was done so far.
-                        block_store_inode_write(fs->BlockStore_inode,fileDescr->inodeNum,fileInode);
-                        free(fileInode);
-                        fileInode = NULL;
-                        block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-                        free(fileDescr);
-                        free(tempBuffer);
-                        return bytes_written;
-                    }
-                    //set pointer in array, write back to block
-                    indirectPtrArr[indirect_block_array_num] = block_num;
-                    block_store_write(fs->BlockStore_whole,fileInode->indirectPointer[0],indirectPtrArr);
-            }
-            else {
-                //writing to double indirect
-                uint16_t doubleIndirectArr[2048];
-                block_store_read(fs->BlockStore_whole,fileInode->doubleIndirectPointer,doubleIndirectArr);
-                int double_indirect_block_array_num = 0;
-                for(double_indirect_block_array_num = 0; double_indirect_block_array_num < 2048; double_indirect_block_array_num++) {
-                    //look for edge occupied spot in double_indirectArr
-                    if(doubleIndirectArr[double_indirect_block_array_num] != 0 && doubleIndirectArr[double_indirect_block_array_num+1] == 0) {
-                        break;
-                    }
-                }
-                //now read given indirect at block num
-                block_store_read(fs->BlockStore_whole,doubleIndirectArr[double_indirect_block_array_num],indirectPtrArr);
-                int indirect_block_array_num = 0;
-                for(indirect_block_array_num = 0; indirect_block_array_num < 2048; indirect_block_array_num++) {
-                    //look for open spot in indirectArr
-                    if(indirectPtrArr[indirect_block_array_num] == 0) {
-                        break;
-                    }
-                }
-                if(indirect_block_array_num == 2048) {
-                    //out of space in given block, so let's allocate space in the next
-                    size_t next_block = block_store_allocate(fs->BlockStore_whole);
-                    uint16_t* blank_indirect = calloc(2048,sizeof(uint16_t));
-                    if(next_block == SIZE_MAX) {
-                        //write updated inode back to bs
-                        //uh oh error, ran out of blocks, so free everything, and write back what was done so far.
-                        block_store_inode_write(fs->BlockStore_inode,fileDescr->inodeNum,fileInode);
-                        free(fileInode);
-                        fileInode = NULL;
-                        block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-                        free(fileDescr);
-                        free(tempBuffer);
-                        return bytes_written;
-                    }
-                    doubleIndirectArr[double_indirect_block_array_num+1] = next_block;
-                    //write back changes
-                    block_store_write(fs->BlockStore_whole,fileInode->doubleIndirectPointer,doubleIndirectArr);
-                    block_store_write(fs->BlockStore_whole,next_block,blank_indirect);
-                    free(blank_indirect);
-                    //restart this loop iteration
-                    continue;
-                }
-                //we found space, so lets allocate it.
-                block_num = block_store_allocate(fs->BlockStore_whole);
-                if(block_num == SIZE_MAX) {
-                    //write updated inode back to bs
-                    //uh oh error, ran out of blocks, so free everything, and write back what was done so far.
-                    block_store_inode_write(fs->BlockStore_inode,fileDescr->inodeNum,fileInode);
-                    free(fileInode);
-                    fileInode = NULL;
-                    block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-                    free(fileDescr);
-                    free(tempBuffer);
-                    return bytes_written;
-                }
-                //set pointer in array, write back to block
-                indirectPtrArr[indirect_block_array_num] = block_num;
-                block_store_write(fs->BlockStore_whole,doubleIndirectArr[double_indirect_block_array_num],indirectPtrArr);
-            }
-            //actually write to block
-            if(nbyte - bytes_written < BLOCK_SIZE_BYTES) {
-                //writing to less than block
-                memcpy(tempBuffer,(src+bytes_written),nbyte-bytes_written);
-                //now update fd
-                fileDescr->locate_offset += nbyte-bytes_written;
-                bytes_written += nbyte-bytes_written;
-            }
-            else {
-                //writing to whole block
-                memcpy(tempBuffer,(src+bytes_written),BLOCK_SIZE_BYTES);
-                fileDescr->locate_order++;
-                bytes_written += BLOCK_SIZE_BYTES;
-            }
-            //actually physically write to given block
-            block_store_write(fs->BlockStore_whole, block_num, tempBuffer);
+    else if(child_inode->fileType != 'd' && inode_viewed(fs, child_inode_ID)) {
+        //its blocks can't be given back while views point at them
+        found = -1;
+    }
+    else if(child_inode->fileType == 'd') {
+        //the directory is empty, checked by its vacancy above
+        //drop the entry from the parent, which writes the parent inode back
+        dir_remove_entry(fs, parent_inode, name, name_len);
+        //finally we can free the child's blocks & all associated data. If it was set to vacant, it still might have a directory file or index left over
+        dir_release(fs, child_inode);
+    }
+    else {
+        //dealing with file then...
+        //since it's a file, we need to go through its block map & free all associated data back, pointer blocks included.
+        fd_delay_discard(fs, child_inode_ID);
+        file_release(fs, child_inode, 0);
+        fd_map_forget(fs, child_inode_ID);
+        //finished freeing all blocks associated with file. Now we just free the file itself.
+        dir_remove_entry(fs, parent_inode, name, name_len);
+        //descriptors still open on it see an empty file
+        child_inode->fileSize = 0;
+    }
+    if(found == 0) {
+        //calls that found the inode before it went away check this once they have it locked
+        child_inode->linkCount = 0;
+        inode_write(fs, child_inode_ID, child_inode);
+        //block should now be empty, so we can free it.
+        inode_free(fs, child_inode_ID);
+        //the name is gone, and nothing can be cached under a dead directory anymore
+        dcache_insert(fs->dcache, parent_ID, name, name_len, DCACHE_NEGATIVE, 0);
+        if(child_type == 'd') {
+            dcache_purge_parent(fs->dcache, child_inode_ID);
         }
-        else {
-            //lets just write as much as we can to this existing block based on offset
-            void* current_block = calloc(1,BLOCK_SIZE_BYTES);
-            uint16_t block_index = 0;
-            uint16_t block_id = 0;
-            block_index = fileDescr->locate_order;
-            if(fileDescr->usage == 1) {
-                //using direct
-                if(fileInode->directPointer[block_index] == 0) {
-                    //can't read empty block, error somewhere, so indicate that.
-                    free(fileDescr);
-                    free(fileInode);
-                    free(current_block);
-                    return -1;
-                }
-                block_id = fileInode->directPointer[block_index];
-                block_store_read(fs->BlockStore_whole,fileInode->directPointer[block_index],current_block);
-            }
-            else if(fileDescr->usage == 2) {
-                if(fileInode->indirectPointer[0] == 0) {
-                    //can't read empty block, error somewhere, so indicate that.
-                    free(fileDescr);
-                    free(fileInode);
-                    free(current_block);
-                    return -1;
-                }
-                uint16_t indirectArr[2048] = {0};
-                block_store_read(fs->BlockStore_whole,fileInode->indirectPointer[0],indirectArr);
-                block_id = indirectArr[block_index];
-                block_store_read(fs->BlockStore_whole,indirectArr[block_index],current_block);
-            }
-            else {
-                //double indirect
-                if(fileInode->doubleIndirectPointer == 0) {
-                    //can't read empty block, error somewhere, so indicate that.
-                    free(fileDescr);
-                    free(fileInode);
-                    free(current_block);
-                    return -1;
-                }
-                uint16_t doubleIndirectArr[2048] = {0};
-                block_store_read(fs->BlockStore_whole,fileInode->indirectPointer[0],doubleIndirectArr);
-                uint16_t indirectArr[2048] = {0};
-                block_store_read(fs->BlockStore_whole,block_index / 2048,indirectArr);
-                block_id = indirectArr[block_index % 2048];
-                block_store_read(fs->BlockStore_whole,indirectArr[block_index % 2048], current_block);
-            }
-            //we have current block, lets just write data all the way to the end of it.
-            uint16_t loc = nbyte - bytes_written;
-            if(loc < (BLOCK_SIZE_BYTES - fileDescr->locate_offset)) {
-                //staying within current block this write.
-                memcpy( (current_block + fileDescr->locate_offset),(bytes_written + src),nbyte-bytes_written);
-                fileDescr->locate_offset = nbyte-bytes_written;
-                bytes_written += nbyte-bytes_written;
-            }
-            else {
-                //writing to end of block
-                size_t bytes_to_write_this_iter = BLOCK_SIZE_BYTES - fileDescr->locate_offset;
-                memcpy( (current_block + fileDescr->locate_offset),(bytes_written + src),bytes_to_write_this_iter);
-                bytes_written += bytes_to_write_this_iter;
-                //now need to increment locate_order & set locate_offset to 0
-                fileDescr->locate_order++;
-                fileDescr->locate_offset = 0;
-            }
-            //write back block
-            block_store_write(fs->BlockStore_whole,block_id,current_block);
-            free(current_block);
-        }
-        if(fileDescr->locate_order == 6 && fileDescr->usage == 1) {
-            //need to go up to indirect blocks, so let's allocate space for indirect
-            uint16_t blank_indirect[2048] = {0};
-            size_t indirect_block = block_store_allocate(fs->BlockStore_whole);
-            if(indirect_block == SIZE_MAX) {
-                //write updated inode back to bs
-                //uh oh error, ran out of blocks, so free everything, and write back what was done so far.
-                block_store_inode_write(fs->BlockStore_inode,fileDescr->inodeNum,fileInode);
-                free(fileInode);
-                fileInode = NULL;
-                block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-                free(fileDescr);
-                free(tempBuffer);
-                return bytes_written;
-            }
-            fileInode->indirectPointer[0] = indirect_block;
-            block_store_write(fs->BlockStore_whole,indirect_block,blank_indirect);
-            fileDescr->locate_order = 0;
-            fileDescr->usage = 2;
-        }
-        else if(fileDescr->locate_order == 2048 && fileDescr->usage == 2) {
-            //go up to double indirect
-            //need to go up to indirect blocks, so let's allocate space for indirect
-            uint16_t blank_double_indirect[2048] = {0};
-            size_t double_indirect_block = block_store_allocate(fs->BlockStore_whole);
-            if(double_indirect_block == SIZE_MAX) {
-                //write updated inode back to bs
-                //uh oh error, ran out of blocks, so free everything, and write back what was done so far.
-                block_store_inode_write(fs->BlockStore_inode,fileDescr->inodeNum,fileInode);
-                free(fileInode);
-                fileInode = NULL;
-                block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-                free(fileDescr);
-                free(tempBuffer);
-                return bytes_written;
-            }
-            fileInode->doubleIndirectPointer = double_indirect_block;
-            //allocate space for indirect block as well
-            uint16_t blank_indirect[2048] = {0};
-            size_t indirect_block = block_store_allocate(fs->BlockStore_whole);
-            if(indirect_block == SIZE_MAX) {
-                //write updated inode back to bs
-                //uh oh error, ran out of blocks, so free everything, and write back what was done so far.
-                block_store_inode_write(fs->BlockStore_inode,fileDescr->inodeNum,fileInode);
-                free(fileInode);
-                fileInode = NULL;
-                block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-                free(fileDescr);
-                free(tempBuffer);
-                return bytes_written;
-            }
-            blank_double_indirect[0] = indirect_block;
-            block_store_write(fs->BlockStore_whole,indirect_block,blank_indirect);
-            block_store_write(fs->BlockStore_whole,double_indirect_block,blank_double_indirect);
-            fileDescr->locate_order = 0;
-            fileDescr->usage = 4;
-        }
-    }
-
-    //wrote everything back, so we can update everything and return how many bytes we wrote.
-    //write updated inode back to bs
-    block_store_inode_write(fs->BlockStore_inode,fileDescr->inodeNum,fileInode);
-    free(fileInode);
-    fileInode = NULL;
-    //fileDescr->locate_order = numOfBlocksToWrite;
-    //fileDescr->locate_offset = nbyte % BLOCK_SIZE_BYTES;
-    block_store_fd_write(fs->BlockStore_fd,fd,fileDescr);
-    free(fileDescr);
-    free(tempBuffer);
-    return bytes_written;
+    }
+    if(!own_parent) {
+        inode_unlock(fs, child_inode_ID);
+    }
+    free(child_inode);
+    return found < 0 ? -1 : 0;
 }
 
 int fs_remove(FS_t *fs, const char *path)
@@ -1375,7 +6285,7 @@ int fs_remove(FS_t *fs, const char *path)
     first, error check all parameters to ensure all are valid
     next, check if path exists already (i.e. make sure file/dir already exists). Return an error if it doesn't exist
     Verify that if this is a directory, that its vacant file is set to 0 to indicate it is empty, return an error if it is not empty.
-    We also need to verify that the link count is set to one, as we can't delete a file/dir that is referenced elsewhere.
+    We also need to check the link count: if the file/dir is referenced elsewhere, only this name is dropped and the count goes down by one.
     After this, we know we can delete. We first will close any open descriptors. This will involve going through all open descriptors, checking the inode #, and if it matches
     the inode number that we are about to delete, we close that fd.
     If this is a file, we first go through any direct pointer/indrect pointer and free those blocks that are referenced.
@@ -1384,503 +6294,198 @@ int fs_remove(FS_t *fs, const char *path)
     if(fs == NULL || path == NULL) {
         return -1;
     }
-    char* copy_path = (char*)calloc(1, 65535);
-    strcpy(copy_path, path);
-    char** tokens;		// tokens are the directory names along the path. The last one is the name for the new file or dir
+    path_span_t tokens[FS_PATH_MAX_DEPTH];		// tokens are the directory names along the path. The last one is the name for the new file or dir
     size_t count = 0;
-    tokens = str_split(copy_path, '/', &count);
-    free(copy_path);
-    if(tokens == NULL)
+    if(path_tokenize(path, tokens, &count) < 0 || count == 0)
     {
         return -1;
     }
+    const char *name = path + tokens[count - 1].offset;
+    size_t name_len = tokens[count - 1].length;
 
-    // let's check if the filenames are valid or not
-    for(size_t n = 0; n < count; n++)
-    {
-        if(isValidFileName(*(tokens + n)) == false)
-        {
-            // before any return, we need to free tokens, otherwise memory leakage
-            for (size_t i = 0; i < count; i++)
-            {
-                free(*(tokens + i));
-            }
-            free(tokens);
-            return -1;
-        }
-    }
-
-    size_t parent_inode_ID = 0;	// start from the 1st inode, ie., the inode for root directory
-    // first, let's find the parent dir
-    size_t indicator = 0;
+    fs_enter(fs);
 
+    // locate the parent directory first, the entry to remove lives in its directory block
+    size_t parent_inode_ID = 0;
+    char parent_type = 0;
+    size_t child_inode_ID = 0;
+    char child_type = 0;
     inode_t * parent_inode = (inode_t *) calloc(1, sizeof(inode_t));
-    directoryFile_t * parent_data = (directoryFile_t *)calloc(1, BLOCK_SIZE_BYTES);
-
-    // locate the file
-    for(size_t i = 0; i < count; i++)
-    {
-        block_store_inode_read(fs->BlockStore_inode, parent_inode_ID, parent_inode);	// read out the parent inode
-        if(parent_inode->fileType == 'd')
-        {
-            block_store_read(fs->BlockStore_whole, parent_inode->directPointer[0], parent_data);
-            //printf("parent_inode->vacantFile = %d\n", parent_inode->vacantFile);
-            for(int j = 0; j < folder_number_entries; j++)
-            {
-                //printf("(parent_data + j) -> filename = %s\n", (parent_data + j) -> filename);
-                if( ((parent_inode->vacantFile >> j) & 1) == 1 && strcmp((parent_data + j) -> filename, *(tokens + i)) == 0 )
-                {
-                    parent_inode_ID = (parent_data + j) -> inodeNumber;
-                    indicator++;
-                }
-            }
-        }
+    bool renaming = false;
+    int found = walk_path(fs, path, tokens, count - 1, &parent_inode_ID, &parent_type);
+    if(found == 0 && parent_type != 'd') {
+        found = -1;
     }
-    //if below is not true, file path does not exist.
-    if(indicator==count) {
-        size_t child_inode_ID = parent_inode_ID;
-        inode_t * child_inode = (inode_t *) calloc(1, sizeof(inode_t));
-        block_store_inode_read(fs->BlockStore_inode, child_inode_ID, child_inode);	// read out the child inode
-        if(child_inode->fileType == 'd') {
-            //if directory, verify empty by checking vacancy, can also confirm by checking if direct pointer is set for file
-            if(child_inode->vacantFile == 0) {
-                for(int j = 0; j < folder_number_entries; j++)
-                {
-                    //printf("(parent_data + j) -> filename = %s\n", (parent_data + j) -> filename);
-                    if( ((parent_inode->vacantFile >> j) & 1) == 1 && strcmp((parent_data + j) -> filename, *(tokens + (count-1))) == 0 )
-                    {
-                        //found entry in vacant file, flip that bit in parent vacancy to indicate it is now available to be used. Now we just need to free the child block
-                        uint32_t currentVacantFile = (1 << j);
-                        currentVacantFile ^= UINT32_MAX;
-                        parent_inode->vacantFile &= currentVacantFile;
-                        //we are going to clear the parent data file as well to be safe...
-                        memset((parent_data+j)->filename,0,127);
-                        (parent_data+j)->inodeNumber = 0;
-                        block_store_write(fs->BlockStore_whole,parent_inode->directPointer[0],parent_data);
-                        //write back parent inode to indicate updates to its vacant file
-                        block_store_inode_write(fs->BlockStore_inode,parent_inode->inodeNumber,parent_inode);
-                        //finally we can free the child block & all associated data. If it was set to vacant, it still might have a directory file, so check for that, otherwise, all pointers should not be set
-                        if(child_inode->directPointer[0] != 0) {
-                            block_store_release(fs->BlockStore_whole,child_inode->directPointer[0]);
-                        }
-                        //block should now be empty, so we can free it.
-                        block_store_sub_release(fs->BlockStore_inode,child_inode_ID);
-                        //now we can finish & return
-                        free(parent_inode);
-                        free(child_inode);
-                        // before any return, we need to free tokens, otherwise memory leakage
-                        for (size_t i = 0; i < count; i++)
-                        {
-                            free(*(tokens + i));
-                        }
-                        free(tokens);
-                        free(parent_data);
-                        return 0;
-                    }
-                }
-            }
-            else {
-                //file not vacant, so can't be removed free everything and indicate error.
-                free(parent_inode);
-                free(child_inode);
-                // before any return, we need to free tokens, otherwise memory leakage
-                for (size_t i = 0; i < count; i++)
-                {
-                    free(*(tokens + i));
-                }
-                free(tokens);
-                free(parent_data);
-                return -1;
-            }
+    // the lookup is repeated under the parent's lock, the walk's result may be stale by now
+    while(found == 0) {
+        inode_lock(fs, parent_inode_ID, true);
+        inode_read(fs, parent_inode_ID, parent_inode);
+        if(parent_inode->fileType != 'd' || parent_inode->linkCount == 0
+                || dir_lookup(fs, parent_inode_ID, name, name_len, &child_inode_ID, &child_type) < 0) {
+            inode_unlock(fs, parent_inode_ID);
+            found = -1;
+        }
+        else if(child_type == 'd' && !renaming) {
+            //removing a directory locks two of them, which only calls holding the rename lock may do
+            inode_unlock(fs, parent_inode_ID);
+            pthread_mutex_lock(&fs->locks->rename);
+            renaming = true;
         }
         else {
-            //dealing with file then...
-            //since it's a file, we need to go through all pointers & free all associated data back.
-            //start w/ direct pointers.
-            for(int direct_count = 0; direct_count < 6; direct_count++) {
-                if(child_inode->directPointer[direct_count] != 0) {
-                    block_store_release(fs->BlockStore_whole,child_inode->directPointer[direct_count]);
-                }
-            }
-            //next go through any indirects...
-            if(child_inode->indirectPointer[0] != 0) {
-                uint16_t indirectArr[2048];
-                block_store_read(fs->BlockStore_whole,child_inode->indirectPointer[0],indirectArr);
-                for(int indirect_count = 0; indirect_count < 2048; indirect_count++) {
-                    if(indirectArr[indirect_count] != 0) {
-                        //if indirect was found in use, release that thing
-                        block_store_release(fs->BlockStore_whole,indirectArr[indirect_count]);
-                    }
-                }
-            }
-            //finally go through the double indirects
-            if(child_inode->doubleIndirectPointer != 0) {
-                uint16_t doubleIndirectArr[2048];
-                block_store_read(fs->BlockStore_whole,child_inode->doubleIndirectPointer,doubleIndirectArr);
-                for(int double_indirect_count = 0; double_indirect_count < 2048; double_indirect_count++) {
-                    //now check each individual double indirect for use
-                    if(doubleIndirectArr[double_indirect_count] != 0) {
-                        //in use, so pull it out
-                        uint16_t indirectArr[2048];
-                        block_store_read(fs->BlockStore_whole,doubleIndirectArr[double_indirect_count],indirectArr);
-                        for(int indirect = 0; indirect < 2048; indirect++) {
-                            if(indirectArr[indirect] != 0) {
-                                //found a block in use, so free
-                                block_store_release(fs->BlockStore_whole,indirectArr[indirect]);
-                            }
-                        }
-                    }
-                }
-            }
-            //finished freeing all blocks associated with file. Now we just free the file itself.
-            for(int j = 0; j < folder_number_entries; j++)
-            {
-                //printf("(parent_data + j) -> filename = %s\n", (parent_data + j) -> filename);
-                if( ((parent_inode->vacantFile >> j) & 1) == 1 && strcmp((parent_data + j) -> filename, *(tokens + (count-1))) == 0 )
-                {
-                    uint32_t currentVacantFile = (1 << j);
-                    currentVacantFile ^= UINT32_MAX;
-                    parent_inode->vacantFile &= currentVacantFile;
-                    //we are going to clear the parent data file as well to be safe...
-                    memset((parent_data+j)->filename,0,127);
-                    (parent_data+j)->inodeNumber = 0;
-                    block_store_write(fs->BlockStore_whole,parent_inode->directPointer[0],parent_data);
-                    //write back parent inode to indicate updates to its vacant file
-                    block_store_inode_write(fs->BlockStore_inode,parent_inode->inodeNumber,parent_inode);
-                    //block should now be empty, so we can free it.
-                    block_store_sub_release(fs->BlockStore_inode,child_inode_ID);
-                    //now we can finish & return
-                    free(parent_inode);
-                    free(child_inode);
-                    // before any return, we need to free tokens, otherwise memory leakage
-                    for (size_t i = 0; i < count; i++)
-                    {
-                        free(*(tokens + i));
-                    }
-                    free(tokens);
-                    free(parent_data);
-                    return 0;
-                }
-            }
+            break;
         }
     }
-    else {
-        //file path does not exist... return error.
-        free(parent_inode);
-        // before any return, we need to free tokens, otherwise memory leakage
-        for (size_t i = 0; i < count; i++)
-        {
-            free(*(tokens + i));
+
+    //if below is not true, file path does not exist.
+    if(found == 0) {
+        found = dir_unlink(fs, parent_inode_ID, parent_inode, name, name_len, child_inode_ID, child_type);
+        if(found == 0) {
+            journal_op_done(fs);
         }
-        free(tokens);
-        free(parent_data);
-        return -1;
+        inode_unlock(fs, parent_inode_ID);
     }
-    return 0;
-}
-void free_str_array(char** path_elems, int number_of_path_elems) {
-    for(int abort = 0; abort < number_of_path_elems;abort++) {
-        free(path_elems[abort]);
-        path_elems[abort] = NULL;
-    }
-    free(path_elems);
-    path_elems = NULL;
-}
-int get_inode_at_path_and_parent(FS_t* fs, const char* path, inode_t* child_inode, inode_t* parent_inode_to_return, char* filename_returned) {
-    if(*path != '/') {
-        //return error if path doesn't start with root directory.
-        return -1;
-    }
-    char lastchar = path[strlen(path)-1];
-    if(lastchar == '/') {
-        //return error if path ends with trailing slash.
-        return -1;
-    }
-    //we need to break up the path into the separate pieces in between slashes. We know that for extended paths, the first couple will all be directories, and the last will be of type specified by type
-    //store each path elem. in array of strings
-    int number_of_path_elems = 0;
-    //need to copy file path to get elements out since it is a const.
-    char* copied_path = calloc(1,strlen(path) + 1);
-    strcpy(copied_path,path);
-    //temp elem to be used with strtok
-    char* temp_elem;
-    //using strtok to figure out how many elements there are
-    temp_elem = strtok(copied_path,"/");
-    while(temp_elem != NULL) {
-        //loop to count # of elems in path
-        number_of_path_elems++;
-        //error check to make sure no element is larger than 127 characters.
-        if(strlen(temp_elem) > 127) {
-            free(copied_path);
-            return -1;
-        }
-        temp_elem = strtok(NULL,"/");
+    //file path does not exist, or is a directory that isn't empty
+    if(renaming) {
+        pthread_mutex_unlock(&fs->locks->rename);
     }
-    if(number_of_path_elems == 0) {
-        //no path given, can't recreate root, as that was done in format.
-        free(copied_path);
-        copied_path = NULL;
+    free(parent_inode);
+    fs_leave(fs);
+    return found < 0 ? -1 : 0;
+}
+
+ssize_t fs_remove_many(FS_t *fs, const char *dir, const char *const *names, size_t count, int *results)
+{
+    //PSEUDOCODE:
+    /*
+    first, error check all parameters to ensure all not null or invalid. Every name is checked on its own, a bad
+    one only fails itself.
+    next, the names are worked through in slices of BATCH_SLICE. For each, walk to the directory. Some of the names may
+    be directories, and removing one of those takes the rename lock, which has to be had before the directory's own
+    lock, so it is taken up front for the whole slice. If the directory is gone the names left fail.
+    Then the directory is locked once, and every name is looked up and removed as fs_remove would. The directory
+    inode stays in memory throughout, and its blocks go through the block cache, so the image sees each changed
+    block once when the cache writes back.
+    We return how many were removed.
+    */
+    if(fs == NULL || dir == NULL || (names == NULL && count != 0)) {
         return -1;
     }
-    //array of strings to hold # of elemnents. Now need to loop back through and pull out individual path elements
-    char ** path_elems = calloc(1,sizeof(char*) * number_of_path_elems);
-    if(path_elems == NULL) {
-        free(copied_path);
-        copied_path = NULL;
+    path_span_t tokens[FS_PATH_MAX_DEPTH];
+    size_t depth = 0;
+    if(path_tokenize(dir, tokens, &depth) < 0) {
         return -1;
     }
-    //get original path to loop through again
-    strcpy(copied_path,path);
-    temp_elem = strtok(copied_path, "/");
-    for(int i = 0; i < number_of_path_elems; i++) {
-        //we know that maximum file name is 127 characters, so only store that many.
-        path_elems[i] = calloc(1,sizeof(char) * 127);
-        if(path_elems[i] == NULL) {
-            free(path_elems);
-            free(copied_path);
-            copied_path = NULL;
-            return -1;
-        }
-        //copy elements into path array
-        strcpy(path_elems[i],temp_elem);
-        temp_elem = strtok(NULL, "/");
-    }
-
-    free(copied_path);
-    copied_path = NULL;
-    //now need to traverse down the path until we reach the parent directory inode, as that is where this file will be referenced from
-    //Start at root, we need to get it's details first
-    size_t parent_inode_num = 0;
-    inode_t* parent_inode = calloc(1,sizeof(inode_t));
-    if(parent_inode == NULL) {
-        //malloc failed, return error.
-        free_str_array(path_elems, number_of_path_elems);
-        return -1;
-    }
-    //directory files occupy one block.
-    directoryFile_t* parent_data = NULL;
-    parent_data = calloc(1,BLOCK_SIZE_BYTES);
-    if(parent_data == NULL) {
-        //malloc failed, return error.
-        free_str_array(path_elems, number_of_path_elems);
-        free(parent_inode);
-        parent_inode = NULL;
-        return -1;
-    }
-    block_store_inode_read(fs->BlockStore_inode,parent_inode_num,parent_inode);
-
-    //we stop one before bc we want parent directory inode, this will make sure these directories exist
-    for(int traverse_count = 0; traverse_count < number_of_path_elems -1; traverse_count++) {
-        block_store_inode_read(fs->BlockStore_inode,parent_inode_num,parent_inode);
-        //we know if this inode is a directory (as it should be, it should have flag setup). The directory should also not be vacant, as we are not creating directories along the given path.
-        if(parent_inode->fileType  == 'd' && parent_inode->vacantFile != 0) {
-            //read the data which should be stored in the first direct pointer block
-            block_store_read(fs->BlockStore_whole,parent_inode->directPointer[0],parent_data);
-            //at this point, we have a parent inode, so we need to look through the inode directory file (sequential search on it until we have a hit. If path is invalid (i.e. couldn't find filename in data, return error))
-            int file_counter = 0;
-            for(file_counter = 0; file_counter < 31; file_counter++) {
-                if(strcmp((parent_data + file_counter)->filename,path_elems[traverse_count])==0 && ((parent_inode->vacantFile>>file_counter) & 1)==1) {
-                    parent_inode_num = (parent_data+file_counter)->inodeNumber;
-                    break;
-                }
+
+    for(size_t i = 0; results != NULL && i < count; i++) {
+        results[i] = -1;
+    }
+    ssize_t removed = 0;
+    size_t first = 0;
+    do {
+        size_t n = count - first < BATCH_SLICE ? count - first : BATCH_SLICE;
+        fs_enter(fs);
+        size_t parent_ID = 0;
+        char parent_type = 0;
+        inode_t parent;
+        bool found = walk_path(fs, dir, tokens, depth, &parent_ID, &parent_type) == 0 && parent_type == 'd';
+        if(found) {
+            pthread_mutex_lock(&fs->locks->rename);
+            inode_lock(fs, parent_ID, true);
+            inode_read(fs, parent_ID, &parent);
+            found = parent.fileType == 'd' && parent.linkCount != 0;
+            if(!found) {
+                inode_unlock(fs, parent_ID);
+                pthread_mutex_unlock(&fs->locks->rename);
             }
-            //if we traverse all the way through the bitmap and can't find the file, then the given path does not exist, and we return an error.
-            if(file_counter == 31) {
-                free_str_array(path_elems,number_of_path_elems);
-                free(parent_inode);
-                free(parent_data);
-                parent_inode = NULL;
-                parent_data = NULL;
+        }
+        if(!found) {
+            fs_leave(fs);
+            if(first == 0) {
                 return -1;
             }
+            break;
         }
-        else {
-            //uh oh, given parent inode is a file, not a directory, which is an error. Free and return error!
-            free_str_array(path_elems,number_of_path_elems);
-            free(parent_inode);
-            free(parent_data);
-            parent_inode = NULL;
-            parent_data = NULL;
-            return -1;
+        ssize_t slice_removed = 0;
+        for(size_t i = first; i < first + n; i++) {
+            size_t len;
+            size_t child_ID;
+            char child_type;
+            int result = -1;
+            if(dir_name_valid(fs, names[i], &len) && dir_lookup(fs, parent_ID, names[i], len, &child_ID, &child_type) == 0) {
+                result = dir_unlink(fs, parent_ID, &parent, names[i], len, child_ID, child_type);
+            }
+            if(result == 0) {
+                slice_removed++;
+            }
+            if(results != NULL) {
+                results[i] = result;
+            }
         }
-    }
-    //we now can read parent inode
-    block_store_inode_read(fs->BlockStore_inode,parent_inode_num,parent_inode);
-    block_store_read(fs->BlockStore_whole,parent_inode->directPointer[0],parent_data);
-    size_t file_inode_number;
-    //find child file doing similar as above, sequentially searching through parent dir until we find given file
-    int parent_counter = 0;
-    for(parent_counter = 0; parent_counter < 31; parent_counter++) {
-        if(strcmp((parent_data + parent_counter)->filename,path_elems[number_of_path_elems-1])==0 && ((parent_inode->vacantFile>>parent_counter) & 1)==1) {
-            //once we find file, copy its inode number so we can read its inode
-            file_inode_number = (parent_data+parent_counter)->inodeNumber;
-            break;
+        if(slice_removed > 0) {
+            journal_op_done(fs);
         }
-    }
-    //if we traverse all the way through the bitmap and can't find the file, then the given path does not exist, and we return an error.
-    if(parent_counter == 31) {
-        free_str_array(path_elems,number_of_path_elems);
-        free(parent_inode);
-        free(parent_data);
-        parent_inode = NULL;
-        parent_data = NULL;
-        return -1;
-    }
-    //we now know that inode exists & we have inode number, so we can read the inode
-    block_store_inode_read(fs->BlockStore_inode,file_inode_number,child_inode);
-    block_store_inode_read(fs->BlockStore_inode,parent_inode->inodeNumber,parent_inode_to_return);
-    strncpy(filename_returned,path_elems[number_of_path_elems-1],strlen(path_elems[number_of_path_elems-1]));
-    free_str_array(path_elems,number_of_path_elems);
-    free(parent_inode);
-    free(parent_data);
-    parent_inode = NULL;
-    parent_data = NULL;
-    return 0;
+        removed += slice_removed;
+        inode_unlock(fs, parent_ID);
+        pthread_mutex_unlock(&fs->locks->rename);
+        fs_leave(fs);
+        first += n;
+    } while(first < count);
+    return removed;
 }
-int get_parent_inode(FS_t* fs, const char* path, inode_t* parent_inode_to_return, char* filename_returned) {
-    if(*path != '/') {
-        //return error if path doesn't start with root directory.
-        return -1;
-    }
-    char lastchar = path[strlen(path)-1];
-    if(lastchar == '/') {
-        //return error if path ends with trailing slash.
-        return -1;
-    }
-    //we need to break up the path into the separate pieces in between slashes. We know that for extended paths, the first couple will all be directories, and the last will be of type specified by type
-    //store each path elem. in array of strings
-    int number_of_path_elems = 0;
-    //need to copy file path to get elements out since it is a const.
-    char* copied_path = calloc(1,strlen(path) + 1);
-    strcpy(copied_path,path);
-    //temp elem to be used with strtok
-    char* temp_elem;
-    //using strtok to figure out how many elements there are
-    temp_elem = strtok(copied_path,"/");
-    while(temp_elem != NULL) {
-        //loop to count # of elems in path
-        number_of_path_elems++;
-        //error check to make sure no element is larger than 127 characters.
-        if(strlen(temp_elem) > 127) {
-            free(copied_path);
-            return -1;
-        }
-        temp_elem = strtok(NULL,"/");
-    }
-    if(number_of_path_elems == 0) {
-        //no path given, can't recreate root, as that was done in format.
-        free(copied_path);
-        copied_path = NULL;
+
+// find the directory the last element of path lives in
+// \return 0 and the directory's inode number and the last element's name, -1 if the path is malformed, names
+// only the root, or runs into something missing or not a directory
+static int path_parent(FS_t *fs, const char *path, size_t *parent_ID, char *name, size_t *name_len)
+{
+    //the tokenizer rejects relative paths, trailing slashes and over-long names, and "/" alone gives no elements
+    //root can't be moved or linked since it was created in format
+    path_span_t tokens[FS_PATH_MAX_DEPTH];
+    size_t count = 0;
+    if(path_tokenize(path, tokens, &count) < 0 || count == 0) {
         return -1;
     }
-    //array of strings to hold # of elemnents. Now need to loop back through and pull out individual path elements
-    char ** path_elems = calloc(1,sizeof(char*) * number_of_path_elems);
-    if(path_elems == NULL) {
-        free(copied_path);
-        copied_path = NULL;
+    //every lookup along the way goes through the dentry cache, so this is one hash probe per element when it's warm
+    char parent_type = 0;
+    if(walk_path(fs, path, tokens, count - 1, parent_ID, &parent_type) == -1 || parent_type != 'd') {
         return -1;
     }
-    //get original path to loop through again
-    strcpy(copied_path,path);
-    temp_elem = strtok(copied_path, "/");
-    for(int i = 0; i < number_of_path_elems; i++) {
-        //we know that maximum file name is 127 characters, so only store that many.
-        path_elems[i] = calloc(1,sizeof(char) * 127);
-        if(path_elems[i] == NULL) {
-            free(path_elems);
-            free(copied_path);
-            copied_path = NULL;
-            return -1;
-        }
-        //copy elements into path array
-        strcpy(path_elems[i],temp_elem);
-        temp_elem = strtok(NULL, "/");
-    }
-
-    free(copied_path);
-    copied_path = NULL;
-    //now need to traverse down the path until we reach the parent directory inode, as that is where this file will be referenced from
-    //Start at root, we need to get it's details first
-    size_t parent_inode_num = 0;
-    inode_t* parent_inode = calloc(1,sizeof(inode_t));
-    if(parent_inode == NULL) {
-        //malloc failed, return error.
-        free_str_array(path_elems, number_of_path_elems);
-        return -1;
-    }
-    //directory files occupy one block.
-    directoryFile_t* parent_data = NULL;
-    parent_data = calloc(1,BLOCK_SIZE_BYTES);
-    if(parent_data == NULL) {
-        //malloc failed, return error.
-        free_str_array(path_elems, number_of_path_elems);
-        free(parent_inode);
-        parent_inode = NULL;
-        return -1;
-    }
-    block_store_inode_read(fs->BlockStore_inode,parent_inode_num,parent_inode);
-
-    //we stop one before bc we want parent directory inode, this will make sure these directories exist
-    for(int traverse_count = 0; traverse_count < number_of_path_elems -1; traverse_count++) {
-        block_store_inode_read(fs->BlockStore_inode,parent_inode_num,parent_inode);
-        //we know if this inode is a directory (as it should be, it should have flag setup). The directory should also not be vacant, as we are not creating directories along the given path.
-        if(parent_inode->fileType  == 'd' && parent_inode->vacantFile != 0) {
-            //read the data which should be stored in the first direct pointer block
-            block_store_read(fs->BlockStore_whole,parent_inode->directPointer[0],parent_data);
-            //at this point, we have a parent inode, so we need to look through the inode directory file (sequential search on it until we have a hit. If path is invalid (i.e. couldn't find filename in data, return error))
-            int file_counter = 0;
-            for(file_counter = 0; file_counter < 31; file_counter++) {
-                if(strcmp((parent_data + file_counter)->filename,path_elems[traverse_count])==0 && ((parent_inode->vacantFile>>file_counter) & 1)==1) {
-                    parent_inode_num = (parent_data+file_counter)->inodeNumber;
-                    break;
-                }
-            }
-            //if we traverse all the way through the bitmap and can't find the file, then the given path does not exist, and we return an error.
-            if(file_counter == 31) {
-                free_str_array(path_elems,number_of_path_elems);
-                free(parent_inode);
-                free(parent_data);
-                parent_inode = NULL;
-                parent_data = NULL;
-                return -1;
-            }
-        }
-        else {
-            //uh oh, given parent inode is a file, not a directory, which is an error. Free and return error!
-            free_str_array(path_elems,number_of_path_elems);
-            free(parent_inode);
-            free(parent_data);
-            parent_inode = NULL;
-            parent_data = NULL;
-            return -1;
-        }
+    *name_len = tokens[count - 1].length;
+    memcpy(name, path + tokens[count - 1].offset, *name_len);
+    name[*name_len] = '\0';
+    return 0;
+}
+
+// lock the source and destination directories of a move or link for writing, with the rename lock held, and
+// check that they are still there. Both may be the same directory.
+// \return 0 and their inodes, -1 (with nothing locked) if one of them was removed
+static int parents_lock(FS_t *fs, size_t src_ID, size_t dst_ID, inode_t *src_parent, inode_t *dst_parent)
+{
+    //the rename lock already keeps two of these from waiting on each other, the order just keeps it obvious
+    inode_lock(fs, src_ID < dst_ID ? src_ID : dst_ID, true);
+    if(dst_ID != src_ID) {
+        inode_lock(fs, src_ID < dst_ID ? dst_ID : src_ID, true);
     }
-    //we now can read parent inode
-    block_store_inode_read(fs->BlockStore_inode,parent_inode_num,parent_inode);
-    block_store_read(fs->BlockStore_whole,parent_inode->directPointer[0],parent_data);
-    //find child file doing similar as above, sequentially searching through parent dir until we find given file
-    int parent_counter = 0;
-    for(parent_counter = 0; parent_counter < 31; parent_counter++) {
-        if(strcmp((parent_data + parent_counter)->filename,path_elems[number_of_path_elems-1])==0 && ((parent_inode->vacantFile>>parent_counter) & 1)==1) {
-            //if we find the file already exists, then this is a problem, so we return an error.
-            free_str_array(path_elems,number_of_path_elems);
-            free(parent_inode);
-            free(parent_data);
-            parent_inode = NULL;
-            parent_data = NULL;
-            return -1;
+    inode_read(fs, src_ID, src_parent);
+    inode_read(fs, dst_ID, dst_parent);
+    if(src_parent->fileType != 'd' || src_parent->linkCount == 0 || dst_parent->fileType != 'd' || dst_parent->linkCount == 0) {
+        if(dst_ID != src_ID) {
+            inode_unlock(fs, dst_ID);
         }
+        inode_unlock(fs, src_ID);
+        return -1;
     }
-    //we now know that inode exists & we have inode number, so we can read the inode
-    block_store_inode_read(fs->BlockStore_inode,parent_inode->inodeNumber,parent_inode_to_return);
-    strncpy(filename_returned,path_elems[number_of_path_elems-1],strlen(path_elems[number_of_path_elems-1]));
-    free_str_array(path_elems,number_of_path_elems);
-    free(parent_inode);
-    free(parent_data);
-    parent_inode = NULL;
-    parent_data = NULL;
     return 0;
 }
+
+static void parents_unlock(FS_t *fs, size_t src_ID, size_t dst_ID)
+{
+    if(dst_ID != src_ID) {
+        inode_unlock(fs, dst_ID);
+    }
+    inode_unlock(fs, src_ID);
+}
+
 int fs_move(FS_t *fs, const char *src, const char *dst)
 {
     //PSEUDOCODE:
@@ -1898,96 +6503,59 @@ int fs_move(FS_t *fs, const char *src, const char *dst)
     if(fs == NULL|| src == NULL || dst == NULL ) {
         return -1;
     }
-    //call helper function to get child & parent inodes for src
-    inode_t* src_child_inode = calloc(1,sizeof(inode_t));
-    inode_t* src_parent_inode = calloc(1, sizeof(inode_t));
-    char* filename = calloc(127,sizeof(char));
-    int returnvalue = 0;
-    returnvalue = get_inode_at_path_and_parent(fs,src,src_child_inode,src_parent_inode,filename);
-    if(returnvalue == -1) {
-        //error along the way, so free what was allocated & return -1.
-        free(src_parent_inode);
-        free(src_child_inode);
-        free(filename);
+    fs_enter(fs);
+    //the destination directory may have to grow
+    fd_delay_make_room(fs, BLOCK_SIZE_BYTES);
+    //find both parents first. They are looked at again once locked, since either may change while we walk
+    size_t src_parent_ID = 0;
+    size_t dst_parent_ID = 0;
+    char filename[FS_FNAME_MAX + 1];
+    char dest_filename[FS_FNAME_MAX + 1];
+    size_t filename_len = 0;
+    size_t dest_filename_len = 0;
+    if(path_parent(fs, src, &src_parent_ID, filename, &filename_len) == -1
+            || path_parent(fs, dst, &dst_parent_ID, dest_filename, &dest_filename_len) == -1) {
+        //error along the way, so return -1.
+        fs_leave(fs);
         return -1;
     }
-    //now we have the source & parent of src, so let's try and get the parent of the destination.
+    inode_t* src_parent_inode = calloc(1, sizeof(inode_t));
     inode_t* dst_parent_inode = calloc(1, sizeof(inode_t));
-    char* dest_filename = calloc(127,sizeof(char));
-    returnvalue = get_parent_inode(fs,dst,dst_parent_inode,dest_filename);
-    if(returnvalue == -1) {
-        //error along the way, so free what was allocated & return -1.
-        free(src_parent_inode);
-        free(src_child_inode);
-        free(dst_parent_inode);
-        free(filename);
-        free(dest_filename);
-        return -1;
-    }
-    //check case for moving into itself, which happens when dst_parent inode is same as src_child_inode
-    if(src_child_inode->inodeNumber == dst_parent_inode->inodeNumber) {
-        free(src_parent_inode);
-        free(src_child_inode);
-        free(dst_parent_inode);
-        free(filename);
-        free(dest_filename);
-        return -1;
-    }
-    //we now should have valid inodes, so we should be able to proceed.
-    //let's scan along & find some space in the dst parent directory file
-    int looking_for_space;
-    for(looking_for_space = 0; looking_for_space < 31; looking_for_space++) {
-        if((dst_parent_inode->vacantFile >> looking_for_space) == 0) {
-            break;
+    pthread_mutex_lock(&fs->locks->rename);
+    int returnvalue = parents_lock(fs, src_parent_ID, dst_parent_ID, src_parent_inode, dst_parent_inode);
+    if(returnvalue == 0) {
+        //the source has to exist and the destination must not
+        size_t child_ID = 0;
+        char child_type = 0;
+        size_t existing_ID = 0;
+        char existing_type = 0;
+        if(dir_lookup(fs, src_parent_ID, filename, filename_len, &child_ID, &child_type) == -1
+                || dir_lookup(fs, dst_parent_ID, dest_filename, dest_filename_len, &existing_ID, &existing_type) == 0
+                //check case for moving into itself, which happens when dst_parent inode is same as the child
+                || child_ID == dst_parent_ID
+                //add the new name first: if the dst parent is full nothing has changed yet and we can just return an error.
+                || dir_add_entry(fs, dst_parent_inode, dest_filename, dest_filename_len, child_ID) == -1) {
+            returnvalue = -1;
         }
-    }
-    //if we get to the end & still no open space was found, then the directory is full, so we return an error.
-    if(looking_for_space == 31) {
-        free(src_parent_inode);
-        free(src_child_inode);
-        free(dst_parent_inode);
-        free(filename);
-        free(dest_filename);
-        return -1;
-    }
-    //sweet. Now all we should need to do is remove the child inode from the src parent directory file & add it to where we just found was open
-    directoryFile_t* src_parent_directory = calloc(1,BLOCK_SIZE_BYTES);
-    block_store_read(fs->BlockStore_whole,src_parent_inode->directPointer[0],src_parent_directory);
-    directoryFile_t* dst_parent_directory = calloc(1,BLOCK_SIZE_BYTES);
-    block_store_read(fs->BlockStore_whole,dst_parent_inode->directPointer[0],dst_parent_directory);
-    for(int j = 0; j < folder_number_entries; j++)
-    {
-        //printf("(parent_data + j) -> filename = %s\n", (parent_data + j) -> filename);
-        if( ((src_parent_inode->vacantFile >> j) & 1) == 1 && strcmp((src_parent_directory + j) -> filename, filename)==0) {
-            //found entry in vacant file, flip that bit in parent vacancy to indicate it is now available to be used. Now we just need to free the child block
-            uint32_t currentVacantFile = (1 << j);
-            currentVacantFile ^= UINT32_MAX;
-            src_parent_inode->vacantFile &= currentVacantFile;
-            //we are going to clear the parent data file as well to be safe...
-            memset((src_parent_directory+j)->filename,0,127);
-            (src_parent_directory+j)->inodeNumber = 0;
-            block_store_write(fs->BlockStore_whole,src_parent_inode->directPointer[0],src_parent_directory);
-            //write back parent inode to indicate updates to its vacant file
-            block_store_inode_write(fs->BlockStore_inode,src_parent_inode->inodeNumber,src_parent_inode);
-            break;
+        else {
+            //a rename within one directory has to see the entry we just added, not the stale copy read before it
+            if(src_parent_ID == dst_parent_ID) {
+                *src_parent_inode = *dst_parent_inode;
+            }
+            //now remove the child from the src parent directory
+            dir_remove_entry(fs, src_parent_inode, filename, filename_len);
+            //the old name is gone and the new one points at the moved inode
+            dcache_insert(fs->dcache, src_parent_ID, filename, filename_len, DCACHE_NEGATIVE, 0);
+            dcache_insert(fs->dcache, dst_parent_ID, dest_filename, dest_filename_len, child_ID, child_type);
+            journal_op_done(fs);
         }
+        parents_unlock(fs, src_parent_ID, dst_parent_ID);
     }
-    //removed from src parent, let's add it to dst.
-    (dst_parent_directory+looking_for_space)->inodeNumber = src_child_inode->inodeNumber;
-    //use new name for file
-    strcpy((dst_parent_directory+looking_for_space)->filename,dest_filename);
-    dst_parent_inode->vacantFile |= (1 << looking_for_space);
-    //everything should now be up to date. Let's just write everything back now and free.
-    block_store_write(fs->BlockStore_whole,dst_parent_inode->directPointer[0],dst_parent_directory);
-    block_store_inode_write(fs->BlockStore_inode,dst_parent_inode->inodeNumber,dst_parent_inode);
+    pthread_mutex_unlock(&fs->locks->rename);
     free(src_parent_inode);
-    free(src_child_inode);
     free(dst_parent_inode);
-    free(filename);
-    free(dest_filename);
-    free(src_parent_directory);
-    free(dst_parent_directory);
-    return 0;
+    fs_leave(fs);
+    return returnvalue;
 }
 
 int fs_link(FS_t *fs, const char *src, const char *dst)
@@ -2006,69 +6574,59 @@ int fs_link(FS_t *fs, const char *src, const char *dst)
     if(fs == NULL|| src == NULL || dst == NULL ) {
         return -1;
     }
-    //call helper function to get child & parent inodes for src
-    inode_t* src_child_inode = calloc(1,sizeof(inode_t));
-    inode_t* src_parent_inode = calloc(1, sizeof(inode_t));
-    char* filename = calloc(127,sizeof(char));
-    int returnvalue = 0;
-    returnvalue = get_inode_at_path_and_parent(fs,src,src_child_inode,src_parent_inode,filename);
-    if(returnvalue == -1) {
-        //error along the way, so free what was allocated & return -1.
-        free(src_parent_inode);
-        free(src_child_inode);
-        free(filename);
+    fs_enter(fs);
+    //the destination directory may have to grow
+    fd_delay_make_room(fs, BLOCK_SIZE_BYTES);
+    //find both parents first. They are looked at again once locked, since either may change while we walk
+    size_t src_parent_ID = 0;
+    size_t dst_parent_ID = 0;
+    char filename[FS_FNAME_MAX + 1];
+    char dest_filename[FS_FNAME_MAX + 1];
+    size_t filename_len = 0;
+    size_t dest_filename_len = 0;
+    if(path_parent(fs, src, &src_parent_ID, filename, &filename_len) == -1
+            || path_parent(fs, dst, &dst_parent_ID, dest_filename, &dest_filename_len) == -1) {
+        //error along the way, so return -1.
+        fs_leave(fs);
         return -1;
     }
-    //now we have the source & parent of src, so let's try and get the parent of the destination.
+    inode_t* src_parent_inode = calloc(1, sizeof(inode_t));
     inode_t* dst_parent_inode = calloc(1, sizeof(inode_t));
-    char* dest_filename = calloc(127,sizeof(char));
-    returnvalue = get_parent_inode(fs,dst,dst_parent_inode,dest_filename);
-    if(returnvalue == -1) {
-        //error along the way, so free what was allocated & return -1.
-        free(src_parent_inode);
-        free(src_child_inode);
-        free(dst_parent_inode);
-        free(filename);
-        free(dest_filename);
-        return -1;
-    }
-    //look for space to link to 
-    int looking_for_space;
-    for(looking_for_space = 0; looking_for_space < 31; looking_for_space++) {
-        if((dst_parent_inode->vacantFile >> looking_for_space) == 0) {
-            break;
+    pthread_mutex_lock(&fs->locks->rename);
+    int returnvalue = parents_lock(fs, src_parent_ID, dst_parent_ID, src_parent_inode, dst_parent_inode);
+    if(returnvalue == 0) {
+        size_t child_ID = 0;
+        char child_type = 0;
+        size_t existing_ID = 0;
+        char existing_type = 0;
+        if(dir_lookup(fs, src_parent_ID, filename, filename_len, &child_ID, &child_type) == -1
+                || dir_lookup(fs, dst_parent_ID, dest_filename, dest_filename_len, &existing_ID, &existing_type) == 0
+                //add the new name to the dst parent, this fails without changing anything if that directory is full
+                || dir_add_entry(fs, dst_parent_inode, dest_filename, dest_filename_len, child_ID) == -1) {
+            returnvalue = -1;
         }
+        else {
+            //the inode now has one more name, fs_remove only frees it once the last one is gone.
+            //A directory linked into itself is already locked as the dst parent
+            bool locked = child_ID == src_parent_ID || child_ID == dst_parent_ID;
+            if(!locked) {
+                inode_lock(fs, child_ID, true);
+            }
+            inode_t child_inode;
+            inode_read(fs, child_ID, &child_inode);
+            child_inode.linkCount++;
+            inode_write(fs, child_ID, &child_inode);
+            if(!locked) {
+                inode_unlock(fs, child_ID);
+            }
+            dcache_insert(fs->dcache, dst_parent_ID, dest_filename, dest_filename_len, child_ID, child_type);
+            journal_op_done(fs);
+        }
+        parents_unlock(fs, src_parent_ID, dst_parent_ID);
     }
-    //if we get to the end & still no open space was found, then the directory is full, so we return an error.
-    if(looking_for_space == 31) {
-        free(src_parent_inode);
-        free(src_child_inode);
-        free(dst_parent_inode);
-        free(filename);
-        free(dest_filename);
-        return -1;
-    }
-    //we have open space in the directory, so let's add the old inode to the parent directory at dst
-    directoryFile_t* dst_parent_directory = calloc(1,BLOCK_SIZE_BYTES);
-    block_store_read(fs->BlockStore_whole,dst_parent_inode->directPointer[0],dst_parent_directory);
-
-    src_child_inode->linkCount++;
-    //update parent now
-    dst_parent_inode->vacantFile |= (1 << looking_for_space);
-    if(src_child_inode->inodeNumber == dst_parent_inode->inodeNumber) {
-        //if linking to itself, we need to update the child's vacant file to match.
-        //child_inode->vacantFile = dst_parent_inode->vacantFile;
-    }
-    strcpy((dst_parent_directory+looking_for_space)->filename,dest_filename);
-    (dst_parent_directory+looking_for_space)->inodeNumber = src_child_inode->inodeNumber;
-    //write updates back
-    block_store_write(fs->BlockStore_whole,dst_parent_inode->directPointer[0],dst_parent_directory);
-    block_store_inode_write(fs->BlockStore_inode,dst_parent_inode->inodeNumber,dst_parent_inode);
+    pthread_mutex_unlock(&fs->locks->rename);
     free(src_parent_inode);
-    free(src_child_inode);
     free(dst_parent_inode);
-    free(filename);
-    free(dest_filename);
-    free(dst_parent_directory);
-    return 0;
+    fs_leave(fs);
+    return returnvalue;
 }
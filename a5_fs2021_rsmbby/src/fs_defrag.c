@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "FS.h"
+
+#define PATH_LENGTH 4096
+
+// print the fragmentation of every regular file under dir, depth first
+static void report_files(FS_t *fs, char *path, size_t length)
+{
+    fs_dir_t *dir = (fs_dir_t *)malloc(sizeof(fs_dir_t));
+    if(dir == NULL || fs_opendir(fs, length == 0 ? "/" : path, dir) < 0) {
+        free(dir);
+        return;
+    }
+    file_record_t record;
+    while(fs_readdir(fs, dir, &record) == 1) {
+        size_t name_length = strlen(record.name);
+        if(length + 1 + name_length >= PATH_LENGTH) {
+            continue;
+        }
+        path[length] = '/';
+        memcpy(path + length + 1, record.name, name_length + 1);
+        if(record.type == FS_DIRECTORY) {
+            report_files(fs, path, length + 1 + name_length);
+        }
+        else {
+            fs_frag_t frag;
+            if(fs_fragmentation(fs, path, &frag) == 0) {
+                printf("%8.4f %8zu %8zu  %s\n", frag.score, frag.blocks, frag.fragments, path);
+            }
+        }
+        path[length] = '\0';
+    }
+    fs_closedir(fs, dir);
+    free(dir);
+}
+
+static void report_image(FS_t *fs, const char *when)
+{
+    fs_frag_t frag;
+    if(fs_fragmentation(fs, NULL, &frag) == 0) {
+        printf("%s: %zu files, %zu blocks in %zu fragments, score %.4f\n", when, frag.files, frag.blocks, frag.fragments, frag.score);
+    }
+}
+
+// Moves the files of an image into contiguous runs. The image is mounted here, so it must not be mounted elsewhere.
+int main(int argc, char **argv)
+{
+    if(argc < 2 || argc > 4) {
+        printf("%s <image> [blocks per step] [pause between steps in ms]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    //a step stops once it moved that many blocks, 0 moves everything in one, and the pause between steps throttles the pass
+    size_t step = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+    long pause_ms = argc > 3 ? strtol(argv[3], NULL, 10) : 0;
+    if(pause_ms < 0) {
+        printf("Invalid pause!\n");
+        return EXIT_FAILURE;
+    }
+    FS_t *fs = fs_mount(argv[1]);
+    if(fs == NULL) {
+        printf("Could not mount %s!\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    char path[PATH_LENGTH] = "";
+    printf("   score   blocks fragments  file\n");
+    report_files(fs, path, 0);
+    report_image(fs, "before");
+
+    fs_defrag_t pass;
+    memset(&pass, 0, sizeof(pass));
+    struct timespec pause = { pause_ms / 1000, (pause_ms % 1000) * 1000000 };
+    int more;
+    while((more = fs_defrag(fs, &pass, step)) == 1) {
+        if(pause_ms > 0) {
+            nanosleep(&pause, NULL);
+        }
+    }
+    if(more < 0) {
+        printf("Defragmentation failed!\n");
+        fs_unmount(fs);
+        return EXIT_FAILURE;
+    }
+    printf("moved %zu files, %zu blocks\n", pass.files_moved, pass.blocks_moved);
+    report_image(fs, "after");
+
+    if(fs_unmount(fs) < 0) {
+        printf("Could not unmount %s!\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,6 +1,11 @@
+#include <climits>
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <map>
 #include <new>
+#include <string>
+#include <thread>
 #include <vector>
 using std::vector;
 using std::string;
@@ -1332,6 +1337,2321 @@ TEST(j_tests, link) {
 	fs_unmount(fs);
 }
 
+/*
+   Lookups are cached in memory (dentry cache), so every namespace change has to be visible right away
+   1. Normal, negative lookup turns positive after create
+   2. Normal, positive lookup turns negative after remove
+   3. Normal, move invalidates the old name and publishes the new one
+   4. Normal, link publishes the new name
+   5. Normal, removed directory does not leave stale children behind
+   6. Normal, remount starts cold but resolves the same paths
+ */
+TEST(k_tests, lookup_cache) {
+	const char * test_fname = "k_tests.FS";
+
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+
+	// 1. Normal, negative lookup turns positive after create
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	ASSERT_LT(fs_open(fs, "/dir/file"), 0);
+	ASSERT_EQ(fs_create(fs, "/dir/file", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/dir/file");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 2. Normal, positive lookup turns negative after remove
+	ASSERT_EQ(fs_remove(fs, "/dir/file"), 0);
+	ASSERT_LT(fs_open(fs, "/dir/file"), 0);
+	ASSERT_EQ(fs_create(fs, "/dir/file", FS_REGULAR), 0);
+
+	// 3. Normal, move invalidates the old name and publishes the new one
+	ASSERT_EQ(fs_create(fs, "/other", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/other/keep", FS_REGULAR), 0);
+	ASSERT_LT(fs_open(fs, "/other/moved"), 0);
+	ASSERT_EQ(fs_move(fs, "/dir/file", "/other/moved"), 0);
+	ASSERT_LT(fs_open(fs, "/dir/file"), 0);
+	fd = fs_open(fs, "/other/moved");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 4. Normal, link publishes the new name
+	ASSERT_LT(fs_open(fs, "/dir/linked"), 0);
+	ASSERT_EQ(fs_link(fs, "/other/moved", "/dir/linked"), 0);
+	fd = fs_open(fs, "/dir/linked");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 5. Normal, removed directory does not leave stale children behind
+	ASSERT_EQ(fs_create(fs, "/empty", FS_DIRECTORY), 0);
+	ASSERT_LT(fs_open(fs, "/empty/nothing"), 0);
+	ASSERT_EQ(fs_remove(fs, "/empty"), 0);
+	ASSERT_LT(fs_open(fs, "/empty/nothing"), 0);
+	ASSERT_EQ(fs_create(fs, "/empty", FS_REGULAR), 0);
+	ASSERT_LT(fs_create(fs, "/empty/nothing", FS_REGULAR), 0);
+	fs_unmount(fs);
+
+	// 6. Normal, remount starts cold but resolves the same paths
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_LT(fs_open(fs, "/dir/file"), 0);
+	fd = fs_open(fs, "/dir/linked");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/other/moved");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+}
+
+TEST(k_tests, path_tokens) {
+	const char * test_fname = "k_tests_path.FS";
+
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+
+	// 1. Normal, longest legal name on every path element
+	std::string longest(FS_FNAME_MAX, 'a');
+	std::string dir = "/" + longest;
+	std::string file = dir + "/" + longest;
+	ASSERT_EQ(fs_create(fs, dir.c_str(), FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, file.c_str(), FS_REGULAR), 0);
+	int fd = fs_open(fs, file.c_str());
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 2. Normal, move and link keep the full name
+	std::string moved = "/" + std::string(FS_FNAME_MAX, 'b');
+	ASSERT_EQ(fs_move(fs, file.c_str(), moved.c_str()), 0);
+	ASSERT_EQ(fs_link(fs, moved.c_str(), file.c_str()), 0);
+	fd = fs_open(fs, file.c_str());
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 3. Error, one character too long
+	std::string too_long = "/" + std::string(FS_FNAME_MAX + 1, 'c');
+	ASSERT_LT(fs_create(fs, too_long.c_str(), FS_REGULAR), 0);
+	ASSERT_LT(fs_move(fs, moved.c_str(), too_long.c_str()), 0);
+
+	// 4. Error, empty elements and trailing slashes
+	ASSERT_LT(fs_create(fs, "//x", FS_REGULAR), 0);
+	ASSERT_LT(fs_create(fs, "/x/", FS_REGULAR), 0);
+	ASSERT_LT(fs_open(fs, (dir + "//" + longest).c_str()), 0);
+	ASSERT_LT(fs_link(fs, moved.c_str(), "/x/"), 0);
+	ASSERT_LT(fs_move(fs, "/", "/x"), 0);
+	ASSERT_LT(fs_create(fs, "x", FS_REGULAR), 0);
+
+	fs_unmount(fs);
+}
+
+TEST(k_tests, indexed_directory) {
+	const char * test_fname = "k_tests_index.FS";
+	const int links = 5000;
+	char name[64];
+
+	FS * fs = fs_format_ex(test_fname, FS_FEATURE_DIR_INDEX);
+	ASSERT_NE(fs, nullptr);
+	size_t free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+
+	// 1. Normal, a directory grows well past one block of entries
+	ASSERT_EQ(fs_create(fs, "/big", FS_DIRECTORY), 0);
+	for (int i = 0; i < 200; ++i) {
+		snprintf(name, sizeof(name), "/big/file%d", i);
+		ASSERT_EQ(fs_create(fs, name, FS_REGULAR), 0);
+	}
+	for (int i = 0; i < links; ++i) {
+		snprintf(name, sizeof(name), "/big/link%d", i);
+		ASSERT_EQ(fs_link(fs, "/big/file0", name), 0);
+	}
+	ASSERT_LT(fs_link(fs, "/big/file0", "/big/link0"), 0);
+	dyn_array_t *record_results = fs_get_dir(fs, "/big");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), (size_t)(200 + links));
+	ASSERT_TRUE(find_in_directory(record_results, "file199"));
+	ASSERT_TRUE(find_in_directory(record_results, "link4999"));
+	dyn_array_destroy(record_results);
+
+	// 2. Normal, move out of, into and within an indexed directory, and into an empty one
+	ASSERT_EQ(fs_create(fs, "/empty", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_move(fs, "/big/file1", "/empty/file1"), 0);
+	ASSERT_EQ(fs_move(fs, "/empty/file1", "/big/back"), 0);
+	ASSERT_EQ(fs_move(fs, "/big/back", "/big/renamed"), 0);
+	ASSERT_LT(fs_open(fs, "/big/back"), 0);
+	int fd = fs_open(fs, "/big/renamed");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	record_results = fs_get_dir(fs, "/empty");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), 0);
+	dyn_array_destroy(record_results);
+	fs_unmount(fs);
+
+	// 3. Normal, the layout survives a remount
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/big/link2500");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_LT(fs_open(fs, "/big/file1"), 0);
+
+	// 4. Normal, emptying the directory gives every block back
+	ASSERT_LT(fs_remove(fs, "/big"), 0);
+	for (int i = 0; i < links; ++i) {
+		snprintf(name, sizeof(name), "/big/link%d", i);
+		ASSERT_EQ(fs_remove(fs, name), 0);
+	}
+	for (int i = 0; i < 200; ++i) {
+		snprintf(name, sizeof(name), i == 1 ? "/big/renamed" : "/big/file%d", i);
+		ASSERT_EQ(fs_remove(fs, name), 0);
+	}
+	record_results = fs_get_dir(fs, "/big");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), 0);
+	dyn_array_destroy(record_results);
+	ASSERT_EQ(fs_remove(fs, "/big"), 0);
+	ASSERT_EQ(fs_remove(fs, "/empty"), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 1);	// the root's own block
+	fs_unmount(fs);
+
+	// 5. Error, a plain image still caps a directory at one block
+	fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	for (int i = 0; i < folder_number_entries; ++i) {
+		snprintf(name, sizeof(name), "/file%d", i);
+		ASSERT_EQ(fs_create(fs, name, FS_REGULAR), 0);
+	}
+	ASSERT_LT(fs_create(fs, "/one_too_many", FS_REGULAR), 0);
+	fs_unmount(fs);
+
+	// 6. Error, unknown features
+	ASSERT_EQ(fs_format_ex(test_fname, 0x80000000), nullptr);
+}
+
+TEST(k_tests, extents) {
+	const char * test_fname = "k_tests_extents.FS";
+	const int blocks = 800;
+	uint8_t block[BLOCK_SIZE_BYTES];
+	uint8_t check[BLOCK_SIZE_BYTES * 3];
+
+	FS * fs = fs_format_ex(test_fname, FS_FEATURE_EXTENTS);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/seq", FS_REGULAR), 0);
+	size_t free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+
+	// 1. Normal, a sequential file takes exactly its data blocks, no pointer blocks
+	int fd = fs_open(fs, "/seq");
+	ASSERT_GE(fd, 0);
+	for (int i = 0; i < blocks; ++i) {
+		memset(block, i & 0xFF, BLOCK_SIZE_BYTES);
+		ASSERT_EQ(fs_write(fs, fd, block, BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+	}
+	// the last appends are only held by the descriptor until it is closed
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/seq");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - blocks);
+
+	// 2. Normal, reads spanning block boundaries, and EOF
+	ASSERT_EQ(fs_seek(fs, fd, BLOCK_SIZE_BYTES * 10 - 100, FS_SEEK_SET), BLOCK_SIZE_BYTES * 10 - 100);
+	ASSERT_EQ(fs_read(fs, fd, check, BLOCK_SIZE_BYTES * 2), BLOCK_SIZE_BYTES * 2);
+	ASSERT_EQ(check[99], 9);
+	ASSERT_EQ(check[100], 10);
+	ASSERT_EQ(check[BLOCK_SIZE_BYTES * 2 - 1], 11);
+	ASSERT_EQ(fs_seek(fs, fd, -10, FS_SEEK_END), BLOCK_SIZE_BYTES * blocks - 10);
+	ASSERT_EQ(fs_read(fs, fd, check, BLOCK_SIZE_BYTES), 10);
+	ASSERT_EQ(fs_read(fs, fd, check, BLOCK_SIZE_BYTES), 0);
+
+	// 3. Normal, two files written in lockstep fragment each other into many extents
+	ASSERT_EQ(fs_create(fs, "/a", FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, "/b", FS_REGULAR), 0);
+	int fd_a = fs_open(fs, "/a");
+	int fd_b = fs_open(fs, "/b");
+	ASSERT_GE(fd_a, 0);
+	ASSERT_GE(fd_b, 0);
+	for (int i = 0; i < blocks; ++i) {
+		memset(block, i & 0xFF, BLOCK_SIZE_BYTES);
+		ASSERT_EQ(fs_write(fs, fd_a, block, BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+		memset(block, ~i & 0xFF, BLOCK_SIZE_BYTES);
+		ASSERT_EQ(fs_write(fs, fd_b, block, 100), 100);
+		ASSERT_EQ(fs_write(fs, fd_b, block + 100, BLOCK_SIZE_BYTES - 100), BLOCK_SIZE_BYTES - 100);
+	}
+	ASSERT_EQ(fs_close(fs, fd_a), 0);
+	ASSERT_EQ(fs_close(fs, fd_b), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+
+	// 4. Normal, contents survive a remount, and overwrites land in place
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fd_a = fs_open(fs, "/a");
+	fd_b = fs_open(fs, "/b");
+	for (int i = 0; i < blocks; ++i) {
+		ASSERT_EQ(fs_read(fs, fd_a, check, BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+		ASSERT_EQ(check[0], i & 0xFF);
+		ASSERT_EQ(check[BLOCK_SIZE_BYTES - 1], i & 0xFF);
+		ASSERT_EQ(fs_read(fs, fd_b, check, BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+		ASSERT_EQ(check[0], ~i & 0xFF);
+		ASSERT_EQ(check[BLOCK_SIZE_BYTES - 1], ~i & 0xFF);
+	}
+	memset(block, 0xEE, BLOCK_SIZE_BYTES);
+	size_t used = block_store_get_free_blocks(fs->BlockStore_whole);
+	ASSERT_EQ(fs_seek(fs, fd_a, BLOCK_SIZE_BYTES * 400 + 10, FS_SEEK_SET), BLOCK_SIZE_BYTES * 400 + 10);
+	ASSERT_EQ(fs_write(fs, fd_a, block, BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), used);
+	ASSERT_EQ(fs_seek(fs, fd_a, BLOCK_SIZE_BYTES * 400, FS_SEEK_SET), BLOCK_SIZE_BYTES * 400);
+	ASSERT_EQ(fs_read(fs, fd_a, check, BLOCK_SIZE_BYTES * 2), BLOCK_SIZE_BYTES * 2);
+	ASSERT_EQ(check[9], 400 & 0xFF);
+	ASSERT_EQ(check[10], 0xEE);
+	ASSERT_EQ(check[BLOCK_SIZE_BYTES + 9], 0xEE);
+	ASSERT_EQ(check[BLOCK_SIZE_BYTES + 10], 401 & 0xFF);
+	ASSERT_EQ(fs_close(fs, fd_a), 0);
+	ASSERT_EQ(fs_close(fs, fd_b), 0);
+
+	// 5. Normal, removing the files gives back data and extent blocks alike
+	ASSERT_EQ(fs_remove(fs, "/a"), 0);
+	ASSERT_EQ(fs_remove(fs, "/b"), 0);
+	ASSERT_EQ(fs_remove(fs, "/seq"), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks);
+
+	// 6. Normal, filling the FS stops short, then nothing more fits
+	ASSERT_EQ(fs_create(fs, "/fill", FS_REGULAR), 0);
+	fd = fs_open(fs, "/fill");
+	ASSERT_GE(fd, 0);
+	size_t chunk = BLOCK_SIZE_BYTES * 1024;
+	uint8_t *giant = new uint8_t[chunk];
+	memset(giant, 0x6E, chunk);
+	ssize_t written;
+	size_t filled = 0;
+	while ((written = fs_write(fs, fd, giant, chunk)) == (ssize_t)chunk) {
+		filled += written;
+	}
+	filled += written;
+	ASSERT_EQ(filled, free_blocks * BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_write(fs, fd, giant, 1), 0);
+	delete[] giant;
+	fs_unmount(fs);
+}
+
+TEST(k_tests, positional_io) {
+	const char * test_fname = "k_tests_positional_io.FS";
+	const size_t blocks = 300;
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/index", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/index");
+	ASSERT_GE(fd, 0);
+
+	// 1. Normal, pwrite fills the file without moving the cursor
+	std::vector<uint32_t> words(BLOCK_SIZE_BYTES / sizeof(uint32_t));
+	for (size_t b = 0; b < blocks; ++b) {
+		for (size_t i = 0; i < words.size(); ++i) {
+			words[i] = b * words.size() + i;
+		}
+		ASSERT_EQ(fs_pwrite(fs, fd, words.data(), BLOCK_SIZE_BYTES, b * BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+	}
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_CUR), 0);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), (off_t)(blocks * BLOCK_SIZE_BYTES));
+	ASSERT_EQ(fs_seek(fs, fd, 12, FS_SEEK_SET), 12);
+
+	// 2. Normal, pread at unaligned offsets and across block boundaries, cursor untouched
+	uint32_t word = 0;
+	ASSERT_EQ(fs_pread(fs, fd, &word, sizeof(word), 4 * 1027), (ssize_t)sizeof(word));
+	ASSERT_EQ(word, 1027u);
+	uint32_t pair[2];
+	ASSERT_EQ(fs_pread(fs, fd, pair, sizeof(pair), BLOCK_SIZE_BYTES * 7 - 4), (ssize_t)sizeof(pair));
+	ASSERT_EQ(pair[0], 7 * 1024u - 1);
+	ASSERT_EQ(pair[1], 7 * 1024u);
+	ASSERT_EQ(fs_read(fs, fd, &word, sizeof(word)), (ssize_t)sizeof(word));
+	ASSERT_EQ(word, 3u);
+
+	// 3. Normal, pread stops at EOF, pwrite past EOF extends the file
+	ASSERT_EQ(fs_pread(fs, fd, pair, sizeof(pair), blocks * BLOCK_SIZE_BYTES - 4), 4);
+	ASSERT_EQ(fs_pread(fs, fd, pair, sizeof(pair), blocks * BLOCK_SIZE_BYTES + 100), 0);
+	word = 0xC0FFEE;
+	ASSERT_EQ(fs_pwrite(fs, fd, &word, sizeof(word), blocks * BLOCK_SIZE_BYTES + 100), (ssize_t)sizeof(word));
+	ASSERT_EQ(fs_pread(fs, fd, pair, sizeof(pair), blocks * BLOCK_SIZE_BYTES + 96), (ssize_t)sizeof(pair));
+	ASSERT_EQ(pair[0], 0u);
+	ASSERT_EQ(pair[1], 0xC0FFEEu);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_CUR), 16);
+
+	// 4. Normal, concurrent preads through the same descriptor
+	std::vector<std::thread> readers;
+	std::vector<int> mismatches(4, 0);
+	for (int t = 0; t < 4; ++t) {
+		readers.emplace_back([fs, fd, t, &mismatches]() {
+			uint32_t value;
+			for (uint32_t i = t; i < blocks * 1024; i += 37) {
+				if (fs_pread(fs, fd, &value, sizeof(value), (off_t)i * sizeof(value)) != (ssize_t)sizeof(value) || value != i) {
+					++mismatches[t];
+				}
+			}
+		});
+	}
+	for (auto &reader : readers) {
+		reader.join();
+	}
+	for (int t = 0; t < 4; ++t) {
+		ASSERT_EQ(mismatches[t], 0);
+	}
+
+	// 5. Error, bad parameters
+	ASSERT_LT(fs_pread(NULL, fd, &word, sizeof(word), 0), 0);
+	ASSERT_LT(fs_pread(fs, fd, NULL, sizeof(word), 0), 0);
+	ASSERT_LT(fs_pread(fs, fd, &word, sizeof(word), -1), 0);
+	ASSERT_LT(fs_pread(fs, fd + 1, &word, sizeof(word), 0), 0);
+	ASSERT_LT(fs_pwrite(fs, fd, &word, sizeof(word), -1), 0);
+	ASSERT_LT(fs_pwrite(fs, 300, &word, sizeof(word), 0), 0);
+	ASSERT_LT(fs_pwrite(fs, fd, NULL, sizeof(word), 0), 0);
+
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+}
+
+TEST(k_tests, vectored_io) {
+	const char * test_fname = "k_tests_vectored_io.FS";
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/log", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/log");
+	ASSERT_GE(fd, 0);
+
+	// 1. Normal, header + payload records land back to back, crossing block boundaries
+	uint32_t header[2];
+	std::vector<uint8_t> payload(3000);
+	const int records = 40;
+	size_t free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+	for (int r = 0; r < records; ++r) {
+		header[0] = r;
+		header[1] = payload.size();
+		memset(payload.data(), r, payload.size());
+		struct iovec iov[2] = { { header, sizeof(header) }, { payload.data(), payload.size() } };
+		ASSERT_EQ(fs_writev(fs, fd, iov, 2), (ssize_t)(sizeof(header) + payload.size()));
+	}
+	const size_t record = sizeof(header) + payload.size();
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_CUR), (off_t)(record * records));
+	size_t data_blocks = (record * records + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+	// the last appends are only held by the descriptor until it is closed
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/log");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - data_blocks - 1);
+
+	// 2. Normal, readv splits them apart again
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+	for (int r = 0; r < records; ++r) {
+		memset(payload.data(), 0xFF, payload.size());
+		struct iovec iov[2] = { { header, sizeof(header) }, { payload.data(), payload.size() } };
+		ASSERT_EQ(fs_readv(fs, fd, iov, 2), (ssize_t)record);
+		ASSERT_EQ(header[0], (uint32_t)r);
+		ASSERT_EQ(header[1], payload.size());
+		ASSERT_EQ(payload[0], r);
+		ASSERT_EQ(payload[payload.size() - 1], r);
+	}
+
+	// 3. Normal, readv stops at EOF part way through the buffers, empty buffers are skipped
+	ASSERT_EQ(fs_seek(fs, fd, -10, FS_SEEK_END), (off_t)(record * records - 10));
+	uint8_t tail[8];
+	struct iovec parts[3] = { { tail, sizeof(tail) }, { NULL, 0 }, { payload.data(), payload.size() } };
+	ASSERT_EQ(fs_readv(fs, fd, parts, 3), 10);
+	ASSERT_EQ(tail[0], records - 1);
+	ASSERT_EQ(payload[1], records - 1);
+	ASSERT_EQ(fs_readv(fs, fd, parts, 3), 0);
+	ASSERT_EQ(fs_writev(fs, fd, parts, 0), 0);
+
+	// 4. Error, bad parameters
+	ASSERT_LT(fs_readv(NULL, fd, parts, 1), 0);
+	ASSERT_LT(fs_readv(fs, fd, NULL, 1), 0);
+	ASSERT_LT(fs_readv(fs, fd, parts, -1), 0);
+	ASSERT_LT(fs_writev(fs, fd + 1, parts, 1), 0);
+	struct iovec bad = { NULL, 1 };
+	ASSERT_LT(fs_writev(fs, fd, &bad, 1), 0);
+
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+}
+
+TEST(k_tests, zero_copy_views) {
+	const char * test_fname = "k_tests_zero_copy_views.FS";
+	FS * fs = fs_format_ex(test_fname, FS_FEATURE_EXTENTS);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/scan", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/scan");
+	ASSERT_GE(fd, 0);
+	const size_t length = BLOCK_SIZE_BYTES * 20 + 123;
+	std::vector<uint8_t> data(length);
+	for (size_t i = 0; i < length; ++i) {
+		data[i] = i * 7 + (i >> 12);
+	}
+	ASSERT_EQ(fs_write(fs, fd, data.data(), length), (ssize_t)length);
+
+	// 1. Normal, a contiguous file comes back as one view, straight from the image
+	fs_view_t view;
+	ASSERT_EQ(fs_view(fs, fd, 10, length, &view), (ssize_t)(length - 10));
+	ASSERT_EQ(view.length, length - 10);
+	ASSERT_EQ(memcmp(view.data, data.data() + 10, view.length), 0);
+	ASSERT_EQ(fs->open_views, 1u);
+	fs_view_t second;
+	ASSERT_EQ(fs_view(fs, fd, BLOCK_SIZE_BYTES * 3, 5, &second), 5);
+	ASSERT_EQ((const uint8_t *)second.data, (const uint8_t *)view.data + BLOCK_SIZE_BYTES * 3 - 10);
+	ASSERT_EQ(fs->open_views, 2u);
+	ASSERT_EQ(fs_view_release(fs, &second), 0);
+	ASSERT_EQ(fs_view_release(fs, &view), 0);
+	ASSERT_EQ(view.data, nullptr);
+	ASSERT_EQ(fs->open_views, 0u);
+
+	// 2. Normal, writes show through, the cursor never moves
+	ASSERT_EQ(fs_view(fs, fd, 0, 4, &view), 4);
+	uint8_t marker = 0xA5;
+	ASSERT_EQ(fs_pwrite(fs, fd, &marker, 1, 2), 1);
+	ASSERT_EQ(((const uint8_t *)view.data)[2], 0xA5);
+	ASSERT_EQ(fs_view_release(fs, &view), 0);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_CUR), (off_t)length);
+
+	// 3. Normal, holes are zeros a block at a time, EOF gives an empty view
+	const off_t far = BLOCK_SIZE_BYTES * 40;
+	ASSERT_EQ(fs_pwrite(fs, fd, &marker, 1, far), 1);
+	ASSERT_EQ(fs_view(fs, fd, length, far, &view), (ssize_t)(BLOCK_SIZE_BYTES * 21 - length));
+	ASSERT_EQ(((const uint8_t *)view.data)[0], 0);
+	ASSERT_EQ(fs_view_release(fs, &view), 0);
+	ASSERT_EQ(fs_view(fs, fd, BLOCK_SIZE_BYTES * 25 + 1, far, &view), BLOCK_SIZE_BYTES - 1);
+	ASSERT_EQ(((const uint8_t *)view.data)[BLOCK_SIZE_BYTES - 2], 0);
+	ASSERT_EQ(fs_view_release(fs, &view), 0);
+	ASSERT_EQ(fs_view(fs, fd, far, 100, &view), 1);
+	ASSERT_EQ(((const uint8_t *)view.data)[0], 0xA5);
+	ASSERT_EQ(fs_view_release(fs, &view), 0);
+	ASSERT_EQ(fs_view(fs, fd, far + 1, 100, &view), 0);
+	ASSERT_EQ(view.data, nullptr);
+	ASSERT_EQ(fs_view_release(fs, &view), 0);
+
+	// 4. Error, bad parameters and stray releases
+	ASSERT_LT(fs_view(NULL, fd, 0, 1, &view), 0);
+	ASSERT_LT(fs_view(fs, fd, 0, 1, NULL), 0);
+	ASSERT_LT(fs_view(fs, fd, -1, 1, &view), 0);
+	ASSERT_LT(fs_view(fs, fd + 1, 0, 1, &view), 0);
+	ASSERT_LT(fs_view_release(fs, NULL), 0);
+	fs_view_t stray = { data.data(), 1, 0 };
+	ASSERT_LT(fs_view_release(fs, &stray), 0);
+
+	// 5. Error, a viewed file can be neither shrunk nor removed, even with no descriptor left, and the view still reads
+	// its data. Growing it and dropping another of its names still work, and once the view is given back so does the rest
+	ASSERT_EQ(fs_view(fs, fd, 0, 4, &view), 4);
+	ASSERT_LT(fs_truncate(fs, fd, 1), 0);
+	ASSERT_EQ(fs_truncate(fs, fd, far + 2), 0);
+	ASSERT_EQ(fs_link(fs, "/scan", "/other"), 0);
+	ASSERT_EQ(fs_remove(fs, "/other"), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_LT(fs_remove(fs, "/scan"), 0);
+	ASSERT_EQ(((const uint8_t *)view.data)[2], 0xA5);
+	ASSERT_EQ(memcmp((const uint8_t *)view.data + 3, data.data() + 3, 1), 0);
+	ASSERT_EQ(fs->open_views, 1u);
+	ASSERT_EQ(fs_view_release(fs, &view), 0);
+	ASSERT_EQ(fs->open_views, 0u);
+	ASSERT_EQ(fs_remove(fs, "/scan"), 0);
+	fs_unmount(fs);
+}
+
+TEST(k_tests, descriptor_block_map) {
+	const char * test_fname = "k_tests_descriptor_block_map.FS";
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/big", FS_REGULAR), 0);
+	int writer = fs_open(fs, "/big");
+	int reader = fs_open(fs, "/big");
+	ASSERT_GE(writer, 0);
+	ASSERT_GE(reader, 0);
+
+	// 1. Normal, small sequential reads through direct, indirect and double indirect blocks,
+	// while another descriptor keeps extending the file ahead of them
+	const uint32_t blocks = 2200;
+	std::vector<uint32_t> words(BLOCK_SIZE_BYTES / sizeof(uint32_t));
+	uint32_t expected = 0;
+	for (uint32_t b = 0; b < blocks; ++b) {
+		for (size_t i = 0; i < words.size(); ++i) {
+			words[i] = b * words.size() + i;
+		}
+		ASSERT_EQ(fs_write(fs, writer, words.data(), BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+		uint32_t chunk[100];
+		for (int r = 0; r < 10; ++r) {
+			ASSERT_EQ(fs_read(fs, reader, chunk, sizeof(chunk)), (ssize_t)sizeof(chunk));
+			for (uint32_t word : chunk) {
+				ASSERT_EQ(word, expected++);
+			}
+		}
+	}
+
+	// 2. Normal, rewinding and reading a block at a time
+	ASSERT_EQ(fs_seek(fs, reader, 0, FS_SEEK_SET), 0);
+	for (uint32_t b = 0; b < blocks; ++b) {
+		ASSERT_EQ(fs_read(fs, reader, words.data(), BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+		ASSERT_EQ(words[0], b * words.size());
+		ASSERT_EQ(words[words.size() - 1], (b + 1) * words.size() - 1);
+	}
+
+	// 3. Normal, a removed file's blocks go to a new file, whose descriptor must not see the old mapping
+	ASSERT_EQ(fs_close(fs, writer), 0);
+	ASSERT_EQ(fs_close(fs, reader), 0);
+	ASSERT_EQ(fs_remove(fs, "/big"), 0);
+	ASSERT_EQ(fs_create(fs, "/spacer", FS_REGULAR), 0);
+	int spacer = fs_open(fs, "/spacer");
+	ASSERT_EQ(fs_write(fs, spacer, words.data(), BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_create(fs, "/small", FS_REGULAR), 0);
+	int small = fs_open(fs, "/small");
+	ASSERT_GE(small, 0);
+	memset(words.data(), 0x5A, BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_write(fs, small, words.data(), BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_seek(fs, small, 0, FS_SEEK_SET), 0);
+	memset(words.data(), 0, BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_read(fs, small, words.data(), BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+	ASSERT_EQ(words[0], 0x5A5A5A5Au);
+	ASSERT_EQ(fs_read(fs, small, words.data(), BLOCK_SIZE_BYTES), 0);
+
+	ASSERT_EQ(fs_close(fs, small), 0);
+	ASSERT_EQ(fs_close(fs, spacer), 0);
+	fs_unmount(fs);
+}
+
+TEST(k_tests, inode_cache) {
+	const char * test_fname = "k_tests_inode_cache.FS";
+	FS * fs = fs_format_ex(test_fname, FS_FEATURE_DIR_INDEX);
+	ASSERT_NE(fs, nullptr);
+	uint8_t data[100];
+	memset(data, 0x33, sizeof(data));
+	inode_t raw;
+
+	// 1. Normal, an open file's inode changes stay in memory, every descriptor sees them
+	ASSERT_EQ(fs_create(fs, "/first", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/first");
+	int other = fs_open(fs, "/first");
+	ASSERT_GE(fd, 0);
+	ASSERT_GE(other, 0);
+	ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t)sizeof(data));
+	ASSERT_EQ(fs_seek(fs, other, 0, FS_SEEK_END), (off_t)sizeof(data));
+	block_store_inode_read(fs->BlockStore_inode, 1, &raw);
+	ASSERT_EQ(raw.fileSize, 0u);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_close(fs, other), 0);
+
+	// 2. Normal, plenty of files open at once, far more than are kept once closed
+	const int files = 200;
+	std::vector<int> fds;
+	for (int i = 0; i < files; ++i) {
+		std::string path = "/f" + std::to_string(i);
+		ASSERT_EQ(fs_create(fs, path.c_str(), FS_REGULAR), 0);
+		fds.push_back(fs_open(fs, path.c_str()));
+		ASSERT_GE(fds.back(), 0);
+		ASSERT_EQ(fs_write(fs, fds.back(), data, i + 1), i + 1);
+	}
+	for (int i = 0; i < files; ++i) {
+		ASSERT_EQ(fs_seek(fs, fds[i], 0, FS_SEEK_END), i + 1);
+		ASSERT_EQ(fs_close(fs, fds[i]), 0);
+	}
+
+	// 3. Normal, closing that many pushed the oldest ones out, written back on the way
+	block_store_inode_read(fs->BlockStore_inode, 1, &raw);
+	ASSERT_EQ(raw.fileSize, sizeof(data));
+	block_store_inode_read(fs->BlockStore_inode, 2, &raw);
+	ASSERT_EQ(raw.fileSize, 1u);
+
+	// 4. Normal, everything left is written back at unmount
+	fs_unmount(fs);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	for (int i = 0; i < files; ++i) {
+		std::string path = "/f" + std::to_string(i);
+		fd = fs_open(fs, path.c_str());
+		ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), i + 1);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+	fs_unmount(fs);
+}
+
+TEST(k_tests, descriptor_table) {
+	const char * test_fname = "k_tests_descriptor_table.FS";
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/shared", FS_REGULAR), 0);
+	char text[] = "0123456789";
+	int fd = fs_open(fs, "/shared");
+	ASSERT_EQ(fs_write(fs, fd, text, 10), 10);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 1. Normal, number_fd at once by default
+	std::vector<int> fds;
+	for (int i = 0; i < number_fd; ++i) {
+		fds.push_back(fs_open(fs, "/shared"));
+		ASSERT_EQ(fds.back(), i);
+	}
+	ASSERT_LT(fs_open(fs, "/shared"), 0);
+
+	// 2. Normal, raising the limit lets thousands be open, each with its own position
+	const int many = 3000;
+	ASSERT_EQ(fs_set_fd_limit(fs, many), 0);
+	while ((int)fds.size() < many) {
+		fds.push_back(fs_open(fs, "/shared"));
+		ASSERT_EQ(fds.back(), (int)fds.size() - 1);
+	}
+	ASSERT_LT(fs_open(fs, "/shared"), 0);
+	for (int i = 0; i < many; ++i) {
+		ASSERT_EQ(fs_seek(fs, fds[i], i % 10, FS_SEEK_SET), i % 10);
+	}
+	for (int i = 0; i < many; i += 7) {
+		char c;
+		ASSERT_EQ(fs_read(fs, fds[i], &c, 1), 1);
+		ASSERT_EQ(c, '0' + i % 10);
+	}
+
+	// 3. Normal, the most recently closed descriptor is handed out next, at BOF
+	ASSERT_EQ(fs_close(fs, fds[1234]), 0);
+	ASSERT_EQ(fs_close(fs, fds[17]), 0);
+	ASSERT_EQ(fs_open(fs, "/shared"), 17);
+	ASSERT_EQ(fs_seek(fs, 17, 0, FS_SEEK_CUR), 0);
+	ASSERT_EQ(fs_open(fs, "/shared"), 1234);
+	ASSERT_LT(fs_close(fs, many), 0);
+
+	// 4. Error, the limit can't drop below an open descriptor, or be nonsense
+	ASSERT_LT(fs_set_fd_limit(fs, 10), 0);
+	ASSERT_LT(fs_set_fd_limit(fs, 0), 0);
+	ASSERT_LT(fs_set_fd_limit(fs, (size_t)INT_MAX + 1), 0);
+	ASSERT_LT(fs_set_fd_limit(NULL, 10), 0);
+
+	// 5. Normal, lowering it once they are closed
+	for (int i = 5; i < many; ++i) {
+		ASSERT_EQ(fs_close(fs, fds[i]), 0);
+	}
+	ASSERT_EQ(fs_set_fd_limit(fs, 10), 0);
+	for (int i = 5; i < 10; ++i) {
+		ASSERT_EQ(fs_open(fs, "/shared"), i);
+	}
+	ASSERT_LT(fs_open(fs, "/shared"), 0);
+	ASSERT_LT(fs_read(fs, 10, text, 1), 0);
+	fs_unmount(fs);
+}
+
+TEST(k_tests, block_cache) {
+	const char * test_fname = "k_tests_block_cache.FS";
+	FS * fs = fs_format_ex(test_fname, FS_FEATURE_DIR_INDEX);
+	ASSERT_NE(fs, nullptr);
+	fs_cache_stats_t stats;
+	ASSERT_EQ(fs_cache_stats(fs, &stats), 0);
+	ASSERT_EQ(stats.capacity, 256u);
+	ASSERT_EQ(stats.hits, 0u);
+
+	// 1. Normal, a busy directory is served from the cache
+	const int files = 200;
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	for (int i = 0; i < files; ++i) {
+		ASSERT_EQ(fs_create(fs, ("/dir/f" + std::to_string(i)).c_str(), FS_REGULAR), 0);
+	}
+	ASSERT_EQ(fs_cache_stats(fs, &stats), 0);
+	ASSERT_GT(stats.hits, stats.misses);
+	ASSERT_EQ(stats.writebacks, 0u);
+
+	// 2. Normal, a tiny cache keeps evicting, and writes back what it evicts
+	ASSERT_EQ(fs_set_cache_capacity(fs, 2), 0);
+	ASSERT_EQ(fs_cache_stats(fs, &stats), 0);
+	ASSERT_EQ(stats.capacity, 2u);
+	ASSERT_EQ(stats.hits + stats.misses, 0u);
+	for (int i = 0; i < files; i += 2) {
+		ASSERT_EQ(fs_remove(fs, ("/dir/f" + std::to_string(i)).c_str()), 0);
+	}
+	ASSERT_EQ(fs_cache_stats(fs, &stats), 0);
+	ASSERT_GT(stats.writebacks, 0u);
+	dyn_array_t *listing = fs_get_dir(fs, "/dir");
+	ASSERT_NE(listing, nullptr);
+	ASSERT_EQ(dyn_array_size(listing), (size_t)files / 2);
+	dyn_array_destroy(listing);
+
+	// 3. Normal, no cache at all still works
+	ASSERT_EQ(fs_set_cache_capacity(fs, 0), 0);
+	ASSERT_EQ(fs_create(fs, "/dir/f0", FS_REGULAR), 0);
+	ASSERT_EQ(fs_cache_stats(fs, &stats), 0);
+	ASSERT_EQ(stats.hits, 0u);
+	ASSERT_EQ(stats.writebacks, 0u);
+
+	// 4. Normal, dirty blocks reach the image at unmount
+	ASSERT_EQ(fs_set_cache_capacity(fs, 64), 0);
+	ASSERT_EQ(fs_remove(fs, "/dir/f1"), 0);
+	fs_unmount(fs);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	listing = fs_get_dir(fs, "/dir");
+	ASSERT_NE(listing, nullptr);
+	ASSERT_EQ(dyn_array_size(listing), (size_t)files / 2);
+	dyn_array_destroy(listing);
+	ASSERT_LT(fs_open(fs, "/dir/f1"), 0);
+	int fd = fs_open(fs, "/dir/f0");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 5. Error, bad parameters
+	ASSERT_LT(fs_cache_stats(NULL, &stats), 0);
+	ASSERT_LT(fs_cache_stats(fs, NULL), 0);
+	ASSERT_LT(fs_set_cache_capacity(NULL, 16), 0);
+	fs_unmount(fs);
+}
+
+
+TEST(k_tests, readahead) {
+	const char * test_fname = "k_tests_readahead.FS";
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/stream", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/stream");
+	ASSERT_GE(fd, 0);
+	const uint32_t blocks = 600;
+	std::vector<uint32_t> words(BLOCK_SIZE_BYTES / sizeof(uint32_t));
+	for (uint32_t b = 0; b < blocks; ++b) {
+		for (size_t i = 0; i < words.size(); ++i) {
+			words[i] = b * words.size() + i;
+		}
+		ASSERT_EQ(fs_write(fs, fd, words.data(), BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+	}
+
+	// 1. Normal, a long sequential stream in odd sized reads runs into EOF with the window fully open
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+	uint32_t chunk[777];
+	uint32_t expected = 0;
+	ssize_t got;
+	while ((got = fs_read(fs, fd, chunk, sizeof(chunk))) > 0) {
+		for (ssize_t i = 0; i < got / (ssize_t)sizeof(uint32_t); ++i) {
+			ASSERT_EQ(chunk[i], expected++);
+		}
+	}
+	ASSERT_EQ(got, 0);
+	ASSERT_EQ(expected, blocks * words.size());
+
+	// 2. Normal, seeking around breaks the stream and every read still lands where it was asked to
+	for (uint32_t b = blocks - 1; b < blocks; b -= 37) {
+		ASSERT_EQ(fs_seek(fs, fd, (off_t)b * BLOCK_SIZE_BYTES + 8, FS_SEEK_SET), (off_t)b * BLOCK_SIZE_BYTES + 8);
+		ASSERT_EQ(fs_read(fs, fd, chunk, 2 * sizeof(uint32_t)), (ssize_t)(2 * sizeof(uint32_t)));
+		ASSERT_EQ(chunk[0], b * words.size() + 2);
+		ASSERT_EQ(chunk[1], b * words.size() + 3);
+	}
+
+	// 3. Normal, readahead on one descriptor does not disturb a writer extending the file on another
+	int writer = fs_open(fs, "/stream");
+	ASSERT_GE(writer, 0);
+	ASSERT_EQ(fs_seek(fs, writer, 0, FS_SEEK_END), (off_t)blocks * BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_seek(fs, fd, (off_t)(blocks - 8) * BLOCK_SIZE_BYTES, FS_SEEK_SET), (off_t)(blocks - 8) * BLOCK_SIZE_BYTES);
+	for (uint32_t b = blocks - 8; b < blocks + 8; ++b) {
+		if (b >= blocks) {
+			for (size_t i = 0; i < words.size(); ++i) {
+				words[i] = b * words.size() + i;
+			}
+			ASSERT_EQ(fs_write(fs, writer, words.data(), BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+		}
+		ASSERT_EQ(fs_read(fs, fd, words.data(), BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+		ASSERT_EQ(words[0], b * words.size());
+	}
+
+	ASSERT_EQ(fs_close(fs, writer), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+}
+
+TEST(k_tests, delayed_allocation) {
+	const char * test_fname = "k_tests_delayed_allocation.FS";
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/a", FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, "/b", FS_REGULAR), 0);
+	int fd_a = fs_open(fs, "/a");
+	int fd_b = fs_open(fs, "/b");
+	ASSERT_GE(fd_a, 0);
+	ASSERT_GE(fd_b, 0);
+	size_t free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+
+	// 1. Normal, 100 byte appends to two files in lockstep take no blocks until the descriptors are closed
+	uint8_t line[100];
+	const int lines = 6 * BLOCK_SIZE_BYTES / sizeof(line);
+	for (int i = 0; i < lines; ++i) {
+		memset(line, i & 0xFF, sizeof(line));
+		ASSERT_EQ(fs_write(fs, fd_a, line, sizeof(line)), (ssize_t)sizeof(line));
+		memset(line, ~i & 0xFF, sizeof(line));
+		ASSERT_EQ(fs_write(fs, fd_b, line, sizeof(line)), (ssize_t)sizeof(line));
+	}
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks);
+	ASSERT_EQ(fs_seek(fs, fd_a, 0, FS_SEEK_END), (off_t)(lines * sizeof(line)));
+
+	// 2. Normal, another descriptor sees buffered appends
+	int reader = fs_open(fs, "/b");
+	ASSERT_GE(reader, 0);
+	ASSERT_EQ(fs_seek(fs, reader, -(off_t)sizeof(line), FS_SEEK_END), (off_t)((lines - 1) * sizeof(line)));
+	ASSERT_EQ(fs_read(fs, reader, line, sizeof(line)), (ssize_t)sizeof(line));
+	ASSERT_EQ(line[0], ~(lines - 1) & 0xFF);
+	ASSERT_EQ(fs_close(fs, reader), 0);
+	ASSERT_EQ(fs_close(fs, fd_a), 0);
+	ASSERT_EQ(fs_close(fs, fd_b), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 12);
+	fs_unmount(fs);
+
+	// 3. Normal, each file ended up in one physically contiguous run, and reads back intact
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	inode_t raw;
+	for (size_t id = 1; id <= 2; ++id) {
+		block_store_inode_read(fs->BlockStore_inode, id, &raw);
+		for (int i = 1; i < 6; ++i) {
+			ASSERT_EQ(raw.directPointer[i], raw.directPointer[0] + i);
+		}
+	}
+	fd_a = fs_open(fs, "/a");
+	ASSERT_GE(fd_a, 0);
+	for (int i = 0; i < lines; ++i) {
+		ASSERT_EQ(fs_read(fs, fd_a, line, sizeof(line)), (ssize_t)sizeof(line));
+		ASSERT_EQ(line[0], i & 0xFF);
+		ASSERT_EQ(line[sizeof(line) - 1], i & 0xFF);
+	}
+
+	// 4. Normal, removing a file drops what is still buffered for it, and the space it was promised
+	free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+	fd_b = fs_open(fs, "/b");
+	ASSERT_EQ(fs_seek(fs, fd_b, 0, FS_SEEK_END), (off_t)(lines * sizeof(line)));
+	ASSERT_EQ(fs_write(fs, fd_b, line, sizeof(line)), (ssize_t)sizeof(line));
+	ASSERT_EQ(fs_remove(fs, "/b"), 0);
+	ASSERT_EQ(fs_close(fs, fd_b), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks + 6);
+
+	// 5. Normal, filling the FS while an append is held back and creating files on the full FS never takes the
+	// blocks promised to it, so it is written out whole
+	ASSERT_EQ(fs_seek(fs, fd_a, 0, FS_SEEK_END), (off_t)(lines * sizeof(line)));
+	memset(line, 0x5A, sizeof(line));
+	ASSERT_EQ(fs_write(fs, fd_a, line, sizeof(line)), (ssize_t)sizeof(line));
+	ASSERT_EQ(fs_create(fs, "/fill", FS_REGULAR), 0);
+	int fill = fs_open(fs, "/fill");
+	ASSERT_GE(fill, 0);
+	std::vector<uint8_t> chunk(64 * BLOCK_SIZE_BYTES, 0xEE);
+	while (fs_write(fs, fill, chunk.data(), chunk.size()) == (ssize_t)chunk.size()) {
+	}
+	for (int i = 0; i < 40; ++i) {
+		std::string name = "/late" + std::to_string(i);
+		fs_create(fs, name.c_str(), FS_DIRECTORY);
+	}
+	ASSERT_EQ(fs_close(fs, fill), 0);
+	ASSERT_EQ(fs_close(fs, fd_a), 0);
+	fs_unmount(fs);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fd_a = fs_open(fs, "/a");
+	ASSERT_GE(fd_a, 0);
+	ASSERT_EQ(fs_seek(fs, fd_a, -(off_t)sizeof(line), FS_SEEK_END), (off_t)(lines * sizeof(line)));
+	memset(line, 0, sizeof(line));
+	ASSERT_EQ(fs_read(fs, fd_a, line, sizeof(line)), (ssize_t)sizeof(line));
+	ASSERT_EQ(line[0], 0x5A);
+	ASSERT_EQ(line[sizeof(line) - 1], 0x5A);
+
+	ASSERT_EQ(fs_close(fs, fd_a), 0);
+	fs_unmount(fs);
+}
+
+TEST(k_tests, fallocate_truncate) {
+	const char * test_fname = "k_tests_fallocate_truncate.FS";
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/db", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/db");
+	ASSERT_GE(fd, 0);
+	size_t free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+	std::vector<uint8_t> data(BLOCK_SIZE_BYTES * 2200);
+
+	// 1. Normal, preallocated space is backed right away, reads as zeros and takes writes without allocating
+	ASSERT_EQ(fs_fallocate(fs, fd, 0, BLOCK_SIZE_BYTES * 100), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 100 - 1);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), BLOCK_SIZE_BYTES * 100);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+	memset(data.data(), 0xFF, BLOCK_SIZE_BYTES * 100);
+	ASSERT_EQ(fs_read(fs, fd, data.data(), BLOCK_SIZE_BYTES * 100), BLOCK_SIZE_BYTES * 100);
+	for (size_t i = 0; i < BLOCK_SIZE_BYTES * 100; ++i) {
+		ASSERT_EQ(data[i], 0);
+	}
+	memset(data.data(), 0x3C, BLOCK_SIZE_BYTES * 100);
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), BLOCK_SIZE_BYTES * 99, 50), BLOCK_SIZE_BYTES * 99);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 100 - 1);
+	ASSERT_EQ(fs_fallocate(fs, fd, 10, 10), 0);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), BLOCK_SIZE_BYTES * 100);
+
+	// 2. Normal, shrinking inside the first block frees the rest, and growing again reads zeros past the cut
+	ASSERT_EQ(fs_truncate(fs, fd, 3000), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 1);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), 3000);
+	ASSERT_EQ(fs_truncate(fs, fd, BLOCK_SIZE_BYTES * 2), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 1);
+	ASSERT_EQ(fs_pread(fs, fd, data.data(), BLOCK_SIZE_BYTES * 3, 0), BLOCK_SIZE_BYTES * 2);
+	ASSERT_EQ(data[49], 0);
+	ASSERT_EQ(data[50], 0x3C);
+	ASSERT_EQ(data[2999], 0x3C);
+	for (size_t i = 3000; i < BLOCK_SIZE_BYTES * 2; ++i) {
+		ASSERT_EQ(data[i], 0);
+	}
+
+	// 3. Normal, cutting a file reaching into double indirect blocks frees those and the pointer blocks too
+	ASSERT_EQ(fs_truncate(fs, fd, 0), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t)data.size());
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 2200 - 3);
+	ASSERT_EQ(fs_truncate(fs, fd, BLOCK_SIZE_BYTES * 10), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 10 - 1);
+	ASSERT_EQ(fs_pread(fs, fd, data.data(), BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES * 9), BLOCK_SIZE_BYTES);
+	ASSERT_EQ(data[0], 0x3C);
+	ASSERT_EQ(fs_pread(fs, fd, data.data(), BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES * 10), 0);
+	ASSERT_EQ(fs_truncate(fs, fd, 0), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks);
+
+	// 4. Error, bad parameters and ranges no file can reach
+	ASSERT_LT(fs_fallocate(NULL, fd, 0, 1), 0);
+	ASSERT_LT(fs_fallocate(fs, 77, 0, 1), 0);
+	ASSERT_LT(fs_fallocate(fs, fd, -1, 1), 0);
+	ASSERT_LT(fs_fallocate(fs, fd, 0, 0), 0);
+	ASSERT_LT(fs_fallocate(fs, fd, 0, (off_t)BLOCK_STORE_NUM_BYTES), 0);
+	ASSERT_LT(fs_truncate(NULL, fd, 0), 0);
+	ASSERT_LT(fs_truncate(fs, 77, 0), 0);
+	ASSERT_LT(fs_truncate(fs, fd, -1), 0);
+	ASSERT_LT(fs_truncate(fs, fd, (off_t)BLOCK_STORE_NUM_BYTES), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+
+	// 5. Normal, an extent mapped file gets one run, and a cut in the middle of it keeps the front
+	fs = fs_format_ex(test_fname, FS_FEATURE_EXTENTS);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/db", FS_REGULAR), 0);
+	fd = fs_open(fs, "/db");
+	free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+	ASSERT_EQ(fs_fallocate(fs, fd, 0, BLOCK_SIZE_BYTES * 500), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 500);
+	memset(data.data(), 0x3C, data.size());
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), BLOCK_SIZE_BYTES * 500, 0), BLOCK_SIZE_BYTES * 500);
+	ASSERT_EQ(fs_truncate(fs, fd, BLOCK_SIZE_BYTES * 250 + 1), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 251);
+	ASSERT_EQ(fs_pread(fs, fd, data.data(), BLOCK_SIZE_BYTES * 2, BLOCK_SIZE_BYTES * 249), BLOCK_SIZE_BYTES + 1);
+	ASSERT_EQ(data[BLOCK_SIZE_BYTES], 0x3C);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+}
+
+TEST(k_tests, sparse_files) {
+	const char * test_fname = "k_tests_sparse_files.FS";
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/vm", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/vm");
+	ASSERT_GE(fd, 0);
+	size_t free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+	std::vector<uint8_t> data(BLOCK_SIZE_BYTES * 8, 0);
+
+	// 1. Normal, writing far past EOF only takes the blocks written, and the gap reads as zeros
+	const off_t far = (off_t)BLOCK_SIZE_BYTES * 3000;
+	memset(data.data(), 0x77, BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_seek(fs, fd, far, FS_SEEK_SET), far);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/vm");
+	ASSERT_GE(fd, 0);
+	// the data block, the double indirect block and one block of pointers under it
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 3);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), far + BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_pread(fs, fd, data.data(), data.size(), far - (off_t)data.size() + 1), (ssize_t)data.size());
+	for (size_t i = 0; i + 1 < data.size(); ++i) {
+		ASSERT_EQ(data[i], 0);
+	}
+	ASSERT_EQ(data[data.size() - 1], 0x77);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 3);
+
+	// 2. Normal, with elision on, zero blocks written into holes stay holes, while the data between them is allocated
+	ASSERT_EQ(fs_set_zero_elision(fs, true), 0);
+	memset(data.data(), 0, data.size());
+	data[BLOCK_SIZE_BYTES * 3 + 5] = 0x11;
+	data[data.size() - 1] = 0x22;
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), data.size(), 0), (ssize_t)data.size());
+	// blocks 3 and 7, and the indirect block behind block 7
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 6);
+	std::vector<uint8_t> check(data.size(), 0xFF);
+	ASSERT_EQ(fs_pread(fs, fd, check.data(), check.size(), 0), (ssize_t)check.size());
+	ASSERT_EQ(check, data);
+
+	// 3. Normal, zeros written over blocks that exist land in place, and appended zero blocks only grow the file
+	ASSERT_EQ(fs_pwrite(fs, fd, data.data(), BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES * 3), BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_pread(fs, fd, check.data(), 10, BLOCK_SIZE_BYTES * 3), 10);
+	ASSERT_EQ(check[5], 0);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), far + BLOCK_SIZE_BYTES);
+	memset(data.data(), 0, data.size());
+	ASSERT_EQ(fs_write(fs, fd, data.data(), BLOCK_SIZE_BYTES * 4), BLOCK_SIZE_BYTES * 4);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 6);
+	fd = fs_open(fs, "/vm");
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), far + BLOCK_SIZE_BYTES * 5);
+
+	// 4. Error, no FS to set it on
+	ASSERT_LT(fs_set_zero_elision(NULL, true), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+}
+
+// copy an image file while it is still mounted, as it would be found after a crash, then wipe the given range
+// of its blocks to stand in for home block writes that never made it
+static void k_tests_crash_copy(const char *from, const char *to, size_t first_block, size_t blocks)
+{
+	std::vector<uint8_t> image(BLOCK_STORE_NUM_BYTES);
+	FILE *in = fopen(from, "rb");
+	ASSERT_NE(in, nullptr);
+	ASSERT_EQ(fread(image.data(), 1, image.size(), in), image.size());
+	fclose(in);
+	memset(image.data() + first_block * BLOCK_SIZE_BYTES, 0, blocks * BLOCK_SIZE_BYTES);
+	FILE *out = fopen(to, "wb");
+	ASSERT_NE(out, nullptr);
+	ASSERT_EQ(fwrite(image.data(), 1, image.size(), out), image.size());
+	fclose(out);
+}
+
+TEST(k_tests, metadata_journal) {
+	const char * test_fname = "k_tests_metadata_journal.FS";
+	const char * crash_fname = "k_tests_metadata_journal_crash.FS";
+	FS * fs = fs_format_ex(test_fname, FS_FEATURE_JOURNAL);
+	ASSERT_NE(fs, nullptr);
+	size_t free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+	uint8_t data[100];
+
+	// 1. Normal, 16 creates and 16 closes make one group, which is committed to the log
+	for (int i = 0; i < 16; ++i) {
+		string name = "/f" + std::to_string(i);
+		ASSERT_EQ(fs_create(fs, name.c_str(), FS_REGULAR), 0);
+		int fd = fs_open(fs, name.c_str());
+		ASSERT_GE(fd, 0);
+		memset(data, i, sizeof(data));
+		ASSERT_EQ(fs_write(fs, fd, data, i + 1), i + 1);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+
+	// 2. Normal, the inode table lost after the commit comes back from the log at mount
+	// (the journal region starts right behind the inode table, at block 5)
+	k_tests_crash_copy(test_fname, crash_fname, 1, 4);
+	FS * crashed = fs_mount(crash_fname);
+	ASSERT_NE(crashed, nullptr);
+	for (int i = 0; i < 16; ++i) {
+		string name = "/f" + std::to_string(i);
+		int fd = fs_open(crashed, name.c_str());
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_seek(crashed, fd, 0, FS_SEEK_END), i + 1);
+		ASSERT_EQ(fs_pread(crashed, fd, data, sizeof(data), 0), i + 1);
+		ASSERT_EQ(data[i], i);
+		ASSERT_EQ(fs_close(crashed, fd), 0);
+	}
+	ASSERT_EQ(fs_unmount(crashed), 0);
+
+	// 3. Normal, a transaction whose logged blocks don't match its commit is not replayed, and the mount still works
+	k_tests_crash_copy(test_fname, crash_fname, 1, 4);
+	FILE *torn = fopen(crash_fname, "r+b");
+	ASSERT_NE(torn, nullptr);
+	ASSERT_EQ(fseek(torn, 7 * BLOCK_SIZE_BYTES + 100, SEEK_SET), 0);
+	ASSERT_EQ(fputc(0x5A, torn), 0x5A);
+	fclose(torn);
+	crashed = fs_mount(crash_fname);
+	ASSERT_NE(crashed, nullptr);
+	ASSERT_LT(fs_open(crashed, "/f3"), 0);
+	ASSERT_EQ(fs_unmount(crashed), 0);
+
+	// 4. Normal, the log takes its region up front, and an image unmounted cleanly mounts with everything in place
+	ASSERT_EQ(fs_remove(fs, "/f0"), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_LT(fs_open(fs, "/f0"), 0);
+	int fd = fs_open(fs, "/f15");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), 16);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_LT(free_blocks, (size_t)BLOCK_STORE_AVAIL_BLOCKS - 1024);
+
+	// 5. Normal, a remove that never committed is rolled back even though the log was emptied before it: the file
+	// keeps its inode and its blocks, and a file created after the crash takes neither
+	uint8_t big[3 * BLOCK_SIZE_BYTES];
+	memset(big, 0x6B, sizeof(big));
+	ASSERT_EQ(fs_create(fs, "/big", FS_REGULAR), 0);
+	fd = fs_open(fs, "/big");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, big, sizeof(big)), (ssize_t)sizeof(big));
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_sync(fs), 0);
+	size_t synced_free = block_store_get_free_blocks(fs->BlockStore_whole);
+	ASSERT_EQ(fs_remove(fs, "/big"), 0);
+	k_tests_crash_copy(test_fname, crash_fname, 0, 0);
+	crashed = fs_mount(crash_fname);
+	ASSERT_NE(crashed, nullptr);
+	ASSERT_EQ(block_store_get_free_blocks(crashed->BlockStore_whole), synced_free);
+	ASSERT_EQ(fs_create(crashed, "/other", FS_REGULAR), 0);
+	fd = fs_open(crashed, "/other");
+	ASSERT_GE(fd, 0);
+	memset(big, 0x11, sizeof(big));
+	ASSERT_EQ(fs_write(crashed, fd, big, sizeof(big)), (ssize_t)sizeof(big));
+	ASSERT_EQ(fs_close(crashed, fd), 0);
+	fd = fs_open(crashed, "/big");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_pread(crashed, fd, big, sizeof(big), 0), (ssize_t)sizeof(big));
+	for (size_t i = 0; i < sizeof(big); ++i) {
+		ASSERT_EQ(big[i], 0x6B);
+	}
+	ASSERT_EQ(fs_close(crashed, fd), 0);
+	ASSERT_EQ(fs_unmount(crashed), 0);
+	fs_unmount(fs);
+}
+
+// every run of blocks an FS pushed through to its image file, see FS::on_sync
+typedef std::vector<std::pair<size_t, size_t>> k_tests_sync_log;
+
+static void k_tests_record_sync(size_t block_ID, size_t count, void *arg)
+{
+	static_cast<k_tests_sync_log *>(arg)->push_back(std::make_pair(block_ID, count));
+}
+
+static bool k_tests_synced(const k_tests_sync_log &log, size_t block_ID)
+{
+	for (const auto &run : log) {
+		if (block_ID >= run.first && block_ID < run.first + run.second) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static size_t k_tests_synced_blocks(const k_tests_sync_log &log)
+{
+	size_t blocks = 0;
+	for (const auto &run : log) {
+		blocks += run.second;
+	}
+	return blocks;
+}
+
+TEST(k_tests, sync) {
+	const char * test_fname = "k_tests_sync.FS";
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	k_tests_sync_log synced;
+	fs->on_sync = k_tests_record_sync;
+	fs->on_sync_arg = &synced;
+	uint8_t data[100];
+	for (size_t i = 0; i < sizeof(data); ++i) {
+		data[i] = i + 1;
+	}
+	inode_t a;
+	inode_t b;
+	inode_t root;
+	const size_t table_block = 1;	// inodes 0 - 7
+
+	// 1. Normal, a short append is held back in its descriptor, then fs_fsync syncs exactly its data block, its inode
+	// table block, block 0 and the free block map
+	ASSERT_EQ(fs_create(fs, "/a", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/a");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_sync(fs), 0);
+	size_t free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+	synced.clear();
+	ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t)sizeof(data));
+	ASSERT_TRUE(synced.empty());
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks);
+	ASSERT_EQ(fs_fsync(fs, fd), 0);
+	block_store_inode_read(fs->BlockStore_inode, 1, &a);
+	ASSERT_EQ(a.fileSize, sizeof(data));
+	ASSERT_NE(a.directPointer[0], 0);
+	ASSERT_TRUE(k_tests_synced(synced, a.directPointer[0]));
+	ASSERT_TRUE(k_tests_synced(synced, table_block));
+	ASSERT_TRUE(k_tests_synced(synced, 0));
+	ASSERT_TRUE(k_tests_synced(synced, BLOCK_STORE_AVAIL_BLOCKS));
+	ASSERT_TRUE(k_tests_synced(synced, BLOCK_STORE_AVAIL_BLOCKS + 1));
+	ASSERT_EQ(k_tests_synced_blocks(synced), 5u);
+
+	// 2. Normal, fs_sync syncs every descriptor's appends and the new directory entry, in ascending runs
+	ASSERT_EQ(fs_create(fs, "/b", FS_REGULAR), 0);
+	int fd2 = fs_open(fs, "/b");
+	ASSERT_GE(fd2, 0);
+	ASSERT_EQ(fs_write(fs, fd2, data, 50), 50);
+	ASSERT_EQ(fs_write(fs, fd, data, 50), 50);
+	synced.clear();
+	ASSERT_EQ(fs_sync(fs), 0);
+	block_store_inode_read(fs->BlockStore_inode, 0, &root);
+	block_store_inode_read(fs->BlockStore_inode, 1, &a);
+	block_store_inode_read(fs->BlockStore_inode, 2, &b);
+	ASSERT_EQ(a.fileSize, 150u);
+	ASSERT_EQ(b.fileSize, 50u);
+	ASSERT_TRUE(k_tests_synced(synced, a.directPointer[0]));
+	ASSERT_TRUE(k_tests_synced(synced, b.directPointer[0]));
+	ASSERT_TRUE(k_tests_synced(synced, root.directPointer[0]));
+	ASSERT_TRUE(k_tests_synced(synced, table_block));
+	ASSERT_TRUE(k_tests_synced(synced, 0));
+	ASSERT_TRUE(k_tests_synced(synced, BLOCK_STORE_AVAIL_BLOCKS));
+	for (size_t i = 1; i < synced.size(); ++i) {
+		ASSERT_GT(synced[i].first, synced[i - 1].first + synced[i - 1].second);
+	}
+
+	// 3. Normal, syncing again with nothing changed syncs nothing, and syncing a file grown past its direct blocks
+	// syncs its new data blocks and its indirect block, but not the other file's blocks
+	synced.clear();
+	ASSERT_EQ(fs_sync(fs), 0);
+	ASSERT_EQ(fs_fsync(fs, fd2), 0);
+	ASSERT_TRUE(synced.empty());
+	std::vector<uint8_t> big(40 * BLOCK_SIZE_BYTES, 0x33);
+	ASSERT_EQ(fs_pwrite(fs, fd2, big.data(), big.size(), 0), (ssize_t)big.size());
+	ASSERT_EQ(fs_fsync(fs, fd2), 0);
+	block_store_inode_read(fs->BlockStore_inode, 2, &b);
+	ASSERT_NE(b.indirectPointer[0], 0);
+	ASSERT_TRUE(k_tests_synced(synced, b.indirectPointer[0]));
+	uint16_t indirect[BLOCK_SIZE_BYTES / sizeof(uint16_t)];
+	ASSERT_EQ(block_store_read(fs->BlockStore_whole, b.indirectPointer[0], indirect), (size_t)BLOCK_SIZE_BYTES);
+	for (size_t i = 0; i < 40; ++i) {
+		ASSERT_TRUE(k_tests_synced(synced, i < 6 ? b.directPointer[i] : indirect[i - 6]));
+	}
+	ASSERT_FALSE(k_tests_synced(synced, a.directPointer[0]));
+	ASSERT_FALSE(k_tests_synced(synced, root.directPointer[0]));
+	ASSERT_EQ(fs_close(fs, fd2), 0);
+
+	// 4. Error, bad parameters
+	ASSERT_LT(fs_sync(NULL), 0);
+	ASSERT_LT(fs_fsync(NULL, fd), 0);
+	ASSERT_LT(fs_fsync(fs, -1), 0);
+	ASSERT_LT(fs_fsync(fs, fd2), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 5. Normal, on a journaled image fs_fsync syncs the data block and the log instead of the inode table block,
+	// and fs_sync puts the metadata in place
+	fs = fs_format_ex(test_fname, FS_FEATURE_JOURNAL);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs->on_sync, nullptr);
+	fs->on_sync = k_tests_record_sync;
+	fs->on_sync_arg = &synced;
+	ASSERT_EQ(fs_create(fs, "/c", FS_REGULAR), 0);
+	fd = fs_open(fs, "/c");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t)sizeof(data));
+	synced.clear();
+	ASSERT_EQ(fs_fsync(fs, fd), 0);
+	k_tests_sync_log fsynced = synced;
+	synced.clear();
+	ASSERT_EQ(fs_sync(fs), 0);
+	block_store_inode_read(fs->BlockStore_inode, 1, &a);
+	ASSERT_EQ(a.fileSize, sizeof(data));
+	ASSERT_TRUE(k_tests_synced(fsynced, a.directPointer[0]));
+	ASSERT_FALSE(k_tests_synced(fsynced, table_block));
+	ASSERT_GT(k_tests_synced_blocks(fsynced), 1u);
+	ASSERT_TRUE(k_tests_synced(synced, table_block));
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 6. Normal, on a large inode image fs_fsync syncs the table block the inode is in, which the map block points at
+	fs = fs_format_ex(test_fname, FS_FEATURE_LARGE_INODES | FS_FEATURE_DIR_INDEX);
+	ASSERT_NE(fs, nullptr);
+	fs->on_sync = k_tests_record_sync;
+	fs->on_sync_arg = &synced;
+	const size_t per_block = BLOCK_SIZE_BYTES / inode_size;
+	for (size_t i = 1; i <= 2 * per_block; ++i) {
+		ASSERT_EQ(fs_create(fs, ("/f" + std::to_string(i)).c_str(), FS_REGULAR), 0);
+	}
+	ASSERT_EQ(fs_sync(fs), 0);
+	//the table is filled from the front, so the last file is inode 2 * per_block, in the third table block
+	fd = fs_open(fs, ("/f" + std::to_string(2 * per_block)).c_str());
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t)sizeof(data));
+	synced.clear();
+	ASSERT_EQ(fs_fsync(fs, fd), 0);
+	uint32_t inode_map[BLOCK_SIZE_BYTES / sizeof(uint32_t)];
+	ASSERT_EQ(block_store_read(fs->BlockStore_whole, 1, inode_map), (size_t)BLOCK_SIZE_BYTES);
+	ASSERT_NE(inode_map[2], 0u);
+	ASSERT_TRUE(k_tests_synced(synced, inode_map[2]));
+	ASSERT_FALSE(k_tests_synced(synced, inode_map[1]));
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+TEST(k_tests, concurrency) {
+	const char * test_fname = "k_tests_concurrency.FS";
+	const int threads = 4;
+	const int files = 8;
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+
+	// 1. Normal, threads create, fill and read back files in directories of their own
+	std::vector<std::thread> workers;
+	std::vector<int> mismatches(threads, 0);
+	for (int t = 0; t < threads; ++t) {
+		workers.emplace_back([fs, t, &mismatches]() {
+			std::string dir = "/t" + std::to_string(t);
+			if (fs_create(fs, dir.c_str(), FS_DIRECTORY) != 0) {
+				++mismatches[t];
+				return;
+			}
+			std::vector<uint8_t> block(BLOCK_SIZE_BYTES);
+			for (int f = 0; f < files; ++f) {
+				std::string path = dir + "/f" + std::to_string(f);
+				int fd = -1;
+				if (fs_create(fs, path.c_str(), FS_REGULAR) != 0 || (fd = fs_open(fs, path.c_str())) < 0) {
+					++mismatches[t];
+					continue;
+				}
+				// short appends get held back, whole blocks go straight in
+				for (int b = 0; b < 16; ++b) {
+					memset(block.data(), t * files + f + b, block.size());
+					size_t length = b % 2 ? block.size() : 100;
+					if (fs_write(fs, fd, block.data(), length) != (ssize_t)length) {
+						++mismatches[t];
+					}
+				}
+				if (fs_close(fs, fd) != 0) {
+					++mismatches[t];
+				}
+			}
+			for (int f = 0; f < files; ++f) {
+				std::string path = dir + "/f" + std::to_string(f);
+				int fd = fs_open(fs, path.c_str());
+				if (fd < 0) {
+					++mismatches[t];
+					continue;
+				}
+				for (int b = 0; b < 16; ++b) {
+					size_t length = b % 2 ? block.size() : 100;
+					if (fs_read(fs, fd, block.data(), length) != (ssize_t)length) {
+						++mismatches[t];
+						break;
+					}
+					for (size_t i = 0; i < length; ++i) {
+						if (block[i] != (uint8_t)(t * files + f + b)) {
+							++mismatches[t];
+							break;
+						}
+					}
+				}
+				fs_close(fs, fd);
+			}
+		});
+	}
+	for (auto &worker : workers) {
+		worker.join();
+	}
+	for (int t = 0; t < threads; ++t) {
+		ASSERT_EQ(mismatches[t], 0);
+		dyn_array_t * record_results = fs_get_dir(fs, ("/t" + std::to_string(t)).c_str());
+		ASSERT_NE(record_results, nullptr);
+		ASSERT_EQ(dyn_array_size(record_results), (size_t)files);
+		dyn_array_destroy(record_results);
+	}
+
+	// 2. Normal, threads write disjoint stretches of one file through one descriptor while others read it through theirs
+	ASSERT_EQ(fs_create(fs, "/shared", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/shared");
+	ASSERT_GE(fd, 0);
+	workers.clear();
+	for (int t = 0; t < threads; ++t) {
+		mismatches[t] = 0;
+		workers.emplace_back([fs, fd, t, &mismatches]() {
+			std::vector<uint32_t> words(BLOCK_SIZE_BYTES / sizeof(uint32_t));
+			for (int b = t; b < 64; b += threads) {
+				for (size_t i = 0; i < words.size(); ++i) {
+					words[i] = b * words.size() + i;
+				}
+				if (fs_pwrite(fs, fd, words.data(), BLOCK_SIZE_BYTES, (off_t)b * BLOCK_SIZE_BYTES) != BLOCK_SIZE_BYTES) {
+					++mismatches[t];
+				}
+			}
+			int own = fs_open(fs, "/shared");
+			if (own < 0) {
+				++mismatches[t];
+				return;
+			}
+			uint32_t value;
+			while (fs_read(fs, own, &value, sizeof(value)) == (ssize_t)sizeof(value)) {
+				// a stretch another thread hasn't written yet reads as zeros
+				if (value != 0 && value != (uint32_t)(fs_seek(fs, own, 0, FS_SEEK_CUR) / sizeof(value) - 1)) {
+					++mismatches[t];
+				}
+			}
+			fs_close(fs, own);
+		});
+	}
+	for (auto &worker : workers) {
+		worker.join();
+	}
+	for (int t = 0; t < threads; ++t) {
+		ASSERT_EQ(mismatches[t], 0);
+	}
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), 64 * BLOCK_SIZE_BYTES);
+	uint32_t word = 0;
+	ASSERT_EQ(fs_pread(fs, fd, &word, sizeof(word), 63 * BLOCK_SIZE_BYTES + 4), (ssize_t)sizeof(word));
+	ASSERT_EQ(word, 63 * 1024u + 1);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 3. Normal, names come and go in one directory while it is listed and the FS is synced
+	ASSERT_EQ(fs_create(fs, "/churn", FS_DIRECTORY), 0);
+	workers.clear();
+	for (int t = 0; t < threads; ++t) {
+		mismatches[t] = 0;
+		workers.emplace_back([fs, t, &mismatches]() {
+			std::string from = "/churn/a" + std::to_string(t);
+			std::string to = "/churn/b" + std::to_string(t);
+			for (int i = 0; i < 200; ++i) {
+				if (fs_create(fs, from.c_str(), FS_REGULAR) != 0 || fs_move(fs, from.c_str(), to.c_str()) != 0
+						|| fs_remove(fs, to.c_str()) != 0) {
+					++mismatches[t];
+				}
+			}
+		});
+	}
+	workers.emplace_back([fs]() {
+		for (int i = 0; i < 50; ++i) {
+			dyn_array_t * record_results = fs_get_dir(fs, "/churn");
+			if (record_results != nullptr) {
+				dyn_array_destroy(record_results);
+			}
+			fs_sync(fs);
+		}
+	});
+	for (auto &worker : workers) {
+		worker.join();
+	}
+	for (int t = 0; t < threads; ++t) {
+		ASSERT_EQ(mismatches[t], 0);
+	}
+	dyn_array_t * record_results = fs_get_dir(fs, "/churn");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), 0u);
+	dyn_array_destroy(record_results);
+
+	// 4. Normal, everything survives a remount
+	ASSERT_EQ(fs_unmount(fs), 0);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/t3/f7");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), 8 * 100 + 8 * BLOCK_SIZE_BYTES);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+
+	// 5. Normal, on a journaled image calls join and leave transactions while another thread keeps committing them
+	fs = fs_format_ex(test_fname, FS_FEATURE_JOURNAL);
+	ASSERT_NE(fs, nullptr);
+	workers.clear();
+	for (int t = 0; t < threads; ++t) {
+		mismatches[t] = 0;
+		workers.emplace_back([fs, t, &mismatches]() {
+			std::vector<uint8_t> block(BLOCK_SIZE_BYTES, (uint8_t)t);
+			for (int i = 0; i < 40; ++i) {
+				std::string path = "/j" + std::to_string(t) + "_" + std::to_string(i % 4);
+				int own = -1;
+				if (fs_create(fs, path.c_str(), FS_REGULAR) != 0 || (own = fs_open(fs, path.c_str())) < 0) {
+					++mismatches[t];
+					continue;
+				}
+				if (fs_write(fs, own, block.data(), i % 2 ? block.size() : 100) < 0 || fs_close(fs, own) != 0) {
+					++mismatches[t];
+				}
+				if (i % 4 == 3) {
+					for (int k = 0; k < 4; ++k) {
+						fs_remove(fs, ("/j" + std::to_string(t) + "_" + std::to_string(k)).c_str());
+					}
+				}
+			}
+		});
+	}
+	workers.emplace_back([fs]() {
+		for (int i = 0; i < 50; ++i) {
+			fs_sync(fs);
+		}
+	});
+	for (auto &worker : workers) {
+		worker.join();
+	}
+	for (int t = 0; t < threads; ++t) {
+		ASSERT_EQ(mismatches[t], 0);
+	}
+	record_results = fs_get_dir(fs, "/");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), 0u);
+	dyn_array_destroy(record_results);
+	ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+TEST(k_tests, async_io) {
+	const char * test_fname = "k_tests_async_io.FS";
+	const size_t blocks = 64;
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/data", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/data");
+	ASSERT_GE(fd, 0);
+	std::vector<fs_aio_completion_t> completions(FS_AIO_QUEUE);
+
+	// 1. Normal, block writes queued back to front land where they were aimed, each completion carries its tag
+	std::vector<std::vector<uint32_t>> out(blocks, std::vector<uint32_t>(BLOCK_SIZE_BYTES / sizeof(uint32_t)));
+	std::vector<fs_aio_request_t> requests(blocks);
+	for (size_t b = 0; b < blocks; ++b) {
+		for (size_t i = 0; i < out[b].size(); ++i) {
+			out[b][i] = b * out[b].size() + i;
+		}
+		size_t r = blocks - 1 - b;
+		requests[r].op = FS_AIO_WRITE;
+		requests[r].fd = fd;
+		requests[r].buffer = out[b].data();
+		requests[r].nbyte = BLOCK_SIZE_BYTES;
+		requests[r].offset = b * BLOCK_SIZE_BYTES;
+		requests[r].tag = b;
+	}
+	ASSERT_EQ(fs_submit(fs, requests.data(), blocks), (ssize_t)blocks);
+	std::vector<int> seen(blocks, 0);
+	for (size_t done = 0; done < blocks; ) {
+		ssize_t got = fs_poll(fs, completions.data(), completions.size(), true);
+		ASSERT_GT(got, 0);
+		for (ssize_t i = 0; i < got; ++i) {
+			ASSERT_LT(completions[i].tag, blocks);
+			ASSERT_EQ(completions[i].result, BLOCK_SIZE_BYTES);
+			++seen[completions[i].tag];
+		}
+		done += got;
+	}
+	for (size_t b = 0; b < blocks; ++b) {
+		ASSERT_EQ(seen[b], 1);
+	}
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_CUR), 0);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), (off_t)(blocks * BLOCK_SIZE_BYTES));
+	uint32_t word = 0;
+	ASSERT_EQ(fs_pread(fs, fd, &word, sizeof(word), 37 * BLOCK_SIZE_BYTES + 8), (ssize_t)sizeof(word));
+	ASSERT_EQ(word, 37 * 1024u + 2);
+
+	// 2. Normal, small reads scattered over the file, the one past EOF comes back short and the one at EOF empty
+	std::vector<uint32_t> in(blocks + 1);
+	for (size_t b = 0; b < blocks; ++b) {
+		requests[b].op = FS_AIO_READ;
+		requests[b].fd = fd;
+		requests[b].buffer = &in[b];
+		requests[b].nbyte = sizeof(uint32_t);
+		requests[b].offset = ((b * 7) % blocks) * BLOCK_SIZE_BYTES + 12;
+		requests[b].tag = b;
+	}
+	requests.push_back(requests[0]);
+	requests[blocks].offset = blocks * BLOCK_SIZE_BYTES - 2;
+	requests[blocks].buffer = &in[blocks];
+	requests[blocks].tag = blocks;
+	ASSERT_EQ(fs_submit(fs, requests.data(), blocks + 1), (ssize_t)blocks + 1);
+	for (size_t done = 0; done < blocks + 1; ) {
+		ssize_t got = fs_poll(fs, completions.data(), completions.size(), true);
+		ASSERT_GT(got, 0);
+		for (ssize_t i = 0; i < got; ++i) {
+			size_t b = completions[i].tag;
+			if (b == blocks) {
+				ASSERT_EQ(completions[i].result, 2);
+			}
+			else {
+				ASSERT_EQ(completions[i].result, (ssize_t)sizeof(uint32_t));
+				ASSERT_EQ(in[b], ((b * 7) % blocks) * 1024u + 3);
+			}
+		}
+		done += got;
+	}
+
+	// 3. Normal, adjacent reads cover the file in one pass however they are split
+	std::vector<uint8_t> whole(blocks * BLOCK_SIZE_BYTES);
+	requests.clear();
+	for (size_t at = 0, i = 0; at < whole.size(); ++i) {
+		size_t length = (i % 5 + 1) * 1000;
+		if (length > whole.size() - at) {
+			length = whole.size() - at;
+		}
+		requests.push_back({ FS_AIO_READ, fd, whole.data() + at, length, (off_t)at, i });
+		at += length;
+	}
+	ASSERT_EQ(fs_submit(fs, requests.data(), requests.size()), (ssize_t)requests.size());
+	for (size_t done = 0; done < requests.size(); ) {
+		ssize_t got = fs_poll(fs, completions.data(), completions.size(), true);
+		ASSERT_GT(got, 0);
+		for (ssize_t i = 0; i < got; ++i) {
+			ASSERT_EQ(completions[i].result, (ssize_t)requests[completions[i].tag].nbyte);
+		}
+		done += got;
+	}
+	for (size_t b = 0; b < blocks; ++b) {
+		ASSERT_EQ(memcmp(whole.data() + b * BLOCK_SIZE_BYTES, out[b].data(), BLOCK_SIZE_BYTES), 0);
+	}
+
+	// 4. Error, bad requests complete with an error, the queue only takes FS_AIO_QUEUE at a time
+	fs_aio_request_t bad[3] = {
+		{ FS_AIO_READ, fd + 1, &word, sizeof(word), 0, 1 },
+		{ FS_AIO_READ, fd, NULL, sizeof(word), 0, 2 },
+		{ FS_AIO_WRITE, fd, &word, sizeof(word), -1, 3 },
+	};
+	ASSERT_EQ(fs_submit(fs, bad, 3), 3);
+	for (size_t done = 0; done < 3; ) {
+		ssize_t got = fs_poll(fs, completions.data(), completions.size(), true);
+		ASSERT_GT(got, 0);
+		for (ssize_t i = 0; i < got; ++i) {
+			ASSERT_LT(completions[i].result, 0);
+		}
+		done += got;
+	}
+	ASSERT_EQ(fs_poll(fs, completions.data(), completions.size(), true), 0);
+	//each request reads into its own word, the workers carry them out at the same time
+	std::vector<fs_aio_request_t> flood(FS_AIO_QUEUE + 10, { FS_AIO_READ, fd, &word, sizeof(word), 0, 0 });
+	std::vector<decltype(word)> words(flood.size());
+	for (size_t i = 0; i < flood.size(); ++i) {
+		flood[i].buffer = &words[i];
+	}
+	ASSERT_EQ(fs_submit(fs, flood.data(), flood.size()), FS_AIO_QUEUE);
+	ASSERT_EQ(fs_submit(fs, flood.data(), 1), 0);
+	ASSERT_LT(fs_submit(NULL, flood.data(), 1), 0);
+	ASSERT_LT(fs_submit(fs, NULL, 1), 0);
+	ASSERT_LT(fs_poll(NULL, completions.data(), 1, false), 0);
+	ASSERT_LT(fs_poll(fs, NULL, 1, false), 0);
+
+	// 5. Normal, unmounting finishes what is still queued
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+TEST(k_tests, batch_metadata) {
+	const char * test_fname = "k_tests_batch.FS";
+	const size_t files = 200;
+	std::vector<std::string> names(files);
+	std::vector<const char *> name_ptrs(files);
+	for (size_t i = 0; i < files; ++i) {
+		names[i] = "file" + std::to_string(i);
+		name_ptrs[i] = names[i].c_str();
+	}
+	std::vector<int> results(files + 4);
+
+	FS * fs = fs_format_ex(test_fname, FS_FEATURE_DIR_INDEX);
+	ASSERT_NE(fs, nullptr);
+	size_t free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+	ASSERT_EQ(fs_create(fs, "/big", FS_DIRECTORY), 0);
+
+	// 1. Normal, a batch far bigger than one directory block goes into an empty directory in one call
+	ASSERT_EQ(fs_create_many(fs, "/big", name_ptrs.data(), files, FS_REGULAR, results.data()), (ssize_t)files);
+	for (size_t i = 0; i < files; ++i) {
+		ASSERT_EQ(results[i], 0);
+	}
+	dyn_array_t *record_results = fs_get_dir(fs, "/big");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), files);
+	ASSERT_TRUE(find_in_directory(record_results, "file0"));
+	ASSERT_TRUE(find_in_directory(record_results, "file199"));
+	dyn_array_destroy(record_results);
+	int fd = fs_open(fs, "/big/file123");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, "abc", 3), 3);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 2. Normal/Error, names already there, repeated within the batch or malformed fail on their own
+	const char *mixed[] = {"file5", "fresh", "fresh", "", "a/b", "sub"};
+	ASSERT_EQ(fs_create_many(fs, "/big", mixed, 6, FS_DIRECTORY, results.data()), 2);
+	ASSERT_LT(results[0], 0);
+	ASSERT_EQ(results[1], 0);
+	ASSERT_LT(results[2], 0);
+	ASSERT_LT(results[3], 0);
+	ASSERT_LT(results[4], 0);
+	ASSERT_EQ(results[5], 0);
+	ASSERT_EQ(fs_create(fs, "/big/sub/inner", FS_REGULAR), 0);
+	ASSERT_LT(fs_open(fs, "/big/fresh"), 0);	// a directory
+
+	// 3. Normal, a classic directory takes a batch that fits, and the root works as the directory
+	const char *few[] = {"one", "two", "three"};
+	ASSERT_EQ(fs_create_many(fs, "/", few, 3, FS_REGULAR, NULL), 3);
+	fd = fs_open(fs, "/two");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+
+	// 4. Normal, the batch survives a remount and comes out again in one call
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/big/file123");
+	ASSERT_GE(fd, 0);
+	char buffer[4] = {0};
+	ASSERT_EQ(fs_read(fs, fd, buffer, 3), 3);
+	ASSERT_STREQ(buffer, "abc");
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	name_ptrs.push_back("missing");
+	name_ptrs.push_back("fresh");
+	name_ptrs.push_back("sub");
+	ASSERT_EQ(fs_remove_many(fs, "/big", name_ptrs.data(), name_ptrs.size(), results.data()), (ssize_t)files + 1);
+	for (size_t i = 0; i < files; ++i) {
+		ASSERT_EQ(results[i], 0);
+	}
+	ASSERT_LT(results[files], 0);
+	ASSERT_EQ(results[files + 1], 0);
+	ASSERT_LT(results[files + 2], 0);	// not empty
+	ASSERT_LT(fs_open(fs, "/big/file42"), 0);
+	ASSERT_EQ(fs_remove(fs, "/big/sub/inner"), 0);
+	const char *rest[] = {"sub"};
+	ASSERT_EQ(fs_remove_many(fs, "/big", rest, 1, NULL), 1);
+	ASSERT_EQ(fs_remove_many(fs, "/", few, 3, NULL), 3);
+	ASSERT_EQ(fs_remove(fs, "/big"), 0);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks - 1);	// the root's own block
+
+	// 5. Error, a plain image still caps a directory at one block, the overflow fails name by name
+	fs_unmount(fs);
+	fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create_many(fs, "/", name_ptrs.data(), 40, FS_REGULAR, results.data()), folder_number_entries);
+	ASSERT_LT(results[folder_number_entries], 0);
+	ASSERT_EQ(fs_remove_many(fs, "/", name_ptrs.data(), 40, NULL), folder_number_entries);
+
+	// 6. Error, bad parameters and directories that aren't there
+	ASSERT_LT(fs_create_many(NULL, "/", few, 3, FS_REGULAR, NULL), 0);
+	ASSERT_LT(fs_create_many(fs, NULL, few, 3, FS_REGULAR, NULL), 0);
+	ASSERT_LT(fs_create_many(fs, "/", NULL, 3, FS_REGULAR, NULL), 0);
+	ASSERT_LT(fs_create_many(fs, "/nowhere", few, 3, FS_REGULAR, NULL), 0);
+	ASSERT_LT(fs_create_many(fs, "/", few, 3, (file_t)7, NULL), 0);
+	ASSERT_LT(fs_remove_many(fs, "/nowhere", few, 3, NULL), 0);
+	ASSERT_LT(fs_remove_many(fs, "relative", few, 3, NULL), 0);
+	ASSERT_EQ(fs_create_many(fs, "/", few, 0, FS_REGULAR, NULL), 0);
+	fs_unmount(fs);
+}
+
+// the bucket an indexed directory files a name under: FNV-1a over its bytes, cut to the 256 slots of the index block
+static size_t k_tests_index_bucket(const std::string &name)
+{
+	uint32_t hash = 2166136261u;
+	for (unsigned char c : name) {
+		hash ^= c;
+		hash *= 16777619u;
+	}
+	return hash & (BLOCK_SIZE_BYTES / sizeof(uint16_t) - 1);
+}
+
+// list what is left of a listing, counting how often each name comes up
+static void k_tests_list_rest(FS *fs, fs_dir_t *dir, std::map<std::string, int> &seen)
+{
+	std::vector<file_record_t> records(folder_number_entries);
+	ssize_t batch;
+	while ((batch = fs_readdir_many(fs, dir, records.data(), records.size())) > 0) {
+		for (ssize_t i = 0; i < batch; ++i) {
+			++seen[records[i].name];
+		}
+	}
+	ASSERT_EQ(batch, 0);
+}
+
+TEST(k_tests, directory_stream) {
+	const char * test_fname = "k_tests_dirstream.FS";
+	const size_t files = 240;
+	std::vector<std::string> names(files);
+	std::vector<const char *> name_ptrs(files);
+	for (size_t i = 0; i < files; ++i) {
+		names[i] = "entry" + std::to_string(i);
+		name_ptrs[i] = names[i].c_str();
+	}
+	fs_dir_t dir;
+	file_record_t record;
+	std::vector<file_record_t> records(7);
+
+	FS * fs = fs_format_ex(test_fname, FS_FEATURE_DIR_INDEX);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/big", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create_many(fs, "/big", name_ptrs.data(), files - 1, FS_REGULAR, NULL), (ssize_t)files - 1);
+	ASSERT_EQ(fs_create(fs, "/big/entry239", FS_DIRECTORY), 0);
+
+	// 1. Normal, one entry at a time lists every name of an indexed directory once, with its type
+	std::vector<int> seen(files, 0);
+	ASSERT_EQ(fs_opendir(fs, "/big", &dir), 0);
+	int got;
+	while ((got = fs_readdir(fs, &dir, &record)) == 1) {
+		size_t i = std::stoul(std::string(record.name).substr(5));
+		ASSERT_LT(i, files);
+		++seen[i];
+		ASSERT_EQ(record.type, i == files - 1 ? FS_DIRECTORY : FS_REGULAR);
+	}
+	ASSERT_EQ(got, 0);
+	ASSERT_EQ(fs_readdir(fs, &dir, &record), 0);
+	ASSERT_EQ(fs_closedir(fs, &dir), 0);
+	for (size_t i = 0; i < files; ++i) {
+		ASSERT_EQ(seen[i], 1);
+	}
+
+	// 2. Normal, in batches, removing entries along the way still ends the listing
+	ASSERT_EQ(fs_opendir(fs, "/big", &dir), 0);
+	size_t listed = 0;
+	ssize_t batch;
+	while ((batch = fs_readdir_many(fs, &dir, records.data(), records.size())) > 0) {
+		ASSERT_LE(batch, (ssize_t)records.size());
+		listed += batch;
+		if (listed == 7) {
+			ASSERT_EQ(fs_remove_many(fs, "/big", name_ptrs.data(), 100, NULL), 100);
+		}
+	}
+	ASSERT_EQ(batch, 0);
+	ASSERT_GE(listed, files - 100);
+	ASSERT_LE(listed, files);
+	ASSERT_EQ(fs_closedir(fs, &dir), 0);
+
+	// 3. Normal, a classic directory, the root and an empty directory
+	const char *few[] = {"a", "b", "c"};
+	ASSERT_EQ(fs_create_many(fs, "/", few, 3, FS_REGULAR, NULL), 3);
+	ASSERT_EQ(fs_opendir(fs, "/", &dir), 0);
+	ASSERT_EQ(fs_readdir_many(fs, &dir, records.data(), records.size()), 4);
+	ASSERT_EQ(fs_readdir_many(fs, &dir, records.data(), records.size()), 0);
+	ASSERT_EQ(fs_closedir(fs, &dir), 0);
+	ASSERT_EQ(fs_create(fs, "/empty", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_opendir(fs, "/empty", &dir), 0);
+	ASSERT_EQ(fs_readdir(fs, &dir, &record), 0);
+	ASSERT_EQ(fs_closedir(fs, &dir), 0);
+
+	// 4. Error, a directory removed under the listing
+	ASSERT_EQ(fs_opendir(fs, "/empty", &dir), 0);
+	ASSERT_EQ(fs_remove(fs, "/empty"), 0);
+	ASSERT_LT(fs_readdir(fs, &dir, &record), 0);
+	ASSERT_EQ(fs_closedir(fs, &dir), 0);
+
+	// 5. Error, bad parameters, missing paths, files and closed listings
+	ASSERT_LT(fs_opendir(NULL, "/", &dir), 0);
+	ASSERT_LT(fs_opendir(fs, NULL, &dir), 0);
+	ASSERT_LT(fs_opendir(fs, "/", NULL), 0);
+	ASSERT_LT(fs_opendir(fs, "/nowhere", &dir), 0);
+	ASSERT_LT(fs_opendir(fs, "/a", &dir), 0);
+	ASSERT_EQ(fs_opendir(fs, "/", &dir), 0);
+	ASSERT_LT(fs_readdir(fs, &dir, NULL), 0);
+	ASSERT_EQ(fs_closedir(fs, &dir), 0);
+	ASSERT_LT(fs_closedir(fs, &dir), 0);
+	ASSERT_LT(fs_readdir(fs, &dir, &record), 0);
+	ASSERT_LT(fs_readdir_many(fs, &dir, records.data(), records.size()), 0);
+	fs_unmount(fs);
+
+	// 6. Normal, a crawler removing what it has listed, three chain blocks of one bucket, with names pushed onto the
+	// chain as it goes: every name that stays is listed once, and none is listed twice
+	fs = fs_format_ex(test_fname, FS_FEATURE_DIR_INDEX | FS_FEATURE_LARGE_INODES);
+	ASSERT_NE(fs, nullptr);
+	std::vector<std::string> chain;
+	for (size_t i = 0; chain.size() < 3 * folder_number_entries + 40; ++i) {
+		std::string name = "c" + std::to_string(i);
+		if (k_tests_index_bucket(name) == 7) {
+			chain.push_back(name);
+		}
+	}
+	ASSERT_EQ(fs_create(fs, "/crawl", FS_DIRECTORY), 0);
+	for (size_t i = 0; i < 3 * folder_number_entries; ++i) {
+		ASSERT_EQ(fs_create(fs, ("/crawl/" + chain[i]).c_str(), FS_REGULAR), 0);
+	}
+	std::map<std::string, int> listing;
+	ASSERT_EQ(fs_opendir(fs, "/crawl", &dir), 0);
+	std::vector<file_record_t> first(folder_number_entries);
+	ASSERT_EQ(fs_readdir_many(fs, &dir, first.data(), first.size()), (ssize_t)first.size());
+	for (const file_record_t &r : first) {
+		++listing[r.name];
+		ASSERT_EQ(fs_remove(fs, ("/crawl/" + std::string(r.name)).c_str()), 0);
+	}
+	ASSERT_EQ(fs_readdir_many(fs, &dir, first.data(), first.size()), (ssize_t)first.size());
+	for (const file_record_t &r : first) {
+		++listing[r.name];
+	}
+	for (size_t i = 3 * folder_number_entries; i < chain.size(); ++i) {
+		ASSERT_EQ(fs_create(fs, ("/crawl/" + chain[i]).c_str(), FS_REGULAR), 0);
+	}
+	k_tests_list_rest(fs, &dir, listing);
+	ASSERT_EQ(fs_closedir(fs, &dir), 0);
+	for (size_t i = 0; i < chain.size(); ++i) {
+		ASSERT_LE(listing[chain[i]], 1) << chain[i];
+		if (i < 3 * folder_number_entries) {
+			ASSERT_EQ(listing[chain[i]], 1) << chain[i];
+		}
+	}
+
+	// 7. Normal, a classic directory that turns indexed between calls hands out none of what it listed again
+	ASSERT_EQ(fs_create(fs, "/grow", FS_DIRECTORY), 0);
+	for (int i = 0; i < 10; ++i) {
+		ASSERT_EQ(fs_create(fs, ("/grow/g" + std::to_string(i)).c_str(), FS_REGULAR), 0);
+	}
+	listing.clear();
+	ASSERT_EQ(fs_opendir(fs, "/grow", &dir), 0);
+	for (int i = 0; i < 10; ++i) {
+		ASSERT_EQ(fs_readdir(fs, &dir, &record), 1);
+		++listing[record.name];
+	}
+	for (int i = 10; i < 50; ++i) {
+		ASSERT_EQ(fs_create(fs, ("/grow/g" + std::to_string(i)).c_str(), FS_REGULAR), 0);
+	}
+	k_tests_list_rest(fs, &dir, listing);
+	ASSERT_EQ(fs_closedir(fs, &dir), 0);
+	for (int i = 0; i < 50; ++i) {
+		ASSERT_LE(listing["g" + std::to_string(i)], 1);
+	}
+	for (int i = 0; i < 10; ++i) {
+		ASSERT_EQ(listing["g" + std::to_string(i)], 1);
+	}
+	fs_unmount(fs);
+}
+
+TEST(k_tests, large_inodes) {
+	const char * test_fname = "k_tests_large_inodes.FS";
+	const size_t files = 1000;
+	std::vector<std::string> names(files);
+	std::vector<const char *> name_ptrs(files);
+	for (size_t i = 0; i < files; ++i) {
+		names[i] = "f" + std::to_string(i);
+		name_ptrs[i] = names[i].c_str();
+	}
+	char buffer[32];
+
+	FS * fs = fs_format_ex(test_fname, FS_FEATURE_LARGE_INODES | FS_FEATURE_DIR_INDEX);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs->BlockStore_inode, nullptr);
+
+	// 1. Normal, far more files than a classic inode table holds, each with its own data
+	ASSERT_EQ(fs_create(fs, "/many", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create_many(fs, "/many", name_ptrs.data(), files, FS_REGULAR, NULL), (ssize_t)files);
+	for (size_t i = 0; i < files; i += 111) {
+		std::string path = "/many/" + names[i];
+		int fd = fs_open(fs, path.c_str());
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_write(fs, fd, path.c_str(), path.size() + 1), (ssize_t)path.size() + 1);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+	dyn_array_t *record_results = fs_get_dir(fs, "/many");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), files);
+	ASSERT_TRUE(find_in_directory(record_results, "f999"));
+	dyn_array_destroy(record_results);
+
+	// 2. Normal/Error, names are a little shorter on this layout
+	std::string longest(FS_LARGE_FNAME_MAX, 'n');
+	ASSERT_EQ(fs_create(fs, ("/" + longest).c_str(), FS_REGULAR), 0);
+	ASSERT_LT(fs_create(fs, ("/" + longest + "n").c_str(), FS_REGULAR), 0);
+	fs_unmount(fs);
+
+	// 3. Normal, the layout is recognised at mount, and the table keeps growing from where it was
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs->BlockStore_inode, nullptr);
+	for (size_t i = 0; i < files; i += 111) {
+		std::string path = "/many/" + names[i];
+		int fd = fs_open(fs, path.c_str());
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_read(fs, fd, buffer, sizeof(buffer)), (ssize_t)path.size() + 1);
+		ASSERT_STREQ(buffer, path.c_str());
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+	fs_dir_t dir;
+	file_record_t record;
+	ASSERT_EQ(fs_opendir(fs, "/", &dir), 0);
+	size_t listed = 0;
+	while (fs_readdir(fs, &dir, &record) == 1) {
+		if (record.name == longest) {
+			++listed;
+		}
+	}
+	ASSERT_EQ(listed, 1u);
+	ASSERT_EQ(fs_closedir(fs, &dir), 0);
+	ASSERT_EQ(fs_create(fs, "/more", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create_many(fs, "/more", name_ptrs.data(), files, FS_DIRECTORY, NULL), (ssize_t)files);
+
+	// 4. Normal, inodes given back are used again
+	ASSERT_EQ(fs_remove_many(fs, "/many", name_ptrs.data(), files, NULL), (ssize_t)files);
+	size_t free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+	ASSERT_EQ(fs_create_many(fs, "/many", name_ptrs.data(), files, FS_REGULAR, NULL), (ssize_t)files);
+	ASSERT_EQ(fs_remove_many(fs, "/many", name_ptrs.data(), files, NULL), (ssize_t)files);
+	ASSERT_EQ(block_store_get_free_blocks(fs->BlockStore_whole), free_blocks);
+	fs_unmount(fs);
+
+	// 5. Normal, together with extents and the journal
+	fs = fs_format_ex(test_fname, FS_FEATURE_LARGE_INODES | FS_FEATURE_EXTENTS | FS_FEATURE_JOURNAL);
+	ASSERT_NE(fs, nullptr);
+	std::vector<uint8_t> data(5 * BLOCK_SIZE_BYTES + 7);
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = (uint8_t)(i * 13);
+	}
+	ASSERT_EQ(fs_create(fs, "/data", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/data");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t)data.size());
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/data");
+	ASSERT_GE(fd, 0);
+	std::vector<uint8_t> back(data.size());
+	ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t)back.size());
+	ASSERT_EQ(back, data);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+
+	// 6. Error, a classic image still runs out at number_inodes
+	fs = fs_format_ex(test_fname, FS_FEATURE_DIR_INDEX);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create_many(fs, "/", name_ptrs.data(), number_inodes + 10, FS_REGULAR, NULL), number_inodes - 1);
+	fs_unmount(fs);
+}
+
+TEST(k_tests, free_space_allocator) {
+	const char * test_fname = "k_tests_free_space_allocator.FS";
+	const size_t run = 16;
+	std::vector<uint8_t> data(run * BLOCK_SIZE_BYTES, 0x5A);
+	fs_view_t view;
+
+	FS * fs = fs_format_ex(test_fname, FS_FEATURE_EXTENTS | FS_FEATURE_DIR_INDEX);
+	ASSERT_NE(fs, nullptr);
+	size_t empty = block_store_get_free_blocks(fs->BlockStore_whole);
+
+	// 1. Normal, single free blocks scattered at the front don't break up a file written in one go
+	for (int i = 0; i < 64; ++i) {
+		std::string path = "/s" + std::to_string(i);
+		ASSERT_EQ(fs_create(fs, path.c_str(), FS_REGULAR), 0);
+		int fd = fs_open(fs, path.c_str());
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_write(fs, fd, data.data(), BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+	for (int i = 0; i < 64; i += 2) {
+		ASSERT_EQ(fs_remove(fs, ("/s" + std::to_string(i)).c_str()), 0);
+	}
+	ASSERT_EQ(fs_create(fs, "/run", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/run");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t)data.size());
+	ASSERT_EQ(fs_view(fs, fd, 0, data.size(), &view), (ssize_t)data.size());
+	ASSERT_EQ(fs_view_release(fs, &view), 0);
+
+	// 2. Normal, the next run goes right behind it
+	ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t)data.size());
+	ASSERT_EQ(fs_view(fs, fd, 0, data.size() * 2, &view), (ssize_t)data.size() * 2);
+	ASSERT_EQ(fs_view_release(fs, &view), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 3. Normal/Error, the image fills up to the last block and then refuses more
+	ASSERT_EQ(fs_create(fs, "/fill", FS_REGULAR), 0);
+	fd = fs_open(fs, "/fill");
+	ASSERT_GE(fd, 0);
+	off_t size = 0;
+	for (off_t chunk = 4096 * BLOCK_SIZE_BYTES; chunk >= BLOCK_SIZE_BYTES; chunk /= 2) {
+		while (fs_fallocate(fs, fd, size, chunk) == 0) {
+			size += chunk;
+		}
+	}
+	ASSERT_LT(block_store_get_free_blocks(fs->BlockStore_whole), (size_t)4);
+	ASSERT_LT(fs_pwrite(fs, fd, data.data(), data.size(), size), (ssize_t)data.size());
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 4. Normal, released blocks can be allocated again, and every one of them comes back at remount
+	ASSERT_EQ(fs_remove(fs, "/fill"), 0);
+	size_t free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+	ASSERT_GT(free_blocks, (size_t)(size / BLOCK_SIZE_BYTES));
+	ASSERT_EQ(fs_create(fs, "/again", FS_REGULAR), 0);
+	fd = fs_open(fs, "/again");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_fallocate(fs, fd, 0, size), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_remove(fs, "/again"), 0);
+	ASSERT_EQ(fs_remove(fs, "/run"), 0);
+	for (int i = 1; i < 64; i += 2) {
+		ASSERT_EQ(fs_remove(fs, ("/s" + std::to_string(i)).c_str()), 0);
+	}
+	ASSERT_EQ(fs_unmount(fs), 0);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/last", FS_REGULAR), 0);
+	fd = fs_open(fs, "/last");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t)data.size());
+	ASSERT_EQ(fs_view(fs, fd, 0, data.size(), &view), (ssize_t)data.size());
+	ASSERT_EQ(fs_view_release(fs, &view), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_remove(fs, "/last"), 0);
+	ASSERT_GE(block_store_get_free_blocks(fs->BlockStore_whole), empty - 1);
+	fs_unmount(fs);
+}
+
+// the allocation group a file's data starts in, found through a view of the image
+static size_t group_of(FS *fs, int fd) {
+	fs_view_t view;
+	if (fs_view(fs, fd, 0, 1, &view) != 1) {
+		return SIZE_MAX;
+	}
+	size_t block = ((const uint8_t *)view.data - block_store_Data_location(fs->BlockStore_whole)) / BLOCK_SIZE_BYTES;
+	fs_view_release(fs, &view);
+	return block / FS_GROUP_BLOCKS;
+}
+
+TEST(k_tests, allocation_groups) {
+	const char * test_fname = "k_tests_allocation_groups.FS";
+	const char * files[] = {"/a/one", "/a/two", "/b/one", "/b/two"};
+	std::vector<uint8_t> data(BLOCK_SIZE_BYTES, 0x3C);
+	size_t groups[4];
+
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+
+	// 1. Normal, directories spread over the image, and files land in their directory's group
+	ASSERT_EQ(fs_create(fs, "/a", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/b", FS_DIRECTORY), 0);
+	for (int i = 0; i < 4; ++i) {
+		ASSERT_EQ(fs_create(fs, files[i], FS_REGULAR), 0);
+		int fd = fs_open(fs, files[i]);
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t)data.size());
+		groups[i] = group_of(fs, fd);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+	ASSERT_NE(groups[0], (size_t)0);
+	ASSERT_EQ(groups[0], groups[1]);
+	ASSERT_EQ(groups[2], groups[3]);
+	ASSERT_NE(groups[0], groups[2]);
+
+	// 2. Normal, a file growing later continues right behind its last block
+	int fd = fs_open(fs, "/b/two");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), (off_t)data.size());
+	ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t)data.size());
+	fs_view_t view;
+	ASSERT_EQ(fs_view(fs, fd, 0, data.size() * 2, &view), (ssize_t)data.size() * 2);
+	ASSERT_EQ(fs_view_release(fs, &view), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+
+	// 3. Normal, the group a directory got is remembered across a remount
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/b/three", FS_REGULAR), 0);
+	fd = fs_open(fs, "/b/three");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t)data.size());
+	ASSERT_EQ(group_of(fs, fd), groups[2]);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+}
+
+// write blocks of two files in turn, so neither ends up in one run. Every block is filled with its file's tag and number.
+static void write_interleaved(FS *fs, int fd_a, int fd_b, size_t first, size_t count) {
+	std::vector<uint8_t> block(BLOCK_SIZE_BYTES);
+	for (size_t i = first; i < first + count; ++i) {
+		int fds[2] = {fd_a, fd_b};
+		for (int f = 0; f < 2; ++f) {
+			memset(block.data(), (int)((i * 2 + f) & 0xFF), block.size());
+			ASSERT_EQ(fs_pwrite(fs, fds[f], block.data(), block.size(), i * BLOCK_SIZE_BYTES), (ssize_t)block.size());
+		}
+	}
+}
+
+// check what write_interleaved wrote, for file number f, holes reading as zeros
+static bool check_interleaved(FS *fs, int fd, int f, size_t blocks, size_t hole_first, size_t hole_end) {
+	std::vector<uint8_t> block(BLOCK_SIZE_BYTES);
+	for (size_t i = 0; i < blocks; ++i) {
+		if (fs_pread(fs, fd, block.data(), block.size(), i * BLOCK_SIZE_BYTES) != (ssize_t)block.size()) {
+			return false;
+		}
+		uint8_t want = i >= hole_first && i < hole_end ? 0 : (uint8_t)((i * 2 + f) & 0xFF);
+		for (size_t j = 0; j < block.size(); ++j) {
+			if (block[j] != want) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+TEST(k_tests, defragmentation) {
+	const char * test_fname = "k_tests_defragmentation.FS";
+	// past the indirect block, into the double indirect one
+	const size_t blocks = 2100;
+	fs_frag_t frag;
+	fs_defrag_t pass;
+	fs_view_t view;
+
+	FS * fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/a", FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, "/b", FS_REGULAR), 0);
+	int fd_a = fs_open(fs, "/a");
+	int fd_b = fs_open(fs, "/b");
+	ASSERT_GE(fd_a, 0);
+	ASSERT_GE(fd_b, 0);
+	write_interleaved(fs, fd_a, fd_b, 0, blocks);
+
+	// 1. Normal, files written in turn are scattered, and so is the image
+	ASSERT_EQ(fs_fragmentation(fs, "/a", &frag), 0);
+	ASSERT_EQ(frag.files, (size_t)1);
+	ASSERT_EQ(frag.blocks, blocks);
+	ASSERT_GT(frag.fragments, blocks / 2);
+	ASSERT_GT(frag.score, 0.5);
+	ASSERT_EQ(fs_fragmentation(fs, NULL, &frag), 0);
+	ASSERT_EQ(frag.files, (size_t)2);
+	ASSERT_EQ(frag.blocks, blocks * 2);
+	ASSERT_GT(frag.score, 0.5);
+
+	// 2. Normal, a throttled pass moves one file per call, pointer blocks and all, but a file with a view outstanding
+	// stays where it is, and the view keeps reading its data
+	ASSERT_EQ(fs_view(fs, fd_b, BLOCK_SIZE_BYTES, 1, &view), 1);
+	const uint8_t *viewed = (const uint8_t *)view.data;
+	memset(&pass, 0, sizeof(pass));
+	ASSERT_EQ(fs_defrag(fs, &pass, 1), 1);
+	ASSERT_EQ(pass.files_moved, (size_t)1);
+	ASSERT_EQ(pass.blocks_moved, blocks);
+	while (fs_defrag(fs, &pass, 1) == 1) {
+	}
+	ASSERT_EQ(pass.files_moved, (size_t)1);
+	ASSERT_EQ(fs_fragmentation(fs, "/a", &frag), 0);
+	ASSERT_EQ(frag.fragments, (size_t)1);
+	ASSERT_EQ(frag.score, 0.0);
+	ASSERT_EQ(fs_fragmentation(fs, "/b", &frag), 0);
+	ASSERT_GT(frag.fragments, blocks / 2);
+	ASSERT_EQ(view.data, viewed);
+	ASSERT_EQ(viewed[0], 3);
+	ASSERT_EQ(fs_view_release(fs, &view), 0);
+
+	// 3. Normal, once the view is given back the file is moved, and the data of both comes along
+	memset(&pass, 0, sizeof(pass));
+	ASSERT_EQ(fs_defrag(fs, &pass, 0), 0);
+	ASSERT_EQ(pass.files_moved, (size_t)1);
+	ASSERT_EQ(pass.blocks_moved, blocks);
+	ASSERT_EQ(fs_fragmentation(fs, "/b", &frag), 0);
+	ASSERT_EQ(frag.fragments, (size_t)1);
+	ASSERT_EQ(fs_view(fs, fd_b, 0, BLOCK_SIZE_BYTES * blocks, &view), (ssize_t)(BLOCK_SIZE_BYTES * blocks));
+	ASSERT_EQ(fs_view_release(fs, &view), 0);
+	ASSERT_TRUE(check_interleaved(fs, fd_a, 0, blocks, 0, 0));
+	ASSERT_TRUE(check_interleaved(fs, fd_b, 1, blocks, 0, 0));
+
+	// 4. Normal, nothing is left to do, and the new layout survives a remount
+	memset(&pass, 0, sizeof(pass));
+	ASSERT_EQ(fs_defrag(fs, &pass, 0), 0);
+	ASSERT_EQ(pass.files_moved, (size_t)0);
+	ASSERT_EQ(fs_close(fs, fd_a), 0);
+	ASSERT_EQ(fs_close(fs, fd_b), 0);
+	fs_unmount(fs);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_fragmentation(fs, NULL, &frag), 0);
+	ASSERT_EQ(frag.fragments, (size_t)2);
+	ASSERT_EQ(frag.score, 0.0);
+	fd_a = fs_open(fs, "/a");
+	ASSERT_GE(fd_a, 0);
+	ASSERT_TRUE(check_interleaved(fs, fd_a, 0, blocks, 0, 0));
+	ASSERT_EQ(fs_close(fs, fd_a), 0);
+
+	// 5. Error, only regular files are measured, and parameters are checked
+	ASSERT_LT(fs_fragmentation(fs, "/", &frag), 0);
+	ASSERT_LT(fs_fragmentation(fs, "/missing", &frag), 0);
+	ASSERT_LT(fs_fragmentation(NULL, "/a", &frag), 0);
+	ASSERT_LT(fs_fragmentation(fs, "/a", NULL), 0);
+	ASSERT_LT(fs_defrag(NULL, &pass, 0), 0);
+	ASSERT_LT(fs_defrag(fs, NULL, 0), 0);
+	fs_unmount(fs);
+
+	// 6. Normal, extent mapped files with holes come out as one run too, holes kept
+	fs = fs_format_ex(test_fname, FS_FEATURE_EXTENTS);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/a", FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, "/b", FS_REGULAR), 0);
+	fd_a = fs_open(fs, "/a");
+	fd_b = fs_open(fs, "/b");
+	write_interleaved(fs, fd_a, fd_b, 0, 10);
+	write_interleaved(fs, fd_a, fd_b, 20, 10);
+	ASSERT_EQ(fs_fragmentation(fs, "/a", &frag), 0);
+	ASSERT_EQ(frag.blocks, (size_t)20);
+	ASSERT_EQ(frag.fragments, (size_t)20);
+	ASSERT_EQ(frag.score, 1.0);
+	memset(&pass, 0, sizeof(pass));
+	ASSERT_EQ(fs_defrag(fs, &pass, 0), 0);
+	ASSERT_EQ(pass.files_moved, (size_t)2);
+	ASSERT_EQ(fs_fragmentation(fs, NULL, &frag), 0);
+	ASSERT_EQ(frag.fragments, (size_t)2);
+	ASSERT_TRUE(check_interleaved(fs, fd_a, 0, 30, 10, 20));
+	ASSERT_TRUE(check_interleaved(fs, fd_b, 1, 30, 10, 20));
+	ASSERT_EQ(fs_close(fs, fd_a), 0);
+	ASSERT_EQ(fs_close(fs, fd_b), 0);
+	fs_unmount(fs);
+}
 
 
 int main(int argc, char **argv) 